@@ -9,52 +9,244 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <endian.h>
 #include <sys/stat.h>
 
 #include <map>
 #include <set>
 #include <list>
+#include <vector>
+#include <unordered_map>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
 #include <cassert>
 #include <stdexcept>
 
 #include "luci.h"
 #include "graph.h"
+#include "io.h"
 
 using namespace std;
 
 //#define dbg_printf printf
 #define dbg_printf
 
+/*
+ * Bitmap in 64 bit words. Bit n is bit n % 64 of word n / 64, the same
+ * numbering as the on-disk little endian bitmaps. Bits past nr_bits are
+ * kept clear.
+ */
+class BitMap {
+        public:
+        BitMap(size_t nr_bits) : nr_bits(nr_bits), words((nr_bits + 63) / 64, 0) {}
+
+        // takes the first nr_bits of an on-disk bitmap
+        void load(const char *buf, size_t size) {
+                size_t nr_words = std::min(words.size(), size / sizeof(uint64_t));
+                for (size_t i = 0; i < nr_words; i++) {
+                        uint64_t word;
+                        memcpy(&word, buf + i * sizeof(uint64_t), sizeof(word));
+                        words[i] = le64toh(word);
+                }
+                if (nr_bits & 63)
+                        words.back() &= (1ULL << (nr_bits & 63)) - 1;
+        }
+
+        size_t size(void) const {
+                return nr_bits;
+        }
+
+        bool test(unsigned long bit) const {
+                return words[bit >> 6] & (1ULL << (bit & 63));
+        }
+
+        void set(unsigned long bit) {
+                words[bit >> 6] |= 1ULL << (bit & 63);
+        }
+
+        // returns the previous value, safe against concurrent setters
+        bool test_and_set(unsigned long bit) {
+                uint64_t mask = 1ULL << (bit & 63);
+                return __atomic_fetch_or(&words[bit >> 6], mask, __ATOMIC_RELAXED) & mask;
+        }
+
+        // number of set bits
+        size_t count(void) const {
+                size_t count = 0;
+                for (auto word : words)
+                        count += __builtin_popcountll(word);
+                return count;
+        }
+
+        // first bit from bit on that is set, or clear, nr_bits if none
+        size_t find_next(size_t bit, bool set) const {
+                while (bit < nr_bits) {
+                        uint64_t word = set ? words[bit >> 6] : ~words[bit >> 6];
+                        word &= ~0ULL << (bit & 63);
+                        if (word)
+                                return std::min(nr_bits,
+                                        (bit & ~63UL) + __builtin_ctzll(word));
+                        bit = (bit | 63) + 1;
+                }
+                return nr_bits;
+        }
+
+        // calls fn(start, len) for every run of set bits
+        template<typename F>
+        void for_each_run(F fn) const {
+                size_t start, end = 0;
+                while ((start = find_next(end, true)) < nr_bits) {
+                        end = find_next(start, false);
+                        fn(start, end - start);
+                }
+        }
+
+        private:
+        size_t nr_bits;
+        std::vector<uint64_t> words;
+};
+
 class Group {
         public:
-        char *blockbitMap;
-        char *inodebitMap;
+        BitMap *blockbitMap;
+        BitMap *inodebitMap;
         struct luci_group_desc *gd;
-        std::map<unsigned long, struct luci_inode> inodeMap;
 
-        Group() {}
+        Group() : blockbitMap(NULL), inodebitMap(NULL), gd(NULL) {}
 
         ~Group() {
-                if (blockbitMap)
-                        delete blockbitMap;
-                if (inodebitMap)
-                        delete inodebitMap;
-                inodeMap.clear();
+                delete blockbitMap;
+                delete inodebitMap;
+        }
+};
+
+// LRU cache of block reads, one shard of the block cache
+class BlockCache {
+        public:
+        unsigned long hits, misses;
+
+        BlockCache(size_t blocksize, size_t nr_max) :
+                hits(0), misses(0), blocksize(blocksize), nr_max(nr_max) {}
+
+        ~BlockCache() {
+                for (auto &i : lru)
+                        delete [] i.second;
+                lru.clear();
+                index.clear();
+        }
+
+        bool contains(unsigned long blockno) {
+                std::lock_guard<std::mutex> guard(lock);
+                return index.find(blockno) != index.end();
+        }
+
+        bool lookup(unsigned long blockno, char *buf) {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = index.find(blockno);
+                if (it == index.end()) {
+                        misses++;
+                        return false;
+                }
+                lru.splice(lru.begin(), lru, it->second);
+                memcpy(buf, it->second->second, blocksize);
+                hits++;
+                return true;
+        }
+
+        void insert(unsigned long blockno, const char *buf) {
+                char *data;
+                std::lock_guard<std::mutex> guard(lock);
+                if (!nr_max || index.find(blockno) != index.end())
+                        return;
+                if (index.size() < nr_max)
+                        data = new char[blocksize];
+                else {
+                        // recycle the least recently used buffer
+                        data = lru.back().second;
+                        index.erase(lru.back().first);
+                        lru.pop_back();
+                }
+                memcpy(data, buf, blocksize);
+                lru.push_front(std::make_pair(blockno, data));
+                index[blockno] = lru.begin();
         }
+
+        private:
+        std::mutex lock;
+        size_t blocksize;
+        size_t nr_max;
+        std::list<std::pair<unsigned long, char *> > lru;
+        std::unordered_map<unsigned long,
+                std::list<std::pair<unsigned long, char *> >::iterator> index;
+};
+
+// indirect blocks kept across both passes
+#define CCHECKER_BLOCK_CACHE_SIZE (64UL << 20)
+
+// shards of the block cache, picked by block number
+#define CCHECKER_BLOCK_CACHE_SHARDS 64
+
+// findings of scanning one group, merged in group order after each pass
+struct GroupResult {
+        std::set<unsigned long> inodesWithDuplicateBlocks;
+        std::set<unsigned long> inodesWithUnmarkedBlocks;
+        std::set<unsigned long> inodesNotMarkedInBitMap;
+        std::list<unsigned long> orphanInodes;
+        std::vector<long> dirVertices;
+        std::vector<std::pair<long, long> > dirEdges;
 };
 
-// bitMap for duplicate blocks
-char *checkdupBlockBitMap;
+// state of a scanning thread
+struct ScanContext {
+        // one indirect block buffer per tree level
+        std::vector<char *> levelBuf;
+        // inode table of the group being scanned
+        std::vector<char> inodeTableBuf;
+        // batches reads in io_uring mode
+        cchecker_io::Ring *ring;
+        GroupResult *result;
+};
+
+// default number of reads in flight per thread in io_uring mode
+#define CCHECKER_IO_DEPTH 64
+
+// inode tables are read in pieces of this size
+#define CCHECKER_IO_CHUNK (64UL << 10)
+
+// indirect blocks read ahead per batch in io_uring mode
+#define CCHECKER_PREFETCH_BATCH 256
+
+cchecker_io::Image *image;
+
+static cchecker_io::Mode io_mode = cchecker_io::PREAD;
+
+static unsigned io_depth = CCHECKER_IO_DEPTH;
+
+// bitMap for duplicate blocks, set by all scanning threads
+BitMap *checkdupBlockBitMap;
+
+std::vector<BlockCache *> blockCache;
+
+// number of threads scanning groups
+static unsigned nr_threads;
 
 // stores block group info
 std::map<unsigned long, Group *> blockgroupMap;
 
-// stores inodes in fs
-std::map<unsigned long, struct luci_inode> globalInodeMap;
+// what the checks need of an inode
+struct InodeSummary {
+        uint16_t mode;          // 0 if the inode is not in use
+        uint16_t links_count;
+};
+
+// stores inodes in fs, indexed by inode number
+std::vector<struct InodeSummary> inodeTable;
 
-// stores directory link count
-std::map<unsigned long, unsigned> globalDirMap;
+// stores directory link count, indexed by inode number
+std::vector<unsigned> dirLinksTable;
 
 // inconsistent inodes list
 std::set<unsigned long> InodeWithDuplicateBlocks;
@@ -76,6 +268,13 @@ static inline size_t sectors_count(struct luci_super_block *lsb, unsigned nr_blo
         return size >> 9;
 }
 
+// reads through the image mapping when there is one
+static inline ssize_t CCheckerPread(int fd, void *buf, size_t len, off_t off) {
+        if (image)
+                return image->read(buf, len, off);
+        return pread(fd, buf, len, off);
+}
+
 static inline bool bpOk(blkptr *bp) {
         return !((!bp->blockno) || (bp->blockno == UINT32_MAX));
 }
@@ -84,190 +283,183 @@ static void CleanupGroupList(std::map<unsigned long, Group*> blockgroupMap) {
         blockgroupMap.clear();
 }
 
-static size_t CCheckerCountBitMap(char *bitmap, size_t size) {
-        size_t count = 0;
-        for (size_t i = 0; i < size; i+=4) {
-                unsigned val = *((unsigned *)(bitmap + i));
-                count += ((sizeof(unsigned) * 8) - __builtin_popcount(val));
-        }
-        return count;
-}
-
-static int __CCheckerCheckBitMap(char *bitmap, unsigned long blockno) {
-        unsigned block = blockno / 8;
-        unsigned offset = blockno & 7;
-
-        char *val = bitmap + block; 
-        if (offset) {
-                if ((*val &= (1 << (offset - 1))) == 0)
-                        return -ENOENT;
-        } else {
-                if ((*val &= (1 << 7)) == 0)
-                        return -ENOENT;
-        }
-        return 0;
+// blocks group covers, the last group may be short
+static unsigned long CCheckerGroupBlocks(struct luci_super_block *lsb, unsigned group) {
+        unsigned long blocks_per_group = __le32_to_cpu(lsb->s_blocks_per_group);
+        unsigned long first = __le32_to_cpu(lsb->s_first_data_block) +
+                (unsigned long)group * blocks_per_group;
+        return std::min(blocks_per_group, __le32_to_cpu(lsb->s_blocks_count) - first);
 }
 
-static void CCheckerCheckBitMap(struct luci_super_block *lsb, unsigned long ino, blkptr bp) {
+static void CCheckerCheckBitMap(struct luci_super_block *lsb, ScanContext *ctx,
+                unsigned long ino, blkptr bp) {
         Group *gp;
         unsigned long blockno = bp.blockno;
+        unsigned long first_block = __le32_to_cpu(lsb->s_first_data_block);
         unsigned long blocks_per_group = __le32_to_cpu(lsb->s_blocks_per_group);
-        unsigned group = blockno / blocks_per_group;
-        gp = (blockgroupMap.find(group))->second;
 
+        // other groups' bitmaps are only complete once pass 1 is done
         if (nr_pass == 1)
                 return;
 
-        if ((blockno >= lsb->s_blocks_count) ||
-                ((__CCheckerCheckBitMap(gp->blockbitMap, blockno) < 0)  && !bp.length)) {
-                if (InodeBlocksNotMarkedInBitMap.find(ino) ==
-                                InodeBlocksNotMarkedInBitMap.end())
-                        InodeWithDuplicateBlocks.insert(ino);
+        if ((blockno < first_block) || (blockno >= lsb->s_blocks_count)) {
+                ctx->result->inodesWithDuplicateBlocks.insert(ino);
+                return;
         }
+
+        blockno -= first_block;
+        gp = (blockgroupMap.find(blockno / blocks_per_group))->second;
+        if (!gp->blockbitMap->test(blockno % blocks_per_group) && !bp.length)
+                ctx->result->inodesWithUnmarkedBlocks.insert(ino);
 }
 
-static void CCheckerCheckInodeBitMap(struct luci_super_block *lsb, unsigned long ino) {
+static void CCheckerCheckInodeBitMap(struct luci_super_block *lsb, ScanContext *ctx,
+                unsigned long ino) {
         unsigned long inodes_per_group = __le32_to_cpu(lsb->s_inodes_per_group);
-        unsigned group = ino / inodes_per_group;
-        Group *gp = (blockgroupMap.find(group))->second;
+        Group *gp;
 
         if (nr_pass == 1)
                 return;
 
-        if (__CCheckerCheckBitMap(gp->inodebitMap, ino) < 0) {
-                if (InodeNotMarkedInBitMap.find(ino) == InodeNotMarkedInBitMap.end())
-                        InodeNotMarkedInBitMap.insert(ino);
-        }
-}
-
-static int __CCheckerAddBitMap(char *bitmap, unsigned long blockno) {
-        unsigned block = blockno / 8;
-        unsigned offset = blockno & 7;
-
-        char *val = bitmap + block; 
-        if (offset) {
-                if ((*val &= (1 << (offset - 1))) != 0)
-                        return -EEXIST;
-                *val |= (1 << (offset - 1));
-        } else {
-                if ((*val &= (1 << 7)) != 0)
-                        return -EEXIST;
-                *val |= (1 << 7);
-        }
-        return 0;
+        gp = (blockgroupMap.find((ino - 1) / inodes_per_group))->second;
+        if (!gp->inodebitMap->test((ino - 1) % inodes_per_group))
+                ctx->result->inodesNotMarkedInBitMap.insert(ino);
 }
 
-static int CCheckerAddBitMap(struct luci_super_block *lsb, unsigned long ino,
-                char *bitmap, blkptr bp) {
+static int CCheckerAddBitMap(struct luci_super_block *lsb, ScanContext *ctx,
+                unsigned long ino, BitMap *bitmap, blkptr bp) {
         unsigned long blockno = bp.blockno;
 
         if (nr_pass != 1)
                 return 0;
 
         if ((blockno >= lsb->s_blocks_count) ||
-                ((__CCheckerAddBitMap(bitmap, blockno) < 0)  && !bp.length)) {
-                if (InodeWithDuplicateBlocks.find(ino) == InodeWithDuplicateBlocks.end())
-                        InodeWithDuplicateBlocks.insert(ino);
-        }
+                (bitmap->test_and_set(blockno) && !bp.length))
+                ctx->result->inodesWithDuplicateBlocks.insert(ino);
         return 0;
 }
 
-static char* CCheckerReadGroupInodeBitmap(struct luci_super_block *lsb,
+static BitMap* CCheckerReadGroupInodeBitmap(struct luci_super_block *lsb,
                 struct luci_group_desc *gd, int fd) {
         unsigned long blocksize = (1024UL << __le32_to_cpu(lsb->s_log_block_size));
-        //loff_t off = __le32_to_cpu(gd->bg_inode_bitmap) * blocksize;
-        loff_t off = gd->bg_inode_bitmap * blocksize;
-        char *bitmap = new char [blocksize];
-        pread(fd, bitmap, blocksize, off);
+        loff_t off = __le32_to_cpu(gd->bg_inode_bitmap) * blocksize;
+        BitMap *bitmap = new BitMap(std::min((unsigned long)__le32_to_cpu(lsb->s_inodes_per_group),
+                blocksize * 8));
+        char *buf = new char [blocksize];
+        if (CCheckerPread(fd, buf, blocksize, off) == (ssize_t)blocksize)
+                bitmap->load(buf, blocksize);
         printf("inodebitMap :%lx/%lx\n", off, off/blocksize);
-        //for (int i = 0; i < blocksize; i++)
-        //        printf("[%d] 0x%x ", i, *(bitmap + i));
-        //printf("\n");
+        delete [] buf;
         return bitmap;
 }
 
-static char* CCheckerReadGroupBlockBitmap(struct luci_super_block *lsb,
-                struct luci_group_desc *gd, int fd) {
-        unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
+static BitMap* CCheckerReadGroupBlockBitmap(struct luci_super_block *lsb,
+                struct luci_group_desc *gd, unsigned group, int fd) {
+        unsigned long blocksize = (1024UL << __le32_to_cpu(lsb->s_log_block_size));
         off_t off = __le32_to_cpu(gd->bg_block_bitmap) * blocksize;
-        char *bitmap = new char [blocksize];
-        pread(fd, bitmap, blocksize, off);
+        BitMap *bitmap = new BitMap(std::min(CCheckerGroupBlocks(lsb, group), blocksize * 8));
+        char *buf = new char [blocksize];
+        if (CCheckerPread(fd, buf, blocksize, off) == (ssize_t)blocksize)
+                bitmap->load(buf, blocksize);
+        delete [] buf;
         return bitmap;
 }
 
-static size_t CCheckerScanInodeIndirectBlocks(struct luci_super_block *lsb, unsigned long ino,
-                unsigned long blockno, int level, int fd) {
+// reads a block through the block cache, a short read leaves zeroes
+static int CCheckerReadBlock(struct luci_super_block *lsb, unsigned long blockno,
+                char *buf, int fd) {
+        ssize_t ret;
+        unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
+        BlockCache *cache = blockCache[blockno % CCHECKER_BLOCK_CACHE_SHARDS];
+
+        if (cache->lookup(blockno, buf))
+                return 0;
+
+        ret = CCheckerPread(fd, buf, blocksize, (off_t)blockno * blocksize);
+        if (ret != (ssize_t)blocksize) {
+                dbg_printf("short read of block %lu :%zd\n", blockno, ret);
+                memset(buf + std::max(ret, (ssize_t)0), 0,
+                        blocksize - std::max(ret, (ssize_t)0));
+                return -EIO;
+        }
+        cache->insert(blockno, buf);
+        return 0;
+}
+
+static size_t CCheckerScanInodeIndirectBlocks(struct luci_super_block *lsb, ScanContext *ctx,
+                unsigned long ino, unsigned long blockno, int level, int fd) {
         int i;
         char *buf;
         size_t nr_blocks = 0;
         unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
         int nr_blkptr = blocksize / LUCI_BLKPTR_SIZE;
-        off_t off = (blocksize * blockno);
 
         if (level == 0)
                 return nr_blocks;
 
-        buf = new char[LUCI_BLKPTR_SIZE];
+        // the pointers of every level stay valid while children are walked
+        buf = ctx->levelBuf[level];
+        if (CCheckerReadBlock(lsb, blockno, buf, fd) < 0)
+                return nr_blocks;
+
         for (i = 0; i < nr_blkptr; i++) {
-                blkptr *bp;
-                pread(fd, buf, LUCI_BLKPTR_SIZE, off + i * LUCI_BLKPTR_SIZE);
-                bp = (blkptr *)buf;
+                blkptr *bp = (blkptr *)(buf + i * LUCI_BLKPTR_SIZE);
                 if (!bpOk(bp))
                         continue;
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, *bp);
-                CCheckerCheckBitMap(lsb, ino, *bp);
-                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ino, bp->blockno, level - 1, fd);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, *bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, *bp);
+                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ctx, ino, bp->blockno,
+                        level - 1, fd);
                 nr_blocks++;
         }
-        delete buf;
         return nr_blocks;
 }
 
-static void CCheckerScanInodeBlockTree(struct luci_super_block *lsb, struct luci_inode *inode,
-                unsigned long ino, int fd) {
+static void CCheckerScanInodeBlockTree(struct luci_super_block *lsb, ScanContext *ctx,
+                struct luci_inode *inode, unsigned long ino, int fd) {
         blkptr bp;
         size_t nr_blocks = 0;
 
         bp = inode->i_block[0];
         dbg_printf("L0 Block :%u\n", bp.blockno);
         if (bpOk(&bp)) {
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, bp);
-                CCheckerCheckBitMap(lsb, ino, bp);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, bp);
                 nr_blocks++;
         }
 
         bp = inode->i_block[1];
         dbg_printf("L0 Block :%u\n", bp.blockno);
         if (bpOk(&bp)) {
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, bp);
-                CCheckerCheckBitMap(lsb, ino, bp);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, bp);
                 nr_blocks++;
         }
 
         bp = inode->i_block[2];
         dbg_printf("L1 Block :%u\n", bp.blockno);
         if (bpOk(&bp)) {
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, bp);
-                CCheckerCheckBitMap(lsb, ino, bp);
-                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ino, bp.blockno, 1, fd);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, bp);
+                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ctx, ino, bp.blockno, 1, fd);
                 nr_blocks++;
         }
 
         bp = inode->i_block[3];
         dbg_printf("L2 Block :%u\n", bp.blockno);
         if (bpOk(&bp)) {
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, bp);
-                CCheckerCheckBitMap(lsb, ino, bp);
-                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ino, bp.blockno, 2, fd);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, bp);
+                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ctx, ino, bp.blockno, 2, fd);
                 nr_blocks++;
         }
 
         bp = inode->i_block[4];
         dbg_printf("L3 Block :%u\n", bp.blockno);
         if (bpOk(&bp)) {
-                CCheckerAddBitMap(lsb, ino, checkdupBlockBitMap, bp);
-                CCheckerCheckBitMap(lsb, ino, bp);
-                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ino, bp.blockno, 3, fd);
+                CCheckerAddBitMap(lsb, ctx, ino, checkdupBlockBitMap, bp);
+                CCheckerCheckBitMap(lsb, ctx, ino, bp);
+                nr_blocks += CCheckerScanInodeIndirectBlocks(lsb, ctx, ino, bp.blockno, 3, fd);
                 nr_blocks++;
         }
         dbg_printf("NR Blocks: %u isize: %u\n",
@@ -327,7 +519,6 @@ static int CCheckerCalculateBlockTreeIndexes(struct luci_super_block *lsb, unsig
 static int CCheckerWalkBlockTree(struct luci_super_block *lsb, struct luci_inode *inode,
                 unsigned long ino, char *buffer, long path[LUCI_MAX_DEPTH], int depth, int fd) {
         blkptr bp;
-        off_t off;
         unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
 
         for (int d = 1; d <= depth; d++) {
@@ -335,13 +526,20 @@ static int CCheckerWalkBlockTree(struct luci_super_block *lsb, struct luci_inode
                 if (d == 1)
                         bp = inode->i_block[index];
                 else {
-                        off = bp.blockno * blocksize;
-                        pread(fd, &bp, sizeof(blkptr), off + index);
+                        if (!bpOk(&bp) ||
+                                CCheckerReadBlock(lsb, bp.blockno, buffer, fd) < 0)
+                                return -EIO;
+                        memcpy(&bp, buffer + index * LUCI_BLKPTR_SIZE, sizeof(blkptr));
                 }
                 dbg_printf("%s:inode=%u depth=%u index=%u blockno=%u\n", __func__,
                         ino, d, index, bp.blockno);
         }
-        pread(fd, buffer, blocksize, bp.blockno*blocksize);
+        if (!bpOk(&bp))
+                return -ENOENT;
+        if (CCheckerPread(fd, buffer, blocksize, (off_t)bp.blockno * blocksize) !=
+                (ssize_t)blocksize)
+                return -EIO;
+        return 0;
 }
 
 static inline struct
@@ -351,8 +549,14 @@ luci_dir_entry_2 *luci_next_entry(struct luci_dir_entry_2 *p)
         __le32_to_cpu(p->rec_len));
 }
 
-static int CCheckerReadDirBlock(struct luci_super_block *lsb, struct luci_inode *dir,
-                unsigned long ino, char *buf, size_t readsize) {
+static inline bool luci_is_dot_entry(struct luci_dir_entry_2 *de)
+{
+    return (de->name_len == 1 && de->name[0] == '.') ||
+        (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.');
+}
+
+static int CCheckerReadDirBlock(struct luci_super_block *lsb, ScanContext *ctx,
+                struct luci_inode *dir, unsigned long ino, char *buf, size_t readsize) {
         int links_count = 0;
         struct luci_dir_entry_2 *de, *limit;
 
@@ -365,28 +569,33 @@ static int CCheckerReadDirBlock(struct luci_super_block *lsb, struct luci_inode
                 if (!de->rec_len)
                         break;
                 if (de->rec_len && de->inode) {
-                        struct luci_inode inode;
+                        struct InodeSummary *inode = NULL;
+                        if (de->inode < inodeTable.size() && inodeTable[de->inode].mode)
+                                inode = &inodeTable[de->inode];
                         dbg_printf("DIR: inode :%u dentry name :%s, inode :%u/%llu, namelen :%u "
                                 "reclen :%u\n",
                                 ino, de->name, de->inode, dir->i_size,
                                 de->name_len, de->rec_len);
-                        if (globalInodeMap.find(de->inode) == globalInodeMap.end()) {
+                        if (!inode) {
                                 dbg_printf("inode in directory has no entry in inode tables\n");
-                                orphanInodeList.push_back(de->inode);
+                                ctx->result->orphanInodes.push_back(de->inode);
+                                continue;
                         }
-                        inode = globalInodeMap[de->inode];
-                        if (S_ISDIR(inode.i_mode)) {
+                        if (S_ISDIR(inode->mode)) {
                                 links_count++;
-                                dirGraph.add_vertex(de->inode);
-                                dirGraph.add_edge(ino, de->inode);
+                                // "." and ".." lead back up, not into the tree
+                                if (luci_is_dot_entry(de))
+                                        continue;
+                                ctx->result->dirVertices.push_back(de->inode);
+                                ctx->result->dirEdges.push_back(std::make_pair(ino, de->inode));
                         }
                 }
         }
         return links_count;
 }
 
-static int CCheckerReadDirInode(struct luci_super_block *lsb, struct luci_inode *inode,
-                unsigned long ino, int fd) {
+static int CCheckerReadDirInode(struct luci_super_block *lsb, ScanContext *ctx,
+                struct luci_inode *inode, unsigned long ino, int fd) {
         int depth;
         int links_count = 0;
         long path[LUCI_MAX_DEPTH];
@@ -395,17 +604,17 @@ static int CCheckerReadDirInode(struct luci_super_block *lsb, struct luci_inode
         unsigned int nr_blocks = (size + blocksize - 1)/blocksize;
         char *buf = new char[blocksize];
 
-        dirGraph.add_vertex(ino);
+        ctx->result->dirVertices.push_back(ino);
 
         for (size_t fblock = 0; fblock < nr_blocks; fblock++) {
                 size_t readbytes = std::min(size, blocksize);
                 memset(path, 0, sizeof(long) * LUCI_MAX_DEPTH);
-                memset(buf, 0, blocksize);
                 depth = CCheckerCalculateBlockTreeIndexes(lsb, fblock, path);
                 if (depth < 0)
                         break;
-                CCheckerWalkBlockTree(lsb, inode, ino, buf, path, depth, fd);
-                links_count += CCheckerReadDirBlock(lsb, inode, ino, buf, readbytes);
+                if (CCheckerWalkBlockTree(lsb, inode, ino, buf, path, depth, fd) < 0)
+                        memset(buf, 0, blocksize);
+                links_count += CCheckerReadDirBlock(lsb, ctx, inode, ino, buf, readbytes);
                 size -= readbytes;
                 assert(size >= 0);
         }
@@ -422,83 +631,224 @@ static std::string CCheckerGetFileType(int mode) {
         return type;
 }
 
-static void CCheckerReadGroupInodeTable(struct luci_super_block *lsb, struct luci_group_desc *gd,
-                int group, int fd, std::map<unsigned long, struct luci_inode>& inodeMap, char *inodebitMap) {
-        size_t i, count;
+/*
+ * Reads the indirect blocks the group's inodes reference into the block
+ * cache, a tree level per round, so the scan finds them there. Stops at
+ * the thread's share of half the cache so they are not evicted before
+ * the scan gets to them.
+ */
+static void CCheckerPrefetchIndirectBlocks(struct luci_super_block *lsb, ScanContext *ctx,
+                BitMap *inodebitMap, char *inodes, int fd) {
+        unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
+        unsigned inode_size = __le32_to_cpu(lsb->s_inode_size);
+        unsigned nr_blkptr = blocksize / LUCI_BLKPTR_SIZE;
+        size_t budget = CCHECKER_BLOCK_CACHE_SIZE / blocksize / (2 * nr_threads);
+        std::vector<std::pair<unsigned long, int> > pending, next;
+        std::vector<char> data((size_t)CCHECKER_PREFETCH_BATCH * blocksize);
+        std::vector<cchecker_io::Request> reqs;
+        std::vector<int> levels;
+
+        auto queue = [&](blkptr *bp, int level) {
+                if (bpOk(bp) && bp->blockno < lsb->s_blocks_count)
+                        next.push_back(std::make_pair((unsigned long)bp->blockno, level));
+        };
+
+        inodebitMap->for_each_run([&](size_t start, size_t len) {
+                for (size_t count = start; count < start + len; count++) {
+                        struct luci_inode *inode =
+                                (struct luci_inode *)(inodes + count * inode_size);
+                        if (!inode->i_mode)
+                                continue;
+                        queue(&inode->i_block[LUCI_IND_BLOCK], 1);
+                        queue(&inode->i_block[LUCI_DIND_BLOCK], 2);
+                        queue(&inode->i_block[LUCI_TIND_BLOCK], 3);
+                }
+        });
+
+        while (!next.empty() && budget) {
+                pending.swap(next);
+                next.clear();
+                for (size_t i = 0; i < pending.size() && budget; ) {
+                        size_t nr = 0;
+
+                        reqs.clear();
+                        levels.clear();
+                        for (; i < pending.size() && nr < CCHECKER_PREFETCH_BATCH && budget; i++) {
+                                unsigned long blockno = pending[i].first;
+                                char *buf = data.data() + nr * blocksize;
+                                BlockCache *cache = blockCache[blockno % CCHECKER_BLOCK_CACHE_SHARDS];
+
+                                // cached ones are only opened for their pointers
+                                if (cache->contains(blockno)) {
+                                        if (pending[i].second > 1 && cache->lookup(blockno, buf)) {
+                                                for (unsigned n = 0; n < nr_blkptr; n++)
+                                                        queue((blkptr *)(buf + n * LUCI_BLKPTR_SIZE),
+                                                                pending[i].second - 1);
+                                        }
+                                        continue;
+                                }
+                                reqs.push_back(cchecker_io::Request((off_t)blockno * blocksize,
+                                        buf, blocksize));
+                                levels.push_back(pending[i].second);
+                                nr++;
+                                budget--;
+                        }
+
+                        cchecker_io::ReadBatch(*image, ctx->ring, reqs);
+                        for (size_t r = 0; r < reqs.size(); r++) {
+                                char *buf = (char *)reqs[r].iov.iov_base;
+                                unsigned long blockno = reqs[r].off / blocksize;
+
+                                if (reqs[r].ret != (ssize_t)blocksize)
+                                        continue;
+                                blockCache[blockno % CCHECKER_BLOCK_CACHE_SHARDS]->insert(blockno, buf);
+                                for (unsigned n = 0; levels[r] > 1 && n < nr_blkptr; n++)
+                                        queue((blkptr *)(buf + n * LUCI_BLKPTR_SIZE), levels[r] - 1);
+                        }
+                }
+        }
+}
+
+static void CCheckerReadGroupInodeTable(struct luci_super_block *lsb, ScanContext *ctx,
+                struct luci_group_desc *gd, int group, int fd, BitMap *inodebitMap) {
         unsigned long ino = 0;
         struct luci_inode *inode;
         unsigned blockno = __le32_to_cpu(gd->bg_inode_table);
         unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
         unsigned inode_size = __le32_to_cpu(lsb->s_inode_size);
-        off_t off = (blocksize * blockno);
+        off_t off = ((off_t)blocksize * blockno);
         unsigned inodes_per_group = __le32_to_cpu(lsb->s_inodes_per_group);
-        unsigned base_inode = group * inodes_per_group + 1;
-        unsigned nr_blocks = (inodes_per_group * inode_size + blocksize - 1) / blocksize;
-        char *buf = new char[inode_size];
-
-        for (i = 0, count = 0; i < (nr_blocks * blocksize); i+=inode_size, count++) {
-                // Lookup inodes only marked in bitmap
-                // For certain groups, inode table entries may not be
-                // initialized if unmarked in inode bitmap
-                if (__CCheckerCheckBitMap(inodebitMap, count) != 0)
-                        continue;
-                printf("count :%lu\n", count);
-                pread(fd, buf, inode_size, off + i);
-                inode = (struct luci_inode *)buf;
-                ino = base_inode + count;
-                if (inode->i_mode) {
-                        if (nr_pass == 1) {
-                                assert(inodeMap.find(ino) == inodeMap.end());
-                                inodeMap[ino] = *inode;
-                                assert(globalInodeMap.find(ino) == globalInodeMap.end());
-                                globalInodeMap[ino] = *inode;
-                                CCheckerCheckInodeBitMap(lsb, ino);
-                        }
-
-                        if ((nr_pass == 2) && S_ISDIR(inode->i_mode)) {
-                                int links;
-                                links = CCheckerReadDirInode(lsb, inode, ino, fd);
-                                assert(globalDirMap.find(ino) == globalDirMap.end());
-                                globalDirMap[ino] = links;
-                        }
+        unsigned long base_inode = (unsigned long)group * inodes_per_group + 1;
+        std::vector<cchecker_io::Request> reqs;
+        char *buf;
 
-                        dbg_printf ("Inode :%u type :%s, blocks :%u links_count :%u\n", ino,
-                                CCheckerGetFileType(inode->i_mode).c_str(), inode->i_blocks,
-                                inode->i_links_count);
+        // Lookup inodes only marked in bitmap
+        // For certain groups, inode table entries may not be
+        // initialized if unmarked in inode bitmap
+        ctx->inodeTableBuf.resize((size_t)inodebitMap->size() * inode_size);
+        buf = ctx->inodeTableBuf.data();
+        inodebitMap->for_each_run([&](size_t start, size_t len) {
+                size_t from = start * inode_size, to = (start + len) * inode_size;
+                for (size_t pos = from; pos < to; pos += CCHECKER_IO_CHUNK)
+                        reqs.push_back(cchecker_io::Request(off + pos, buf + pos,
+                                std::min(CCHECKER_IO_CHUNK, to - pos)));
+        });
+        cchecker_io::ReadBatch(*image, ctx->ring, reqs);
+        for (auto &req : reqs) {
+                // what could not be read is scanned as unused inodes
+                size_t done = std::max(req.ret, (ssize_t)0);
+                if (done < req.iov.iov_len)
+                        memset((char *)req.iov.iov_base + done, 0, req.iov.iov_len - done);
+        }
 
-                        CCheckerScanInodeBlockTree(lsb, inode, ino, fd);
+        if (ctx->ring)
+                CCheckerPrefetchIndirectBlocks(lsb, ctx, inodebitMap, buf, fd);
+
+        inodebitMap->for_each_run([&](size_t start, size_t len) {
+                for (size_t count = start; count < start + len; count++) {
+                        printf("count :%lu\n", count);
+                        inode = (struct luci_inode *)(buf + count * inode_size);
+                        ino = base_inode + count;
+                        if (inode->i_mode) {
+                                // a group's slots are only written by the thread scanning it
+                                if (nr_pass == 1) {
+                                        inodeTable[ino].mode = __le16_to_cpu(inode->i_mode);
+                                        inodeTable[ino].links_count = __le16_to_cpu(inode->i_links_count);
+                                        CCheckerCheckInodeBitMap(lsb, ctx, ino);
+                                }
+
+                                if ((nr_pass == 2) && S_ISDIR(inode->i_mode))
+                                        dirLinksTable[ino] = CCheckerReadDirInode(lsb, ctx, inode, ino, fd);
+
+                                dbg_printf ("Inode :%u type :%s, blocks :%u links_count :%u\n", ino,
+                                        CCheckerGetFileType(inode->i_mode).c_str(), inode->i_blocks,
+                                        inode->i_links_count);
+
+                                CCheckerScanInodeBlockTree(lsb, ctx, inode, ino, fd);
+                        }
                 }
-                //count++;
-        }
-        delete [] buf;
+        });
 }
 
-static Group *CCheckerLuciLoadGroupDescriptorSingle(struct luci_super_block *lsb,
-                struct luci_group_desc *gd, int group, int fd) {
-        Group *gp = new Group();
-        gp->gd = gd;
+static void CCheckerLuciLoadGroupDescriptorSingle(struct luci_super_block *lsb,
+                ScanContext *ctx, Group *gp, int group, int fd) {
+        struct luci_group_desc *gd = gp->gd;
+
         gp->inodebitMap = CCheckerReadGroupInodeBitmap(lsb, gd, fd);
-        gp->blockbitMap = CCheckerReadGroupBlockBitmap(lsb, gd, fd);
+        gp->blockbitMap = CCheckerReadGroupBlockBitmap(lsb, gd, group, fd);
         dbg_printf ("Block Group BlockMap No[%u]   : 0x%x/crc=0x%x\n",
                         group, gd->bg_block_bitmap, gd->bg_block_bitmap_checksum);
         dbg_printf ("Block Group Free Blocks[%u]   : %u/%u\n",
-                        group, gd->bg_free_blocks_count, CCheckerCountBitMap(gp->blockbitMap, 4096));
+                        group, gd->bg_free_blocks_count, gp->blockbitMap->size() - gp->blockbitMap->count());
         dbg_printf ("Block Group InodeMap No[%u]   : 0x%x/crc=0x%x\n",
                         group, gd->bg_inode_bitmap, gd->bg_inode_bitmap_checksum);
         dbg_printf ("Block Group Free Inodes[%u]   : %u/%u\n",
-                        group, gd->bg_free_inodes_count, CCheckerCountBitMap(gp->inodebitMap, 4096));
+                        group, gd->bg_free_inodes_count, gp->inodebitMap->size() - gp->inodebitMap->count());
         dbg_printf ("Block Group InodeTable No[%u] : 0x%x/crc=0x%x, 0x%x\n",
                         group, gd->bg_inode_table, gd->bg_inode_table_checksum, gd->bg_checksum);
 
-        CCheckerReadGroupInodeTable(lsb, gd, group, fd, gp->inodeMap, gp->inodebitMap);
-        if (!gp->inodeMap.empty()) {
-                dbg_printf("group=%u inode list:\n", group);
-                for (auto &i : gp->inodeMap) {
-                        dbg_printf("%u ", i.first);
+        CCheckerReadGroupInodeTable(lsb, ctx, gd, group, fd, gp->inodebitMap);
+}
+
+/*
+ * Hands out groups in order to nr_threads threads running scan on each.
+ * A thread only writes the result slot of the group it scans, shared
+ * state is either read only during a pass or the duplicate block bitmap.
+ */
+static void CCheckerScanGroups(struct luci_super_block *lsb, unsigned nr_groups,
+                std::vector<GroupResult>& results,
+                std::function<void(ScanContext *, unsigned)> scan) {
+        std::atomic<unsigned> next(0);
+        std::vector<std::thread> threads;
+        unsigned blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
+
+        results.resize(nr_groups);
+
+        auto worker = [&]() {
+                unsigned group;
+                ScanContext ctx;
+
+                for (int level = 0; level < LUCI_MAX_DEPTH; level++)
+                        ctx.levelBuf.push_back(new char[blocksize]);
+                ctx.ring = NULL;
+                if (io_mode == cchecker_io::URING) {
+                        ctx.ring = new cchecker_io::Ring(io_depth);
+                        if (!ctx.ring->ok()) {
+                                delete ctx.ring;
+                                ctx.ring = NULL;
+                        }
+                }
+                while ((group = next.fetch_add(1)) < nr_groups) {
+                        ctx.result = &results[group];
+                        scan(&ctx, group);
                 }
-                dbg_printf("\n");
+                for (auto buf : ctx.levelBuf)
+                        delete [] buf;
+                delete ctx.ring;
+        };
+
+        for (unsigned i = 0; i < std::min(nr_threads, nr_groups); i++)
+                threads.push_back(std::thread(worker));
+        for (auto &t : threads)
+                t.join();
+}
+
+// folds the findings of a pass into the global ones, in group order
+static void CCheckerMergeResults(std::vector<GroupResult>& results) {
+        for (auto &r : results) {
+                InodeWithDuplicateBlocks.insert(r.inodesWithDuplicateBlocks.begin(),
+                        r.inodesWithDuplicateBlocks.end());
+                InodeBlocksNotMarkedInBitMap.insert(r.inodesWithUnmarkedBlocks.begin(),
+                        r.inodesWithUnmarkedBlocks.end());
+                InodeNotMarkedInBitMap.insert(r.inodesNotMarkedInBitMap.begin(),
+                        r.inodesNotMarkedInBitMap.end());
+                orphanInodeList.splice(orphanInodeList.end(), r.orphanInodes);
+                for (auto v : r.dirVertices)
+                        dirGraph.add_vertex(v);
+                for (auto &e : r.dirEdges)
+                        dirGraph.add_edge(e.first, e.second);
         }
-        return gp;
+        results.clear();
 }
 
 static void CCheckerLuciLoadGroupDescriptorAll(int fd, struct luci_super_block *lsb) {
@@ -508,6 +858,8 @@ static void CCheckerLuciLoadGroupDescriptorAll(int fd, struct luci_super_block *
         unsigned long nr_free_blocks2 = 0;
         unsigned long nr_free_inodes = 0;
         unsigned block_size, nr_groups, nr_desc_per_block, nr_desc_blocks;
+        unsigned long nr_inodes;
+        std::vector<GroupResult> results;
 
         block_size = (1024U << __le32_to_cpu(lsb->s_log_block_size));
         nr_desc_per_block = block_size/(sizeof(struct luci_group_desc));
@@ -518,33 +870,48 @@ static void CCheckerLuciLoadGroupDescriptorAll(int fd, struct luci_super_block *
         gdesc = (struct luci_group_desc *) malloc(nr_desc_blocks * block_size);
 
         // 2nd block GDT entries
-        pread(fd, gdesc, block_size * nr_desc_blocks, block_size);
+        CCheckerPread(fd, gdesc, block_size * nr_desc_blocks, block_size);
 
         dbg_printf ("Nr Groups : %u\n", nr_groups);
         dbg_printf ("Nr Group descriptor blocks :%u\n", nr_desc_blocks); 
         for (i = 0; i < nr_groups; i++) {
-                Group *gp;
+                Group *gp = new Group();
                 dbg_printf ("GD :%u\n", i);
                 struct luci_group_desc *gd = (struct luci_group_desc *)
                         ((char *)gdesc + i * sizeof(struct luci_group_desc));
                 nr_free_blocks += gd->bg_free_blocks_count;
                 nr_free_inodes += gd->bg_free_inodes_count;
-                gp = CCheckerLuciLoadGroupDescriptorSingle(lsb, gd, i, fd);
+                gp->gd = gd;
                 blockgroupMap[i] = gp;
         }
+
+        // inode numbers of the last group bound the tables
+        nr_inodes = (unsigned long)nr_groups * __le32_to_cpu(lsb->s_inodes_per_group) + 1;
+        inodeTable.assign(nr_inodes, InodeSummary());
+        dirLinksTable.assign(nr_inodes, 0);
+
+        CCheckerScanGroups(lsb, nr_groups, results, [&](ScanContext *ctx, unsigned group) {
+                CCheckerLuciLoadGroupDescriptorSingle(lsb, ctx, blockgroupMap[group], group, fd);
+        });
+        CCheckerMergeResults(results);
         dbg_printf("GDT Free Blocks :%u\n", nr_free_blocks);
         dbg_printf("GDT Free Inodes :%u\n", nr_free_inodes);
 }
 
 static void CCheckerLuciMissingBlocks(struct luci_super_block *lsb, int fd) {
-        for (auto &i : blockgroupMap)
-                CCheckerReadGroupInodeTable(lsb, i.second->gd, i.first, fd,
-                        i.second->inodeMap, i.second->inodebitMap);
+        std::vector<GroupResult> results;
+
+        CCheckerScanGroups(lsb, blockgroupMap.size(), results,
+                        [&](ScanContext *ctx, unsigned group) {
+                Group *gp = blockgroupMap.find(group)->second;
+                CCheckerReadGroupInodeTable(lsb, ctx, gp->gd, group, fd, gp->inodebitMap);
+        });
+        CCheckerMergeResults(results);
 }
 
 struct luci_super_block *CCheckerLuciLoadSuper(int fd) {
         struct luci_super_block *lsb = (struct luci_super_block *)malloc(1024);;
-        pread(fd, lsb, 1024, 1024);
+        CCheckerPread(fd, lsb, 1024, 1024);
         dbg_printf ("SB Magic           :0x%x\n", lsb->s_magic);
         dbg_printf ("Nr Inodes          :%lu\n", lsb->s_inodes_count);
         dbg_printf ("Nr Blocks          :%lu\n", lsb->s_blocks_count);
@@ -562,8 +929,11 @@ struct luci_super_block *CCheckerLuciLoadSuper(int fd) {
 static void TestFreeBlocksCount(struct luci_super_block *lsb,
                 std::map<unsigned long, Group*> &blockgroupMap) {
         size_t sum_blocks = 0;
-        for (auto &i : blockgroupMap)
+        for (auto &i : blockgroupMap) {
+                BitMap *bitmap = i.second->blockbitMap;
                 sum_blocks += i.second->gd->bg_free_blocks_count;
+                assert(i.second->gd->bg_free_blocks_count == bitmap->size() - bitmap->count());
+        }
         assert(lsb->s_free_blocks_count == sum_blocks);
         printf ("CChecker:TestFreeBlocksCount pass\n");
 }
@@ -571,8 +941,11 @@ static void TestFreeBlocksCount(struct luci_super_block *lsb,
 static void TestFreeInodesCount(struct luci_super_block *lsb,
                 std::map<unsigned long, Group*> &blockgroupMap) {
         size_t sum_inodes = 0;
-        for (auto &i : blockgroupMap)
+        for (auto &i : blockgroupMap) {
+                BitMap *bitmap = i.second->inodebitMap;
                 sum_inodes += i.second->gd->bg_free_inodes_count;
+                assert(i.second->gd->bg_free_inodes_count == bitmap->size() - bitmap->count());
+        }
         assert(lsb->s_free_inodes_count == sum_inodes);
         printf ("CChecker:TestFreeInodesCount pass\n");
 }
@@ -592,18 +965,17 @@ static void TestMissingBlocks(std::set<unsigned long> &InodeBlocksNotMarkedInBit
         printf ("CChecker:TestMissingBlocks pass\n");
 }
 
-static void TestDirLinks(std::map<unsigned long, unsigned>& globalDirMap) {
-        struct luci_inode inode;
-        for (auto &i : globalDirMap) {
-                assert(globalInodeMap.find(i.first) != globalInodeMap.end());
-                inode = globalInodeMap[i.first];
-                assert(S_ISDIR(inode.i_mode));
-                if (i.first == LUCI_ROOT_INO)
-                        assert((i.second + 1) == inode.i_links_count);
+static void TestDirLinks(std::vector<unsigned>& dirLinksTable) {
+        for (size_t ino = 0; ino < inodeTable.size(); ino++) {
+                struct InodeSummary *inode = &inodeTable[ino];
+                if (!S_ISDIR(inode->mode))
+                        continue;
+                if (ino == LUCI_ROOT_INO)
+                        assert((dirLinksTable[ino] + 1) == inode->links_count);
                 else
-                        assert(i.second == inode.i_links_count);
-                dbg_printf("links : inode :%u %u/%u\n", i.first, i.second,
-                                inode.i_links_count);
+                        assert(dirLinksTable[ino] == inode->links_count);
+                dbg_printf("links : inode :%lu %u/%u\n", ino, dirLinksTable[ino],
+                                inode->links_count);
         }
         printf ("CChecker:TestDirLinks pass\n");
 }
@@ -618,17 +990,56 @@ static void TestDirCycle(cchecker_graph::Graph<long>& dirGraph) {
         printf ("CChecker:TestDirCycle pass\n");
 }
 
+static void usage(const char *prog) {
+        printf("usage: %s [-j threads] [-m pread|mmap|uring] [-q queue depth] <device>\n",
+                prog);
+}
+
 int main(int argc, char *argv[]) {
-        int fd;
+        int fd, opt;
         char *testdev;
+        unsigned blocksize;
         struct luci_super_block *lsb;
 
-        if (argc < 2) {
+        // one scanning thread per cpu by default
+        nr_threads = std::thread::hardware_concurrency();
+        while ((opt = getopt(argc, argv, "j:m:q:")) != -1) {
+                switch (opt) {
+                case 'j':
+                        nr_threads = strtoul(optarg, NULL, 10);
+                        break;
+                case 'm':
+                        if (!strcmp(optarg, "pread"))
+                                io_mode = cchecker_io::PREAD;
+                        else if (!strcmp(optarg, "mmap"))
+                                io_mode = cchecker_io::MMAP;
+                        else if (!strcmp(optarg, "uring"))
+                                io_mode = cchecker_io::URING;
+                        else {
+                                usage(argv[0]);
+                                return -1;
+                        }
+                        break;
+                case 'q':
+                        io_depth = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (!nr_threads)
+                nr_threads = 1;
+        if (!io_depth)
+                io_depth = 1;
+
+        if (optind >= argc) {
                 printf("need device path\n");
+                usage(argv[0]);
                 return -1;
         }
 
-        testdev = argv[1];
+        testdev = argv[optind];
         fd = open(testdev, O_RDONLY);
         if (fd < 0) {
                 printf("failed to open device:%s\n", strerror(errno));
@@ -636,7 +1047,22 @@ int main(int argc, char *argv[]) {
         }
 
         lsb = CCheckerLuciLoadSuper(fd);
-        checkdupBlockBitMap = new char[lsb->s_blocks_count/8];
+        checkdupBlockBitMap = new BitMap(lsb->s_blocks_count);
+        blocksize = (1024U << __le32_to_cpu(lsb->s_log_block_size));
+
+        image = new cchecker_io::Image(fd);
+        if (io_mode == cchecker_io::MMAP &&
+                !image->map((size_t)lsb->s_blocks_count * blocksize)) {
+                printf("failed to map device:%s, using pread\n", strerror(errno));
+                io_mode = cchecker_io::PREAD;
+        }
+        if (io_mode == cchecker_io::URING && !cchecker_io::Ring(io_depth).ok()) {
+                printf("io_uring not available, using pread\n");
+                io_mode = cchecker_io::PREAD;
+        }
+        for (int i = 0; i < CCHECKER_BLOCK_CACHE_SHARDS; i++)
+                blockCache.push_back(new BlockCache(blocksize,
+                        CCHECKER_BLOCK_CACHE_SIZE / blocksize / CCHECKER_BLOCK_CACHE_SHARDS));
 
         nr_pass = 1;
         CCheckerLuciLoadGroupDescriptorAll(fd, lsb);
@@ -648,19 +1074,27 @@ int main(int argc, char *argv[]) {
         nr_pass = 2;
         CCheckerLuciMissingBlocks(lsb, fd);
         TestMissingBlocks(InodeBlocksNotMarkedInBitMap);
-        TestDirLinks(globalDirMap);
+        TestDirLinks(dirLinksTable);
         TestDirCycle(dirGraph);
         TestOrphanInodes(orphanInodeList);
 
+        for (auto cache : blockCache) {
+                dbg_printf("block cache hits :%lu misses :%lu\n",
+                        cache->hits, cache->misses);
+                delete cache;
+        }
+        blockCache.clear();
+
         CleanupGroupList(blockgroupMap);
-        delete [] checkdupBlockBitMap;
+        delete checkdupBlockBitMap;
         blockgroupMap.clear();
         InodeWithDuplicateBlocks.clear();
         InodeBlocksNotMarkedInBitMap.clear();
-        globalInodeMap.clear();
-        globalDirMap.clear();
+        inodeTable.clear();
+        dirLinksTable.clear();
 
         free(lsb);
+        delete image;
         close(fd);
         return 0;
 }
@@ -0,0 +1,277 @@
+/*
+ * Image access for the checker
+ *
+ * Reads go to the device with pread, or are copied out of a shared
+ * read-only mapping of it. A Ring batches reads through io_uring with a
+ * bounded number in flight, it talks to the kernel directly so the
+ * checker does not depend on liburing. Without io_uring support in the
+ * headers or the running kernel, a Ring is never ok and batches fall
+ * back to synchronous reads.
+ */
+#ifndef _CCHECKER_IO_H_
+#define _CCHECKER_IO_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+#include <vector>
+#include <algorithm>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define CCHECKER_HAVE_URING
+#endif
+#endif
+
+namespace cchecker_io {
+
+        typedef enum Mode {
+                PREAD,
+                MMAP,
+                URING,
+        } Mode;
+
+        // one read of a batch, ret is what pread would have returned
+        struct Request {
+                off_t off;
+                struct iovec iov;
+                ssize_t ret;
+
+                Request(off_t off, void *buf, size_t len) : off(off), ret(-EINPROGRESS) {
+                        iov.iov_base = buf;
+                        iov.iov_len = len;
+                }
+        };
+
+        class Image {
+                public:
+                Image(int fd) : fd(fd), base(NULL), size(0) {}
+
+                ~Image() {
+                        if (base)
+                                munmap(base, size);
+                }
+
+                // maps up to size bytes, no more than the device has
+                bool map(size_t size) {
+                        struct stat st;
+                        uint64_t devsize = 0;
+                        void *addr;
+
+                        if (fstat(fd, &st) < 0)
+                                return false;
+                        if (S_ISBLK(st.st_mode)) {
+                                if (ioctl(fd, BLKGETSIZE64, &devsize) < 0)
+                                        return false;
+                        } else
+                                devsize = st.st_size;
+
+                        size = std::min(size, (size_t)devsize);
+                        if (!size)
+                                return false;
+                        addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+                        if (addr == MAP_FAILED)
+                                return false;
+                        base = (char *)addr;
+                        this->size = size;
+                        return true;
+                }
+
+                bool mapped(void) const {
+                        return base != NULL;
+                }
+
+                ssize_t read(void *buf, size_t len, off_t off) const {
+                        if (!base)
+                                return pread(fd, buf, len, off);
+                        if (off < 0 || (size_t)off >= size)
+                                return 0;
+                        len = std::min(len, size - off);
+                        memcpy(buf, base + off, len);
+                        return len;
+                }
+
+                int fd;
+
+                private:
+                char *base;
+                size_t size;
+        };
+
+        // io_uring instance owned by one thread
+        class Ring {
+                public:
+                Ring(unsigned depth) : ring_fd(-1), depth(depth),
+                        sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(MAP_FAILED) {
+#ifdef CCHECKER_HAVE_URING
+                        struct io_uring_params p;
+
+                        memset(&p, 0, sizeof(p));
+                        ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+                        if (ring_fd < 0)
+                                return;
+
+                        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+                        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                                sq_size = cq_size = std::max(sq_size, cq_size);
+                        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+                        sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+                        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                                cq_ring = sq_ring;
+                        else
+                                cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                        sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+                        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+                                sqes == MAP_FAILED) {
+                                release();
+                                return;
+                        }
+
+                        sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+                        sq_mask = *(unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+                        sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+                        cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+                        cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+                        cq_mask = *(unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+                        cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+                        this->depth = std::min(depth, p.sq_entries);
+#endif
+                }
+
+                ~Ring() {
+                        release();
+                }
+
+                bool ok(void) const {
+                        return ring_fd >= 0;
+                }
+
+                /*
+                 * Reads every request keeping up to depth of them in flight.
+                 * Returns once none is in flight, requests the kernel would
+                 * not take keep ret at -EINPROGRESS. A ring that failed to
+                 * wait for completions is torn down after the drain.
+                 */
+                int read(int fd, std::vector<Request>& reqs) {
+#ifdef CCHECKER_HAVE_URING
+                        int ret;
+                        int err = 0;
+                        size_t next = 0;
+                        unsigned inflight = 0, pending = 0;
+                        unsigned tail = *sq_tail;
+                        bool broken = false;
+
+                        while (inflight || (next < reqs.size() && !err)) {
+                                // queue as many as the depth allows
+                                while (!err && next < reqs.size() &&
+                                        inflight + pending < depth) {
+                                        struct io_uring_sqe *sqe =
+                                                &((struct io_uring_sqe *)sqes)[tail & sq_mask];
+                                        memset(sqe, 0, sizeof(*sqe));
+                                        sqe->opcode = IORING_OP_READV;
+                                        sqe->fd = fd;
+                                        sqe->off = reqs[next].off;
+                                        sqe->addr = (unsigned long)&reqs[next].iov;
+                                        sqe->len = 1;
+                                        sqe->user_data = next;
+                                        sq_array[tail & sq_mask] = tail & sq_mask;
+                                        tail++;
+                                        next++;
+                                        pending++;
+                                }
+                                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+                                ret = syscall(__NR_io_uring_enter, ring_fd, pending,
+                                        inflight + pending ? 1 : 0,
+                                        IORING_ENTER_GETEVENTS, NULL, 0);
+                                if (ret < 0) {
+                                        if (errno == EINTR || errno == EAGAIN ||
+                                                errno == EBUSY)
+                                                continue;
+                                        if (!err) {
+                                                // take back what the kernel did not
+                                                // consume and drain what is in flight
+                                                err = -errno;
+                                                tail -= pending;
+                                                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                                                pending = 0;
+                                        } else {
+                                                // cannot wait in the kernel, the
+                                                // buffers stay in use until every
+                                                // read completes so poll the queue
+                                                broken = true;
+                                                usleep(1000);
+                                        }
+                                } else {
+                                        inflight += ret;
+                                        pending -= ret;
+                                }
+
+                                unsigned head = *cq_head;
+                                unsigned ctail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                                for (; head != ctail; head++) {
+                                        struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+                                        reqs[cqe->user_data].ret = cqe->res;
+                                        inflight--;
+                                }
+                                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                        }
+                        // nothing in flight, later batches read synchronously
+                        if (broken)
+                                release();
+                        return err;
+#else
+                        return -ENOSYS;
+#endif
+                }
+
+                private:
+                int ring_fd;
+                unsigned depth;
+                void *sq_ring, *cq_ring, *sqes;
+                size_t sq_size, cq_size, sqes_size;
+                unsigned *sq_tail, *sq_array, sq_mask;
+                unsigned *cq_head, *cq_tail, cq_mask;
+#ifdef CCHECKER_HAVE_URING
+                struct io_uring_cqe *cqes;
+#endif
+
+                void release(void) {
+                        if (sqes != MAP_FAILED)
+                                munmap(sqes, sqes_size);
+                        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+                                munmap(cq_ring, cq_size);
+                        if (sq_ring != MAP_FAILED)
+                                munmap(sq_ring, sq_size);
+                        sqes = cq_ring = sq_ring = MAP_FAILED;
+                        if (ring_fd >= 0)
+                                close(ring_fd);
+                        ring_fd = -1;
+                }
+        };
+
+        // reads a batch through ring when there is one, whatever it left synchronously
+        inline void ReadBatch(const Image &image, Ring *ring, std::vector<Request>& reqs) {
+                if (ring && ring->ok())
+                        ring->read(image.fd, reqs);
+                for (auto &req : reqs) {
+                        if (req.ret == -EINPROGRESS || req.ret == -EAGAIN)
+                                req.ret = image.read(req.iov.iov_base, req.iov.iov_len, req.off);
+                }
+        }
+};
+#endif
@@ -0,0 +1,330 @@
+/*--------------------------------------------------------------------
+ * Copyright(C) 2016, Saptarshi Sen
+ *
+ * LUCI per-inode L0 block pointer cache
+ *
+ * Caches file block -> L0 blkptr mappings so that repeated lookups
+ * do not walk the indirect block map. Entries are populated on bmap
+ * lookup, updated on L0 insert and dropped on truncate/evict. The
+ * cache is bounded by a shrinker.
+ * ------------------------------------------------------------------*/
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/radix-tree.h>
+
+#include "kern_feature.h"
+#include "luci.h"
+
+#define LUCI_BMAP_CACHE_BATCH 16
+
+struct luci_bmap_cache_entry {
+    unsigned long i_block;
+    blkptr bp;
+};
+
+static struct kmem_cache *luci_bmap_cachep;
+
+// inodes with non-empty caches, walked by the shrinker
+static LIST_HEAD(luci_bmap_cache_inodes);
+static DEFINE_SPINLOCK(luci_bmap_cache_lock);
+
+static atomic_long_t bmap_cache_nr_entries;
+static atomic64_t bmap_cache_hit;
+static atomic64_t bmap_cache_miss;
+static atomic64_t bmap_cache_reclaimed;
+
+void
+luci_bmap_cache_init_once(struct luci_inode_info *li)
+{
+    INIT_RADIX_TREE(&li->i_bmap_cache, GFP_ATOMIC);
+    spin_lock_init(&li->i_bmap_cache_lock);
+    INIT_LIST_HEAD(&li->i_bmap_cache_list);
+    li->i_bmap_cache_nr = 0;
+    li->i_bmap_cache_gen = 0;
+}
+
+// caller holds inode cache lock
+static unsigned long
+__luci_bmap_cache_purge(struct luci_inode_info *li)
+{
+    int i, nr;
+    unsigned long nr_freed = 0;
+    struct luci_bmap_cache_entry *entries[LUCI_BMAP_CACHE_BATCH];
+
+    do {
+        nr = radix_tree_gang_lookup(&li->i_bmap_cache, (void **)entries, 0,
+                                    LUCI_BMAP_CACHE_BATCH);
+        for (i = 0; i < nr; i++) {
+            radix_tree_delete(&li->i_bmap_cache, entries[i]->i_block);
+            kmem_cache_free(luci_bmap_cachep, entries[i]);
+        }
+        nr_freed += nr;
+    } while (nr);
+
+    li->i_bmap_cache_nr = 0;
+    atomic_long_sub(nr_freed, &bmap_cache_nr_entries);
+    return nr_freed;
+}
+
+bool
+luci_bmap_cache_lookup(struct inode *inode,
+                       unsigned long i_block,
+                       blkptr *bp)
+{
+    struct luci_bmap_cache_entry *entry;
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    spin_lock(&li->i_bmap_cache_lock);
+    entry = radix_tree_lookup(&li->i_bmap_cache, i_block);
+    if (entry)
+        *bp = entry->bp;
+    spin_unlock(&li->i_bmap_cache_lock);
+
+    if (entry)
+        atomic64_inc(&bmap_cache_hit);
+    else
+        atomic64_inc(&bmap_cache_miss);
+    return entry != NULL;
+}
+
+/*
+ * Sample cache generation before walking the bmap. Mappings observed by
+ * the walk are only cached if no update/truncate raced with the walk.
+ */
+unsigned long
+luci_bmap_cache_gen(struct inode *inode)
+{
+    unsigned long gen;
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    spin_lock(&li->i_bmap_cache_lock);
+    gen = li->i_bmap_cache_gen;
+    spin_unlock(&li->i_bmap_cache_lock);
+    return gen;
+}
+
+static void
+__luci_bmap_cache_set(struct luci_inode_info *li,
+                      unsigned long i_block,
+                      blkptr *bp,
+                      struct luci_bmap_cache_entry **newp)
+{
+    struct luci_bmap_cache_entry *entry;
+
+    entry = radix_tree_lookup(&li->i_bmap_cache, i_block);
+    if (entry) {
+        if (bp->blockno)
+            entry->bp = *bp;
+        else {
+            // hole, mappings are never cached for holes
+            radix_tree_delete(&li->i_bmap_cache, i_block);
+            kmem_cache_free(luci_bmap_cachep, entry);
+            li->i_bmap_cache_nr--;
+            atomic_long_dec(&bmap_cache_nr_entries);
+        }
+        return;
+    }
+
+    if (!bp->blockno || *newp == NULL)
+        return;
+
+    entry = *newp;
+    entry->i_block = i_block;
+    entry->bp = *bp;
+    if (radix_tree_insert(&li->i_bmap_cache, i_block, entry) < 0)
+        return;
+
+    *newp = NULL;
+    li->i_bmap_cache_nr++;
+    atomic_long_inc(&bmap_cache_nr_entries);
+
+    if (list_empty(&li->i_bmap_cache_list)) {
+        spin_lock(&luci_bmap_cache_lock);
+        list_add_tail(&li->i_bmap_cache_list, &luci_bmap_cache_inodes);
+        spin_unlock(&luci_bmap_cache_lock);
+    }
+}
+
+/*
+ * Update cached mapping for a block. Lookups only populate the entry if
+ * the generation is unchanged since the walk started; updates bump the
+ * generation to fence off such concurrent lookups.
+ */
+static void
+luci_bmap_cache_set(struct inode *inode,
+                    unsigned long i_block,
+                    blkptr *bp,
+                    bool update,
+                    unsigned long gen)
+{
+    struct luci_bmap_cache_entry *entry = NULL;
+    struct luci_inode_info *li = LUCI_I(inode);
+    bool preloaded = false;
+
+    if (bp->blockno) {
+        entry = kmem_cache_alloc(luci_bmap_cachep, GFP_NOFS);
+        if (entry)
+            preloaded = (radix_tree_preload(GFP_NOFS) == 0);
+        if (entry && !preloaded) {
+            kmem_cache_free(luci_bmap_cachep, entry);
+            entry = NULL;
+        }
+    }
+
+    spin_lock(&li->i_bmap_cache_lock);
+    if (update)
+        li->i_bmap_cache_gen++;
+    if (update || li->i_bmap_cache_gen == gen)
+        __luci_bmap_cache_set(li, i_block, bp, &entry);
+    spin_unlock(&li->i_bmap_cache_lock);
+
+    if (preloaded)
+        radix_tree_preload_end();
+    if (entry)
+        kmem_cache_free(luci_bmap_cachep, entry);
+}
+
+void
+luci_bmap_cache_populate(struct inode *inode,
+                         unsigned long i_block,
+                         blkptr *bp,
+                         unsigned long gen)
+{
+    luci_bmap_cache_set(inode, i_block, bp, false, gen);
+}
+
+void
+luci_bmap_cache_update(struct inode *inode,
+                       unsigned long i_block,
+                       blkptr *bp)
+{
+    luci_bmap_cache_set(inode, i_block, bp, true, 0);
+}
+
+// drop all cached mappings, used on truncate and evict
+void
+luci_bmap_cache_invalidate(struct inode *inode)
+{
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    spin_lock(&li->i_bmap_cache_lock);
+    li->i_bmap_cache_gen++;
+    __luci_bmap_cache_purge(li);
+    if (!list_empty(&li->i_bmap_cache_list)) {
+        spin_lock(&luci_bmap_cache_lock);
+        list_del_init(&li->i_bmap_cache_list);
+        spin_unlock(&luci_bmap_cache_lock);
+    }
+    spin_unlock(&li->i_bmap_cache_lock);
+}
+
+static unsigned long
+luci_bmap_cache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    return atomic_long_read(&bmap_cache_nr_entries);
+}
+
+/*
+ * Reclaim whole per-inode caches, oldest populated inode first. Lock order
+ * is inode cache lock -> global lock, so we only trylock inodes here; the
+ * global lock held during purge keeps the inode from being evicted.
+ */
+static unsigned long
+luci_bmap_cache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long nr_freed = 0;
+    struct luci_inode_info *li, *tmp;
+
+    spin_lock(&luci_bmap_cache_lock);
+    list_for_each_entry_safe(li, tmp, &luci_bmap_cache_inodes, i_bmap_cache_list) {
+        if (nr_freed >= sc->nr_to_scan)
+            break;
+        if (!spin_trylock(&li->i_bmap_cache_lock))
+            continue;
+        li->i_bmap_cache_gen++;
+        nr_freed += __luci_bmap_cache_purge(li);
+        list_del_init(&li->i_bmap_cache_list);
+        spin_unlock(&li->i_bmap_cache_lock);
+    }
+    spin_unlock(&luci_bmap_cache_lock);
+
+    atomic64_add(nr_freed, &bmap_cache_reclaimed);
+    return nr_freed;
+}
+
+#ifdef HAVE_SHRINKER_COUNT_SCAN
+static struct shrinker luci_bmap_cache_shrinker = {
+    .count_objects = luci_bmap_cache_count,
+    .scan_objects  = luci_bmap_cache_scan,
+    .seeks         = DEFAULT_SEEKS,
+};
+#else
+static int
+luci_bmap_cache_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+    if (sc->nr_to_scan)
+        luci_bmap_cache_scan(shrink, sc);
+    return (int)luci_bmap_cache_count(shrink, sc);
+}
+
+static struct shrinker luci_bmap_cache_shrinker = {
+    .shrink = luci_bmap_cache_shrink,
+    .seeks  = DEFAULT_SEEKS,
+};
+#endif
+
+static int luci_bmap_cache_show_stats(struct seq_file *m, void *data)
+{
+        seq_printf(m, "entries   :%ld\n"
+                      "hit       :%lld\n"
+                      "miss      :%lld\n"
+                      "reclaimed :%lld\n",
+                      atomic_long_read(&bmap_cache_nr_entries),
+                      atomic64_read(&bmap_cache_hit),
+                      atomic64_read(&bmap_cache_miss),
+                      atomic64_read(&bmap_cache_reclaimed));
+        return 0;
+}
+
+static int luci_bmap_cache_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, luci_bmap_cache_show_stats, inode->i_private);
+}
+
+const struct file_operations luci_bmap_cache_ops = {
+        .open		= luci_bmap_cache_open,
+        .read		= seq_read,
+        .llseek		= no_llseek,
+        .release	= single_release,
+};
+
+int
+init_luci_bmap_cache(void)
+{
+    luci_bmap_cachep = kmem_cache_create("luci_bmap_cache",
+                                         sizeof(struct luci_bmap_cache_entry),
+                                         0,
+                                         SLAB_RECLAIM_ACCOUNT,
+                                         NULL);
+    if (luci_bmap_cachep == NULL)
+        return -ENOMEM;
+
+#ifdef HAVE_SHRINKER_COUNT_SCAN
+    if (register_shrinker(&luci_bmap_cache_shrinker)) {
+        kmem_cache_destroy(luci_bmap_cachep);
+        return -ENOMEM;
+    }
+#else
+    register_shrinker(&luci_bmap_cache_shrinker);
+#endif
+    return 0;
+}
+
+void
+exit_luci_bmap_cache(void)
+{
+    unregister_shrinker(&luci_bmap_cache_shrinker);
+    kmem_cache_destroy(luci_bmap_cachep);
+}
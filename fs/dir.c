@@ -12,8 +12,11 @@
 #include <linux/fs.h>
 #include <linux/mm.h>
 #include <linux/pagemap.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 /*
  *  returns a mapped page
@@ -61,6 +64,36 @@ luci_put_page(struct page *page)
     put_page(page);
 }
 
+/*
+ * Directory scans walk pages in order, so feed them to the page cache
+ * readahead state: a missing page starts a window sized to what is left
+ * of the directory, capped by the device readahead limit, and hitting a
+ * window's PG_readahead marker queues the next one asynchronously. Cold
+ * directories are then read with a few large requests instead of one
+ * synchronous read per page.
+ */
+void
+luci_dir_readahead(struct inode *dir, struct file_ra_state *ra,
+                   struct file *file, unsigned long n)
+{
+    struct page *page;
+    struct address_space *mapping = dir->i_mapping;
+    unsigned long npages = dir_pages(dir);
+
+    if (n >= npages)
+        return;
+
+    page = find_get_page(mapping, n);
+    if (!page) {
+        page_cache_sync_readahead(mapping, ra, file, n, npages - n);
+        return;
+    }
+
+    if (PageReadahead(page))
+        page_cache_async_readahead(mapping, ra, file, page, n, npages - n);
+    put_page(page);
+}
+
 unsigned inline
 luci_rec_len_from_disk(__le16 dlen)
 {
@@ -97,19 +130,243 @@ luci_last_byte(struct inode *inode, unsigned long page_nr)
     return last_byte;
 }
 
+/*
+ * Free space hints for dentry insertion
+ *
+ * i_dir_free holds the largest record a new dentry could take in each
+ * page of a linear directory, so luci_add_link only maps pages that
+ * fit. It is built by one scan of the directory on the first insert,
+ * then kept up by add, delete and compaction and dropped on evict. The
+ * directory's i_mutex serializes all updates. Without a map every page
+ * is a candidate.
+ */
+
+// largest dentry record that fits in a directory page
+unsigned
+luci_dir_page_free(struct inode *dir, struct page *page)
+{
+    unsigned rec_len, gap, max_gap = 0;
+    char *kaddr = page_address(page);
+    struct luci_dir_entry_2 *de = (struct luci_dir_entry_2 *)kaddr;
+    struct luci_dir_entry_2 *limit = (struct luci_dir_entry_2 *)
+        (kaddr + PAGE_SIZE - LUCI_DIR_REC_LEN(1));
+
+    for (; de <= limit; de = luci_next_entry(de)) {
+        // rest of the chunk is unused
+        if (!de->rec_len)
+            return max_t(unsigned, max_gap, luci_chunk_size(dir));
+
+        rec_len = luci_rec_len_from_disk(de->rec_len);
+        gap = de->inode ? rec_len - LUCI_DIR_REC_LEN(de->name_len) : rec_len;
+        max_gap = max(max_gap, gap);
+    }
+    return max_gap;
+}
+
+// zeroed array for per page directory state, large ones from vmalloc
+void *
+luci_dir_map_alloc(size_t size)
+{
+    return (size <= PAGE_SIZE) ? kzalloc(size, GFP_NOFS) : vzalloc(size);
+}
+
+void
+luci_dir_map_free(void *map)
+{
+    if (is_vmalloc_addr(map))
+        vfree(map);
+    else
+        kfree(map);
+}
+
+static int
+luci_dir_free_grow(struct inode *dir, unsigned long nr)
+{
+    __u16 *map;
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    nr = roundup_pow_of_two(nr);
+    map = luci_dir_map_alloc(nr * sizeof(__u16));
+    if (!map)
+        return -ENOMEM;
+
+    if (li->i_dir_free) {
+        memcpy(map, li->i_dir_free, li->i_dir_free_nr * sizeof(__u16));
+        luci_dir_map_free(li->i_dir_free);
+    }
+    li->i_dir_free = map;
+    li->i_dir_free_nr = nr;
+    return 0;
+}
+
+void
+luci_dir_free_release(struct inode *dir)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    if (li->i_dir_free)
+        luci_dir_map_free(li->i_dir_free);
+    li->i_dir_free = NULL;
+    li->i_dir_free_nr = 0;
+}
+
+// scan a directory once for its free space map, none on failure
+void
+luci_dir_free_build(struct inode *dir)
+{
+    struct page *page;
+    unsigned long n, npages = dir_pages(dir);
+
+    if (LUCI_I(dir)->i_dir_free || !npages)
+        return;
+
+    if (luci_dir_free_grow(dir, npages))
+        return;
+
+    for (n = 0; n < npages; n++) {
+        page = luci_get_page(dir, n);
+        if (IS_ERR(page)) {
+            luci_dir_free_release(dir);
+            return;
+        }
+        LUCI_I(dir)->i_dir_free[n] = min_t(unsigned, U16_MAX,
+            luci_dir_page_free(dir, page));
+        luci_put_page(page);
+    }
+    luci_dbg_inode(dir, "built free space map, %lu pages", npages);
+}
+
+// first page from start with room for a len byte dentry
+unsigned long
+luci_dir_free_find(struct inode *dir, unsigned len, unsigned long start)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+    unsigned long n, npages = dir_pages(dir);
+
+    if (!li->i_dir_free)
+        return start;
+
+    for (n = start; n < npages && n < li->i_dir_free_nr; n++) {
+        if (li->i_dir_free[n] >= len)
+            return n;
+    }
+    // pages past the map are unknown, try them
+    return min(n, npages);
+}
+
+// record the largest gap of page n after it changed
+void
+luci_dir_free_update(struct inode *dir, unsigned long n, unsigned gap)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    if (!li->i_dir_free)
+        return;
+
+    if (n >= li->i_dir_free_nr && luci_dir_free_grow(dir, n + 1)) {
+        // cannot track the page, drop the map rather than miss it
+        luci_dir_free_release(dir);
+        return;
+    }
+    li->i_dir_free[n] = min_t(unsigned, U16_MAX, gap);
+}
+
+// a record of gap bytes was freed in page n
+void
+luci_dir_free_note(struct inode *dir, unsigned long n, unsigned gap)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    if (li->i_dir_free && n < li->i_dir_free_nr && li->i_dir_free[n] < gap)
+        li->i_dir_free[n] = min_t(unsigned, U16_MAX, gap);
+}
+
+/*
+ * Read ahead the inode table blocks behind the dentries of a page, so
+ * that stat calls following readdir find them cached. Inodes allocated
+ * together share table blocks, only distinct blocks are queued, at most
+ * LUCI_INODE_RA_BLOCKS per page.
+ */
+static void
+luci_readdir_inode_readahead(struct inode *dir, struct luci_dir_entry_2 *de,
+                             struct luci_dir_entry_2 *limit)
+{
+    int i, nr = 0;
+    unsigned long block, blocks[LUCI_INODE_RA_BLOCKS];
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    for (; de <= limit && de->rec_len; de = luci_next_entry(de)) {
+        if (!de->inode)
+            continue;
+
+        block = luci_inode_block(dir->i_sb, le32_to_cpu(de->inode));
+        if (!block)
+            continue;
+
+        for (i = 0; i < nr && blocks[i] != block; i++)
+            ;
+        if (i < nr)
+            continue;
+        if (nr == LUCI_INODE_RA_BLOCKS)
+            break;
+
+        blocks[nr++] = block;
+        sb_breadahead(dir->i_sb, block);
+    }
+    blk_finish_plug(&plug);
+}
+
+/*
+ * Offset of the last record boundary at or before offset, walking from
+ * the start of its chunk. A position that did not come from the current
+ * layout may point into the middle of a record.
+ */
+static unsigned
+luci_validate_entry(char *base, unsigned offset, unsigned chunk)
+{
+    struct luci_dir_entry_2 *de = (struct luci_dir_entry_2 *)(base + offset);
+    struct luci_dir_entry_2 *p, *next;
+
+    p = (struct luci_dir_entry_2 *)(base + (offset & ~(chunk - 1)));
+    while ((char *)p < (char *)de && p->rec_len) {
+        next = luci_next_entry(p);
+        if ((char *)next > (char *)de)
+            break;
+        p = next;
+    }
+    return (char *)p - base;
+}
+
 static int
 luci_readdir(struct file *file, struct dir_context *ctx)
 {
-    loff_t pos = ctx->pos;
-    unsigned long n = pos >> PAGE_SHIFT;
+    loff_t pos;
+    unsigned long n;
     struct inode *dir = file_inode(file);
+    struct luci_inode_info *li = LUCI_I(dir);
     unsigned long npages = dir_pages(dir);
-    unsigned int offset = pos & ~PAGE_MASK;
+    // generation + 1 this stream last ran in, 0 before its first call
+    unsigned long seen = (unsigned long)file->private_data;
+    bool need_revalidate = false;
+    unsigned int offset;
 
     #ifdef DEBUG_DENTRY
     luci_dbg("reading directory");
     #endif
 
+    // entries moved since this reader last ran, see dir_compact.c. A new
+    // stream may have seeked to a cookie of any generation.
+    if (unlikely(seen != li->i_dir_gen + 1)) {
+        if (!seen || !luci_dir_compact_remap(dir, seen - 1, &ctx->pos))
+            need_revalidate = true;
+        file->private_data = (void *)(li->i_dir_gen + 1);
+    }
+
+    pos = ctx->pos;
+    n = pos >> PAGE_SHIFT;
+    offset = pos & ~PAGE_MASK;
+
     // scan all pages of this dir inode
     for (; n < npages; n++, offset = 0) {
         char *kaddr;
@@ -121,6 +378,7 @@ luci_readdir(struct file *file, struct dir_context *ctx)
                              n, pos, offset);
         #endif
 
+        luci_dir_readahead(dir, &file->f_ra, file, n);
         page = luci_get_page(dir, n);
         if (IS_ERR(page)) {
             luci_err_inode(dir, "bad dentry page page :%ld err:%ld", n,
@@ -130,10 +388,20 @@ luci_readdir(struct file *file, struct dir_context *ctx)
         }
 
         kaddr = page_address(page);
+        if (unlikely(need_revalidate)) {
+            if (offset) {
+                offset = luci_validate_entry(kaddr, offset,
+                                             luci_chunk_size(dir));
+                ctx->pos = ((loff_t)n << PAGE_SHIFT) + offset;
+            }
+            need_revalidate = false;
+        }
         de = (struct luci_dir_entry_2*) (kaddr + offset);
         limit = (struct luci_dir_entry_2*)
 	    ((char*)kaddr + luci_last_byte(dir, n) - LUCI_DIR_REC_LEN(1));
 
+        luci_readdir_inode_readahead(dir, de, limit);
+
         // lookup dentries in the page
         for (; de <= limit; de = luci_next_entry(de)) {
 
@@ -206,4 +474,5 @@ const struct file_operations luci_dir_operations = {
     .read     = generic_read_dir,
     .iterate  = luci_readdir,
     .fsync    = generic_file_fsync,
+    .unlocked_ioctl = luci_ioctl,
 };
@@ -0,0 +1,340 @@
+/*--------------------------------------------------------------------
+ * Copyright(C) 2016, Saptarshi Sen
+ *
+ * LUCI online directory compaction
+ *
+ * Deleting a dentry only clears its inode number, so a directory that
+ * went through heavy churn keeps every page it ever had and scans walk
+ * all of them. LUCI_IOC_DIR_COMPACT repacks the live entries of a linear
+ * directory in order, each at its minimum record length, and frees the
+ * pages left empty at the tail. Entries only ever move towards the start
+ * of the directory, so the rewrite is done in place, one destination
+ * page at a time.
+ *
+ * A page is only overwritten once the earlier pages that took over its
+ * entries are on disk, so a crash leaves an entry in its old place, its
+ * new one or both, never neither. Readers holding a position from before
+ * the compaction resume at the new position of the page they were in,
+ * see luci_dir_compact_remap.
+ * ------------------------------------------------------------------*/
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+
+#include "kern_feature.h"
+#include "luci.h"
+
+// destination of the repacked entries
+struct luci_compact_cursor {
+    loff_t pos;                     // end of the last entry placed
+    loff_t size;                    // directory size after compaction
+    unsigned long page;             // page assembled in buf
+    char *buf;
+    struct luci_dir_entry_2 *last;  // last entry placed in buf
+    loff_t *remap;                  // new position of each old page
+};
+
+// next position a rec_len record fits at, entries do not cross chunks
+static loff_t
+luci_compact_place(struct inode *dir, loff_t *pos, unsigned rec_len)
+{
+    unsigned chunk = luci_chunk_size(dir);
+    loff_t at = *pos;
+
+    if ((at & (chunk - 1)) + rec_len > chunk)
+        at = round_up(at, chunk);
+    *pos = at + rec_len;
+    return at;
+}
+
+/*
+ * Validates every page and sizes the compacted directory before anything
+ * is written, the source pages stay pinned for the rewrite.
+ */
+static int
+luci_compact_scan(struct inode *dir, struct page **pages, loff_t *size)
+{
+    loff_t pos = 0;
+    char *kaddr;
+    unsigned rec_len, from, chunk = luci_chunk_size(dir);
+    unsigned long n, npages = dir_pages(dir);
+    struct page *page;
+    struct file_ra_state ra;
+    struct luci_dir_entry_2 *de, *limit;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (n = 0; n < npages; n++) {
+        luci_dir_readahead(dir, &ra, NULL, n);
+        page = luci_get_page(dir, n);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+
+        kaddr = page_address(page);
+        de = (struct luci_dir_entry_2 *)kaddr;
+        limit = (struct luci_dir_entry_2 *)
+            (kaddr + luci_last_byte(dir, n) - LUCI_DIR_REC_LEN(1));
+
+        for (; de <= limit; de = luci_next_entry(de)) {
+            from = ((char *)de - kaddr) & (chunk - 1);
+            rec_len = luci_rec_len_from_disk(de->rec_len);
+            if (rec_len < LUCI_DIR_REC_LEN(1) || (rec_len & 3) ||
+                from + rec_len > chunk ||
+                (de->inode && rec_len < LUCI_DIR_REC_LEN(de->name_len))) {
+                luci_err_inode(dir, "bad dentry at page %lu offset %ld, "
+                    "rec_len :%u", n, (long)((char *)de - kaddr), rec_len);
+                luci_put_page(page);
+                return -EIO;
+            }
+            if (de->inode)
+                luci_compact_place(dir, &pos, LUCI_DIR_REC_LEN(de->name_len));
+        }
+
+        get_page(page);
+        luci_put_page(page);
+        pages[n] = page;
+    }
+
+    *size = round_up(pos, chunk);
+    return 0;
+}
+
+// last entry of a chunk takes up the rest of it
+static void
+luci_compact_close_chunk(struct inode *dir, struct luci_compact_cursor *cur)
+{
+    unsigned off, chunk = luci_chunk_size(dir);
+
+    if (!cur->last)
+        return;
+
+    off = (char *)cur->last - cur->buf;
+    cur->last->rec_len = luci_rec_len_to_disk(round_up(off + 1, chunk) - off);
+    cur->last = NULL;
+}
+
+// write the assembled page over its page cache page
+static int
+luci_compact_flush(struct inode *dir, struct luci_compact_cursor *cur)
+{
+    int err;
+    unsigned len;
+    struct page *page;
+    loff_t start = (loff_t)cur->page << PAGE_SHIFT;
+
+    luci_compact_close_chunk(dir, cur);
+    len = min_t(loff_t, PAGE_SIZE, cur->size - start);
+
+    // entries of this page moved to earlier pages, those go to disk first
+    if (cur->remap[cur->page] >= 0 && cur->remap[cur->page] < start) {
+        err = filemap_write_and_wait_range(dir->i_mapping, 0, start - 1);
+        if (err)
+            return err;
+    }
+
+    page = luci_get_page(dir, cur->page);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    lock_page(page);
+    err = luci_prepare_chunk(page, start, len);
+    if (err) {
+        unlock_page(page);
+        goto out;
+    }
+    memcpy(page_address(page), cur->buf, len);
+    err = luci_commit_chunk(page, start, len);
+    luci_dir_free_update(dir, cur->page, luci_dir_page_free(dir, page));
+out:
+    luci_put_page(page);
+    return err;
+}
+
+static int
+luci_compact_add(struct inode *dir, struct luci_compact_cursor *cur,
+                 struct luci_dir_entry_2 *de, loff_t *remap)
+{
+    int err;
+    loff_t at;
+    unsigned chunk = luci_chunk_size(dir);
+    unsigned rec_len = LUCI_DIR_REC_LEN(de->name_len);
+    struct luci_dir_entry_2 *new;
+
+    at = luci_compact_place(dir, &cur->pos, rec_len);
+    if ((at >> PAGE_SHIFT) != cur->page) {
+        err = luci_compact_flush(dir, cur);
+        if (err)
+            return err;
+        cur->page = at >> PAGE_SHIFT;
+        memset(cur->buf, 0, PAGE_SIZE);
+    } else if (cur->last &&
+               ((char *)cur->last - cur->buf) / chunk != (at & ~PAGE_MASK) / chunk)
+        luci_compact_close_chunk(dir, cur);
+
+    new = (struct luci_dir_entry_2 *)(cur->buf + (at & ~PAGE_MASK));
+    memcpy(new, de, offsetof(struct luci_dir_entry_2, name) + de->name_len);
+    new->rec_len = luci_rec_len_to_disk(rec_len);
+    cur->last = new;
+
+    if (*remap < 0)
+        *remap = at;
+    return 0;
+}
+
+// publish where the old pages went, or make readers start over
+static void
+luci_compact_set_remap(struct inode *dir, loff_t *remap, unsigned long nr)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    luci_dir_compact_release(dir);
+    li->i_dir_remap = remap;
+    li->i_dir_remap_nr = remap ? nr : 0;
+    li->i_dir_gen++;
+}
+
+/*
+ * Compacts a linear directory, the caller holds the directory's inode
+ * lock. Indexed directories place entries by hash and are left alone.
+ */
+int
+luci_dir_compact(struct inode *dir)
+{
+    int err;
+    char *kaddr;
+    loff_t *remap = NULL;
+    unsigned long n, npages = dir_pages(dir);
+    struct page **pages;
+    struct luci_dir_entry_2 *de, *limit;
+    struct luci_compact_cursor cur;
+
+    if (luci_dx_dir(dir))
+        return -EOPNOTSUPP;
+
+    if (npages <= 1)
+        return 0;
+
+    memset(&cur, 0, sizeof(cur));
+    pages = luci_dir_map_alloc(npages * sizeof(struct page *));
+    if (!pages)
+        return -ENOMEM;
+
+    err = luci_compact_scan(dir, pages, &cur.size);
+    if (err)
+        goto out;
+
+    if (cur.size >= dir->i_size) {
+        luci_dbg_inode(dir, "nothing to compact, size :%llu", dir->i_size);
+        goto out;
+    }
+
+    remap = luci_dir_map_alloc((npages + 1) * sizeof(loff_t));
+    cur.buf = kzalloc(PAGE_SIZE, GFP_NOFS);
+    if (!remap || !cur.buf) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (n = 0; n <= npages; n++)
+        remap[n] = -1;
+    cur.remap = remap;
+
+    for (n = 0; n < npages && !err; n++) {
+        kaddr = kmap(pages[n]);
+        de = (struct luci_dir_entry_2 *)kaddr;
+        limit = (struct luci_dir_entry_2 *)
+            (kaddr + luci_last_byte(dir, n) - LUCI_DIR_REC_LEN(1));
+
+        for (; de <= limit && !err; de = luci_next_entry(de)) {
+            if (de->inode)
+                err = luci_compact_add(dir, &cur, de, &remap[n]);
+        }
+        kunmap(pages[n]);
+    }
+
+    if (!err)
+        err = luci_compact_flush(dir, &cur);
+    if (err) {
+        luci_err_inode(dir, "compaction stopped at page %lu :%d", cur.page, err);
+        luci_compact_set_remap(dir, NULL, 0);
+        goto out;
+    }
+
+    // pages without live entries resume readers at the next one that had
+    remap[npages] = cur.size;
+    for (n = npages; n-- > 0; ) {
+        if (remap[n] < 0)
+            remap[n] = remap[n + 1];
+    }
+    luci_compact_set_remap(dir, remap, npages + 1);
+    remap = NULL;
+
+    for (n = 0; n < npages; n++) {
+        put_page(pages[n]);
+        pages[n] = NULL;
+    }
+
+    // the repacked pages reach the disk before the tail goes
+    err = filemap_write_and_wait_range(dir->i_mapping, 0, cur.size - 1);
+    if (err)
+        goto out;
+
+    luci_info_inode(dir, "compacted directory, size :%llu -> %llu",
+        dir->i_size, cur.size);
+    truncate_inode_pages(dir->i_mapping, cur.size);
+    err = luci_truncate(dir, cur.size);
+    i_size_write(dir, cur.size);
+    mark_inode_dirty(dir);
+
+    for (n = dir_pages(dir); n < npages; n++) {
+        if (n < LUCI_I(dir)->i_dir_free_nr)
+            luci_dir_free_update(dir, n, 0);
+    }
+
+out:
+    for (n = 0; n < npages; n++) {
+        if (pages[n])
+            put_page(pages[n]);
+    }
+    luci_dir_map_free(pages);
+    if (remap)
+        luci_dir_map_free(remap);
+    kfree(cur.buf);
+    return err;
+}
+
+/*
+ * Moves pos of a reader that last ran in generation gen to where its
+ * entries went. A reader from just before the last compaction resumes at
+ * the first entry of its old page, which may repeat entries already
+ * returned but skips none. Returns false if pos cannot be remapped, the
+ * caller then validates it against the current layout.
+ */
+bool
+luci_dir_compact_remap(struct inode *dir, unsigned long gen, loff_t *pos)
+{
+    unsigned long n = *pos >> PAGE_SHIFT;
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    if (!*pos)
+        return true;
+
+    if (gen + 1 != li->i_dir_gen || !li->i_dir_remap)
+        return false;
+
+    if (n >= li->i_dir_remap_nr)
+        n = li->i_dir_remap_nr - 1;
+    *pos = li->i_dir_remap[n];
+    return true;
+}
+
+void
+luci_dir_compact_release(struct inode *dir)
+{
+    struct luci_inode_info *li = LUCI_I(dir);
+
+    if (li->i_dir_remap)
+        luci_dir_map_free(li->i_dir_remap);
+    li->i_dir_remap = NULL;
+    li->i_dir_remap_nr = 0;
+}
@@ -0,0 +1,824 @@
+/*--------------------------------------------------------------------
+ * Copyright(C) 2016, Saptarshi Sen
+ *
+ * LUCI hashed directory index
+ *
+ * With the 'dirindex' mount option a directory that outgrows its first
+ * page is converted to an htree: page 0 becomes the index root and the
+ * entries are spread over leaf pages by hash range, so a lookup reads
+ * the root, at most one interior index page and one leaf. A full leaf
+ * is split in two at a hash boundary, a full interior page likewise.
+ * Leaves continuing a run of colliding hashes are marked by the low bit
+ * of their hash in the index.
+ *
+ * Only filesystems whose block size is the page size are indexed, the
+ * index pages do not fit in smaller directory chunks.
+ * ------------------------------------------------------------------*/
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/pagemap.h>
+
+#include "kern_feature.h"
+#include "luci.h"
+
+// an index page on the path from the root to a leaf
+struct luci_dx_frame {
+    struct page *page;
+    struct luci_dx_entry *entries;
+    struct luci_dx_entry *at;
+};
+
+// a live entry of a leaf being split
+struct luci_dx_map {
+    __u32 hash;
+    __u16 offs;
+    __u16 size;
+};
+
+#define LUCI_DX_ROOT_OFFSET (LUCI_DIR_REC_LEN(1) + LUCI_DIR_REC_LEN(2))
+
+#define LUCI_DX_MAP_MAX     (PAGE_SIZE / LUCI_DIR_REC_LEN(1))
+
+static inline struct luci_dx_root_info *
+luci_dx_info(void *kaddr)
+{
+    return (struct luci_dx_root_info *)((char *)kaddr + LUCI_DX_ROOT_OFFSET);
+}
+
+static inline struct luci_dx_entry *
+luci_dx_root_entries(void *kaddr)
+{
+    return (struct luci_dx_entry *)((char *)luci_dx_info(kaddr) +
+        sizeof(struct luci_dx_root_info));
+}
+
+static inline struct luci_dx_entry *
+luci_dx_node_entries(void *kaddr)
+{
+    return (struct luci_dx_entry *)((char *)kaddr + LUCI_DIR_REC_LEN(0));
+}
+
+static inline unsigned
+luci_dx_root_limit(void)
+{
+    return (PAGE_SIZE - LUCI_DX_ROOT_OFFSET -
+        sizeof(struct luci_dx_root_info)) / sizeof(struct luci_dx_entry);
+}
+
+static inline unsigned
+luci_dx_node_limit(void)
+{
+    return (PAGE_SIZE - LUCI_DIR_REC_LEN(0)) / sizeof(struct luci_dx_entry);
+}
+
+static inline unsigned
+luci_dx_get_count(struct luci_dx_entry *entries)
+{
+    return le16_to_cpu(((struct luci_dx_countlimit *)entries)->count);
+}
+
+static inline unsigned
+luci_dx_get_limit(struct luci_dx_entry *entries)
+{
+    return le16_to_cpu(((struct luci_dx_countlimit *)entries)->limit);
+}
+
+static inline void
+luci_dx_set_count(struct luci_dx_entry *entries, unsigned count)
+{
+    ((struct luci_dx_countlimit *)entries)->count = cpu_to_le16(count);
+}
+
+static inline void
+luci_dx_set_limit(struct luci_dx_entry *entries, unsigned limit)
+{
+    ((struct luci_dx_countlimit *)entries)->limit = cpu_to_le16(limit);
+}
+
+static inline bool
+luci_dx_page_sized(struct inode *dir)
+{
+    return luci_chunk_size(dir) == PAGE_SIZE && PAGE_SIZE <= LUCI_MAX_REC_LEN;
+}
+
+bool
+luci_dx_dir(struct inode *dir)
+{
+    return (LUCI_I(dir)->i_flags & LUCI_INDEX_FL) && luci_dx_page_sized(dir);
+}
+
+bool
+luci_dx_can_index(struct inode *dir)
+{
+    return test_opt(LUCI_SB(dir->i_sb)->s_mount_opt, LUCI_MOUNT_DIR_INDEX) &&
+        luci_dx_page_sized(dir);
+}
+
+static inline __u32
+luci_dx_name_hash(struct inode *dir, int version, const char *name, int len)
+{
+    return luci_dx_hash(version, LUCI_SB(dir->i_sb)->s_lsb->s_hash_seed,
+        name, len);
+}
+
+static inline int
+luci_dx_version(struct luci_dx_frame *frames)
+{
+    return luci_dx_info(page_address(frames[0].page))->hash_version;
+}
+
+// lock a directory page and map its blocks for a whole page update
+static int
+luci_dx_begin_update(struct page *page)
+{
+    int err;
+
+    lock_page(page);
+    err = luci_prepare_chunk(page, page_offset(page), PAGE_SIZE);
+    if (err)
+        unlock_page(page);
+    return err;
+}
+
+static int
+luci_dx_end_update(struct page *page)
+{
+    return luci_commit_chunk(page, page_offset(page), PAGE_SIZE);
+}
+
+static void
+luci_dx_release(struct luci_dx_frame *frames, int levels)
+{
+    while (levels--)
+        luci_put_page(frames[levels].page);
+}
+
+static struct page *
+luci_dx_get_leaf(struct inode *dir, unsigned long block)
+{
+    if (!block || block >= dir_pages(dir)) {
+        luci_err_inode(dir, "bad index leaf %lu", block);
+        return ERR_PTR(-EINVAL);
+    }
+    return luci_get_page(dir, block);
+}
+
+static struct page *
+luci_dx_get_node(struct inode *dir, unsigned long block)
+{
+    unsigned count;
+    struct page *page;
+    struct luci_dir_entry_2 *de;
+    struct luci_dx_entry *entries;
+
+    if (!block || block >= dir_pages(dir))
+        goto bad;
+
+    page = luci_get_page(dir, block);
+    if (IS_ERR(page))
+        return page;
+
+    de = (struct luci_dir_entry_2 *)page_address(page);
+    entries = luci_dx_node_entries(de);
+    count = luci_dx_get_count(entries);
+    if (de->inode || luci_rec_len_from_disk(de->rec_len) != PAGE_SIZE ||
+        luci_dx_get_limit(entries) != luci_dx_node_limit() ||
+        !count || count > luci_dx_node_limit()) {
+        luci_put_page(page);
+        goto bad;
+    }
+    return page;
+
+bad:
+    luci_err_inode(dir, "bad index page %lu", block);
+    return ERR_PTR(-EINVAL);
+}
+
+/*
+ * Walks the index from the root to the leaf covering the hash of name,
+ * filling one frame per index page. Returns the number of frames, or
+ * -EINVAL for a corrupt index. The frame pages are held until released.
+ */
+static int
+luci_dx_probe(struct inode *dir, const char *name, int len, __u32 *hash,
+              struct luci_dx_frame *frames)
+{
+    int level = 0, levels;
+    unsigned count, limit;
+    void *kaddr;
+    struct page *page;
+    struct luci_dir_entry_2 *dot, *dotdot;
+    struct luci_dx_root_info *info;
+    struct luci_dx_entry *entries, *p, *q, *m;
+
+    page = luci_get_page(dir, 0);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    kaddr = page_address(page);
+    dot = (struct luci_dir_entry_2 *)kaddr;
+    dotdot = (struct luci_dir_entry_2 *)((char *)kaddr + LUCI_DIR_REC_LEN(1));
+    info = luci_dx_info(kaddr);
+    if (luci_rec_len_from_disk(dot->rec_len) != LUCI_DIR_REC_LEN(1) ||
+        luci_rec_len_from_disk(dotdot->rec_len) != PAGE_SIZE - LUCI_DIR_REC_LEN(1) ||
+        info->reserved_zero || info->info_length != sizeof(*info) ||
+        info->indirect_levels >= LUCI_DX_MAX_LEVELS ||
+        !luci_dx_hash_supported(info->hash_version)) {
+        luci_err_inode(dir, "bad index root");
+        goto bad;
+    }
+
+    levels = info->indirect_levels;
+    *hash = luci_dx_name_hash(dir, info->hash_version, name, len);
+    entries = luci_dx_root_entries(kaddr);
+    limit = luci_dx_root_limit();
+
+    for (;;) {
+        count = luci_dx_get_count(entries);
+        if (!count || count > limit || luci_dx_get_limit(entries) != limit) {
+            luci_err_inode(dir, "bad index page, level %d", level);
+            goto bad;
+        }
+
+        // last entry with a hash not above ours, entries[0] starts at 0
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (le32_to_cpu(m->hash) > *hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+
+        frames[level].page = page;
+        frames[level].entries = entries;
+        frames[level].at = p - 1;
+        if (level == levels)
+            return levels + 1;
+
+        page = luci_dx_get_node(dir, le32_to_cpu(frames[level].at->block));
+        level++;
+        if (IS_ERR(page)) {
+            luci_dx_release(frames, level);
+            return PTR_ERR(page);
+        }
+        entries = luci_dx_node_entries(page_address(page));
+        limit = luci_dx_node_limit();
+    }
+
+bad:
+    luci_put_page(page);
+    luci_dx_release(frames, level);
+    return -EINVAL;
+}
+
+/*
+ * Moves the path to the next leaf if that continues the collision run
+ * of hash. Returns 1 if it does, 0 if the run ends here, or an error.
+ */
+static int
+luci_dx_next_leaf(struct inode *dir, __u32 hash, struct luci_dx_frame *frames,
+                  int levels)
+{
+    int level = levels - 1;
+    struct page *page;
+    struct luci_dx_frame *frame;
+
+    for (;;) {
+        frame = &frames[level];
+        if (frame->at + 1 < frame->entries + luci_dx_get_count(frame->entries))
+            break;
+        if (!level)
+            return 0;
+        level--;
+    }
+
+    if ((le32_to_cpu(frame->at[1].hash) & ~1) != hash)
+        return 0;
+    frame->at++;
+
+    // down the leftmost entries to the leaf level
+    for (; level < levels - 1; level++) {
+        page = luci_dx_get_node(dir, le32_to_cpu(frames[level].at->block));
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        luci_put_page(frames[level + 1].page);
+        frames[level + 1].page = page;
+        frames[level + 1].entries = luci_dx_node_entries(page_address(page));
+        frames[level + 1].at = frames[level + 1].entries;
+    }
+    return 1;
+}
+
+/*
+ * Looks child up through the index. Returns the entry, NULL if there is
+ * none, or an error; -EINVAL means the index is corrupt and the caller
+ * should fall back to a linear scan.
+ */
+struct luci_dir_entry_2 *
+luci_dx_find_entry(struct inode *dir, const struct qstr *child,
+                   struct page **res)
+{
+    int err, levels;
+    __u32 hash;
+    unsigned long block;
+    struct page *page;
+    struct luci_dir_entry_2 *de;
+    struct luci_dx_frame frames[LUCI_DX_MAX_LEVELS];
+
+    levels = luci_dx_probe(dir, child->name, child->len, &hash, frames);
+    if (levels < 0)
+        return ERR_PTR(levels);
+
+    for (;;) {
+        block = le32_to_cpu(frames[levels - 1].at->block);
+        page = luci_dx_get_leaf(dir, block);
+        if (IS_ERR(page)) {
+            de = ERR_CAST(page);
+            break;
+        }
+
+        de = luci_find_entry_page(dir, page, block, child);
+        if (de && !IS_ERR(de)) {
+            *res = page;
+            break;
+        }
+        luci_put_page(page);
+        if (de)
+            break;
+
+        err = luci_dx_next_leaf(dir, hash, frames, levels);
+        if (err <= 0) {
+            de = err ? ERR_PTR(err) : NULL;
+            break;
+        }
+    }
+
+    luci_dx_release(frames, levels);
+    return de;
+}
+
+static int
+luci_dx_map_cmp(const void *a, const void *b)
+{
+    const struct luci_dx_map *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->offs < y->offs ? -1 : x->offs > y->offs;
+}
+
+// collects the live entries of a leaf from offset start, sorted by hash
+static int
+luci_dx_map_entries(struct inode *dir, int version, char *kaddr,
+                    unsigned start, struct luci_dx_map *map)
+{
+    int count = 0;
+    char *limit = kaddr + PAGE_SIZE - LUCI_DIR_REC_LEN(1);
+    struct luci_dir_entry_2 *de = (struct luci_dir_entry_2 *)(kaddr + start);
+
+    for (; (char *)de <= limit; de = luci_next_entry(de)) {
+        if (!de->rec_len)
+            break;
+        if (!de->inode)
+            continue;
+        map[count].hash = luci_dx_name_hash(dir, version, de->name, de->name_len);
+        map[count].offs = (char *)de - kaddr;
+        map[count].size = LUCI_DIR_REC_LEN(de->name_len);
+        count++;
+    }
+
+    sort(map, count, sizeof(*map), luci_dx_map_cmp, NULL);
+    return count;
+}
+
+// first entry of the upper half, splitting the bytes in use evenly
+static int
+luci_dx_split_point(struct luci_dx_map *map, int count)
+{
+    int i, split;
+    unsigned size = 0, total = 0;
+
+    for (i = 0; i < count; i++)
+        total += map[i].size;
+
+    for (split = 1, size = map[0].size; split < count - 1; split++) {
+        if (size + map[split].size > total / 2)
+            break;
+        size += map[split].size;
+    }
+    return split;
+}
+
+// rewrites a leaf with the mapped entries, the last spans the rest of the page
+static void
+luci_dx_pack(char *to, char *from, struct luci_dx_map *map, int count)
+{
+    int i;
+    char *p = to;
+    struct luci_dir_entry_2 *de = (struct luci_dir_entry_2 *)to;
+
+    memset(to, 0, PAGE_SIZE);
+    for (i = 0; i < count; i++) {
+        de = (struct luci_dir_entry_2 *)p;
+        memcpy(p, from + map[i].offs, map[i].size);
+        de->rec_len = luci_rec_len_to_disk(map[i].size);
+        p += map[i].size;
+    }
+    de->rec_len = luci_rec_len_to_disk(to + PAGE_SIZE - (char *)de);
+}
+
+// appends a leaf holding the mapped entries
+static int
+luci_dx_new_leaf(struct inode *dir, char *from, struct luci_dx_map *map,
+                 int count, unsigned long *block)
+{
+    int err;
+    struct page *page;
+
+    *block = dir_pages(dir);
+    page = luci_get_page(dir, *block);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    err = luci_dx_begin_update(page);
+    if (!err) {
+        luci_dx_pack(page_address(page), from, map, count);
+        err = luci_dx_end_update(page);
+    }
+    luci_put_page(page);
+    return err;
+}
+
+// appends an interior index page holding count entries
+static struct page *
+luci_dx_new_node(struct inode *dir, struct luci_dx_entry *from, unsigned count,
+                 unsigned long *block)
+{
+    int err;
+    struct page *page;
+    struct luci_dir_entry_2 *de;
+    struct luci_dx_entry *entries;
+
+    *block = dir_pages(dir);
+    page = luci_get_page(dir, *block);
+    if (IS_ERR(page))
+        return page;
+
+    err = luci_dx_begin_update(page);
+    if (err)
+        goto fail;
+
+    de = (struct luci_dir_entry_2 *)page_address(page);
+    memset(de, 0, PAGE_SIZE);
+    de->rec_len = luci_rec_len_to_disk(PAGE_SIZE);
+    entries = luci_dx_node_entries(de);
+    memcpy(entries, from, count * sizeof(*from));
+    luci_dx_set_limit(entries, luci_dx_node_limit());
+    luci_dx_set_count(entries, count);
+
+    err = luci_dx_end_update(page);
+    if (err)
+        goto fail;
+    return page;
+
+fail:
+    luci_put_page(page);
+    return ERR_PTR(err);
+}
+
+// adds an index entry after the one the frame follows
+static int
+luci_dx_insert(struct luci_dx_frame *frame, __u32 hash, unsigned long block)
+{
+    int err;
+    unsigned count = luci_dx_get_count(frame->entries);
+    struct luci_dx_entry *new = frame->at + 1;
+
+    err = luci_dx_begin_update(frame->page);
+    if (err)
+        return err;
+
+    memmove(new + 1, new, (char *)(frame->entries + count) - (char *)new);
+    new->hash = cpu_to_le32(hash);
+    new->block = cpu_to_le32(block);
+    luci_dx_set_count(frame->entries, count + 1);
+
+    return luci_dx_end_update(frame->page);
+}
+
+// moves the root entries to a new interior page under the root
+static int
+luci_dx_add_level(struct inode *dir, struct luci_dx_frame *frames, int *levels)
+{
+    int err;
+    unsigned long block;
+    struct page *page;
+    struct luci_dx_entry *root = frames[0].entries;
+
+    page = luci_dx_new_node(dir, root, luci_dx_get_count(root), &block);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    err = luci_dx_begin_update(frames[0].page);
+    if (err) {
+        luci_put_page(page);
+        return err;
+    }
+    luci_dx_set_count(root, 1);
+    root[0].block = cpu_to_le32(block);
+    luci_dx_info(page_address(frames[0].page))->indirect_levels = 1;
+    err = luci_dx_end_update(frames[0].page);
+
+    frames[1].page = page;
+    frames[1].entries = luci_dx_node_entries(page_address(page));
+    frames[1].at = frames[1].entries + (frames[0].at - root);
+    frames[0].at = root;
+    *levels = 2;
+    return err;
+}
+
+// moves the upper half of a full interior page to a new one
+static int
+luci_dx_split_node(struct inode *dir, struct luci_dx_frame *frames)
+{
+    int err;
+    __u32 hash;
+    unsigned count, split;
+    unsigned long block;
+    struct page *page;
+    struct luci_dx_entry *old = frames[1].entries;
+
+    count = luci_dx_get_count(old);
+    split = count / 2;
+    hash = le32_to_cpu(old[split].hash);
+
+    page = luci_dx_new_node(dir, old + split, count - split, &block);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    err = luci_dx_insert(&frames[0], hash, block);
+    if (err)
+        goto out;
+
+    err = luci_dx_begin_update(frames[1].page);
+    if (err)
+        goto out;
+    luci_dx_set_count(old, split);
+    err = luci_dx_end_update(frames[1].page);
+    if (err)
+        goto out;
+
+    // follow the half the leaf is in
+    if (frames[1].at >= old + split) {
+        frames[0].at++;
+        frames[1].at = luci_dx_node_entries(page_address(page)) +
+            (frames[1].at - (old + split));
+        frames[1].entries = luci_dx_node_entries(page_address(page));
+        swap(frames[1].page, page);
+    }
+out:
+    luci_put_page(page);
+    return err;
+}
+
+/*
+ * Makes room for one more entry in the index page above the leaf, by
+ * adding a level under a full root or splitting a full interior page.
+ * The frames are updated to the leaf's new path.
+ */
+static int
+luci_dx_make_room(struct inode *dir, struct luci_dx_frame *frames, int *levels)
+{
+    struct luci_dx_frame *frame = &frames[*levels - 1];
+
+    if (luci_dx_get_count(frame->entries) < luci_dx_get_limit(frame->entries))
+        return 0;
+
+    if (*levels == 1)
+        return luci_dx_add_level(dir, frames, levels);
+
+    if (luci_dx_get_count(frames[0].entries) == luci_dx_get_limit(frames[0].entries)) {
+        luci_err_inode(dir, "directory index full");
+        return -ENOSPC;
+    }
+    return luci_dx_split_node(dir, frames);
+}
+
+/*
+ * Splits a full leaf at a hash boundary into itself and a new leaf and
+ * adds the dentry to the half covering its hash. The new leaf is written
+ * and indexed before the moved entries are dropped from the old one.
+ */
+static int
+luci_dx_split_leaf(struct inode *dir, struct luci_dx_frame *frames,
+                   int *levels, struct page *page, __u32 hash,
+                   struct dentry *dentry, struct inode *inode)
+{
+    int err, count, split;
+    __u32 split_hash;
+    unsigned long block;
+    char *scratch;
+    struct page *target;
+    struct luci_dx_map *map;
+
+    err = luci_dx_make_room(dir, frames, levels);
+    if (err)
+        return err;
+
+    scratch = kmalloc(PAGE_SIZE, GFP_NOFS);
+    map = kmalloc(LUCI_DX_MAP_MAX * sizeof(*map), GFP_NOFS);
+    if (!scratch || !map) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(scratch, page_address(page), PAGE_SIZE);
+    count = luci_dx_map_entries(dir, luci_dx_version(frames), scratch, 0, map);
+    if (count < 2) {
+        err = -ENOSPC;
+        goto out;
+    }
+
+    split = luci_dx_split_point(map, count);
+    split_hash = map[split].hash;
+    if (split_hash == map[split - 1].hash)
+        split_hash |= 1;
+
+    err = luci_dx_new_leaf(dir, scratch, map + split, count - split, &block);
+    if (err)
+        goto out;
+
+    err = luci_dx_insert(&frames[*levels - 1], split_hash, block);
+    if (err)
+        goto out;
+
+    err = luci_dx_begin_update(page);
+    if (err)
+        goto out;
+    luci_dx_pack(page_address(page), scratch, map, split);
+    err = luci_dx_end_update(page);
+    if (err)
+        goto out;
+
+    luci_dbg_inode(dir, "split leaf %lu at hash 0x%x to %lu", page->index,
+                   split_hash, block);
+
+    if (hash < split_hash) {
+        err = luci_add_entry_page(dir, page, dentry, inode);
+        goto out;
+    }
+
+    target = luci_get_page(dir, block);
+    if (IS_ERR(target)) {
+        err = PTR_ERR(target);
+        goto out;
+    }
+    err = luci_add_entry_page(dir, target, dentry, inode);
+    luci_put_page(target);
+
+out:
+    kfree(map);
+    kfree(scratch);
+    return err;
+}
+
+/*
+ * Adds a dentry to the leaf covering its hash, splitting the leaf when
+ * full. Returns -EINVAL if the index is corrupt.
+ */
+int
+luci_dx_add_entry(struct dentry *dentry, struct inode *inode)
+{
+    int err, levels;
+    __u32 hash;
+    unsigned long block;
+    struct page *page;
+    struct luci_dx_frame frames[LUCI_DX_MAX_LEVELS];
+    struct inode *dir = DENTRY_INODE(dentry->d_parent);
+
+    levels = luci_dx_probe(dir, dentry->d_name.name, dentry->d_name.len,
+                           &hash, frames);
+    if (levels < 0)
+        return levels;
+
+    block = le32_to_cpu(frames[levels - 1].at->block);
+    page = luci_dx_get_leaf(dir, block);
+    if (IS_ERR(page)) {
+        err = PTR_ERR(page);
+        goto out;
+    }
+
+    err = luci_add_entry_page(dir, page, dentry, inode);
+    if (err == -ENOSPC)
+        err = luci_dx_split_leaf(dir, frames, &levels, page, hash, dentry, inode);
+    luci_put_page(page);
+
+out:
+    luci_dx_release(frames, levels);
+    return err;
+}
+
+/*
+ * Converts a full single page directory to an indexed one. The entries
+ * other than "." and ".." move to two new leaves and page 0 becomes the
+ * index root.
+ */
+int
+luci_dx_make_indexed(struct inode *dir)
+{
+    int err, count, split = 0, version;
+    __u32 split_hash = 0;
+    unsigned long block;
+    char *scratch, *kaddr;
+    struct page *page;
+    struct luci_dx_map *map;
+    struct luci_dir_entry_2 *dot, *dotdot;
+    struct luci_dx_root_info *info;
+    struct luci_dx_entry *entries;
+
+    version = LUCI_SB(dir->i_sb)->s_lsb->s_def_hash_version;
+    if (!luci_dx_hash_supported(version))
+        version = LUCI_HASH_TEA;
+
+    page = luci_get_page(dir, 0);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    scratch = kmalloc(PAGE_SIZE, GFP_NOFS);
+    map = kmalloc(LUCI_DX_MAP_MAX * sizeof(*map), GFP_NOFS);
+    if (!scratch || !map) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(scratch, page_address(page), PAGE_SIZE);
+    dot = (struct luci_dir_entry_2 *)scratch;
+    dotdot = (struct luci_dir_entry_2 *)(scratch + LUCI_DIR_REC_LEN(1));
+    if (luci_rec_len_from_disk(dot->rec_len) != LUCI_DIR_REC_LEN(1) ||
+        dot->name_len != 1 || dotdot->name_len != 2 ||
+        memcmp(dotdot->name, "..", 2)) {
+        luci_err_inode(dir, "cannot index, no . and .. entries");
+        err = -EINVAL;
+        goto out;
+    }
+
+    count = luci_dx_map_entries(dir, version, scratch,
+        LUCI_DIR_REC_LEN(1) + luci_rec_len_from_disk(dotdot->rec_len), map);
+
+    if (count > 1) {
+        split = luci_dx_split_point(map, count);
+        split_hash = map[split].hash;
+        if (split_hash == map[split - 1].hash)
+            split_hash |= 1;
+    } else
+        split = count;
+
+    err = luci_dx_new_leaf(dir, scratch, map, split, &block);
+    if (err)
+        goto out;
+    if (split < count) {
+        err = luci_dx_new_leaf(dir, scratch, map + split, count - split, &block);
+        if (err)
+            goto out;
+    }
+
+    err = luci_dx_begin_update(page);
+    if (err)
+        goto out;
+
+    kaddr = page_address(page);
+    memset(kaddr, 0, PAGE_SIZE);
+    memcpy(kaddr, dot, LUCI_DIR_REC_LEN(1));
+    memcpy(kaddr + LUCI_DIR_REC_LEN(1), dotdot, LUCI_DIR_REC_LEN(2));
+    dotdot = (struct luci_dir_entry_2 *)(kaddr + LUCI_DIR_REC_LEN(1));
+    dotdot->rec_len = luci_rec_len_to_disk(PAGE_SIZE - LUCI_DIR_REC_LEN(1));
+
+    info = luci_dx_info(kaddr);
+    info->hash_version = version;
+    info->info_length = sizeof(*info);
+
+    entries = luci_dx_root_entries(kaddr);
+    luci_dx_set_limit(entries, luci_dx_root_limit());
+    luci_dx_set_count(entries, split < count ? 2 : 1);
+    entries[0].block = cpu_to_le32(1);
+    entries[1].hash = cpu_to_le32(split_hash);
+    entries[1].block = cpu_to_le32(2);
+
+    err = luci_dx_end_update(page);
+    if (err)
+        goto out;
+
+    LUCI_I(dir)->i_flags |= LUCI_INDEX_FL;
+    mark_inode_dirty(dir);
+    luci_info_inode(dir, "indexed directory, %d entries hash version %d",
+                    count, version);
+
+out:
+    kfree(map);
+    kfree(scratch);
+    luci_put_page(page);
+    return err;
+}
@@ -0,0 +1,529 @@
+/*--------------------------------------------------------------------
+ * Copyright(C) 2016, Saptarshi Sen
+ *
+ * LUCI extent mapped files
+ *
+ * Regular files created with the 'extents' mount option map file blocks
+ * through the extent B+tree instead of the indirect block map. The root
+ * node block of the tree is stored in i_data[0]. A key maps a run of
+ * nr_blocks file blocks starting at the key offset: an uncompressed
+ * block gets a key of its own, a compressed extent gets a single key.
+ * The block pointer fields are carried in the key.
+ *
+ * Physically contiguous uncompressed blocks are not merged into one key.
+ * Uncompressed pages are verified against a CRC32 of their own on read,
+ * and a key has room for a single checksum. A 28 byte key per block costs
+ * more than the 16 byte blkptr of the indirect map, the saving is on
+ * compressed extents which need one key instead of a blkptr per block.
+ * ------------------------------------------------------------------*/
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/buffer_head.h>
+
+#include "luci.h"
+#include "extent_tree.h"
+
+#define LUCI_EXTENT_ROOT        0 // i_data slot holding the tree root
+
+#define LUCI_EXTENT_MAX_KEYS(sb) \
+        ((LUCI_BLOCK_SIZE(sb) - sizeof(struct btree_header)) / sizeof(struct btree_key))
+
+#define LUCI_EXTENT_FILL        90 // node fill percent for bulk loads
+
+static struct buffer_head *
+luci_extent_alloc_node(struct btree_root_node *root, unsigned long *block)
+{
+    struct buffer_head *bh;
+    struct inode *inode = root->private;
+
+    if (luci_new_block(inode, 1, block) < 0)
+        return NULL;
+
+    bh = sb_getblk(inode->i_sb, *block);
+    if (!bh) {
+        luci_free_block(inode, *block);
+        return NULL;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    clear_buffer_released(bh);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty_inode(bh, inode);
+    return bh;
+}
+
+// data blocks referenced by keys are owned and freed by the caller
+static void
+luci_extent_release_block(struct btree_root_node *root,
+                          unsigned long block,
+                          size_t size,
+                          bool meta)
+{
+    struct buffer_head *bh;
+    struct inode *inode = root->private;
+
+    if (!meta)
+        return;
+
+    // node may still be referenced by the tree path, never write it back
+    bh = sb_find_get_block(inode->i_sb, block);
+    if (bh) {
+        set_buffer_released(bh);
+        clear_buffer_dirty(bh);
+        brelse(bh);
+    }
+    luci_free_block(inode, block);
+}
+
+static struct buffer_head *
+luci_extent_get_node(struct btree_root_node *root, unsigned long block)
+{
+    struct buffer_head *bh;
+    struct inode *inode = root->private;
+
+    bh = sb_bread(inode->i_sb, block);
+    if (!bh)
+        luci_err_inode(inode, "failed to read extent node :%lu", block);
+    return bh;
+}
+
+static void
+luci_extent_put_node(struct btree_root_node *root, struct buffer_head *bh)
+{
+    if ((root->flags & BTREE_ROOT_MODIFYING) && !buffer_released(bh))
+        mark_buffer_dirty_inode(bh, (struct inode *)root->private);
+    brelse(bh);
+}
+
+static const struct btree_block_ops luci_extent_ops = {
+    .alloc_node    = luci_extent_alloc_node,
+    .release_block = luci_extent_release_block,
+    .get_node      = luci_extent_get_node,
+    .put_node      = luci_extent_put_node,
+};
+
+// root node moves on split and shrink, keep i_data in sync
+static void
+luci_extent_sync_root(struct inode *inode)
+{
+    struct luci_inode_info *li = LUCI_I(inode);
+    blkptr *bp = &li->i_data[LUCI_EXTENT_ROOT];
+    unsigned long block = li->i_extent_root->node->header.blockptr;
+
+    if (bp->blockno == block)
+        return;
+
+    memset((char *)bp, 0, sizeof(blkptr));
+    bp->blockno = block;
+    mark_inode_dirty(inode);
+}
+
+/*
+ * Load the extent tree of the inode, creating an empty tree if asked for.
+ * Returns NULL if the file has no tree. Caller holds truncate_mutex.
+ */
+static struct btree_root_node *
+luci_extent_root(struct inode *inode, bool create)
+{
+    struct btree_root_node *root;
+    struct luci_inode_info *li = LUCI_I(inode);
+    unsigned long block = li->i_data[LUCI_EXTENT_ROOT].blockno;
+
+    if (li->i_extent_root)
+        return li->i_extent_root;
+
+    if (block)
+        root = extent_tree_open(block, &luci_extent_ops, inode);
+    else if (create)
+        root = extent_tree_init(0, LUCI_EXTENT_MAX_KEYS(inode->i_sb),
+                                &luci_extent_ops, inode);
+    else
+        return NULL;
+
+    if (!root) {
+        luci_err_inode(inode, "failed to load extent tree, root :%lu", block);
+        return ERR_PTR(-EIO);
+    }
+
+    root->inode = inode;
+    li->i_extent_root = root;
+    if (!block)
+        luci_extent_sync_root(inode);
+    return root;
+}
+
+static void
+luci_extent_key_to_bp(struct inode *inode, struct btree_key *key, blkptr *bp)
+{
+    memset((char *)bp, 0, sizeof(blkptr));
+    bp->blockno = key->blockptr;
+    bp->checksum = key->checksum;
+    if (key->flags & LUCI_COMPR_FLAG) {
+        bp->flags = LUCI_COMPR_FLAG;
+        bp->length = key->size;
+    } else
+        bp->length = LUCI_BLOCK_SIZE(inode->i_sb);
+}
+
+static void
+luci_extent_bp_to_key(unsigned long i_block,
+                      blkptr *bp,
+                      unsigned nr_blocks,
+                      struct btree_key *key)
+{
+    memset((char *)key, 0, sizeof(struct btree_key));
+    key->offset = i_block;
+    key->blockptr = bp->blockno;
+    key->checksum = bp->checksum;
+    key->nr_blocks = nr_blocks;
+    if (bp->flags & LUCI_COMPR_FLAG) {
+        key->flags = LUCI_COMPR_FLAG;
+        key->size = bp->length;
+    }
+}
+
+// caller holds truncate_mutex, bp is zeroed for a hole
+static int
+__luci_extent_lookup(struct inode *inode, unsigned long i_block, blkptr *bp)
+{
+    int err;
+    struct btree_key key;
+    struct btree_root_node *root = luci_extent_root(inode, false);
+
+    memset((char *)bp, 0, sizeof(blkptr));
+    if (IS_ERR(root))
+        return PTR_ERR(root);
+    if (!root)
+        return 0;
+
+    err = extent_tree_lookup_key(root, i_block, &key);
+    if (err == -ENOENT)
+        return 0;
+    if (err < 0)
+        return err;
+
+    if (i_block < key.offset + max_t(unsigned, key.nr_blocks, 1))
+        luci_extent_key_to_bp(inode, &key, bp);
+    return 0;
+}
+
+// file blocks mapped by the bp at i, a compressed extent shares one bp
+static unsigned
+luci_extent_run(blkptr bp[], unsigned i, unsigned nr)
+{
+    unsigned run = 1;
+
+    if (bp[i].blockno && (bp[i].flags & LUCI_COMPR_FLAG)) {
+        while ((i + run < nr) && (bp[i + run].blockno == bp[i].blockno))
+            run++;
+    }
+    return run;
+}
+
+// empty tree, build it bottom-up instead of inserting key by key
+static int
+luci_extent_bulk_insert(struct btree_root_node *root,
+                        unsigned long i_block,
+                        blkptr bp[],
+                        unsigned nr)
+{
+    int err;
+    unsigned i, run, nr_keys = 0;
+    struct btree_key *keys;
+
+    keys = kmalloc_array(nr, sizeof(struct btree_key), GFP_NOFS);
+    if (!keys)
+        return -ENOMEM;
+
+    for (i = 0; i < nr; i += run) {
+        run = luci_extent_run(bp, i, nr);
+        if (bp[i].blockno)
+            luci_extent_bp_to_key(i_block + i, &bp[i], run, &keys[nr_keys++]);
+    }
+
+    err = extent_tree_bulk_load(root, keys, nr_keys, LUCI_EXTENT_FILL);
+    kfree(keys);
+    return err;
+}
+
+// true if the bps for [i_block, i_block + nr) start a key at offset
+static bool
+luci_extent_new_key_at(unsigned long i_block,
+                       blkptr bp[],
+                       unsigned nr,
+                       u64 offset)
+{
+    unsigned i, run;
+
+    for (i = 0; i < nr && i_block + i <= offset; i += run) {
+        run = luci_extent_run(bp, i, nr);
+        if (i_block + i == offset)
+            return bp[i].blockno != 0;
+    }
+    return false;
+}
+
+static bool
+luci_extent_old_key_at(struct list_head *old, u64 offset)
+{
+    struct btree_key_entry *entry;
+
+    list_for_each_entry(entry, old, list) {
+        if (entry->key.offset == offset)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Undo a failed update of the range. Keys inserted from the first nr bps
+ * are removed unless they replaced an old key, then every old key is put
+ * back. An old key still in the tree is replaced by itself.
+ */
+static void
+luci_extent_restore(struct inode *inode,
+                    struct btree_root_node *root,
+                    unsigned long i_block,
+                    blkptr bp[],
+                    unsigned nr,
+                    struct list_head *old)
+{
+    int err;
+    unsigned i, run;
+    struct btree_key_entry *entry;
+
+    for (i = 0; i < nr; i += run) {
+        run = luci_extent_run(bp, i, nr);
+        if (!bp[i].blockno || luci_extent_old_key_at(old, i_block + i))
+            continue;
+
+        err = extent_tree_delete_item(root, i_block + i);
+        if (err < 0)
+            luci_err_inode(inode, "failed to drop key :%lu, err :%d",
+                           i_block + i, err);
+    }
+
+    list_for_each_entry(entry, old, list) {
+        err = extent_tree_insert_key(root, &entry->key);
+        if (err < 0)
+            luci_err_inode(inode, "failed to restore key :%llu, err :%d",
+                           entry->key.offset, err);
+    }
+}
+
+/*
+ * Map [i_block, i_block + nr) to bp. New keys go in first, replacing keys
+ * at the same offset in place, and old keys left over in the range are
+ * removed after. If any step fails the old mapping is restored, so the
+ * caller still owns the new blocks and the old ones stay mapped.
+ */
+int
+luci_extent_insert_L0bps(struct inode *inode,
+                         unsigned long i_block,
+                         blkptr bp[],
+                         unsigned nr)
+{
+    int err;
+    unsigned i, run;
+    struct btree_key key;
+    struct btree_key_entry *entry;
+    struct btree_root_node *root;
+    struct luci_inode_info *li = LUCI_I(inode);
+    LIST_HEAD(old);
+
+    mutex_lock(&li->truncate_mutex);
+
+    root = luci_extent_root(inode, true);
+    if (IS_ERR(root)) {
+        err = PTR_ERR(root);
+        goto out;
+    }
+
+    if (!root->max_level && !root->node->header.nr_items) {
+        err = luci_extent_bulk_insert(root, i_block, bp, nr);
+        if (err != -ENOMEM)
+            goto sync;
+    }
+
+    // keys mapping the range now, put back if the update fails
+    err = extent_tree_range_query(root, i_block, nr, &old);
+    if (err < 0)
+        goto sync;
+
+    for (i = 0, err = 0; i < nr; i += run) {
+        run = luci_extent_run(bp, i, nr);
+        if (!bp[i].blockno)
+            continue;
+
+        luci_extent_bp_to_key(i_block + i, &bp[i], run, &key);
+        err = extent_tree_insert_key(root, &key);
+        if (err < 0) {
+            luci_extent_restore(inode, root, i_block, bp, i, &old);
+            goto sync;
+        }
+    }
+
+    list_for_each_entry(entry, &old, list) {
+        if (luci_extent_new_key_at(i_block, bp, nr, entry->key.offset))
+            continue;
+
+        err = extent_tree_delete_item(root, entry->key.offset);
+        if (err < 0) {
+            luci_extent_restore(inode, root, i_block, bp, nr, &old);
+            break;
+        }
+    }
+
+sync:
+    extent_tree_range_release(&old);
+    luci_extent_sync_root(inode);
+    luci_info_inode(inode, "inserted %u L0 bps from i_block :%lu err :%d", nr,
+                    i_block, err);
+out:
+    mutex_unlock(&li->truncate_mutex);
+    return err;
+}
+
+/*
+ * luci_get_block for extent mapped files. Follows the same bh conventions
+ * as the block map path, see luci_get_block.
+ */
+int
+luci_extent_get_block(struct inode *inode,
+                      sector_t iblock,
+                      struct buffer_head *bh_result,
+                      int flags)
+{
+    int err;
+    blkptr bp;
+    unsigned long block;
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    if (flags & COMPR_BLK_INFO)
+        flags = 0;
+
+    // update L0 block entry on COW
+    if ((flags & COMPR_BLK_INSERT) || (flags & COMPR_BLK_UPDATE)) {
+        memset((char *)&bp, 0, sizeof(blkptr));
+        bp.blockno = bh_result->b_blocknr;
+        bp.checksum = *(u32*)bh_result->b_data;
+        if (bh_result->b_state & BH_PrivateStart) {
+            bp.flags = LUCI_COMPR_FLAG;
+            bp.length = (unsigned short) bh_result->b_size;
+        }
+        return luci_extent_insert_L0bps(inode, iblock, &bp, 1);
+    }
+
+    mutex_lock(&li->truncate_mutex);
+    err = __luci_extent_lookup(inode, iblock, &bp);
+    mutex_unlock(&li->truncate_mutex);
+    if (err < 0)
+        return err;
+
+    if (!bp.blockno) {
+        // hole, mpage API identifies a hole if bh is not mapped
+        if (!flags)
+            return 0;
+
+        err = luci_new_block(inode, 1, &block);
+        if (err < 0)
+            return err;
+
+        bp_reset(&bp, block, LUCI_BLOCK_SIZE(inode->i_sb), 0, 0);
+        err = luci_extent_insert_L0bps(inode, iblock, &bp, 1);
+        if (err < 0) {
+            luci_free_block(inode, block);
+            return err;
+        }
+    }
+
+    // BH_Mapped, bh blockno, length
+    map_bh(bh_result, inode->i_sb, bp.blockno);
+
+    // hack to fetch bp checksum from bmap lookup
+    if (bh_result->b_state & BH_PrivateStart)
+        *(u32*) bh_result->b_data = bp.checksum;
+
+    // update bp size with compressed length
+    if (bp.flags & LUCI_COMPR_FLAG)
+        bh_result->b_size = (size_t) bp.length;
+    else
+        bh_result->b_state &= ~BH_PrivateStart;
+
+    luci_dump_blkptr(inode, iblock, &bp);
+    return 0;
+}
+
+/*
+ * Unmap the highest mapped file block run, used by truncate. Returns
+ * -ENOENT once the file has no mapped blocks.
+ */
+int
+luci_extent_remove_last(struct inode *inode,
+                        unsigned long *i_block,
+                        blkptr *bp,
+                        unsigned *nr_blocks)
+{
+    int err;
+    struct btree_key key;
+    struct btree_root_node *root;
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    mutex_lock(&li->truncate_mutex);
+
+    root = luci_extent_root(inode, false);
+    if (IS_ERR_OR_NULL(root)) {
+        err = root ? PTR_ERR(root) : -ENOENT;
+        goto out;
+    }
+
+    err = extent_tree_lookup_key(root, LLONG_MAX, &key);
+    if (err < 0)
+        goto out;
+
+    err = extent_tree_delete_item(root, key.offset);
+    if (err < 0)
+        goto out;
+
+    luci_extent_sync_root(inode);
+
+    *i_block = key.offset;
+    *nr_blocks = max_t(unsigned, key.nr_blocks, 1);
+    luci_extent_key_to_bp(inode, &key, bp);
+out:
+    mutex_unlock(&li->truncate_mutex);
+    return err;
+}
+
+/*
+ * Drop the in-memory tree on evict. For deleted inodes the tree blocks are
+ * freed as well; data blocks are released by truncate before this.
+ */
+void
+luci_extent_release(struct inode *inode, bool destroy)
+{
+    struct btree_root_node *root;
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    if (!luci_has_extents(inode))
+        return;
+
+    mutex_lock(&li->truncate_mutex);
+
+    root = destroy ? luci_extent_root(inode, false) : li->i_extent_root;
+    if (IS_ERR_OR_NULL(root))
+        goto out;
+
+    if (destroy) {
+        extent_tree_destroy(root);
+        memset((char *)&li->i_data[LUCI_EXTENT_ROOT], 0, sizeof(blkptr));
+        mark_inode_dirty(inode);
+    } else
+        extent_tree_close(root);
+
+    li->i_extent_root = NULL;
+out:
+    mutex_unlock(&li->truncate_mutex);
+}
@@ -4,10 +4,6 @@
 
 #include "extent_tree.h"
 
-int bt_version;
-
-extern struct list_head btree_ver_list;
-
 static int btree_debugfs_show(struct seq_file *m, void *data)
 {
         unsigned long nr_keys;
@@ -16,6 +12,7 @@ static int btree_debugfs_show(struct seq_file *m, void *data)
         root_node = (struct btree_root_node *)m->private;
         if (root_node) {
                 nr_keys = extent_tree_dump(m,
+                                           root_node,
                                            root_node->node,
                                            atomic_read(&root_node->bh->b_count),
                                            0);
@@ -24,27 +21,6 @@ static int btree_debugfs_show(struct seq_file *m, void *data)
         return 0;
 }
 
-static int btree_debugfs_show_version(struct seq_file *m, void *data)
-{
-        int vers;
-        unsigned long nr_keys;
-        struct btree_root_node *root_node;
-
-        vers = *(int *)m->private;
-
-        list_for_each_entry(root_node, &btree_ver_list, list) {
-                if (root_node->version != vers)
-                        continue;
-                nr_keys = extent_tree_dump(m,
-                                           root_node->node,
-                                           atomic_read(&root_node->bh->b_count),
-                                           0);
-                seq_printf(m, "Total Keys Stored :%lu\n", nr_keys);
-                break;
-        }
-        return 0;
-}
-
 static ssize_t btree_debugfs_insert(struct file *file,
                                    const char __user *ubuf,
                                    size_t count,
@@ -83,31 +59,11 @@ static ssize_t btree_debugfs_delete(struct file *file,
         return count;
 }
 
-static ssize_t btree_debugfs_update_version(struct file *file,
-                                            const char __user *ubuf,
-                                            size_t count,
-                                            loff_t *off)
-{
-        int rc;
-        long vers;
-
-        rc = kstrtol_from_user(ubuf, count, 10, &vers);
-        if (rc)
-                return rc;
-        bt_version = vers;
-        return count;
-}
-
 static int btree_debugfs_open(struct inode *inode, struct file *file)
 {
         return single_open(file, btree_debugfs_show, inode->i_private);
 }
 
-static int btree_debugfs_open_version(struct inode *inode, struct file *file)
-{
-        return single_open(file, btree_debugfs_show_version, inode->i_private);
-}
-
 static const struct file_operations btree_insops = {
         .open		= btree_debugfs_open,
         .read		= seq_read,
@@ -124,18 +80,10 @@ static const struct file_operations btree_delops = {
         .release 	= single_release,
 };
 
-static const struct file_operations btree_ioctlops = {
-        .open		= btree_debugfs_open_version,
-        .read 		= seq_read,
-        .write 		= btree_debugfs_update_version,
-        .llseek 	= no_llseek,
-        .release 	= single_release,
-};
-
 struct dentry *btree_debugfs_init(struct btree_root_node *btree_root)
 {
         struct dentry *dir;
-        struct dentry *insert, *delete, *ioctl;
+        struct dentry *insert, *delete;
 
         dir = debugfs_create_dir("btree", NULL);
         if (!dir)
@@ -157,14 +105,6 @@ struct dentry *btree_debugfs_init(struct btree_root_node *btree_root)
         if (!insert)
                 goto free_out;
 
-        ioctl = debugfs_create_file("version",
-                                     0644,
-                                     dir,
-                                     (void *) &bt_version,
-                                     &btree_ioctlops);
-        if (!ioctl)
-                goto free_out;
-
         return dir;
 
 free_out:
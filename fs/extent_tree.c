@@ -14,24 +14,31 @@
 #include <linux/buffer_head.h>
 #include <linux/radix-tree.h>
 #include "extent_tree.h"
-#include "../lib/page_io.h"
-
-#define MAX_KEYS 32
 
 enum {
         LEFT_SIBLING,
         RIGHT_SIBLING,
 } dir_t;
 
-static struct dentry *dbgfs_dir;
-
-static struct btree_root_node *btree_test_root;
-
-extern int  btreedev_init(void);
+static inline struct buffer_head *extent_get_node(struct btree_root_node *root,
+                                                  unsigned long block)
+{
+        return root->ops->get_node(root, block);
+}
 
-extern void btreedev_exit(void);
+static inline void extent_put_node(struct btree_root_node *root,
+                                   struct buffer_head *bh)
+{
+        root->ops->put_node(root, bh);
+}
 
-//long btreedev_ioctl(struct file *file, unsigned cmd, unsigned long arg);
+static inline void extent_release_block(struct btree_root_node *root,
+                                        unsigned long block,
+                                        size_t size,
+                                        bool meta)
+{
+        root->ops->release_block(root, block, size, meta);
+}
 
 static inline void extent_reset_key(struct btree_key *key)
 {
@@ -43,15 +50,6 @@ static inline int compare_key(struct btree_key *key, struct btree_node *node)
         return (node->header.offset == key->offset);
 }
 
-static inline void swap_keys(struct btree_key *keyp, struct btree_key *keyq)
-{
-        struct btree_key temp;
-
-        memcpy((char *)&temp, (char *)keyp,  sizeof(struct btree_key));
-        memcpy((char *)keyp,  (char *)keyq,  sizeof(struct btree_key));
-        memcpy((char *)keyq,  (char *)&temp, sizeof(struct btree_key));
-}
-
 static inline int extent_node_is_root(struct btree_node *node,
 			              struct btree_path *path)
 {
@@ -117,64 +115,121 @@ static inline bool extent_node_has_overflowed(struct btree_node *node)
                return (node->header.max_items - node->header.nr_items) <= 2;
 }
 
-static inline int paritition_keys(struct btree_key *keys, int l, int h)
+static inline void extent_node_update_offset(struct btree_node *node)
 {
-        int p = h;
-        struct btree_key pivot = keys[h--];
+        if (node->header.nr_items)
+                node->header.offset = node->keys[0].offset;
+}
 
-        while (l <= h) {
-                if (keys[l].offset > pivot.offset) {
-                        swap_keys(&keys[l], &keys[h]);
-                        h--;
-                } else {
-                        l++;
-                }
+// first slot with key offset above offset, keys are kept ordered
+static inline int extent_node_upper_bound(struct btree_node *node, u64 offset)
+{
+        int lo = 0, hi = node->header.nr_items;
+
+        while (lo < hi) {
+                int mid = lo + ((hi - lo) >> 1);
+
+                if (node->keys[mid].offset <= offset)
+                        lo = mid + 1;
+                else
+                        hi = mid;
         }
+        return lo;
+}
+
+static inline void extent_node_insert_at(struct btree_node *node,
+                                         int slot,
+                                         struct btree_key *key)
+{
+        int nr = node->header.nr_items;
+
+        BUG_ON(nr >= node->header.max_items || slot > nr);
 
-        swap_keys(&keys[l], &keys[p]);
-        return l;
+        memmove((char *)&node->keys[slot + 1], (char *)&node->keys[slot],
+                (nr - slot) * sizeof(struct btree_key));
+        memcpy((char *)&node->keys[slot], (char *)key, sizeof(struct btree_key));
+        node->header.nr_items++;
+        extent_node_update_offset(node);
 }
 
-static inline void extent_node_sort(struct btree_node *node)
+static inline void extent_node_remove_at(struct btree_node *node, int slot)
 {
-        int top = 0;
-        int stack[MAX_KEYS]; // stack size grows with btree fan-out
+        int nr = node->header.nr_items;
 
-        if (!node->header.nr_items)
-                return;
+        BUG_ON(slot >= nr);
 
-        stack[top++] = 0;
-        stack[top++] = node->header.nr_items - 1;
+        memmove((char *)&node->keys[slot], (char *)&node->keys[slot + 1],
+                (nr - slot - 1) * sizeof(struct btree_key));
+        SET_KEY_EMPTY(node->keys[nr - 1]);
+        node->header.nr_items--;
+        extent_node_update_offset(node);
+}
 
-        while (top) {
-                int p, q, k;
+/*
+ * Leaves are chained in key order through the header prev/next block
+ * pointers. first..last take the place of the leaves between prev and
+ * next; the outer neighbours are pointed back at them.
+ */
+static void extent_leaf_link(struct btree_root_node *root,
+                             struct btree_node *first,
+                             struct btree_node *last,
+                             u64 prev,
+                             u64 next)
+{
+        struct buffer_head *ebh;
 
-                q = stack[--top];
-                p = stack[--top];
+        first->header.prev = prev;
+        last->header.next = next;
 
-                k = paritition_keys(node->keys, p, q);
+        if (prev) {
+                ebh = extent_get_node(root, prev);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.next = first->header.blockptr;
+                        extent_put_node(root, ebh);
+                }
+        }
 
-                if (k > p) {
-                       stack[top++] = p;
-                       stack[top++] = k - 1;
+        if (next) {
+                ebh = extent_get_node(root, next);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.prev = last->header.blockptr;
+                        extent_put_node(root, ebh);
                 }
+        }
+}
+
+static void extent_leaf_unlink(struct btree_root_node *root,
+                               struct btree_node *leaf)
+{
+        struct buffer_head *ebh;
 
-                if (k < q) {
-                       stack[top++] = k + 1;
-                       stack[top++] = q;
+        if (leaf->header.prev) {
+                ebh = extent_get_node(root, leaf->header.prev);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.next = leaf->header.next;
+                        extent_put_node(root, ebh);
                 }
         }
 
-        node->header.offset = node->keys[0].offset;
+        if (leaf->header.next) {
+                ebh = extent_get_node(root, leaf->header.next);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.prev = leaf->header.prev;
+                        extent_put_node(root, ebh);
+                }
+        }
 }
 
-static struct buffer_head *extent_tree_read_node(struct btree_node *node, int key_index)
+static struct buffer_head *extent_tree_read_node(struct btree_root_node *root,
+                                                 struct btree_node *node,
+                                                 int key_index)
 {
         struct buffer_head *ebh = NULL;
 
         if (node->keys[key_index].blockptr) {
-                ebh = bump_get_buffer_head(node->keys[key_index].blockptr);
-                BUG_ON(!ebh);
+                ebh = extent_get_node(root, node->keys[key_index].blockptr);
+                if (!ebh)
+                        return ERR_PTR(-EIO);
         }
         return ebh;
 }
@@ -185,7 +240,7 @@ static void extent_drop_path_refs(struct btree_path *paths)
 
         for (i = 0; i < paths->depth; i++) {
                 BUG_ON (paths->bh[i] == NULL);
-                bump_put_buffer_head(paths->bh[i]);
+                extent_put_node(paths->root, paths->bh[i]);
                 BUG_ON(paths->nodes[i] == NULL);
                 paths->nodes[i] = NULL;
         }
@@ -197,37 +252,32 @@ static void extent_drop_path_refs(struct btree_path *paths)
 static int extent_index_node_search_keys(struct btree_node *node,
                                          struct btree_key *key)
 {
-        int i, slot = 0;
+        int slot;
 
         btree_node_print("search node entry", node);
 
-        for (i = 0; i < node->header.nr_items; i++) {
-                if (key->offset == node->keys[i].offset)
-                        return i;
-                else if (key->offset > node->keys[i].offset)
-                        slot = i;
-                else
-                        break;
-        }
-
-        btree_node_keys_print(node);
-        return slot;
+        // last key not above the search key, first child otherwise
+        slot = extent_node_upper_bound(node, key->offset) - 1;
+        return (slot < 0) ? 0 : slot;
 }
 
 static int extent_index_node_lookup(struct btree_node *node,
                                     struct btree_key *key)
 {
-        int i;
+        int slot;
 
         btree_node_print("lookup parent", node);
 
-        for (i = 0; i < node->header.nr_items; i++) {
-                if (key->offset == node->keys[i].offset)
-                        return i;
-        }
+        slot = extent_node_upper_bound(node, key->offset) - 1;
+        if (slot >= 0 && node->keys[slot].offset == key->offset)
+                return slot;
         return -ENOENT;
 }
 
+/*
+ * Keys are ordered by offset, not by blockptr, so this is a scan. Callers
+ * on the insert path use the slot recorded by the descent instead.
+ */
 static int extent_index_node_lookup_bptr(struct btree_node *node,
                                          struct btree_key *key)
 {
@@ -249,7 +299,7 @@ static void extent_node_update_backrefs(struct btree_node *curr_node,
 {
         struct btree_node *parent;
         int slot, level = curr_node->header.level;
-        struct btree_key key = {0, 0, curr_node->header.blockptr};
+        struct btree_key key = { .blockptr = curr_node->header.blockptr };
 
         if (extent_node_is_root(curr_node, path))
                 return;
@@ -258,7 +308,10 @@ static void extent_node_update_backrefs(struct btree_node *curr_node,
         do {
                 parent = path->nodes[++level];
 
-                slot = extent_index_node_lookup_bptr(parent, &key);
+                slot = path->slots[level];
+                if (slot < 0 || slot >= parent->header.nr_items ||
+                    parent->keys[slot].blockptr != key.blockptr)
+                        slot = extent_index_node_lookup_bptr(parent, &key);
                 if (slot < 0) {
                         pr_debug("blockptr key :%llu\n", key.blockptr);
                         btree_node_print("child bptr not found in parent", parent);
@@ -285,6 +338,7 @@ static int extent_index_node_insert_key(struct btree_node *parent,
 {
         struct btree_key key;
 
+        extent_reset_key(&key);
         SET_KEY_FROM_BTREE_HDR(key, node);
 
         if (extent_node_full(parent)) {
@@ -293,12 +347,9 @@ static int extent_index_node_insert_key(struct btree_node *parent,
                 return -ENOSPC;
         }
 
-        parent->header.nr_items++;
-
-        memcpy((char* )&parent->keys[parent->header.nr_items - 1],
-               (char*)&key, sizeof(struct btree_key));
-
-        extent_node_sort(parent);
+        extent_node_insert_at(parent,
+                              extent_node_upper_bound(parent, key.offset),
+                              &key);
 
         btree_node_print("added child node", node);
 
@@ -314,7 +365,7 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
                                         struct btree_path *path,
                                         bool collapse)
 {
-        int slot, last;
+        int slot;
         struct btree_key key;
 
         do {
@@ -322,7 +373,7 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
 
                 btree_node_print("remove index node entry (before)", node);
 
-                bump_release_block(node->header.blockptr, PAGE_SIZE);
+                extent_release_block(path->root, node->header.blockptr, PAGE_SIZE, true);
 
                 //path->bh[node->header.level] = NULL;
 
@@ -336,22 +387,10 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
 
                 btree_node_keys_print(pnode);
 
-                last = pnode->header.nr_items - 1;
-
-                if (last) {
-                        memcpy((char* )&pnode->keys[slot],
-                               (char* )&pnode->keys[last], sizeof(struct btree_key));
-
-                        pnode->header.nr_items--;
-
-                        extent_node_sort(pnode);
+                extent_node_remove_at(pnode, slot);
 
+                if (pnode->header.nr_items)
                         extent_node_update_backrefs(pnode, path);
-                } else {
-                        pnode->header.nr_items--;
-
-                        BUG_ON(pnode->header.nr_items);
-                }
 
                 btree_node_print("parent node entry (after)", pnode);
 
@@ -370,7 +409,8 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
         return pnode->header.level;
 }
 
-static struct btree_node* extent_node_create(int level,
+static struct btree_node* extent_node_create(struct btree_root_node *root,
+                                             int level,
                                              int max_items,
                                              int flag,
                                              struct buffer_head **bh)
@@ -381,9 +421,7 @@ static struct btree_node* extent_node_create(int level,
     
         BUG_ON(level >= MAX_BTREE_LEVEL);
 
-        block = bump_alloc_meta_block();
-
-        ebh = bump_get_buffer_head(block);
+        ebh = root->ops->alloc_node(root, &block);
         if (!ebh)
                 return NULL;
 
@@ -394,13 +432,16 @@ static struct btree_node* extent_node_create(int level,
         node->header.offset = 0xFFFFFFFF;
         node->header.blockptr = block;
         node->header.max_items = max_items;
+        node->header.prev = 0;
+        node->header.next = 0;
         if (bh)
                 *bh = ebh;
         btree_node_print("new node created", node);
         return node;
 }
 
-static void extent_node_destroy(struct btree_node *node)
+static void extent_node_destroy(struct btree_root_node *root,
+                                struct btree_node *node)
 {
         int i, nr_keys = node->header.nr_items;
 
@@ -409,7 +450,8 @@ static void extent_node_destroy(struct btree_node *node)
 
         if (IS_BTREE_LEAF(node)) {
                 for (i = 0; i < nr_keys; i++) {
-                        bump_release_block(node->keys[i].blockptr, node->keys[i].size);
+                        extent_release_block(root, node->keys[i].blockptr,
+                                             node->keys[i].size, false);
                         extent_reset_key(&node->keys[i]);
                         node->header.nr_items--;
                 }
@@ -417,46 +459,52 @@ static void extent_node_destroy(struct btree_node *node)
                 for (i = 0; i < nr_keys; i++) {
                         struct buffer_head *ebh;
                         if (node->keys[i].blockptr) {
-                                ebh = bump_get_buffer_head(node->keys[i].blockptr);
+                                ebh = extent_get_node(root, node->keys[i].blockptr);
                                 if (!ebh) {
                                         pr_err("blockptr error :%llu\n", node->keys[i].blockptr);
                                         BUG();
                                 }
-                                extent_node_destroy((struct btree_node *) (ebh->b_data));
+                                extent_node_destroy(root, (struct btree_node *) (ebh->b_data));
                                 extent_reset_key(&node->keys[i]);
-                                bump_put_buffer_head(ebh);
+                                extent_put_node(root, ebh);
                                 node->header.nr_items--;
                         }
                 }
         }
 
         BUG_ON(node->header.nr_items);
-        bump_release_block(node->header.blockptr, PAGE_SIZE);
+        extent_release_block(root, node->header.blockptr, PAGE_SIZE, true);
 }
 
-static inline bool extent_tree_can_shrink(struct btree_node *root)
+// 1 if the two children of the root fit in one node, -EIO on a read error
+static inline int extent_tree_can_shrink(struct btree_root_node *root)
 {
-        bool shrink = false;
+        int shrink = 0;
         struct buffer_head *pbh, *qbh;
         struct btree_node *pnode, *qnode;
+        struct btree_node *rnode = root->node;
 
-        if (IS_BTREE_LEAF(root) || (root->header.nr_items != 2))
+        if (IS_BTREE_LEAF(rnode) || (rnode->header.nr_items != 2))
                 return shrink;
 
-        pbh = extent_tree_read_node(root, 0);
-        BUG_ON(pbh == NULL);
+        pbh = extent_tree_read_node(root, rnode, 0);
+        if (IS_ERR_OR_NULL(pbh))
+                return -EIO;
         pnode = BH2BTNODE(pbh);
 
-        qbh = extent_tree_read_node(root, 1);
-        BUG_ON(qbh == NULL);
+        qbh = extent_tree_read_node(root, rnode, 1);
+        if (IS_ERR_OR_NULL(qbh)) {
+                extent_put_node(root, pbh);
+                return -EIO;
+        }
         qnode = BH2BTNODE(qbh);
 
-        if (pnode->header.nr_items + qnode->header.nr_items <= root->header.max_items)
-                shrink = true;
+        if (pnode->header.nr_items + qnode->header.nr_items <= rnode->header.max_items - 3)
+                shrink = 1;
 
-        bump_put_buffer_head(pbh);
+        extent_put_node(root, pbh);
 
-        bump_put_buffer_head(qbh);
+        extent_put_node(root, qbh);
 
         return shrink;
 }
@@ -468,12 +516,16 @@ static struct btree_node* extent_tree_shrink(struct btree_root_node *root,
         struct buffer_head *pbh, *qbh;
         struct btree_node *pnode, *qnode, *merge;
 
-        pbh = extent_tree_read_node(root->node, 0);
-        BUG_ON(pbh == NULL);
+        pbh = extent_tree_read_node(root, root->node, 0);
+        if (IS_ERR_OR_NULL(pbh))
+                return ERR_PTR(-EIO);
         pnode = BH2BTNODE(pbh);
 
-        qbh = extent_tree_read_node(root->node, 1);
-        BUG_ON(qbh == NULL);
+        qbh = extent_tree_read_node(root, root->node, 1);
+        if (IS_ERR_OR_NULL(qbh)) {
+                extent_put_node(root, pbh);
+                return ERR_PTR(-EIO);
+        }
         qnode = BH2BTNODE(qbh);
 
 	BUG_ON(pnode->header.level != qnode->header.level);
@@ -487,10 +539,17 @@ static struct btree_node* extent_tree_shrink(struct btree_root_node *root,
         btree_node_print("merging node (r)", qnode);
         btree_node_keys_print(qnode);
 
-        merge = extent_node_create(pnode->header.level,
+        merge = extent_node_create(root,
+                                   pnode->header.level,
                                    pnode->header.max_items,
                                    pnode->header.flags,
                                    bh);
+        if (!merge) {
+                // nothing is released yet, the old root stays in place
+                extent_put_node(root, pbh);
+                extent_put_node(root, qbh);
+                return ERR_PTR(-ENOSPC);
+        }
 
         for (i = 0; i < pnode->header.nr_items; i++)
                 merge->keys[merge->header.nr_items++] = pnode->keys[i];
@@ -498,23 +557,27 @@ static struct btree_node* extent_tree_shrink(struct btree_root_node *root,
         for (j = 0; j < qnode->header.nr_items; j++)
                 merge->keys[merge->header.nr_items++] = qnode->keys[j];
 
-        extent_node_sort(merge);
+        extent_node_update_offset(merge);
+
+        if (IS_BTREE_LEAF(merge))
+                extent_leaf_link(root, merge, merge,
+                                 pnode->header.prev, qnode->header.next);
 
         btree_node_print("merged new root node", merge);
 
         btree_node_keys_print(merge);
 
-        bump_put_buffer_head(pbh);
+        extent_release_block(root, pnode->header.blockptr, PAGE_SIZE, true);
 
-        bump_release_block(pnode->header.blockptr, PAGE_SIZE);
+        extent_put_node(root, pbh);
 
-        bump_put_buffer_head(qbh);
+        extent_release_block(root, qnode->header.blockptr, PAGE_SIZE, true);
 
-        bump_release_block(qnode->header.blockptr, PAGE_SIZE);
+        extent_put_node(root, qbh);
 
-        bump_put_buffer_head(root->bh);
+        extent_release_block(root, root->node->header.blockptr, PAGE_SIZE, true);
 
-        bump_release_block(root->node->header.blockptr, PAGE_SIZE);
+        extent_put_node(root, root->bh);
 
         return merge;
 }
@@ -550,10 +613,13 @@ static struct btree_node* extent_node_merge_siblings(struct btree_node *pnode,
 
         parent = paths->nodes[level + 1];
 
-        merge = extent_node_create(level,
+        merge = extent_node_create(paths->root,
+                                   level,
                                    parent->header.max_items,
                                    pnode->header.flags,
                                    &bh);
+        if (!merge)
+                return ERR_PTR(-ENOSPC);
 
         for (i = 0; i < pnode->header.nr_items; i++)
                 merge->keys[merge->header.nr_items++] = pnode->keys[i];
@@ -561,7 +627,11 @@ static struct btree_node* extent_node_merge_siblings(struct btree_node *pnode,
         for (j = 0; j < qnode->header.nr_items; j++)
                 merge->keys[merge->header.nr_items++] = qnode->keys[j];
 
-	extent_node_sort(merge);
+	extent_node_update_offset(merge);
+
+        if (IS_BTREE_LEAF(merge))
+                extent_leaf_link(paths->root, merge, merge,
+                                 pnode->header.prev, qnode->header.next);
 
 	btree_node_print("merged new node", merge);
 
@@ -571,7 +641,7 @@ static struct btree_node* extent_node_merge_siblings(struct btree_node *pnode,
 
         (void) extent_index_node_remove_key(parent, qnode, paths, collapse);
 
-        bump_put_buffer_head(paths->bh[level]);
+        extent_put_node(paths->root, paths->bh[level]);
 
 	paths->nodes[level] = merge;
 
@@ -594,7 +664,7 @@ static int extent_node_steal_from_sibling(struct btree_node *cur_node,
         struct btree_node *parent;
         int r_index_curr, r_index_sib;
 
-        parent = path->nodes[cur_node->header.level];
+        parent = path->nodes[cur_node->header.level + 1];
 
         SET_KEY_FROM_BTREE_HDR(key, cur_node);
         r_index_curr = extent_index_node_lookup(parent, &key);
@@ -608,41 +678,21 @@ static int extent_node_steal_from_sibling(struct btree_node *cur_node,
 
         btree_node_print("stealing keys from adjacent node", cur_node);
 
-        // right sibling
+        // right sibling, its first key goes to the end of current node
         if (cur_node->header.offset < sib_node->header.offset) {
-                int p = cur_node->header.nr_items - 1;
-                int q = sib_node->header.nr_items - 1;
-
-                memcpy((char *) &cur_node->keys[p + 1], (char *) &sib_node->keys[0],
-                       sizeof(struct btree_key));
-                memcpy((char *) &sib_node->keys[0], (char *) &sib_node->keys[q],
-                       sizeof(struct btree_key));
-                cur_node->header.nr_items++;
-                sib_node->header.nr_items--;
-
-                extent_node_sort(sib_node);
-                //btree_node_keys_print(sib_node);
+                extent_node_insert_at(cur_node, cur_node->header.nr_items,
+                                      &sib_node->keys[0]);
+                extent_node_remove_at(sib_node, 0);
 
-                SET_KEY_EMPTY(sib_node->keys[p]);
-                sib_node->header.offset = sib_node->keys[0].offset;
                 parent->keys[r_index_sib].offset = sib_node->header.offset;
                 extent_node_update_backrefs(sib_node, path);
-        // left sibling
+        // left sibling, its last key goes to the front of current node
         } else {
-                int p = cur_node->header.nr_items - 1;
                 int q = sib_node->header.nr_items - 1;
 
-                memcpy((char *) &cur_node->keys[p + 1], (char *) &sib_node->keys[q],
-                       sizeof(struct btree_key));
-
-                cur_node->header.nr_items++;
-                sib_node->header.nr_items--;
-
-                extent_node_sort(cur_node);
-                //btree_node_keys_print(cur_node);
+                extent_node_insert_at(cur_node, 0, &sib_node->keys[q]);
+                extent_node_remove_at(sib_node, q);
 
-                SET_KEY_EMPTY(sib_node->keys[q]);
-                cur_node->header.offset = cur_node->keys[0].offset;
                 parent->keys[r_index_curr].offset = cur_node->header.offset;
                 extent_node_update_backrefs(cur_node, path);
         }
@@ -656,6 +706,7 @@ static struct buffer_head *extent_tree_get_adjacent_node(struct btree_node *node
                                                          int dir)
 {
         int slot;
+        struct buffer_head *ebh;
         struct btree_key key;
 
         SET_KEY_FROM_BTREE_HDR(key, node);
@@ -663,20 +714,32 @@ static struct buffer_head *extent_tree_get_adjacent_node(struct btree_node *node
         slot = extent_index_node_lookup_bptr(parent, &key);
         BUG_ON(slot < 0);
 
-        if (dir == LEFT_SIBLING)
-                return (slot == 0) ?
-                        NULL : bump_get_buffer_head(parent->keys[slot - 1].blockptr);
-        else
-                return (slot == parent->header.nr_items - 1) ? 
-                        NULL : bump_get_buffer_head(parent->keys[slot + 1].blockptr);
+        if (dir == LEFT_SIBLING) {
+                if (slot == 0)
+                        return NULL;
+                slot--;
+        } else {
+                if (slot == parent->header.nr_items - 1)
+                        return NULL;
+                slot++;
+        }
+
+        ebh = extent_get_node(path->root, parent->keys[slot].blockptr);
+        return ebh ? ebh : ERR_PTR(-EIO);
 }
 
-static void extent_tree_rebalance(struct btree_node *curr_node,
-                                  struct btree_path *path)
+/*
+ * Borrow from or merge with a sibling, walking up while the parent has
+ * underflowed. An error leaves the tree valid, only less compact.
+ */
+static int extent_tree_rebalance(struct btree_node *curr_node,
+                                 struct btree_path *path)
 {
+        int err = 0;
+
         while (!extent_node_is_root(curr_node, path)) {
                 bool continue_balance = false;
-                struct btree_node  *parent, *lsib = NULL, *rsib = NULL;
+                struct btree_node  *parent, *merge, *lsib = NULL, *rsib = NULL;
                 struct buffer_head *lsib_bh = NULL, *rsib_bh = NULL;
 
 		if (!extent_node_has_underflowed(curr_node))
@@ -689,6 +752,11 @@ static void extent_tree_rebalance(struct btree_node *curr_node,
                 btree_node_keys_print(parent);
 
                 lsib_bh = extent_tree_get_adjacent_node(curr_node, parent, path, LEFT_SIBLING);
+                if (IS_ERR(lsib_bh)) {
+                        err = PTR_ERR(lsib_bh);
+                        lsib_bh = NULL;
+                        goto next_round;
+                }
 		if (lsib_bh) {
                         lsib = BH2BTNODE(lsib_bh); 
                         if (extent_node_can_borrow(curr_node, lsib)) {
@@ -699,6 +767,11 @@ static void extent_tree_rebalance(struct btree_node *curr_node,
                 }
 
                 rsib_bh = extent_tree_get_adjacent_node(curr_node, parent, path, RIGHT_SIBLING);
+                if (IS_ERR(rsib_bh)) {
+                        err = PTR_ERR(rsib_bh);
+                        rsib_bh = NULL;
+                        goto next_round;
+                }
 		if (rsib_bh) {
                         rsib = BH2BTNODE(rsib_bh); 
                         if (extent_node_can_borrow(curr_node, rsib)) {
@@ -709,25 +782,35 @@ static void extent_tree_rebalance(struct btree_node *curr_node,
                 }
 
                 if (lsib && extent_node_can_merge(curr_node, lsib)) {
-                        if (IS_ERR(extent_node_merge_siblings(lsib, curr_node, path)))
-					BUG();
-                        continue_balance = true;
+                        merge = extent_node_merge_siblings(lsib, curr_node, path);
+                        if (IS_ERR(merge))
+                                err = PTR_ERR(merge);
+                        else
+                                continue_balance = true;
                         goto next_round;
 		}
 
 		if (rsib && extent_node_can_merge(curr_node, rsib)) {
-                        if (IS_ERR(extent_node_merge_siblings(curr_node, rsib, path)))
-					BUG();
-                        continue_balance = true;
+                        merge = extent_node_merge_siblings(curr_node, rsib, path);
+                        if (IS_ERR(merge))
+                                err = PTR_ERR(merge);
+                        else
+                                continue_balance = true;
                         goto next_round;
 		}
 
 next_round:
                 if (lsib_bh)
-                        brelse(lsib_bh);
+                        extent_put_node(path->root, lsib_bh);
 
                 if (rsib_bh)
-                        brelse(rsib_bh);
+                        extent_put_node(path->root, rsib_bh);
+
+                if (err) {
+                        pr_err("rebalance failed at level %d, err :%d\n",
+                               curr_node->header.level, err);
+                        break;
+                }
 
                 if (!continue_balance) {
 		        btree_node_print("node is balanced", curr_node);
@@ -736,19 +819,40 @@ next_round:
 
                 curr_node = parent;
         }
+
+        return err;
 }
 
-static struct btree_node* extent_node_split(struct btree_root_node *root_node,
-                                            struct btree_path *paths,
-                                            int curr_level)
+// drop a node created by a split that could not complete
+static void extent_node_discard(struct btree_root_node *root,
+                                struct btree_node *node,
+                                struct buffer_head *bh)
 {
+        extent_release_block(root, node->header.blockptr, PAGE_SIZE, true);
+        extent_put_node(root, bh);
+}
+
+/*
+ * Split the overflowed node at curr_level and walk up while the parent
+ * overflows. All blocks for a level are allocated before the level is
+ * touched, so a failure on the first level leaves the tree as it was and
+ * is returned. A failure further up is not: the levels below are already
+ * split and the tree stays valid with the parent kept at its headroom.
+ * extent_tree_insert_key splits such a parent before it inserts below it.
+ */
+static int extent_node_split(struct btree_root_node *root_node,
+                             struct btree_path *paths,
+                             int curr_level)
+{
+        int ret = 0;
+        int start_level = curr_level;
         bool new_root = false;  // tree grew
         bool collapse = false;  // replace do not need node adjustments
         struct buffer_head *bh = NULL;
         struct btree_node *pnode= NULL;
 
         do {
-                int i, mid, ret;
+                int i, mid;
                 struct buffer_head *lbh, *rbh;
                 struct btree_node *node, *l_sib, *r_sib;
 
@@ -760,13 +864,51 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
 
                 btree_node_print("splitting node", node);
 
-                mid = node->header.nr_items >> 1;
+                // the parent loses one key and gains two
+                if (curr_level < paths->depth - 1) {
+                        pnode = paths->nodes[curr_level + 1];
+                        if (extent_node_full(pnode)) {
+                                ret = -ENOSPC;
+                                break;
+                        }
+                }
 
-                l_sib = extent_node_create(curr_level,
+                l_sib = extent_node_create(root_node,
+                                           curr_level,
                                            node->header.max_items,
                                            node->header.flags,
                                            &lbh);
-                BUG_ON(l_sib == NULL);
+                if (!l_sib) {
+                        ret = -ENOSPC;
+                        break;
+                }
+
+                r_sib = extent_node_create(root_node,
+                                           curr_level,
+                                           node->header.max_items,
+                                           node->header.flags,
+                                           &rbh);
+                if (!r_sib) {
+                        extent_node_discard(root_node, l_sib, lbh);
+                        ret = -ENOSPC;
+                        break;
+                }
+
+                if (curr_level == paths->depth - 1) {
+                        pnode = extent_node_create(root_node,
+                                                   curr_level + 1,
+                                                   node->header.max_items,
+                                                   INDEX_NODE,
+                                                   &bh);
+                        if (!pnode) {
+                                extent_node_discard(root_node, r_sib, rbh);
+                                extent_node_discard(root_node, l_sib, lbh);
+                                ret = -ENOSPC;
+                                break;
+                        }
+                }
+
+                mid = node->header.nr_items >> 1;
 
                 for (i = 0; i < mid; i++) {
                         memcpy((char *)&l_sib->keys[i],
@@ -780,13 +922,6 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
 
                 btree_node_keys_print(l_sib);
 
-                r_sib = extent_node_create(curr_level,
-                                           node->header.max_items,
-                                           node->header.flags,
-                                           &rbh);
-
-                BUG_ON(r_sib == NULL);
-
                 for (i = mid; i < node->header.nr_items; i++) {
                         memcpy((char *)&r_sib->keys[i - mid],
                                (char *)&node->keys[i], sizeof(struct btree_key));
@@ -799,17 +934,20 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
 
                 btree_node_keys_print(r_sib);
 
+                if (IS_BTREE_LEAF(node)) {
+                        l_sib->header.next = r_sib->header.blockptr;
+                        r_sib->header.prev = l_sib->header.blockptr;
+                        extent_leaf_link(root_node, l_sib, r_sib,
+                                         node->header.prev, node->header.next);
+                }
+
                 if (curr_level < paths->depth - 1) {
-                        pnode = paths->nodes[curr_level + 1];
                         if (extent_index_node_remove_key(pnode, node, paths, collapse) < 0)
                                 WARN_ON(1);
                 } else {
-                        bump_release_block(node->header.blockptr, PAGE_SIZE);
+                        extent_release_block(root_node, node->header.blockptr,
+                                             PAGE_SIZE, true);
                         //paths->bh[curr_level] = NULL;
-                        pnode = extent_node_create(curr_level + 1,
-                                                   node->header.max_items,
-                                                   INDEX_NODE,
-                                                   &bh);
                         paths->nodes[curr_level + 1] = pnode;
                         paths->bh[curr_level + 1] = bh;
                         paths->depth++;
@@ -826,9 +964,9 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
                 BUG_ON(ret < 0);
                 extent_node_update_backrefs(r_sib, paths);
 
-                bump_put_buffer_head(rbh);
+                extent_put_node(root_node, rbh);
 
-                bump_put_buffer_head(lbh);
+                extent_put_node(root_node, lbh);
 
                 //extent_tree_rebalance(inode, pnode, paths);
 
@@ -837,14 +975,20 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
         } while (extent_node_has_overflowed(pnode));
 
         if (new_root) {
-                // path refs drops the old root
+                // path refs drop the old root, root_node ref is dropped here
+                extent_put_node(root_node, root_node->bh);
                 get_bh(bh);
                 root_node->bh = bh;
                 root_node->node = pnode;
                 root_node->max_level = paths->depth - 1;
         }
 
-        return pnode;
+        if (ret < 0 && curr_level > start_level) {
+                pr_warn("split deferred at level %d, err :%d\n", curr_level, ret);
+                ret = 0;
+        }
+
+        return ret;
 }
 
 static struct btree_node* extent_tree_find_leaf(struct btree_key* key,
@@ -872,7 +1016,9 @@ static struct btree_node* extent_tree_find_leaf(struct btree_key* key,
 
         slot = extent_index_node_search_keys(node, key);
 
-        ebh = bump_get_buffer_head(node->keys[slot].blockptr);
+        path->slots[node->header.level] = slot;
+
+        ebh = extent_get_node(path->root, node->keys[slot].blockptr);
         if (!ebh)
                 return ERR_PTR(-EIO);
 
@@ -882,18 +1028,31 @@ static struct btree_node* extent_tree_find_leaf(struct btree_key* key,
                                      path);
 }
 
+static struct btree_path *extent_tree_alloc_path(struct btree_root_node *root)
+{
+        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_NOFS);
+
+        if (!path)
+                return NULL;
+
+        path->root = root;
+        path->level = root->max_level;
+        return path;
+}
+
 long extent_tree_lookup_item(struct btree_root_node *root,
                              loff_t off,
                              unsigned int size)
 {
         int slot;
         struct btree_node *leaf;
-        struct btree_key key = { off, size, 0xFFFFFFFF };
-        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
+        struct btree_key key = { .offset = off, .size = size, .blockptr = 0xFFFFFFFF };
+        struct btree_path *path = extent_tree_alloc_path(root);
 
-        pr_debug("lookup request for key :%llu\n", off); 
+        if (!path)
+                return -ENOMEM;
 
-        path->level = root->max_level;
+        pr_debug("lookup request for key :%llu\n", off); 
 
         get_bh(root->bh);
 
@@ -901,8 +1060,7 @@ long extent_tree_lookup_item(struct btree_root_node *root,
         BUG_ON(!leaf);
         if (IS_ERR(leaf)) {
                 pr_err("failed to locate key: %llu, status: %ld\n", off, PTR_ERR(leaf));
-                brelse(root->bh);
-                kfree(path);
+                extent_drop_path_refs(path);
                 return -EIO;
         }
 
@@ -920,83 +1078,182 @@ long extent_tree_lookup_item(struct btree_root_node *root,
         return key.blockptr;
 }
 
-int extent_tree_insert_item(struct btree_root_node *root,
-                            loff_t off,
-                            unsigned long block,
-                            unsigned int size)
+/*
+ * Lookup the key with the largest offset not above off. Index keys carry
+ * the lowest offset of their child, so the floor key is always found in
+ * the leaf selected by the descent.
+ */
+int extent_tree_lookup_key(struct btree_root_node *root,
+                           loff_t off,
+                           struct btree_key *key)
 {
-        int i, ret = 0;
+        int slot;
+        struct btree_node *leaf;
+        struct btree_key skey = { .offset = off };
+        struct btree_path *path = extent_tree_alloc_path(root);
+
+        if (!path)
+                return -ENOMEM;
+
+        get_bh(root->bh);
+
+        leaf = extent_tree_find_leaf(&skey, root->node, root->bh, path);
+        BUG_ON(!leaf);
+        if (IS_ERR(leaf)) {
+                pr_err("failed to locate key: %llu, status: %ld\n", off, PTR_ERR(leaf));
+                extent_drop_path_refs(path);
+                return -EIO;
+        }
+
+        slot = extent_node_upper_bound(leaf, off) - 1;
+        if (slot >= 0)
+                memcpy((char *)key, (char *)&leaf->keys[slot], sizeof(struct btree_key));
+
+        extent_drop_path_refs(path);
+        return (slot < 0) ? -ENOENT : 0;
+}
+
+/*
+ * Insert key into the tree. A key already stored at the same offset is
+ * replaced in place; the caller owns the block it referenced.
+ */
+int extent_tree_insert_key(struct btree_root_node *root,
+                           struct btree_key *key)
+{
+        int i, level, ret = 0;
         bool added = false;
         struct btree_node *leaf;
-        struct btree_key key = { off, size, block };
-        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
+        struct btree_path *path;
 
-        path->level = root->max_level;
+        if (IS_KEY_EMPTY(*key))
+                return -EINVAL;
 
-        pr_debug("insert request for key :%llu\n", off); 
+        pr_debug("insert request for key :%llu\n", key->offset); 
+
+        root->flags |= BTREE_ROOT_MODIFYING;
+retry:
+        path = extent_tree_alloc_path(root);
+        if (!path) {
+                ret = -ENOMEM;
+                goto unmark;
+        }
 
         pr_debug("root max level :%u\n", root->max_level);
 
         get_bh(root->bh);
 
-        leaf = extent_tree_find_leaf(&key, root->node, root->bh, path);
+        leaf = extent_tree_find_leaf(key, root->node, root->bh, path);
         BUG_ON(!leaf);
 
         if (IS_ERR(leaf)) {
                 pr_err("failed to locate key: %llu, status: %ld\n",
-                                off, PTR_ERR(leaf));
-                brelse(root->bh);
-                kfree(path);
-                return -EIO;
+                                key->offset, PTR_ERR(leaf));
+                ret = -EIO;
+                goto out;
         }
 
         btree_node_print("selected leaf to insert", leaf);
 
-        if (!block)
-                block = bump_alloc_data_block();
-
-        for (i = 0; i < leaf->header.max_items; i++) {
-                if (IS_KEY_EMPTY(leaf->keys[i])) {
-                    leaf->keys[i].blockptr = block;
-                    leaf->keys[i].offset = off;
-                    leaf->keys[i].size = size;
-                    leaf->header.nr_items++;
-                    btree_info("inserted item[%d/%d] :%llu %u-%u\n",
-                            i, leaf->header.nr_items, off,
-                            path->level, path->depth);
-                    added = true;
-                    break;
+        /*
+         * A split that failed part way up left an index node on the path
+         * without headroom. Split the topmost such node first, its parent
+         * has room, then descend again to the leaf.
+         */
+        for (level = path->depth - 1; level > 0; level--) {
+                if (extent_node_has_overflowed(path->nodes[level]))
+                        break;
+        }
+        if (level > 0) {
+                ret = extent_node_split(root, path, level);
+                extent_drop_path_refs(path);
+                if (ret < 0) {
+                        pr_err("failed to split index level %d for key :%llu, "
+                               "err :%d\n", level, key->offset, ret);
+                        goto unmark;
                 }
+                goto retry;
+        }
+
+        i = extent_node_upper_bound(leaf, key->offset);
+        if (i > 0 && leaf->keys[i - 1].offset == key->offset) {
+                memcpy((char *)&leaf->keys[i - 1], (char *)key,
+                       sizeof(struct btree_key));
+                btree_info("replaced item[%d/%d] :%llu\n",
+                           i - 1, leaf->header.nr_items, key->offset);
+                goto out;
+        }
+
+        if (!extent_node_full(leaf)) {
+                extent_node_insert_at(leaf, i, key);
+                btree_info("inserted item[%d/%d] :%llu %u-%u\n",
+                        i, leaf->header.nr_items, key->offset,
+                        path->level, path->depth);
+                added = true;
         }
 
         if (added) {
-                extent_node_sort(leaf);
                 //btree_node_keys_print(leaf);
                 extent_node_update_backrefs(leaf, path);
                 //extent_tree_rebalance(inode, leaf, path);
                 if (extent_node_has_overflowed(leaf))
-                        extent_node_split(root, path, leaf->header.level);
+                        ret = extent_node_split(root, path, leaf->header.level);
+                if (ret < 0) {
+                        // split did not touch the tree, back the key out
+                        pr_err("failed to split leaf for key :%llu, err :%d\n",
+                                        key->offset, ret);
+                        extent_node_remove_at(leaf, i);
+                        extent_node_update_backrefs(leaf, path);
+                }
         } else {
-                bump_release_block(block, PAGE_SIZE);
-                pr_err("failed to insert key :%llu\n", off);
+                pr_err("failed to insert key :%llu\n", key->offset);
                 ret = -EAGAIN;
         }
-
+out:
         extent_drop_path_refs(path);
+unmark:
+        root->flags &= ~BTREE_ROOT_MODIFYING;
+        return ret;
+}
+
+int extent_tree_insert_item(struct btree_root_node *root,
+                            loff_t off,
+                            unsigned long block,
+                            unsigned int size)
+{
+        int ret;
+        struct btree_key key = { .offset = off, .size = size, .blockptr = block };
+
+        if (!block) {
+                if (!root->ops->alloc_data)
+                        return -EINVAL;
+                key.blockptr = root->ops->alloc_data(root);
+        }
+
+        ret = extent_tree_insert_key(root, &key);
+        if (ret < 0 && !block)
+                extent_release_block(root, key.blockptr, PAGE_SIZE, false);
         return ret;
 }
 
+/*
+ * Remove the key at offset. Errors before the key is gone are returned.
+ * Once it is removed the delete has happened; a rebalance or shrink that
+ * fails on I/O or space leaves a valid, less compact tree and is logged.
+ */
 int extent_tree_delete_item(struct btree_root_node *root,
                             unsigned long offset)
 {
-        int i;
+        int i, err = 0, ret = 0;
         bool deleted = false;
         bool collapse = true;
         struct btree_node *leaf, *parent;
-        struct btree_key key = { offset, 0, 0 };
-        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
+        struct btree_key key = { .offset = offset };
+        struct btree_path *path = extent_tree_alloc_path(root);
 
-        path->level = root->max_level;
+        if (!path)
+                return -ENOMEM;
+
+        root->flags |= BTREE_ROOT_MODIFYING;
 
         get_bh(root->bh);
 
@@ -1008,75 +1265,377 @@ int extent_tree_delete_item(struct btree_root_node *root,
         if (IS_ERR(leaf)) {
                 pr_err("failed to locate key: %ld, status: %ld\n",
                                 offset, PTR_ERR(leaf));
-                brelse(root->bh);
-                kfree(path);
-                return -EIO;
+                ret = -EIO;
+                goto out;
         }
 
         btree_node_print("selected leaf to delete", leaf);
         btree_node_keys_print(leaf);
 
-        for (i = 0; i < leaf->header.nr_items; i++) {
-                if (leaf->keys[i].offset != key.offset)
-                        continue;
-                bump_release_block(leaf->keys[i].blockptr, PAGE_SIZE);
-                memcpy((char *)&leaf->keys[i],
-	               (char *)&leaf->keys[leaf->header.nr_items - 1],
-                       sizeof(struct btree_key));
-                memset((char *)&leaf->keys[leaf->header.nr_items - 1],
-                        0,
-                        sizeof(struct btree_key));
-                leaf->header.nr_items--;
-		BUG_ON(leaf->header.nr_items < 0);
+        i = extent_index_node_lookup(leaf, &key);
+        if (i >= 0) {
+                extent_release_block(root, leaf->keys[i].blockptr,
+                                     leaf->keys[i].size, false);
+                extent_node_remove_at(leaf, i);
                 btree_info("deleted item[%d/%d] :%lu %u-%u/%u\n",
                             i, leaf->header.nr_items, offset,
                             path->level, path->depth, leaf->header.max_items);
                 deleted = true;
-                break;
         }
 
         if (!deleted) {
                 pr_err("key :%lu not found\n", offset);
+                ret = -ENOENT;
                 goto out;
         }
 
-        if (extent_node_is_root(leaf, path)) {
-                extent_node_sort(leaf);
-        } else {
+        if (!extent_node_is_root(leaf, path)) {
                 parent = path->nodes[leaf->header.level + 1];
                 if (leaf->header.nr_items) {
-                        extent_node_sort(leaf);
                         extent_node_update_backrefs(leaf, path);
-                        extent_tree_rebalance(leaf, path);
+                        err = extent_tree_rebalance(leaf, path);
                 } else {
                         int plevel;
 
+                        extent_leaf_unlink(root, leaf);
+
                         plevel = extent_index_node_remove_key(parent, leaf, path, collapse);
                         if (plevel < 0)
 				BUG();
                         else {
                                 parent = path->nodes[plevel];
-                                extent_tree_rebalance(parent, path);
+                                err = extent_tree_rebalance(parent, path);
                         }
                 }
         }
 
         //btree_node_keys_print(leaf);
 
-        if (extent_tree_can_shrink(root->node)) {
+        // last key gone, every index level emptied up to the root
+        if (!IS_BTREE_LEAF(root->node) && !root->node->header.nr_items) {
+                root->node->header.level = 0;
+                root->node->header.flags = LEAF_NODE;
+                root->node->header.prev = 0;
+                root->node->header.next = 0;
+                root->max_level = 0;
+        } else if (!err)
+                err = extent_tree_can_shrink(root);
+        if (err > 0) {
                 struct buffer_head *new_bh;
+                struct btree_node *merge;
 
-                root->node = extent_tree_shrink(root, &new_bh);
-                root->bh = new_bh;
-                root->max_level--;
+                merge = extent_tree_shrink(root, &new_bh);
+                if (IS_ERR(merge)) {
+                        err = PTR_ERR(merge);
+                } else {
+                        root->node = merge;
+                        root->bh = new_bh;
+                        root->max_level--;
+                        err = 0;
+                }
         }
+
+        if (err < 0)
+                pr_warn("key :%lu deleted, tree not rebalanced, err :%d\n",
+                        offset, err);
 out:
         extent_drop_path_refs(path);
+        root->flags &= ~BTREE_ROOT_MODIFYING;
+        return ret;
+}
+
+// keys packed into a bulk loaded node, leaving the headroom insert expects
+static inline int extent_bulk_node_cap(int max_items, int level, int fill)
+{
+        int cap = max_items * fill / 100;
+        int limit = level ? max_items - 3 : max_items - 1;
+
+        return clamp(cap, 2, limit);
+}
+
+/*
+ * Build the tree bottom-up from nr_keys keys sorted by offset. Each level
+ * is packed to fill percent of node capacity with keys spread evenly over
+ * its nodes, so no node starts out underflowed. The tree must be empty.
+ * Blocks referenced by the keys are left to the caller on failure.
+ */
+int extent_tree_bulk_load(struct btree_root_node *root,
+                          struct btree_key *keys,
+                          int nr_keys,
+                          int fill)
+{
+        int i, n, level, ret = 0;
+        int nr_nodes = 0, max_nodes = 0;
+        int max_items = root->node->header.max_items;
+        unsigned long *blocks;
+        struct btree_key *in = keys, *out = NULL;
+        struct buffer_head *bh, *prev_bh = NULL;
+        struct btree_node *node, *prev = NULL;
+
+        if (root->max_level || root->node->header.nr_items)
+                return -EEXIST;
+
+        if (fill <= 0 || fill > 100)
+                return -EINVAL;
+
+        for (i = 0; i < nr_keys; i++) {
+                if (IS_KEY_EMPTY(keys[i]) ||
+                    (i && keys[i].offset <= keys[i - 1].offset))
+                        return -EINVAL;
+        }
+
+        if (!nr_keys)
+                return 0;
+
+        // size the tree up front, the root must fit MAX_BTREE_LEVEL
+        n = nr_keys;
+        level = 0;
+        do {
+                n = DIV_ROUND_UP(n, extent_bulk_node_cap(max_items, level, fill));
+                max_nodes += n;
+                level++;
+        } while (n > 1);
+
+        if (level > MAX_BTREE_LEVEL)
+                return -E2BIG;
+
+        blocks = kmalloc(max_nodes * sizeof(unsigned long), GFP_NOFS);
+        if (!blocks)
+                return -ENOMEM;
+
+        root->flags |= BTREE_ROOT_MODIFYING;
+
+        n = nr_keys;
+        for (level = 0; ; level++) {
+                int j, k = 0;
+                int m = DIV_ROUND_UP(n, extent_bulk_node_cap(max_items, level, fill));
+
+                out = kmalloc(m * sizeof(struct btree_key), GFP_NOFS);
+                if (!out) {
+                        ret = -ENOMEM;
+                        goto fail;
+                }
+
+                for (j = 0; j < m; j++) {
+                        // first n % m nodes take one key more
+                        int cnt = n / m + (j < n % m);
+
+                        node = extent_node_create(root,
+                                                  level,
+                                                  max_items,
+                                                  level ? INDEX_NODE : LEAF_NODE,
+                                                  &bh);
+                        if (!node) {
+                                ret = -ENOSPC;
+                                goto fail;
+                        }
+
+                        blocks[nr_nodes++] = node->header.blockptr;
+
+                        memcpy((char *)node->keys, (char *)&in[k],
+                               cnt * sizeof(struct btree_key));
+                        node->header.nr_items = cnt;
+                        extent_node_update_offset(node);
+                        k += cnt;
+
+                        extent_reset_key(&out[j]);
+                        SET_KEY_FROM_BTREE_HDR(out[j], node);
+
+                        if (prev_bh) {
+                                if (!level) {
+                                        prev->header.next = node->header.blockptr;
+                                        node->header.prev = prev->header.blockptr;
+                                }
+                                extent_put_node(root, prev_bh);
+                        }
+                        prev = node;
+                        prev_bh = bh;
+                }
+
+                extent_put_node(root, prev_bh);
+                prev_bh = NULL;
+
+                if (in != keys)
+                        kfree(in);
+                in = out;
+                out = NULL;
+                n = m;
+
+                if (n == 1)
+                        break;
+        }
+
+        bh = extent_get_node(root, in[0].blockptr);
+        if (!bh) {
+                ret = -EIO;
+                goto fail;
+        }
+
+        extent_release_block(root, root->node->header.blockptr, PAGE_SIZE, true);
+        extent_put_node(root, root->bh);
+
+        root->bh = bh;
+        root->node = BH2BTNODE(bh);
+        root->max_level = level;
+
+        btree_node_print("bulk loaded root", root->node);
+
+        root->flags &= ~BTREE_ROOT_MODIFYING;
+
+        kfree(in);
+        kfree(blocks);
+        return 0;
+
+fail:
+        if (prev_bh)
+                extent_put_node(root, prev_bh);
+
+        for (i = 0; i < nr_nodes; i++)
+                extent_release_block(root, blocks[i], PAGE_SIZE, true);
+
+        root->flags &= ~BTREE_ROOT_MODIFYING;
+
+        if (in != keys)
+                kfree(in);
+        kfree(out);
+        kfree(blocks);
+        return ret;
+}
+
+/*
+ * Position iter at the last key not above off, or at the first key of the
+ * tree if there is none. The descent holds one node reference at a time;
+ * the leaf reference is kept until extent_tree_iter_release().
+ */
+int extent_tree_iter_init(struct btree_root_node *root,
+                          struct btree_iter *iter,
+                          loff_t off)
+{
+        int slot;
+        struct btree_key key = { .offset = off };
+        struct buffer_head *ebh, *bh = root->bh;
+        struct btree_node *node = root->node;
+
+        iter->root = root;
+        iter->bh = NULL;
+        iter->node = NULL;
+        iter->slot = 0;
+
+        get_bh(bh);
+
+        while (!IS_BTREE_LEAF(node)) {
+                slot = extent_index_node_search_keys(node, &key);
+                ebh = extent_get_node(root, node->keys[slot].blockptr);
+                extent_put_node(root, bh);
+                if (!ebh)
+                        return -EIO;
+                bh = ebh;
+                node = BH2BTNODE(bh);
+        }
+
+        slot = extent_node_upper_bound(node, off) - 1;
+
+        iter->bh = bh;
+        iter->node = node;
+        iter->slot = (slot < 0) ? 0 : slot;
+        return 0;
+}
+
+// return the key under the cursor and advance, following leaf links
+int extent_tree_iter_next(struct btree_iter *iter, struct btree_key *key)
+{
+        u64 next;
+        struct buffer_head *ebh;
+
+        if (!iter->bh)
+                return -ENOENT;
+
+        while (iter->slot >= iter->node->header.nr_items) {
+                next = iter->node->header.next;
+                extent_tree_iter_release(iter);
+                if (!next)
+                        return -ENOENT;
+                ebh = extent_get_node(iter->root, next);
+                if (!ebh)
+                        return -EIO;
+                iter->bh = ebh;
+                iter->node = BH2BTNODE(ebh);
+                iter->slot = 0;
+        }
+
+        memcpy((char *)key, (char *)&iter->node->keys[iter->slot++],
+               sizeof(struct btree_key));
         return 0;
 }
 
+void extent_tree_iter_release(struct btree_iter *iter)
+{
+        if (iter->bh)
+                extent_put_node(iter->root, iter->bh);
+        iter->bh = NULL;
+        iter->node = NULL;
+}
+
+/*
+ * Collect keys mapping any offset in [off, off + range) on range_list as
+ * btree_key_entry items, in key order. Returns the number of keys added;
+ * the caller frees them with extent_tree_range_release().
+ */
+int extent_tree_range_query(struct btree_root_node *root,
+                            loff_t off,
+                            size_t range,
+                            struct list_head *range_list)
+{
+        int ret, count = 0;
+        struct btree_iter iter;
+        struct btree_key key;
+        struct btree_key_entry *entry;
+
+        ret = extent_tree_iter_init(root, &iter, off);
+        if (ret < 0)
+                return ret;
+
+        while ((ret = extent_tree_iter_next(&iter, &key)) == 0) {
+                if (key.offset >= off && key.offset - off >= range)
+                        break;
+                // extents cover nr_blocks from their offset
+                if (key.offset + max_t(u64, key.nr_blocks, 1) <= off)
+                        continue;
+                entry = kmalloc(sizeof(struct btree_key_entry), GFP_NOFS);
+                if (!entry) {
+                        ret = -ENOMEM;
+                        break;
+                }
+                memcpy((char *)&entry->key, (char *)&key, sizeof(struct btree_key));
+                list_add_tail(&entry->list, range_list);
+                count++;
+        }
+
+        extent_tree_iter_release(&iter);
+
+        if (ret < 0 && ret != -ENOENT) {
+                extent_tree_range_release(range_list);
+                return ret;
+        }
+        return count;
+}
+
+void extent_tree_range_release(struct list_head *range_list)
+{
+        struct btree_key_entry *entry, *tmp;
+
+        list_for_each_entry_safe(entry, tmp, range_list, list) {
+                list_del(&entry->list);
+                kfree(entry);
+        }
+}
+
 // DFS
-unsigned long extent_tree_dump(struct seq_file *m, struct btree_node *node, long refcount, int count)
+unsigned long extent_tree_dump(struct seq_file *m,
+                               struct btree_root_node *root,
+                               struct btree_node *node,
+                               long refcount,
+                               int count)
 {
         int i;
         unsigned long nr_keys = 0;
@@ -1106,47 +1665,72 @@ unsigned long extent_tree_dump(struct seq_file *m, struct btree_node *node, long
                               node->keys[i].blockptr);
 
                 if (!IS_BTREE_LEAF(node)) {
-                        ebh = bump_get_buffer_head(node->keys[i].blockptr);
-                        nr_keys += extent_tree_dump(m, (struct btree_node *)(ebh->b_data),
+                        ebh = extent_get_node(root, node->keys[i].blockptr);
+                        if (!ebh)
+                                continue;
+                        nr_keys += extent_tree_dump(m, root, (struct btree_node *)(ebh->b_data),
                                         atomic_read(&ebh->b_count), count + 1);
-                        bump_put_buffer_head(ebh);
+                        extent_put_node(root, ebh);
                 }
         }
 
         return (IS_BTREE_LEAF(node)) ? node->header.nr_items : nr_keys;
 }
 
-static struct btree_root_node* extent_tree_load(struct inode* inode, struct btree_key *key)
+// load a tree persisted at root block
+struct btree_root_node* extent_tree_open(unsigned long block,
+                                         const struct btree_block_ops *ops,
+                                         void *private)
 {
         struct btree_root_node *root = NULL;
+        struct btree_node *node;
         struct buffer_head *ebh;
 
-        root = kzalloc(sizeof(struct btree_root_node), GFP_KERNEL);
+        root = kzalloc(sizeof(struct btree_root_node), GFP_NOFS);
         if (!root)
                 goto exit;
 
-        ebh = bump_get_buffer_head(key->blockptr);
+        root->ops = ops;
+        root->private = private;
+
+        ebh = extent_get_node(root, block);
         if (!ebh)
                 goto exit;
 
-        memcpy((char*)root->node, ebh->b_data, sizeof(struct btree_node));
-        bump_put_buffer_head(ebh);
+        node = BH2BTNODE(ebh);
+        if ((node->header.blockptr != block) ||
+            (node->header.level >= MAX_BTREE_LEVEL) ||
+            (node->header.nr_items > node->header.max_items)) {
+                pr_err("bad btree root block :%lu\n", block);
+                extent_put_node(root, ebh);
+                goto exit;
+        }
+
+        root->bh = ebh;
+        root->node = node;
+        root->max_level = node->header.level;
         return root;
 exit:
         kfree(root);
         return NULL;
 }
 
-struct btree_root_node* extent_tree_init(int version, int max_keys)
+struct btree_root_node* extent_tree_init(int version,
+                                         int max_keys,
+                                         const struct btree_block_ops *ops,
+                                         void *private)
 {
         struct btree_root_node *root = NULL;
         struct buffer_head *bh = NULL;
 
-        root = kzalloc(sizeof(struct btree_root_node), GFP_KERNEL);
+        root = kzalloc(sizeof(struct btree_root_node), GFP_NOFS);
         if (!root)
                 goto exit;
 
-        root->node = extent_node_create(0, max_keys, LEAF_NODE, &bh);
+        root->ops = ops;
+        root->private = private;
+
+        root->node = extent_node_create(root, 0, max_keys, LEAF_NODE, &bh);
         if (!root->node)
                 goto exit;
 
@@ -1161,42 +1745,20 @@ exit:
         return NULL;
 }
 
-void extent_tree_destroy(struct btree_root_node *root)
+// drop in-memory root, tree blocks are left intact
+void extent_tree_close(struct btree_root_node *root)
 {
-        bump_leak_detector();
-        extent_node_destroy(root->node);
-        BUG_ON(root->node->header.nr_items);
-        bump_put_buffer_head(root->bh);
+        extent_put_node(root, root->bh);
         root->node = NULL;
         kfree(root);
 }
 
-#define TEST_ROOT_VERSION 0xFF
-
-static int init_test_root(void)
-{
-        btree_test_root = extent_tree_init(TEST_ROOT_VERSION, MAX_KEYS);
-        if (!btree_test_root) {
-                pr_err("failed to initialize tree");
-                return -ENODEV;
-        }
-
-        dbgfs_dir = btree_debugfs_init(btree_test_root);
-        if (!dbgfs_dir)
-                return -ENODEV;
-
-        return 0;
-}
-
-static void cleanup_test_root(void)
+// free all tree blocks and the in-memory root
+void extent_tree_destroy(struct btree_root_node *root)
 {
-        if (btree_test_root) {
-                extent_tree_destroy(btree_test_root);
-                btree_test_root = NULL;
-        }
-
-        if (dbgfs_dir) {
-                btree_debugfs_destroy(dbgfs_dir);
-                dbgfs_dir = NULL;
-        }
+        extent_node_destroy(root, root->node);
+        BUG_ON(root->node->header.nr_items);
+        extent_put_node(root, root->bh);
+        root->node = NULL;
+        kfree(root);
 }
@@ -21,12 +21,17 @@ struct btree_header {
         __le64 offset;
         __le64 blockptr;
         __le64 flags;
+        __le64 prev;    // leaf sibling links, 0 at either end
+        __le64 next;
 } __attribute__ ((__packed__));
 
 struct btree_key {
         __le64 offset;
         __le32 size;
         __le64 blockptr;
+        __le32 checksum;
+        __le16 nr_blocks;
+        __le16 flags;
 } __attribute__ ((__packed__));
 
 struct btree_node {
@@ -36,18 +41,61 @@ struct btree_node {
 
 // in-memory
 struct btree_path {
+        struct btree_root_node *root;
         struct btree_node  *nodes[MAX_BTREE_LEVEL];
         struct buffer_head *bh[MAX_BTREE_LEVEL];
+        int                 slots[MAX_BTREE_LEVEL]; // child slot taken at each level
         int                 depth;
         int                 level;
 };
 
+// leaf cursor for in-order scans
+struct btree_iter {
+        struct btree_root_node *root;
+        struct buffer_head     *bh;
+        struct btree_node      *node;
+        int                     slot;
+};
+
+struct btree_key_entry {
+        struct list_head list;
+        struct btree_key key;
+};
+
+struct btree_root_node;
+
+/*
+ * Block store backing the tree nodes. alloc_node returns a zeroed,
+ * referenced node buffer; put_node drops a reference taken by alloc_node
+ * or get_node. release_block frees a node (meta) or a leaf data block.
+ * alloc_data is optional, used when an item is inserted without a block.
+ */
+struct btree_block_ops {
+        struct buffer_head* (*alloc_node)    (struct btree_root_node *root,
+                                              unsigned long *block);
+        unsigned long       (*alloc_data)    (struct btree_root_node *root);
+        void                (*release_block) (struct btree_root_node *root,
+                                              unsigned long block,
+                                              size_t size,
+                                              bool meta);
+        struct buffer_head* (*get_node)      (struct btree_root_node *root,
+                                              unsigned long block);
+        void                (*put_node)      (struct btree_root_node *root,
+                                              struct buffer_head *bh);
+};
+
+// root flags
+#define BTREE_ROOT_MODIFYING 0x1 // nodes put during insert/delete are dirty
+
 struct btree_root_node {
         struct inode* inode;
         struct btree_node* node;
         struct buffer_head *bh;
         int    version;
         int    max_level;
+        unsigned long flags;
+        const struct btree_block_ops *ops;
+        void   *private;
         struct list_head list;
 };
 
@@ -64,6 +112,13 @@ long extent_tree_lookup_item(struct btree_root_node *root,
                              loff_t off,
                              unsigned int size);
 
+int extent_tree_lookup_key(struct btree_root_node *root,
+                           loff_t off,
+                           struct btree_key *key);
+
+int extent_tree_insert_key(struct btree_root_node *root,
+                           struct btree_key *key);
+
 int extent_tree_insert_item(struct btree_root_node *root,
                             loff_t off,
                             unsigned long block,
@@ -72,18 +127,42 @@ int extent_tree_insert_item(struct btree_root_node *root,
 int extent_tree_delete_item(struct btree_root_node *root,
                             unsigned long key);
 
+int extent_tree_bulk_load(struct btree_root_node *root,
+                          struct btree_key *keys,
+                          int nr_keys,
+                          int fill);
+
+int extent_tree_iter_init(struct btree_root_node *root,
+                          struct btree_iter *iter,
+                          loff_t off);
+
+int extent_tree_iter_next(struct btree_iter *iter,
+                          struct btree_key *key);
+
+void extent_tree_iter_release(struct btree_iter *iter);
+
 int extent_tree_range_query(struct btree_root_node *root,
                             loff_t off,
                             size_t range,
-                            struct list_head *range_list,
-                            int level);
+                            struct list_head *range_list);
+
+void extent_tree_range_release(struct list_head *range_list);
 
 struct btree_root_node* extent_tree_init(int version,
-                                         int max_keys);
+                                         int max_keys,
+                                         const struct btree_block_ops *ops,
+                                         void *private);
+
+struct btree_root_node* extent_tree_open(unsigned long block,
+                                         const struct btree_block_ops *ops,
+                                         void *private);
+
+void extent_tree_close(struct btree_root_node *root);
 
 void extent_tree_destroy(struct btree_root_node *root);
 
 unsigned long extent_tree_dump(struct seq_file *m,
+                               struct btree_root_node *root,
                                struct btree_node *node,
                                long refcount,
                                int count);
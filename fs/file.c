@@ -140,6 +140,24 @@ long luci_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
    case FS_IOC32_SETVERSION:
            luci_err("FS_IOC_SETVERSION, not supported ioctl :0x%x\n", cmd);
            break;
+   case LUCI_IOC_DIR_COMPACT: {
+           int err;
+           struct inode *inode = file_inode(file);
+
+           if (!S_ISDIR(inode->i_mode))
+               return -ENOTDIR;
+           if (!inode_owner_or_capable(inode))
+               return -EACCES;
+
+           err = mnt_want_write_file(file);
+           if (err)
+               return err;
+           inode_lock(inode);
+           err = luci_dir_compact(inode);
+           inode_unlock(inode);
+           mnt_drop_write_file(file);
+           return err;
+   }
    case FS_IOC_FIEMAP:
            luci_err("FS_IOC_FIEMAP, not supported ioctl :0x%x\n", cmd);
            break;
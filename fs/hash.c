@@ -0,0 +1,117 @@
+/*--------------------------------------------------------------------
+ * Copyright(C) 2016, Saptarshi Sen
+ *
+ * LUCI directory index name hashes
+ *
+ * Same functions as the ext2/3 htree hashes of the same version, so a
+ * hash seed generated by mke2fs works unchanged. The low bit of a hash
+ * is cleared, the index uses it to mark leaves continuing a collision.
+ * ------------------------------------------------------------------*/
+#include <linux/fs.h>
+
+#include "luci.h"
+
+#define TEA_DELTA 0x9E3779B9
+
+static void
+luci_tea_transform(__u32 buf[4], __u32 const in[])
+{
+    __u32 sum = 0;
+    __u32 b0 = buf[0], b1 = buf[1];
+    __u32 a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// legacy hash, no seed
+static __u32
+luci_dx_hack_hash(const char *name, int len)
+{
+    __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    while (len--) {
+        hash = hash1 + (hash0 ^ (*name++ * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// pack up to num words of name into buf, padded with the length
+static void
+luci_str2hashbuf(const char *msg, int len, __u32 *buf, int num)
+{
+    int i;
+    __u32 pad, val;
+
+    pad = (__u32)len | ((__u32)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (i = 0; i < len; i++) {
+        if ((i % 4) == 0)
+            val = pad;
+        val = msg[i] + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+bool
+luci_dx_hash_supported(int version)
+{
+    return version == LUCI_HASH_LEGACY || version == LUCI_HASH_TEA;
+}
+
+__u32
+luci_dx_hash(int version, const __u32 *seed, const char *name, int len)
+{
+    int i;
+    __u32 hash, in[4];
+    __u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+    switch (version) {
+    case LUCI_HASH_LEGACY:
+        hash = luci_dx_hack_hash(name, len);
+        break;
+
+    case LUCI_HASH_TEA:
+        // an all zero seed selects the default
+        for (i = 0; seed && i < 4; i++) {
+            if (seed[i])
+                break;
+        }
+        if (seed && i < 4)
+            memcpy(buf, seed, sizeof(buf));
+
+        for (; len > 0; len -= 16, name += 16) {
+            luci_str2hashbuf(name, len, in, 4);
+            luci_tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+
+    default:
+        BUG();
+    }
+    return hash & ~1;
+}
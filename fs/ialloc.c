@@ -40,6 +40,7 @@ luci_bg_block_bitmap_update_csum(struct luci_group_desc *gdesc,
         u32 crc32, crc32seed = ~0U;
         crc32 = luci_compute_page_cksum(bh_bitmap->b_page, 0, PAGE_SIZE, crc32seed);
         gdesc->bg_block_bitmap_checksum = crc32 & 0xFFFF;
+        set_buffer_verified(bh_bitmap);
 }
 
 /* 32-bit CRC of group desciptor inode bitmap */
@@ -50,17 +51,23 @@ luci_bg_inode_bitmap_update_csum(struct luci_group_desc *gdesc,
         u32 crc32, crc32seed = ~0U;
         crc32 = luci_compute_page_cksum(bh_inode->b_page, 0, PAGE_SIZE, crc32seed);
         gdesc->bg_inode_bitmap_checksum = crc32 & 0xFFFF;
+        set_buffer_verified(bh_inode);
 }
 
 /* inode attribute */
 static void luci_init_inode_flags(struct inode *inode) {
+        struct luci_inode_info *li = LUCI_I(inode);
+
+        // inode info is recycled from the inode cache, start afresh
+        li->i_flags = 0;
         if (S_ISREG(inode->i_mode)) {
-                struct luci_inode_info *li = LUCI_I(inode);
 #ifdef LUCIFS_COMPRESSION
                 li->i_flags |= LUCI_COMPR_FL;
 #else
                 li->i_flags |= LUCI_NOCOMP_FL;
 #endif
+                if (test_opt(LUCI_SB(inode->i_sb)->s_mount_opt, LUCI_MOUNT_EXTENTS))
+                        li->i_flags |= LUCI_EXTENTS_FL;
         }
 }
 
@@ -150,14 +157,13 @@ badsuper:
 /*
  * read inode bitmap of a block group.
  * The following cases come up with respect to integrity checking here:
- *     1. meta-data is not cached. Need check.
- *     2. meta-data is cached. Do NOT need check.
- *     3. meta-data is dirty. Do NOT need check.
+ *     1. meta-data read from disk and not yet verified. Need check.
+ *     2. meta-data verified since last read. Do NOT need check.
+ *     3. meta-data updated by us (csum recomputed). Do NOT need check.
  */
 struct buffer_head *
 read_inode_bitmap(struct super_block *sb, unsigned long bg) {
         u32 crc;
-        bool cached;
         uint32_t bmap_block;
         struct buffer_head *bmap_bh;
         struct luci_group_desc *gdesc;
@@ -168,19 +174,14 @@ read_inode_bitmap(struct super_block *sb, unsigned long bg) {
 
         bmap_block = gdesc->bg_inode_bitmap;
 
-        cached = true;
-        bmap_bh = sb_find_get_block(sb, bmap_block);
-        if (!bmap_bh) {
-                cached = false;
-                bmap_bh = sb_bread(sb, bmap_block);
-        }
+        bmap_bh = luci_sb_bread(sb, bmap_block);
 
         if (!bmap_bh) {
                 luci_err("read error inode bitmap :%u/%lu", bmap_block, bg);
                 goto err;
         }
 
-        if (!cached && buffer_uptodate(bmap_bh) && trylock_buffer(bmap_bh)) {
+        if (!buffer_verified(bmap_bh) && trylock_buffer(bmap_bh)) {
                 crc = gdesc->bg_inode_bitmap_checksum;
                 if (crc) {
                         u32 crc_chk;
@@ -194,6 +195,7 @@ read_inode_bitmap(struct super_block *sb, unsigned long bg) {
                                 goto err;
                         }
                 }
+                set_buffer_verified(bmap_bh);
                 unlock_buffer(bmap_bh);
                 luci_info("bg inode bitmap %lu crc OK", bg);
         }
@@ -205,15 +207,14 @@ err:
 
 /*
  * read block bitmap of a block group
- *     1. meta-data is not cached. Need check.
- *     2. meta-data is cached. Do NOT need check.
- *     3. meta-data is dirty. Do NOT need check.
+ *     1. meta-data read from disk and not yet verified. Need check.
+ *     2. meta-data verified since last read. Do NOT need check.
+ *     3. meta-data updated by us (csum recomputed). Do NOT need check.
  *
  */
 struct buffer_head *
 read_block_bitmap(struct super_block *sb, unsigned long bg) {
         u32 crc;
-        bool cached;
         uint32_t bmap_block;
         struct luci_group_desc *gdesc;
         struct buffer_head *bmap_bh = NULL;
@@ -230,19 +231,14 @@ read_block_bitmap(struct super_block *sb, unsigned long bg) {
         bmap_block = gdesc->bg_block_bitmap;
         luci_dbg("block group :%lu/%u nr_free blocks : %u", bg, bmap_block, gdesc->bg_free_blocks_count);
 
-        cached = true;
-        bmap_bh = sb_find_get_block(sb, bmap_block);
-        if (!bmap_bh) {
-                cached = false;
-                bmap_bh = sb_bread(sb, bmap_block);
-        }
+        bmap_bh = luci_sb_bread(sb, bmap_block);
 
         if (!bmap_bh) {
                 luci_err("read error block bitmap :%u/%lu", bmap_block, bg);
                 goto err;
         }
 
-        if (!cached && buffer_uptodate(bmap_bh) && trylock_buffer(bmap_bh)) {
+        if (!buffer_verified(bmap_bh) && trylock_buffer(bmap_bh)) {
                 crc = gdesc->bg_block_bitmap_checksum;
                 if (crc) {
                         u32 crc_chk;
@@ -256,6 +252,7 @@ read_block_bitmap(struct super_block *sb, unsigned long bg) {
                                 goto err;
                         }
                 }
+                set_buffer_verified(bmap_bh);
                 unlock_buffer(bmap_bh);
                 //luci_dbg("bg block bitmap %lu crc OK", bg);
         }
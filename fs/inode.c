@@ -40,6 +40,10 @@ static atomic64_t setattr_out;
 static atomic64_t getattr_in;
 static atomic64_t getattr_out;
 
+static atomic64_t meta_csum_verified;
+static atomic64_t meta_csum_skipped;
+static atomic64_t meta_csum_flushed;
+
 extern debugfs_t dbgfsparam;
 
 static int
@@ -174,9 +178,117 @@ const struct inode_operations luci_symlink_inode_operations = {
 
 /* bmap functions */
 
+/*
+ * Track an indirect block whose checksum in the parent is stale. The buffer
+ * is pinned so its stale state survives until luci_bmap_flush_cksum.
+ */
+static int
+luci_bmap_track_stale(struct inode *inode, struct buffer_head *bh)
+{
+    int err;
+
+    if (test_set_buffer_csum_stale(bh))
+        return 0;
+
+    get_bh(bh);
+    err = radix_tree_insert(&LUCI_I(inode)->i_bmap_stale, bh->b_blocknr, bh);
+    if (err < 0) {
+        // flush will still find the buffer through the current path
+        put_bh(bh);
+        return err;
+    }
+    return 0;
+}
+
+/*
+ * Recompute checksum of a stale indirect block bottom-up and store it in
+ * the parent block pointer. level is the number of indirect levels at and
+ * below bp, so level 1 blocks hold L0 block pointers.
+ */
+static void
+luci_bmap_flush_branch_cksum(struct inode *inode,
+                             blkptr *bp,
+                             int level,
+                             int do_sync)
+{
+    int i;
+    struct buffer_head *bh;
+    struct super_block *sb = inode->i_sb;
+
+    bh = sb_find_get_block(sb, bp->blockno);
+    if (bh == NULL)
+        return;
+
+    if (!buffer_csum_stale(bh))
+        goto out;
+
+    if (level > 1) {
+        for (i = 0; i < LUCI_ADDR_PER_BLOCK(sb); i++) {
+            blkptr *child = (blkptr *)bh->b_data + i;
+            if (child->blockno)
+                luci_bmap_flush_branch_cksum(inode, child, level - 1, do_sync);
+        }
+    }
+
+    lock_buffer(bh);
+    bp->checksum = luci_compute_page_cksum(bh->b_page, 0, PAGE_SIZE, ~0U);
+    clear_buffer_csum_stale(bh);
+    set_buffer_verified(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    if (do_sync)
+        sync_dirty_buffer(bh);
+
+    atomic64_inc(&meta_csum_flushed);
+    luci_info("updated meta cksum, inode :%lu level :%d bp {%u/0x%x}",
+              inode->i_ino, level, bp->blockno, bp->checksum);
+out:
+    brelse(bh);
+}
+
+// caller holds truncate_mutex
+static void
+__luci_bmap_flush_cksum(struct inode *inode, int do_sync)
+{
+    int i, nr;
+    struct buffer_head *bhs[16];
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    luci_bmap_flush_branch_cksum(inode, &li->i_data[LUCI_IND_BLOCK], 1, do_sync);
+    luci_bmap_flush_branch_cksum(inode, &li->i_data[LUCI_DIND_BLOCK], 2, do_sync);
+    luci_bmap_flush_branch_cksum(inode, &li->i_data[LUCI_TIND_BLOCK], 3, do_sync);
+
+    // unpin
+    while ((nr = radix_tree_gang_lookup(&li->i_bmap_stale, (void **)bhs, 0,
+                                        ARRAY_SIZE(bhs))) > 0) {
+        for (i = 0; i < nr; i++) {
+            radix_tree_delete(&li->i_bmap_stale, bhs[i]->b_blocknr);
+            WARN_ON(buffer_csum_stale(bhs[i]));
+            put_bh(bhs[i]);
+        }
+    }
+}
+
+/*
+ * Propagate deferred indirect block checksums up to the inode's i_data.
+ * Invoked before the inode is written back and before truncate.
+ */
+void
+luci_bmap_flush_cksum(struct inode *inode, int do_sync)
+{
+    struct luci_inode_info *li = LUCI_I(inode);
+
+    mutex_lock(&li->truncate_mutex);
+    __luci_bmap_flush_cksum(inode, do_sync);
+    mutex_unlock(&li->truncate_mutex);
+}
+
 /*
  * Use this function for updating metadata block checksum
  * All access to metadata blocks are protected by inode truncate mutex
+ *
+ * Checksums are not computed here, the indirect blocks along the path are
+ * marked stale and checksums are propagated once at inode writeback.
  */
 static int
 luci_update_bmap_path_cksum(struct inode *inode,
@@ -184,8 +296,8 @@ luci_update_bmap_path_cksum(struct inode *inode,
                             int depth,
                             unsigned long i_block)
 {
-    u32 crc32;
     Indirect *p;
+    bool need_flush = false;
     struct buffer_head *currbh;
 
     depth -= 1; // ignore leaf block/extent, already csummed
@@ -193,20 +305,21 @@ luci_update_bmap_path_cksum(struct inode *inode,
         p = &ichain[depth];
         currbh = p->bh;
         BUG_ON(currbh == NULL || currbh->b_page == NULL);
-        lock_buffer(currbh);
-        crc32 = luci_compute_page_cksum(currbh->b_page, 0, PAGE_SIZE, ~0U);
-        p->key.checksum = crc32;
-        memcpy((char*)p->p, (char*)&p->key, sizeof(blkptr));
+        if (luci_bmap_track_stale(inode, currbh) < 0)
+            need_flush = true;
         mark_buffer_dirty(currbh);
-        unlock_buffer(currbh);
-        luci_info("%s meta cksum, inode :%lu i_block :%lu depth :%u bp {%u/0x%x}",
-                  "updated",
+        luci_info("%s meta cksum, inode :%lu i_block :%lu depth :%u bp {%u}",
+                  "deferred",
                   inode->i_ino,
                   i_block,
                   depth,
-                  p->key.blockno,
-                  p->key.checksum);
+                  p->key.blockno);
     }
+
+    // could not pin stale blocks, propagate now
+    if (need_flush)
+        __luci_bmap_flush_cksum(inode, 0);
+
     // since modifications propagate till root indices which are part of inode.
     mark_inode_dirty(inode);
     return 0;
@@ -228,10 +341,16 @@ luci_check_bmap_index_cksum(struct inode *inode,
 
     BUG_ON(bh == NULL || bh->b_page == NULL || bh->b_page->mapping == NULL);
 
+    // contents already matched parent checksum since last read from disk
+    if (buffer_verified(bh)) {
+        atomic64_inc(&meta_csum_skipped);
+        return 0;
+    }
+
     lock_buffer(bh);
 
-    if (buffer_dirty(bh) || !bp->checksum) {
-        luci_info("bh is dirty or has zero csum, cannot verify csum");
+    if (buffer_dirty(bh) || buffer_csum_stale(bh) || !bp->checksum) {
+        luci_info("bh is dirty, stale or has zero csum, cannot verify csum");
         goto exit;
     }
 
@@ -260,7 +379,9 @@ luci_check_bmap_index_cksum(struct inode *inode,
                  crc32,
                  buffer_dirty(bh),
                  PageDirty(bh->b_page));
-    } else
+    } else {
+        set_buffer_verified(bh);
+        atomic64_inc(&meta_csum_verified);
         luci_info("meta csum OK, inode :%lu depth :%u/%u bp {%u/0x%x},"
                   "PageDirty :%d/%d",
                  inode->i_ino,
@@ -270,6 +391,7 @@ luci_check_bmap_index_cksum(struct inode *inode,
                  bp->checksum,
                  buffer_dirty(bh),
                  PageDirty(bh->b_page));
+    }
 
 exit:
     unlock_buffer(bh);
@@ -280,7 +402,7 @@ exit:
  * Description : calculate block map indices given a file offset
  *
  */
-static int
+int
 luci_calculate_bmap_indices(struct inode *inode,
                             long i_block,
                             long path[LUCI_MAX_DEPTH],
@@ -346,6 +468,30 @@ done:
     return n;
 }
 
+/*
+ * Issue readahead for indirect blocks following index in a parent indirect
+ * block. Siblings under a double or triple indirect block are likely to be
+ * walked next during sequential access.
+ */
+static void
+luci_bmap_readahead(struct super_block *sb,
+                    struct buffer_head *parent_bh,
+                    long index)
+{
+    long i, end;
+    struct blk_plug plug;
+    blkptr *bp = (blkptr *)parent_bh->b_data;
+
+    end = min_t(long, index + 1 + LUCI_BMAP_RA_BLOCKS, LUCI_ADDR_PER_BLOCK(sb));
+
+    blk_start_plug(&plug);
+    for (i = index + 1; i < end; i++) {
+        if (bp[i].blockno)
+            sb_breadahead(sb, bp[i].blockno);
+    }
+    blk_finish_plug(&plug);
+}
+
 /*
  * Description : walk an inode block-map
  *
@@ -378,7 +524,7 @@ luci_walk_bmap(struct inode *inode,
 
     // indirect block
     if (depth > 1) {
-        p->bh = sb_bread(sb, p->key.blockno);
+        p->bh = luci_sb_bread(sb, p->key.blockno);
         if (p->bh == NULL)
                 panic("metadata read error, inode :%lu ipath[depth=%d] %u",
                       inode->i_ino, depth, p->key.blockno);
@@ -410,7 +556,11 @@ luci_walk_bmap(struct inode *inode,
         if ((i + 1 == depth) && skip_leaf)
             break;
 
-        p->bh = sb_bread(sb, p->key.blockno);
+        // cold indirect block, prefetch its siblings
+        if ((i + 1 < depth) && !luci_sb_cached(sb, p->key.blockno))
+            luci_bmap_readahead(sb, bh, *ipaths);
+
+        p->bh = luci_sb_bread(sb, p->key.blockno);
         if (p->bh == NULL) {
             panic("metadata read error, inode :%lu ipath[depth=%d] %u",
                    inode->i_ino, depth, p->key.blockno);
@@ -488,6 +638,7 @@ luci_bmap_allocate_entry(struct inode *inode,
     ichain[curr_level].key.checksum =
             luci_compute_page_cksum(currbh->b_page, 0, PAGE_SIZE, ~0U);
     ichain[curr_level].bh = currbh;
+    set_buffer_verified(currbh);
 
     unlock_buffer(currbh);
 
@@ -674,6 +825,9 @@ luci_get_block(struct inode *inode,
 
     BUG_ON(bh_result == NULL);
 
+    if (luci_has_extents(inode))
+        return luci_extent_get_block(inode, iblock, bh_result, flags);
+
     memset((char*)ipaths, 0, sizeof(long)*LUCI_MAX_DEPTH);
     memset((char*)ichain, 0, sizeof(Indirect)*LUCI_MAX_DEPTH);
 
@@ -852,11 +1006,17 @@ luci_bmap_fetch_L0bp(struct inode *inode,
                      unsigned long i_block)
 {
     blkptr bp;
+    unsigned long gen;
     struct buffer_head bh;
 
     memset((char*)&bp, 0, sizeof(blkptr));
     memset((char*)&bh, 0, sizeof(struct buffer_head));
 
+    if (luci_bmap_cache_lookup(inode, i_block, &bp))
+        return bp;
+
+    gen = luci_bmap_cache_gen(inode);
+
     bh.b_state = BH_PrivateStart;
     bh.b_data = (void *)&bp.checksum;
     if (luci_get_block(inode, i_block, &bh, COMPR_BLK_INFO) < 0)
@@ -870,40 +1030,158 @@ luci_bmap_fetch_L0bp(struct inode *inode,
         if (bh.b_state & BH_PrivateStart)
             bp.flags = LUCI_COMPR_FLAG;
         luci_dump_blkptr(inode, i_block, &bp);
+        luci_bmap_cache_populate(inode, i_block, &bp, gen);
     }
     return bp;
 }
 
-// passthrough bp info to bmap via bh entry
+// update L0 block ptr slot, same layout as the COW path in luci_get_block
+static void
+luci_bmap_set_L0bp(blkptr *slot, blkptr *bp)
+{
+    memset((char *)slot, 0, sizeof(blkptr));
+    slot->blockno = bp->blockno;
+    slot->checksum = bp->checksum;
+    if (bp->flags == LUCI_COMPR_FLAG) {
+        slot->flags |= LUCI_COMPR_FLAG;
+        slot->length = (unsigned short) bp->length;
+    }
+}
+
+// cache bp the way luci_bmap_fetch_L0bp reports it
+static void
+luci_bmap_cache_L0bp(struct inode *inode, unsigned long i_block, blkptr *bp)
+{
+    blkptr cached;
+
+    memset((char*)&cached, 0, sizeof(blkptr));
+    cached.blockno = bp->blockno;
+    cached.checksum = bp->checksum;
+    if (bp->flags == LUCI_COMPR_FLAG) {
+        cached.flags = LUCI_COMPR_FLAG;
+        cached.length = bp->length;
+    } else
+        cached.length = LUCI_BLOCK_SIZE(inode->i_sb);
+    luci_bmap_cache_update(inode, i_block, &cached);
+}
+
+/*
+ * Insert nr consecutive L0 block pointers starting at file block i_block.
+ *
+ * Pointers sharing an L1 block are installed with a single bmap walk, and
+ * the indirect path checksums are propagated once per L1 block instead of
+ * once per pointer.
+ */
 int
-luci_bmap_insert_L0bp(struct inode *inode,
-                      unsigned long i_block,
-                      blkptr *bp)
+luci_bmap_insert_L0bps(struct inode *inode,
+                       unsigned long i_block,
+                       blkptr bp[],
+                       unsigned nr)
 {
-    int ret;
-    struct buffer_head bh;
+    int err = 0;
+    unsigned i;
     struct super_block *sb = inode->i_sb;
+    struct luci_inode_info *li = LUCI_I(inode);
 
-    // sanity
-    BUG_ON(bp->blockno > blkdev_max_block(sb->s_bdev));
+    BUG_ON(!S_ISREG(inode->i_mode));
 
-    memset((char*)&bh, 0, sizeof(struct buffer_head));
-    bh.b_blocknr = bp->blockno;
-    bh.b_data = (void *)&bp->checksum;
+    // sanity
+    for (i = 0; i < nr; i++)
+        BUG_ON(bp[i].blockno > blkdev_max_block(sb->s_bdev));
 
-    if (bp->flags == LUCI_COMPR_FLAG) {
-        bh.b_size = (size_t) bp->length;
-        bh.b_state = BH_PrivateStart; // flag for compressed block
+    if (luci_has_extents(inode)) {
+        err = luci_extent_insert_L0bps(inode, i_block, bp, nr);
+        for (i = 0; !err && i < nr; i++)
+            luci_bmap_cache_L0bp(inode, i_block + i, &bp[i]);
+        goto done;
     }
 
-    ret = luci_get_block(inode,
-                         i_block,
-                         &bh,
-                         COMPR_BLK_UPDATE | COMPR_BLK_INSERT);
-    if (ret < 0)
-        luci_err_inode(inode, "error inserting leaf i_block :%lu", i_block);
+    mutex_lock(&li->truncate_mutex);
 
-    return ret;
+    i = 0;
+    while (i < nr) {
+        int depth, boundary = 0;
+        unsigned j, run;
+        Indirect *partial, *leaf;
+        struct buffer_head *parent_bh;
+        unsigned long iblock = i_block + i;
+        long ipaths[LUCI_MAX_DEPTH];
+        Indirect ichain[LUCI_MAX_DEPTH];
+
+        memset((char*)ipaths, 0, sizeof(long)*LUCI_MAX_DEPTH);
+        memset((char*)ichain, 0, sizeof(Indirect)*LUCI_MAX_DEPTH);
+
+        depth = luci_calculate_bmap_indices(inode, iblock, ipaths, &boundary);
+        if (depth < 0) {
+            err = -EIO;
+            break;
+        }
+
+        partial = luci_walk_bmap(inode, depth, ipaths, ichain, &err,
+                                 COMPR_BLK_INSERT);
+        if (err) {
+            luci_err_inode(inode, "bmap path error %d", err);
+            break;
+        }
+
+        // pointers installed under the current L1 block
+        run = min_t(unsigned, nr - i, boundary);
+        BUG_ON(run == 0);
+
+        // allocate and link missing indirect blocks, an empty slot under
+        // an existing L1 block needs nothing but the write below
+        leaf = &ichain[depth - 1];
+        if (partial && partial != leaf) {
+            struct buffer_head bh;
+
+            memset((char*)&bh, 0, sizeof(struct buffer_head));
+            bh.b_blocknr = bp[i].blockno;
+            bh.b_data = (void *)&bp[i].checksum;
+            if (bp[i].flags == LUCI_COMPR_FLAG) {
+                bh.b_size = (size_t) bp[i].length;
+                bh.b_state = BH_PrivateStart; // flag for compressed block
+            }
+            err = luci_bmap_insert_entry(inode,
+                                         ichain,
+                                         ipaths,
+                                         partial - ichain,
+                                         depth,
+                                         iblock,
+                                         &bh);
+            BUG_ON(err);
+        }
+
+        // whole run, slot 0 included, is installed under the L1 lock
+        parent_bh = (depth > 1) ? ichain[depth - 2].bh : NULL;
+        if (parent_bh)
+            lock_buffer(parent_bh);
+        for (j = 0; j < run; j++)
+            luci_bmap_set_L0bp(leaf->p + j, &bp[i + j]);
+        if (parent_bh)
+            unlock_buffer(parent_bh);
+
+        err = luci_update_bmap_path_cksum(inode, ichain, depth, iblock);
+
+        for (partial = ichain + depth - 1; partial >= ichain; partial--) {
+            if (partial->bh != NULL)
+                brelse(partial->bh);
+        }
+
+        for (j = 0; j < run; j++)
+            luci_bmap_cache_L0bp(inode, iblock + j, &bp[i + j]);
+
+        luci_info_inode(inode, "inserted %u L0 bps from i_block :%lu", run,
+                        iblock);
+        i += run;
+    }
+
+    mutex_unlock(&li->truncate_mutex);
+done:
+    if (err < 0) {
+        luci_err_inode(inode, "error inserting leaf i_block :%lu", i_block + i);
+        luci_bmap_cache_invalidate(inode);
+    }
+    return err;
 }
 
 static int
@@ -988,12 +1266,18 @@ luci_bmap_delete_extent_bp(struct inode *inode, struct blkptr *bp)
         return ret;
 }
 
+/*
+ * Map the extent of page to bp_new and free the blocks it replaces. delta
+ * returns the change in physical size. On error the old blocks are kept,
+ * the range may be partly remapped and freeing either set is unsafe.
+ */
 int
 luci_bmap_update_extent_bp(struct page *page,
                            struct inode *inode,
-                           blkptr bp_new [])
+                           blkptr bp_new [],
+                           int *delta)
 {
-    int delta;
+    int err;
     unsigned long extent;
     unsigned long i, b_i, b_start, b_end, blockno = 0;
     blkptr bp_old[EXTENT_NRBLOCKS_MAX];
@@ -1007,13 +1291,17 @@ luci_bmap_update_extent_bp(struct page *page,
 
     luci_extent_range(page, &b_start, &b_end);
 
-    // update block pointer
+    // update block pointers, single bmap walk per L1 block
+    err = luci_bmap_insert_L0bps(inode, b_start, bp_new, b_end - b_start + 1);
+    if (err < 0) {
+        luci_err_inode(inode, "failed to update bp for extent %lu, err :%d",
+                       extent, err);
+        return err;
+    }
+
     for (i = 0, b_i = b_start; b_i <= b_end; b_i++, i++) {
         int flags;
 
-        if (luci_bmap_insert_L0bp(inode, b_i, &bp_new[i]) < 0)
-            BUG();
-
         luci_info_inode(inode, "updated bp %u-%x-%u(%u)-0x%x for file block %lu"
                                " extent %lu",
                                 bp_new[i].blockno,
@@ -1039,9 +1327,9 @@ luci_bmap_update_extent_bp(struct page *page,
         }
     }
 
-    delta = luci_account_delta(bp_old, bp_new, i);
-    luci_dbg_inode(inode, "delta bytes :%d", delta);
-    return delta;
+    *delta = luci_account_delta(bp_old, bp_new, i);
+    luci_dbg_inode(inode, "delta bytes :%d", *delta);
+    return 0;
 }
 
 int
@@ -1113,6 +1401,70 @@ Egdp:
     return ERR_PTR(-EIO);
 }
 
+// inode table block holding an inode, 0 for a bad inode number
+unsigned long
+luci_inode_block(struct super_block *sb, ino_t ino)
+{
+    unsigned long offset;
+    struct luci_group_desc *gdp;
+
+    if ((ino != LUCI_ROOT_INO && ino < LUCI_FIRST_INO(sb)) ||
+         ino > le32_to_cpu(LUCI_SB(sb)->s_lsb->s_inodes_count))
+        return 0;
+
+    gdp = luci_get_group_desc(sb, (ino - 1) / LUCI_INODES_PER_GROUP(sb), NULL);
+    if (!gdp)
+        return 0;
+
+    offset = ((ino - 1) % LUCI_INODES_PER_GROUP(sb)) * LUCI_INODE_SIZE(sb);
+    return le32_to_cpu(gdp->bg_inode_table) +
+        (offset >> LUCI_BLOCK_SIZE_BITS(sb));
+}
+
+/*
+ * Detect igets walking inode numbers upwards, as stat after readdir does
+ * for inodes allocated together, and keep a window of inode table blocks
+ * read ahead of them. The next window is issued once the walk gets half
+ * way through the current one, so reads overlap the igets. The state is
+ * per super block and unlocked, racing igets only cost a wasted or missed
+ * readahead.
+ */
+static void
+luci_iget_readahead(struct super_block *sb, unsigned long ino,
+                    unsigned long block, unsigned long table_end)
+{
+    unsigned long start, end;
+    struct blk_plug plug;
+    struct luci_sb_info *sbi = LUCI_SB(sb);
+
+    // next inode within a couple of table blocks of the last one
+    if (ino > sbi->s_iget_last_ino &&
+        ino - sbi->s_iget_last_ino <= 2 * sbi->s_inodes_per_block)
+        sbi->s_iget_seq++;
+    else
+        sbi->s_iget_seq = 0;
+    sbi->s_iget_last_ino = ino;
+
+    if (sbi->s_iget_seq < LUCI_IGET_SEQ_MIN)
+        return;
+
+    // continue the current window, unless it belongs to another walk
+    start = sbi->s_iget_ra_end;
+    if (start <= block || start > block + 1 + LUCI_INODE_RA_BLOCKS)
+        start = block + 1;
+    else if (start > block + LUCI_INODE_RA_BLOCKS / 2)
+        return;
+
+    end = min(block + 1 + LUCI_INODE_RA_BLOCKS, table_end);
+    if (start >= end)
+        return;
+
+    blk_start_plug(&plug);
+    for (sbi->s_iget_ra_end = end; start < end; start++)
+        sb_breadahead(sb, start);
+    blk_finish_plug(&plug);
+}
+
 void luci_set_inode_flags(struct inode *inode)
 {
         unsigned int flags = LUCI_I(inode)->i_flags;
@@ -1194,6 +1546,8 @@ luci_iget(struct super_block *sb, unsigned long ino) {
         (LUCI_SB(sb)->s_inode_size);
     block_no = gdesc->bg_inode_table +
         (offset >> sb->s_blocksize_bits);
+    luci_iget_readahead(sb, ino, block_no,
+        gdesc->bg_inode_table + LUCI_SB(sb)->s_itb_per_group);
     if (!(bh = sb_bread(sb, block_no))) {
         iget_failed(inode);
         return (ERR_PTR(-EIO));
@@ -1249,7 +1603,9 @@ luci_iget(struct super_block *sb, unsigned long ino) {
         luci_dbg_inode(inode, "i_data[%d]:%u", n, li->i_data[n].blockno);
     }
 
-    err = luci_bmap_scan_metacsum(inode);
+    // extent tree nodes are loaded on first access
+    if (!luci_has_extents(inode))
+        err = luci_bmap_scan_metacsum(inode);
     if(err < 0) {
         iget_failed(inode);
         return ERR_PTR(err);
@@ -1294,6 +1650,9 @@ luci_write_inode_raw(struct inode *inode, int do_sync)
     if (IS_ERR(raw_inode))
         return -EIO;
 
+    // bring indirect block checksums in i_data up to date
+    luci_bmap_flush_cksum(inode, do_sync);
+
     /* For fields not not tracking in the in-memory inode,
      * initialise them to zero for new inodes. */
     if (ei->i_state & LUCI_STATE_NEW)
@@ -1602,7 +1961,10 @@ static int luci_debugfs_show_stats(struct seq_file *m, void *data)
                       "setattr   in   :%ld\n"
                       "setattr   done :%ld\n"
                       "getattr   in   :%ld\n"
-                      "getattr   done :%ld\n",
+                      "getattr   done :%ld\n"
+                      "meta csum verified :%ld\n"
+                      "meta csum skipped  :%ld\n"
+                      "meta csum flushed  :%ld\n",
                       atomic64_read(&readfile_in),
                       atomic64_read(&readfile_out),
                       atomic64_read(&writefile_in),
@@ -1612,7 +1974,10 @@ static int luci_debugfs_show_stats(struct seq_file *m, void *data)
                       atomic64_read(&setattr_in),
                       atomic64_read(&setattr_out),
                       atomic64_read(&getattr_in),
-                      atomic64_read(&getattr_out));
+                      atomic64_read(&getattr_out),
+                      atomic64_read(&meta_csum_verified),
+                      atomic64_read(&meta_csum_skipped),
+                      atomic64_read(&meta_csum_flushed));
         return 0;
 }
 
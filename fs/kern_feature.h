@@ -16,6 +16,10 @@
     #define HAVE_BIO_ITER
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0))
+    #define HAVE_SHRINKER_COUNT_SCAN
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0))
     #include <linux/hrtimer.h>
     #define HAVE_IOV_ITER
@@ -40,6 +44,11 @@
     #define NEW_BIO_SUBMIT
 #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0))
+    #define inode_lock(inode)   mutex_lock(&(inode)->i_mutex)
+    #define inode_unlock(inode) mutex_unlock(&(inode)->i_mutex)
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0))
     #include <linux/aio.h>
     #include <linux/pagemap.h>
@@ -207,6 +207,11 @@ struct luci_sb_info {
 
     // Work item for monitoring fragmentation
     struct delayed_work blockgroup_work;
+
+    // sequential luci_iget detection, unlocked hints
+    unsigned long s_iget_last_ino;
+    unsigned long s_iget_seq;
+    unsigned long s_iget_ra_end;
 };
 
 /*
@@ -297,6 +302,8 @@ struct luci_inode {
     } osd2;             /* OS dependent 2 */
 };
 
+struct btree_root_node;
+
 /*
  * second extended file system inode data in memory
  */
@@ -347,6 +354,23 @@ struct luci_inode_info {
      * luci_reserve_window_node.
      */
     struct mutex truncate_mutex;
+    /* L0 block pointer cache, keyed by file block */
+    struct radix_tree_root i_bmap_cache;
+    spinlock_t i_bmap_cache_lock;
+    struct list_head i_bmap_cache_list;
+    unsigned long i_bmap_cache_nr;
+    unsigned long i_bmap_cache_gen;
+    /* indirect blocks with deferred checksums, pinned until writeback */
+    struct radix_tree_root i_bmap_stale;
+    /* extent tree root for LUCI_EXTENTS_FL files, loaded on first use */
+    struct btree_root_node *i_extent_root;
+    /* largest free dentry gap of each directory page, see dir.c */
+    __u16 *i_dir_free;
+    unsigned long i_dir_free_nr;
+    /* new position of each page's entries after the last compaction */
+    loff_t *i_dir_remap;
+    unsigned long i_dir_remap_nr;
+    unsigned long i_dir_gen;
     struct inode vfs_inode;
     struct list_head i_orphan;  /* unlinked but open inodes */
 };
@@ -395,6 +419,40 @@ struct luci_dir_entry_2 {
     char    name[];         /* File name, up to LUCI_NAME_LEN */
 };
 
+/*
+ * Hashed directory index, see dir_index.c. Page 0 of an indexed
+ * directory holds "." and a ".." entry spanning the rest of the page,
+ * the root info and the root entries follow the ".." name. Interior
+ * index pages start with an empty entry spanning the page. Linear
+ * scans skip both, so the leaves read as an ordinary directory.
+ *
+ * In every index page the hash of entries[0] holds the count and limit
+ * and its block the leftmost child. Blocks are directory page numbers.
+ */
+struct luci_dx_root_info {
+    __le32  reserved_zero;
+    __u8    hash_version;
+    __u8    info_length;    /* 8 */
+    __u8    indirect_levels;
+    __u8    unused_flags;
+};
+
+struct luci_dx_entry {
+    __le32  hash;
+    __le32  block;
+};
+
+struct luci_dx_countlimit {
+    __le16  limit;
+    __le16  count;
+};
+
+#define LUCI_HASH_LEGACY        0
+#define LUCI_HASH_HALF_MD4      1
+#define LUCI_HASH_TEA           2
+
+#define LUCI_DX_MAX_LEVELS      2
+
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
  * other bits are reserved for now.
@@ -507,9 +565,11 @@ struct luci_mount_options {
 #define LUCI_MOUNT_GRPQUOTA     0x040000  /* group quota */
 #define LUCI_MOUNT_RESERVATION  0x080000  /* Preallocation */
 #define LUCI_MOUNT_EXTENTS      0x100000  /* Extent allocation */
+#define LUCI_MOUNT_DIR_INDEX    0x200000  /* Hash index large directories */
 
 #define clear_opt(o, opt)       o &= ~opt
 #define set_opt(o, opt)         o |= opt
+#define test_opt(o, opt)        ((o) & (opt))
 
 /*
  * Inode i_flags
@@ -536,6 +596,7 @@ struct luci_mount_options {
 #define LUCI_DIRSYNC_FL                 FS_DIRSYNC_FL   /* dirsync behaviour (directories only) */
 #define LUCI_TOPDIR_FL                  FS_TOPDIR_FL    /* Top of directory hierarchies*/
 #define LUCI_RESERVED_FL                FS_RESERVED_FL  /* reserved for ext2 lib */
+#define LUCI_EXTENTS_FL                 FS_EXTENT_FL    /* file blocks mapped by extent tree */
 
 #define LUCI_FL_USER_VISIBLE            FS_FL_USER_VISIBLE      /* User visible flags */
 #define LUCI_FL_USER_MODIFIABLE         FS_FL_USER_MODIFIABLE   /* User modifiable flags */
@@ -622,6 +683,9 @@ static inline __u32 luci_mask_flags(umode_t mode, __u32 flags)
 #define LUCI_SUPER_MAGIC        0xEF53
 #define LUCI_LINK_MAX           32000
 #define LUCI_MAX_DEPTH          4
+#define LUCI_BMAP_RA_BLOCKS     8   /* indirect block readahead window */
+#define LUCI_INODE_RA_BLOCKS    16  /* inode table readahead window */
+#define LUCI_IGET_SEQ_MIN       4   /* sequential igets before readahead */
 
 #define LUCI_SB_MAGIC_OFFSET    0x38
 #define LUCI_SB_BLOCKS_OFFSET   0x04
@@ -666,6 +730,62 @@ luci_bmap_add_chain(Indirect *p, struct buffer_head *bh, blkptr *v)
     memcpy((char*)&p->key, (char*)v, sizeof(blkptr));
 }
 
+/*
+ * Private buffer state bits for metadata buffers (bitmaps, indirect blocks).
+ * BH_Verified is set once the buffer contents are known to match the
+ * checksum stored by the parent, either because we verified it after a
+ * read from disk or because we computed the checksum ourselves on update.
+ */
+enum luci_bh_state_bits {
+    BH_Verified = BH_PrivateStart,
+    BH_CsumStale,   /* indirect block modified, parent checksum deferred */
+    BH_Released,    /* extent tree node freed, must not be written back */
+};
+
+BUFFER_FNS(Verified, verified)
+BUFFER_FNS(CsumStale, csum_stale)
+TAS_BUFFER_FNS(CsumStale, csum_stale)
+BUFFER_FNS(Released, released)
+
+/*
+ * Read a metadata block. The verified state is dropped whenever buffer
+ * contents have to be fetched from disk, so checksums are verified once
+ * per read and not on every access of a cached buffer.
+ */
+static inline struct buffer_head *
+luci_sb_bread(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh = sb_getblk(sb, block);
+
+    if (bh == NULL || buffer_uptodate(bh))
+        return bh;
+
+    lock_buffer(bh);
+    // somebody else may have read it while we waited for the lock
+    if (buffer_uptodate(bh)) {
+        unlock_buffer(bh);
+        return bh;
+    }
+    clear_buffer_verified(bh);
+    if (bh_submit_read(bh) < 0) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+// check if a metadata block is uptodate in buffer cache
+static inline bool
+luci_sb_cached(struct super_block *sb, sector_t block)
+{
+    bool uptodate;
+    struct buffer_head *bh = sb_find_get_block(sb, block);
+
+    uptodate = (bh != NULL) && buffer_uptodate(bh);
+    brelse(bh);
+    return uptodate;
+}
+
 static inline struct luci_sb_info *LUCI_SB(struct super_block *sb)
 {
     return sb->s_fs_info;
@@ -690,6 +810,12 @@ luci_inode_info *LUCI_I(struct inode *inode)
     return container_of(inode, struct luci_inode_info, vfs_inode);
 }
 
+static inline bool
+luci_has_extents(struct inode *inode)
+{
+    return S_ISREG(inode->i_mode) && (LUCI_I(inode)->i_flags & LUCI_EXTENTS_FL);
+}
+
 static inline unsigned
 luci_chunk_size(struct inode *inode)
 {
@@ -732,6 +858,23 @@ void luci_free_super(struct super_block * sb);
 void luci_super_update_csum(struct super_block *sb);
 
 /* dir.c */
+void luci_dir_readahead(struct inode *dir, struct file_ra_state *ra,
+                        struct file *file, unsigned long n);
+unsigned luci_dir_page_free(struct inode *dir, struct page *page);
+void luci_dir_free_build(struct inode *dir);
+unsigned long luci_dir_free_find(struct inode *dir, unsigned len, unsigned long start);
+void luci_dir_free_update(struct inode *dir, unsigned long n, unsigned gap);
+void luci_dir_free_note(struct inode *dir, unsigned long n, unsigned gap);
+void luci_dir_free_release(struct inode *dir);
+void *luci_dir_map_alloc(size_t size);
+void luci_dir_map_free(void *map);
+
+/* dir_compact.c */
+#define LUCI_IOC_DIR_COMPACT    _IO('l', 1)
+
+int luci_dir_compact(struct inode *dir);
+bool luci_dir_compact_remap(struct inode *dir, unsigned long gen, loff_t *pos);
+void luci_dir_compact_release(struct inode *dir);
 
 /* namei.c */
 
@@ -750,6 +893,22 @@ struct page *luci_get_page(struct inode *dir, unsigned long n);
 int luci_prepare_chunk(struct page *page, loff_t pos, unsigned len);
 int luci_commit_chunk(struct page *page, loff_t pos, unsigned len);
 unsigned luci_last_byte(struct inode *inode, unsigned long page_nr);
+struct luci_dir_entry_2 *luci_find_entry_page(struct inode *dir, struct page *page,
+    unsigned long n, const struct qstr *child);
+int luci_add_entry_page(struct inode *dir, struct page *page,
+    struct dentry *dentry, struct inode *inode);
+
+/* dir_index.c */
+bool luci_dx_dir(struct inode *dir);
+bool luci_dx_can_index(struct inode *dir);
+struct luci_dir_entry_2 *luci_dx_find_entry(struct inode *dir,
+    const struct qstr *child, struct page **res);
+int luci_dx_add_entry(struct dentry *dentry, struct inode *inode);
+int luci_dx_make_indexed(struct inode *dir);
+
+/* hash.c */
+bool luci_dx_hash_supported(int version);
+__u32 luci_dx_hash(int version, const __u32 *seed, const char *name, int len);
 
 /* inode.c */
 #define LUCI_COMPR_FLAG  0x1
@@ -772,14 +931,33 @@ int luci_getattr(const struct path *path, struct kstat *stat, u32 request_mask,
 int luci_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat);
 #endif
 extern struct inode *luci_iget(struct super_block *sb, unsigned long ino);
+unsigned long luci_inode_block(struct super_block *sb, ino_t ino);
 extern int luci_get_block(struct inode *, sector_t, struct buffer_head *, int);
+int luci_calculate_bmap_indices(struct inode *inode, long i_block, long path[LUCI_MAX_DEPTH], int *blocks_to_boundary);
 extern blkptr luci_bmap_fetch_L0bp(struct inode *inode, unsigned long i_block);
-extern int luci_bmap_insert_L0bp(struct inode *inode, unsigned long i_block, blkptr *bp);
+extern int luci_bmap_insert_L0bps(struct inode *inode, unsigned long i_block, blkptr bp[], unsigned nr);
 int luci_write_inode_raw(struct inode *inode, int do_sync);
+void luci_bmap_flush_cksum(struct inode *inode, int do_sync);
 int luci_bmap_free_extents(struct inode *inode, blkptr extents_array[], int n_extents);
 extern void luci_set_inode_flags(struct inode *);
 extern void luci_get_inode_flags(struct luci_inode_info *);
 
+/* bmap_cache.c */
+void luci_bmap_cache_init_once(struct luci_inode_info *li);
+bool luci_bmap_cache_lookup(struct inode *inode, unsigned long i_block, blkptr *bp);
+unsigned long luci_bmap_cache_gen(struct inode *inode);
+void luci_bmap_cache_populate(struct inode *inode, unsigned long i_block, blkptr *bp, unsigned long gen);
+void luci_bmap_cache_update(struct inode *inode, unsigned long i_block, blkptr *bp);
+void luci_bmap_cache_invalidate(struct inode *inode);
+int init_luci_bmap_cache(void);
+void exit_luci_bmap_cache(void);
+
+/* extent_map.c */
+int luci_extent_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int flags);
+int luci_extent_insert_L0bps(struct inode *inode, unsigned long i_block, blkptr bp[], unsigned nr);
+int luci_extent_remove_last(struct inode *inode, unsigned long *i_block, blkptr *bp, unsigned *nr_blocks);
+void luci_extent_release(struct inode *inode, bool destroy);
+
 /* crc32 */
 u32 luci_compute_data_cksum(void *addr, size_t length, u32 crc_seed);
 u32 luci_compute_page_cksum(struct page *page, off_t off, size_t length, u32 crc_seed);
@@ -832,7 +1010,7 @@ int luci_write_extents(struct address_space *mapping,
     struct writeback_control *wbc);
 int luci_read_extent(struct page * page, blkptr *bp);
 
-int luci_bmap_update_extent_bp(struct page *page, struct inode *inode, blkptr bp[]);
+int luci_bmap_update_extent_bp(struct page *page, struct inode *inode, blkptr bp[], int *delta);
 struct pagevec *luci_scan_pgtree_dirty_pages(struct address_space *mapping,
                                              struct page *pageout,
                                              pgoff_t *index,
@@ -840,6 +1018,8 @@ struct pagevec *luci_scan_pgtree_dirty_pages(struct address_space *mapping,
 int luci_write_extents(struct address_space *mapping,
                        struct writeback_control *wbc);
 
+long luci_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 extern const struct inode_operations luci_file_inode_operations;
 extern const struct file_operations luci_file_operations;
 extern const struct inode_operations luci_dir_inode_operations;
@@ -881,6 +1061,7 @@ typedef struct debugfs {
     u64 avg_io_lat; //ns
     struct dentry *dirent_io_lat;
     struct dentry *dirent_iostat;
+    struct dentry *dirent_bmap_cache;
     struct dentry *dirent_frags;
 }debugfs_t;
 
@@ -164,100 +164,64 @@ luci_track_size(struct inode * inode)
       inode->i_size, size, inode->i_blocks);
 }
 
-static int
-luci_add_link(struct dentry *dentry, struct inode *inode) {
+/*
+ * Adds a dentry for inode to a directory page if it has a slot large
+ * enough, returns -ENOSPC otherwise. Takes and drops the page lock.
+ */
+int
+luci_add_entry_page(struct inode *dir, struct page *page,
+                    struct dentry *dentry, struct inode *inode)
+{
     loff_t pos;  // offset in page with empty dentry
-    struct inode *dir;
     int err, rec_len = 0, new_dentry_len;
-    struct page *page = NULL;
-    unsigned long n, npages;
+    char *kaddr, *page_boundary;
     struct luci_dir_entry_2 *de = NULL;  //dentry iterator
     unsigned chunk_size = luci_chunk_size(inode);
 
-    BUG_ON(inode->i_ino == 0); // sanity check for new inode
-    dir = DENTRY_INODE(dentry->d_parent);
-    npages = dir_pages(dir);
-
     new_dentry_len = LUCI_DIR_REC_LEN(dentry->d_name.len);
-    luci_dbg("dentry add, inode :%lu (%s) npages :%lu len :%d",
-              dir->i_ino,
-              dentry->d_name.name,
-              npages,
-              new_dentry_len);
 
-    for (n = 0; n < npages; n++) {
-        char *kaddr, *page_boundary;
-
-        page = luci_get_page(dir, n);
-        if (IS_ERR(page)) {
-            err = PTR_ERR(page);
-            luci_err_inode(inode, "error dentry page %lu :%d", n, err);
-            return err;
+    lock_page(page);
+    kaddr = page_address(page);
+    page_boundary = kaddr + PAGE_SIZE - new_dentry_len; // dentry not cross page boundary
+    de = (struct luci_dir_entry_2*)((char*)kaddr);
+    while ((char*)de <= page_boundary) {
+        // dentry rolls over to next block, terminal dentry in this block
+        if (de->rec_len == 0) {
+            de->inode = 0;
+            de->rec_len = luci_rec_len_to_disk(chunk_size);
+            goto gotit;
         }
 
-        lock_page(page);
-        kaddr = page_address(page);
-        page_boundary = kaddr + PAGE_SIZE - new_dentry_len; // dentry not cross page boundary
-        de = (struct luci_dir_entry_2*)((char*)kaddr);
-        while ((char*)de <= page_boundary) {
-	    // dentry rolls over to next block, terminal dentry in this block
-            if (de->rec_len == 0) {
-                de->inode = 0;
-                de->rec_len = luci_rec_len_to_disk(chunk_size);
-                goto gotit;
-            }
-
-            // entry already exists
-            if (luci_match(dentry->d_name.len, dentry->d_name.name, de)) {
-                err = -EEXIST;
-                luci_err("failed to add link, file exists %s",
-		   dentry->d_name.name);
-                goto outunlock;
-            }
-
-            // offset to next valid dentry from current de
-            rec_len = luci_rec_len_from_disk(de->rec_len);
-            luci_dbg("dname :%s inode :%u next_len :%u",
-                      de->name,
-                      de->inode,
-                      rec_len);
+        // entry already exists
+        if (luci_match(dentry->d_name.len, dentry->d_name.name, de)) {
+            err = -EEXIST;
+            luci_err("failed to add link, file exists %s",
+               dentry->d_name.name);
+            goto outunlock;
+        }
 
-	    // if new dentry record can be acommodated in this block
-            if (!de->inode && rec_len >= new_dentry_len)
-               goto gotit;
+        // offset to next valid dentry from current de
+        rec_len = luci_rec_len_from_disk(de->rec_len);
+        luci_dbg("dname :%s inode :%u next_len :%u",
+                  de->name,
+                  de->inode,
+                  rec_len);
 
-            if (rec_len >= (LUCI_DIR_REC_LEN(de->name_len) +
-               LUCI_DIR_REC_LEN(dentry->d_name.len)))
-               goto gotit;
+        // if new dentry record can be acommodated in this block
+        if (!de->inode && rec_len >= new_dentry_len)
+           goto gotit;
 
-            de = (struct luci_dir_entry_2*)((char*)de + rec_len);
-        }
+        if (rec_len >= (LUCI_DIR_REC_LEN(de->name_len) +
+           LUCI_DIR_REC_LEN(dentry->d_name.len)))
+           goto gotit;
 
-        luci_put_page(page);
-        unlock_page(page);
-        luci_dbg("dentry page %ld nr_pages :%ld ", n, npages);
-    }
-
-    // extend the directory to accomodate new dentry
-    page = luci_get_page(dir, n);
-    if (IS_ERR(page)) {
-       err = -ENOSPC;
-       luci_err_inode(inode, "failed to adding new link entry, no space");
-       luci_err_inode(inode, "error dentry page %lu :%ld", n, PTR_ERR(page));
-       return err;
+        de = (struct luci_dir_entry_2*)((char*)de + rec_len);
     }
-
-    lock_page(page);
-    de = (struct luci_dir_entry_2*) page_address(page);
-    de->inode = 0;
-    de->rec_len = luci_rec_len_to_disk(chunk_size);
-    luci_info_inode(dir, "allocated page %lu(%p) for new dentry", n, (char*)de);
-    goto gotit;
+    unlock_page(page);
+    return -ENOSPC;
 
 outunlock:
-    BUG_ON(page == NULL);
     unlock_page(page);
-    luci_put_page(page);
     return err;
 
 gotit:
@@ -265,8 +229,8 @@ gotit:
     // Previous entry have to be modified
     if (de->inode) {
         struct luci_dir_entry_2 * de_new = (struct luci_dir_entry_2*)
-	   ((char*) de + LUCI_DIR_REC_LEN(de->name_len));
-	de_new->inode = inode->i_ino;
+           ((char*) de + LUCI_DIR_REC_LEN(de->name_len));
+        de_new->inode = inode->i_ino;
         de->rec_len = luci_rec_len_to_disk(LUCI_DIR_REC_LEN(de->name_len));
         de_new->rec_len = luci_rec_len_to_disk(rec_len - de->rec_len);
         de = de_new;
@@ -289,9 +253,6 @@ gotit:
         BUG();
     }
 
-    dir->i_mtime = dir->i_ctime = LUCI_CURR_TIME;
-    mark_inode_dirty(dir);
-
     luci_info("sucessfully inserted parent :%lu/%u dentry %s rec_len :%d "
        "next_rec :%d page :%lu pos :%llu size :%llu va :%p",
        dir->i_ino,
@@ -299,17 +260,101 @@ gotit:
        dentry->d_name.name,
        LUCI_DIR_REC_LEN(de->name_len),
        de->rec_len,
-       n,
+       page->index,
        pos,
        dir->i_size,
        page_address(page));
+    return 0;
+}
+
+static int
+luci_add_link(struct dentry *dentry, struct inode *inode) {
+    struct inode *dir;
+    int err;
+    struct page *page = NULL;
+    unsigned long n, npages;
+    unsigned len = LUCI_DIR_REC_LEN(dentry->d_name.len);
+
+    BUG_ON(inode->i_ino == 0); // sanity check for new inode
+    dir = DENTRY_INODE(dentry->d_parent);
+    npages = dir_pages(dir);
+
+    luci_dbg("dentry add, inode :%lu (%s) npages :%lu len :%d",
+              dir->i_ino,
+              dentry->d_name.name,
+              npages,
+              len);
+
+    if (luci_dx_dir(dir)) {
+        err = luci_dx_add_entry(dentry, inode);
+        if (err != -EINVAL)
+            goto out;
+        // bad index, the leaves still read as a linear directory
+        luci_err_inode(dir, "bad directory index, dropping it");
+        LUCI_I(dir)->i_flags &= ~LUCI_INDEX_FL;
+        mark_inode_dirty(dir);
+    }
+
+    // only visit pages the free space map says have room
+    luci_dir_free_build(dir);
+    for (n = luci_dir_free_find(dir, len, 0); n < npages;
+         n = luci_dir_free_find(dir, len, n + 1)) {
+        page = luci_get_page(dir, n);
+        if (IS_ERR(page)) {
+            err = PTR_ERR(page);
+            luci_err_inode(inode, "error dentry page %lu :%d", n, err);
+            return err;
+        }
+
+        err = luci_add_entry_page(dir, page, dentry, inode);
+        if (!err || err == -ENOSPC)
+            luci_dir_free_update(dir, n, luci_dir_page_free(dir, page));
+        luci_put_page(page);
+        if (err != -ENOSPC)
+            goto out;
+        luci_dbg("dentry page %ld nr_pages :%ld ", n, npages);
+    }
+
+    // a full single page directory is indexed instead of extended
+    if (npages == 1 && luci_dx_can_index(dir)) {
+        err = luci_dx_make_indexed(dir);
+        if (!err) {
+            // indexed directories find free space through the index
+            luci_dir_free_release(dir);
+            err = luci_dx_add_entry(dentry, inode);
+            goto out;
+        }
+        if (err != -EINVAL)
+            goto out;
+    }
+
+    // extend the directory to accomodate new dentry
+    page = luci_get_page(dir, n);
+    if (IS_ERR(page)) {
+       err = -ENOSPC;
+       luci_err_inode(inode, "failed to adding new link entry, no space");
+       luci_err_inode(inode, "error dentry page %lu :%ld", n, PTR_ERR(page));
+       return err;
+    }
+
+    luci_info_inode(dir, "allocated page %lu for new dentry", n);
+    err = luci_add_entry_page(dir, page, dentry, inode);
+    if (!err)
+        luci_dir_free_update(dir, n, luci_dir_page_free(dir, page));
+    luci_put_page(page);
+
+out:
+    if (err)
+        return err;
+
+    dir->i_mtime = dir->i_ctime = LUCI_CURR_TIME;
+    mark_inode_dirty(dir);
 
 #ifdef HAVE_TRACEPOINT_ENABLED
     trace_luci_add_link_enabled()
 #endif
     trace_luci_add_link(dentry, inode);
-    luci_put_page(page);
-    return err;
+    return 0;
 }
 
 static int
@@ -348,6 +393,45 @@ luci_create(struct inode *dir,
     return 0;
 }
 
+/*
+ * Scans directory page n for child. Returns the entry, NULL if it is
+ * not in the page or ERR_PTR(-EIO) for a corrupt page.
+ */
+struct luci_dir_entry_2 *
+luci_find_entry_page(struct inode *dir, struct page *page, unsigned long n,
+                     const struct qstr *child)
+{
+    struct luci_dir_entry_2 *de, *kaddr, *limit;
+
+    kaddr = (struct luci_dir_entry_2*) page_address(page);
+    // limit takes care of page boundary issues
+    limit = (struct luci_dir_entry_2*) ((char*) kaddr +
+        luci_last_byte(dir, n) - LUCI_DIR_REC_LEN(child->len));
+    // scan dentries
+    for (de = kaddr; de <= limit; de = luci_next_entry(de)) {
+        if (de->rec_len == 0) {
+            // check page boundary
+            // Fixed an issue, where newly created dentry block was alloted
+            // to an incorrect index due to a bug in alloc branch
+            luci_err_inode(dir, "invalid zero record length found at page "
+                "%lu(%p-%p)", n, (char*)de, (char*)limit);
+            return ERR_PTR(-EIO);
+        }
+
+        if (luci_match(child->len, child->name, de)) {
+            luci_dbg("dentry found %s", child->name);
+            return de;
+        }
+
+        #ifdef DEBUG_DENTRY
+        luci_dbg("dentry name :%s, inode :%u, namelen :%u reclen :%u",
+            de->name, de->inode, de->name_len,
+            luci_rec_len_from_disk(de->rec_len));
+        #endif
+    }
+    return NULL;
+}
+
 /*
  * core function to lookup dentries
  */
@@ -357,43 +441,35 @@ luci_find_entry (struct inode * dir, const struct qstr * child,
     struct page *page = NULL;
     struct luci_dir_entry_2 *de = NULL;
     unsigned long n, npages = dir_pages(dir);
+    struct file_ra_state ra;
+
+    if (luci_dx_dir(dir)) {
+        de = luci_dx_find_entry(dir, child, res);
+        if (!IS_ERR(de))
+            return de;
+        // bad index, the leaves still read as a linear directory
+        luci_err_inode(dir, "bad directory index, scanning all pages");
+    }
 
+    // readahead window for this scan, there is no file to carry one
+    file_ra_state_init(&ra, dir->i_mapping);
     for (n = 0; n < npages; n++) {
-        struct luci_dir_entry_2 *kaddr, *limit;
         //lookup dentry page
+        luci_dir_readahead(dir, &ra, NULL, n);
         page = luci_get_page(dir, n);
         if (IS_ERR(page)) {
             luci_err_inode(dir, "bad dentry page page :%ld err:%ld",
                n, PTR_ERR(page));
-	    goto fail;
-	}
-        kaddr = (struct luci_dir_entry_2*) page_address(page);
-	// limit takes care of page boundary issues
-        limit = (struct luci_dir_entry_2*) ((char*) kaddr +
-            luci_last_byte(dir, n) - LUCI_DIR_REC_LEN(child->len));
-        // scan dentries
-        for (de = kaddr; de <= limit; de = luci_next_entry(de)) {
-            if (de->rec_len == 0) {
-	        // check page boundary
-                // Fixed an issue, where newly created dentry block was alloted
-                // to an incorrect index due to a bug in alloc branch
-                luci_err_inode(dir, "invalid zero record length found at page "
-                    "%lu(%p-%p)", n, (char*)de, (char*)limit);
-	        luci_put_page(page);
-	        goto fail;
-            }
-
-	    if (luci_match(child->len, child->name, de)) {
-                luci_dbg("dentry found %s", child->name);
-                goto found;
-            }
+            goto fail;
+        }
 
-            #ifdef DEBUG_DENTRY
-            luci_dbg("dentry name :%s, inode :%u, namelen :%u reclen :%u",
-	        de->name, de->inode, de->name_len,
-                luci_rec_len_from_disk(de->rec_len));
-            #endif
+        de = luci_find_entry_page(dir, page, n, child);
+        if (IS_ERR(de)) {
+            luci_put_page(page);
+            goto fail;
         }
+        if (de)
+            goto found;
         luci_put_page(page);    // get_page
     }
 
@@ -425,11 +501,14 @@ luci_empty_dir(struct inode *dir)
     struct page* page = NULL;
     unsigned long n;
     unsigned long npages = dir_pages(dir);
+    struct file_ra_state ra;
 
+    file_ra_state_init(&ra, dir->i_mapping);
     for (n = 0; n < npages; n++) {
         char *kaddr;
         struct luci_dir_entry_2 *de, *limit;
 
+        luci_dir_readahead(dir, &ra, NULL, n);
         page = luci_get_page(dir, n);
         if (IS_ERR(page)) {
             luci_err_inode(dir, "bad dentry page page :%ld err:%ld", n,
@@ -499,6 +578,7 @@ luci_delete_entry(struct luci_dir_entry_2* de, struct page *page)
     if (err) {
         luci_err("error in commiting page chunk");
     }
+    luci_dir_free_note(inode, page->index, length);
     inode->i_ctime = inode->i_mtime = LUCI_CURR_TIME;
     mark_inode_dirty(inode);
     luci_put_page(page);
@@ -819,6 +899,7 @@ luci_rename(struct inode *src_dir, struct dentry *src_dentry,
             BUG_ON(ret);
             de_tgt->inode = 0;
             ret = luci_commit_chunk(dst_page, pos, len);
+            luci_dir_free_note(tgt_dir, dst_page->index, len);
             luci_put_page(dst_page);
 
             // lookup a slot to accomodate new dentry. Note we
@@ -838,6 +919,14 @@ luci_rename(struct inode *src_dir, struct dentry *src_dentry,
             src_dentry->d_inode->i_ctime = LUCI_CURR_TIME;
     }
 
+    // an index split in luci_add_link can move the source entry
+    if (!ret && luci_dx_dir(src_dir)) {
+        luci_put_page(src_page);
+        de_src = luci_find_entry(src_dir, &src_dentry->d_name, &src_page);
+        if (!de_src)
+            return -ENOENT;
+    }
+
     if (!ret) {
         ret = luci_delete_entry(de_src, src_page);
         // if source is a directory, decref its parent
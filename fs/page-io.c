@@ -339,17 +339,18 @@ __luci_compress_extent_and_write(struct work_struct *work)
 {
     ktime_t start;
     int i, err, delta;
-    bool compressed = true, redirty_page = false;
+    bool compressed = true;
     struct list_head *ws = NULL;
     struct inode *inode;
     unsigned extent;
     struct page **page_array, *pageout;
     struct extent_write_work *ext_work;
     unsigned long start_compr_block, disk_start, nr_blocks;
-    unsigned long nr_pages_out, total_in, total_out;
+    unsigned long nr_pages_out = 0, total_in, total_out;
     blkptr bp_array[EXTENT_NRBLOCKS_MAX]; // [-Waggressive-loop-optimizations]
     u32 crc32[EXTENT_NRBLOCKS_MAX], crc32_extent = 0;
     struct luci_compressed_bio_data *bio_data = NULL;
+    struct writeback_control wbc = { .sync_mode = WB_SYNC_NONE };
 
     memset((char *)crc32, 0, sizeof(u32) * EXTENT_NRBLOCKS_MAX);
 
@@ -366,7 +367,7 @@ __luci_compress_extent_and_write(struct work_struct *work)
     page_array = kzalloc(EXTENT_NRPAGE * sizeof(struct page *), GFP_NOFS);
     if (!page_array) {
         luci_err_inode(inode, "failed to allocate page extent");
-        return;
+        goto write_error;
     }
 
     atomic64_add(EXTENT_NRPAGE, &pages_ingested);
@@ -478,7 +479,15 @@ notcompressible:
     }
 
     // Write block map meta data. We COW on a new write.
-    delta = luci_bmap_update_extent_bp(ext_work->begin_page, inode, bp_array);
+    err = luci_bmap_update_extent_bp(ext_work->begin_page, inode, bp_array, &delta);
+    if (err < 0) {
+        mapping_set_error(inode->i_mapping, err);
+        luci_err_inode(inode, "bmap update error for extent %u", extent);
+        // nothing maps the new blocks, give them back
+        for (i = 0; i < nr_blocks; i++)
+            luci_free_block(inode, start_compr_block + i);
+        goto write_error;
+    }
 
     // update physical file size
     LUCI_I(inode)->i_size_comp += delta;
@@ -494,7 +503,6 @@ notcompressible:
                                     disk_start,
                                     compressed,
                                     compressed ? bio_data : NULL) < 0) {
-        redirty_page = true;
         luci_err_inode(inode, "submit write error for extent %u", extent);
         goto write_error;
     } else {
@@ -507,8 +515,19 @@ write_error:
     if (compressed) {
         while (nr_pages_out--)
             luci_zlib_compress.remit_workspace(ws, page_array[nr_pages_out]);
+        kfree(bio_data);
     }
 
+    // nothing was submitted, so no bio completion ends writeback on the
+    // extent pages, hand them back dirty to be written out again
+    for (i = 0; i < pagevec_count(ext_work->pvec); i++)
+        redirty_page_for_writepage(&wbc, ext_work->pvec->pages[i]);
+    luci_release_backing_pages(ext_work->pvec);
+    kfree(page_array);
+    kfree(ext_work->pvec);
+    kfree(ext_work);
+    return;
+
 release:
 
     if (page_array)
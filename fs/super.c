@@ -37,6 +37,8 @@ extern const struct file_operations luci_frag_ops;
 
 extern const struct file_operations luci_compression_stats_ops;
 
+extern const struct file_operations luci_bmap_cache_ops;
+
 static struct kmem_cache* luci_inode_cachep;
 
 static struct inode *
@@ -46,6 +48,12 @@ luci_alloc_inode(struct super_block *sb)
         ei = (struct luci_inode_info *)kmem_cache_alloc(luci_inode_cachep, GFP_KERNEL);
         if (!ei)
                 return NULL;
+        ei->i_extent_root = NULL;
+        ei->i_dir_free = NULL;
+        ei->i_dir_free_nr = 0;
+        ei->i_dir_remap = NULL;
+        ei->i_dir_remap_nr = 0;
+        ei->i_dir_gen = 0;
         return &ei->vfs_inode;
 }
 
@@ -152,7 +160,24 @@ __luci_count_clear_bits(char *data, size_t size)
 }
 
 /*
- *  Tree walk to free the leaf block
+ *  Readahead indirect blocks referenced by block pointers p..q
+ */
+static void
+luci_free_branch_readahead(struct super_block *sb, blkptr *p, blkptr *q)
+{
+        struct blk_plug plug;
+
+        blk_start_plug(&plug);
+        for (; p <= q; p++) {
+                if (p->blockno)
+                        sb_breadahead(sb, p->blockno);
+        }
+        blk_finish_plug(&plug);
+}
+
+/*
+ *  Tree walk to free the leaf block. partial holds the indices of the
+ *  first block truncated below bp, NULL if the whole branch goes.
  */
 static int
 luci_free_branch(struct inode *inode,
@@ -160,7 +185,8 @@ luci_free_branch(struct inode *inode,
                 long *delta_blocks,
                 int depth,
                 blkptr extents_array[],
-                int *n_entries)
+                int *n_entries,
+                long *partial)
 {
         int err = 0;
         blkptr *p, *q;
@@ -191,6 +217,12 @@ luci_free_branch(struct inode *inode,
         p = (blkptr*)bh->b_data;
         q = (blkptr*)((char*)bh->b_data + bh->b_size - sizeof(blkptr));
         BUG_ON(p > q);
+
+        // child indirect blocks from the partial one on are going to be
+        // read, prefetch them
+        if (depth > 1)
+                luci_free_branch_readahead(sb, partial ? p + partial[0] : p, q);
+
         for (;q >= p; q--) {
 
                 uint32_t entry = q->blockno;
@@ -210,7 +242,8 @@ luci_free_branch(struct inode *inode,
                         continue;
                 }
 
-                err = luci_free_branch(inode, q, delta_blocks, depth - 1, extents_array, n_entries);
+                err = luci_free_branch(inode, q, delta_blocks, depth - 1, extents_array, n_entries,
+                                (partial && q - p == partial[0]) ? partial + 1 : NULL);
                 if (err) {
                         luci_err("failed to free branch at depth:%d block:%d", depth - 1,
                                         q->blockno);
@@ -277,13 +310,69 @@ luci_free_direct(struct inode *inode, long *delta_blocks)
         return 0;
 }
 
+/*
+ *  Free trailing blocks of an extent mapped file
+ */
 static int
-luci_free_blocks(struct inode *inode, long delta_blocks)
+luci_free_extent_blocks(struct inode *inode, long delta_blocks)
+{
+        int err = 0;
+        blkptr bp;
+        unsigned i, nr_blocks;
+        unsigned long i_block;
+
+        while (delta_blocks > 0) {
+                err = luci_extent_remove_last(inode, &i_block, &bp, &nr_blocks);
+                if (err == -ENOENT) {
+                        err = 0;
+                        break;
+                }
+                if (err < 0)
+                        break;
+
+                if (bp.flags & LUCI_COMPR_FLAG)
+                        err = luci_bmap_free_extents(inode, &bp, 1);
+                else
+                        err = luci_free_block(inode, bp.blockno);
+                if (err < 0) {
+                        luci_err_inode(inode, "error freeing extent at i_block %lu",
+                                        i_block);
+                        break;
+                }
+
+                for (i = 0; i < nr_blocks && inode->i_size; i++)
+                        luci_dec_size(inode, 1);
+                delta_blocks -= nr_blocks;
+        }
+
+        if (delta_blocks > 0)
+                luci_info_inode(inode, "detected blocks with possible holes, nr :%ld",
+                                delta_blocks);
+        return err;
+}
+
+/*
+ *  Free delta_blocks blocks from the end of the file, first is the first
+ *  file block past the new size.
+ */
+static int
+luci_free_blocks(struct inode *inode, long first, long delta_blocks)
 {
         long ret;
-        int i, level;
+        int i, level, depth, boundary;
+        long offsets[LUCI_MAX_DEPTH];
         struct luci_inode_info *li = LUCI_I(inode);
 
+        if (luci_has_extents(inode))
+                return luci_free_extent_blocks(inode, delta_blocks);
+
+        // root indirect blocks the truncate reaches
+        depth = luci_calculate_bmap_indices(inode, first, offsets, &boundary);
+        if (depth > 0)
+                luci_free_branch_readahead(inode->i_sb,
+                                &li->i_data[depth > 1 ? offsets[0] : LUCI_IND_BLOCK],
+                                &li->i_data[LUCI_TIND_BLOCK]);
+
         // Free indirect blocks bottom up
         // Fix : macro represents array index
         for (i = LUCI_TIND_BLOCK, level = 3; level && delta_blocks; i--, level--) {
@@ -302,7 +391,8 @@ luci_free_blocks(struct inode *inode, long delta_blocks)
                         return -ENOMEM;
                 }
 
-                ret = luci_free_branch(inode, &bp, &delta_blocks, level, extents_array, &n_extents);
+                ret = luci_free_branch(inode, &bp, &delta_blocks, level, extents_array, &n_extents,
+                                (depth > 1 && i == offsets[0]) ? offsets + 1 : NULL);
 
                 kfree(extents_array);
                 if (ret < 0) {
@@ -371,7 +461,10 @@ luci_truncate(struct inode *inode, loff_t size)
         // do not grow blocks; this makes truncate O(n) operation.
         if (delta_blocks < 0) {
                 luci_dbg("freeing %ld blocks on truncate", delta_blocks);
-                ret = luci_free_blocks(inode, -delta_blocks);
+                // no deferred checksums on blocks we are about to free
+                luci_bmap_flush_cksum(inode, 0);
+                ret = luci_free_blocks(inode, n_blocks, -delta_blocks);
+                luci_bmap_cache_invalidate(inode);
         }
         return ret;
 }
@@ -410,6 +503,11 @@ luci_evict_inode(struct inode * inode)
                 luci_truncate(inode, 0);
         }
 
+        luci_bmap_flush_cksum(inode, 0);
+        luci_bmap_cache_invalidate(inode);
+        luci_extent_release(inode, !inode->i_nlink);
+        luci_dir_free_release(inode);
+        luci_dir_compact_release(inode);
         invalidate_inode_buffers(inode);
         clear_inode(inode);
 
@@ -449,6 +547,8 @@ init_once(void *foo)
         INIT_LIST_HEAD(&li->i_orphan);
         mutex_init(&li->truncate_mutex);
         rwlock_init(&li->i_meta_lock);
+        luci_bmap_cache_init_once(li);
+        INIT_RADIX_TREE(&li->i_bmap_stale, GFP_NOFS);
         inode_init_once(&li->vfs_inode);
 }
 
@@ -1137,11 +1237,12 @@ luci_read_rootinode(struct super_block *sb) {
 }
 
 enum {
-        Opt_debug, Opt_extents, Opt_layout
+        Opt_debug, Opt_extents, Opt_dirindex, Opt_layout
 };
 
 static const match_table_t tokens = {
         {Opt_extents, "extents"},
+        {Opt_dirindex, "dirindex"},
 };
 
 static int parse_options(char *options, struct super_block *sb)
@@ -1165,6 +1266,10 @@ static int parse_options(char *options, struct super_block *sb)
                                 set_opt (sbi->s_mount_opt, LUCI_MOUNT_EXTENTS);
                                 printk(KERN_DEBUG "extent allocation enabled for files");
                                 break;
+                        case Opt_dirindex:
+                                set_opt (sbi->s_mount_opt, LUCI_MOUNT_DIR_INDEX);
+                                printk(KERN_DEBUG "hash index enabled for large directories");
+                                break;
                         default:
                                 luci_err("Unrecognized mount option : %s", p);
                                 return 0;
@@ -1352,6 +1457,13 @@ init_debugfs(void) {
                 return (-ENODEV);
         }
 
+        dbgfsparam.dirent_bmap_cache = debugfs_create_file("bmap_cache", 0644,
+                        dbgfsparam.dirent, (void *) NULL, &luci_bmap_cache_ops);
+        if (dbgfsparam.dirent_bmap_cache == NULL) {
+                printk(KERN_ERR "error creating file");
+                return (-ENODEV);
+        }
+
         return 0;
 }
 
@@ -1371,6 +1483,10 @@ __init init_luci_fs(void)
         if (err)
                 return err;
 
+        err = init_luci_bmap_cache();
+        if (err)
+                goto failed_bmap_cache;
+
         init_luci_compress();
 
         err = register_filesystem(&luci_fs);
@@ -1388,6 +1504,8 @@ failed_debugfs:
         unregister_filesystem(&luci_fs);
 failed_compr:
         exit_luci_compress();
+        exit_luci_bmap_cache();
+failed_bmap_cache:
         destroy_inodecache();
         return err;
 }
@@ -1398,6 +1516,7 @@ __exit exit_luci_fs(void)
         exit_debugfs();
         unregister_filesystem(&luci_fs);
         exit_luci_compress();
+        exit_luci_bmap_cache();
         destroy_inodecache();
 }
 
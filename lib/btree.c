@@ -13,6 +13,7 @@
 #include <linux/module.h>
 #include <linux/buffer_head.h>
 #include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 #include "btree.h"
 #include "btree_ioctl.h"
 #include "page_io.h"
@@ -23,6 +24,9 @@ MODULE_LICENSE("GPL");
 
 #define MAX_KEYS 32
 
+// optimistic read attempts before a reader waits for the writer
+#define BTREE_READ_RETRIES 8
+
 enum {
         LEFT_SIBLING,
         RIGHT_SIBLING,
@@ -48,13 +52,9 @@ static inline int compare_key(struct btree_key *key, struct btree_node *node)
         return (node->header.offset == key->offset);
 }
 
-static inline void swap_keys(struct btree_key *keyp, struct btree_key *keyq)
+static inline bool extent_block_shared(u64 block)
 {
-        struct btree_key temp;
-
-        memcpy((char *)&temp, (char *)keyp,  sizeof(struct btree_key));
-        memcpy((char *)keyp,  (char *)keyq,  sizeof(struct btree_key));
-        memcpy((char *)keyq,  (char *)&temp, sizeof(struct btree_key));
+        return bump_block_refcount(block) > 1;
 }
 
 static inline int extent_node_is_root(struct btree_node *node,
@@ -122,55 +122,116 @@ static inline bool extent_node_has_overflowed(struct btree_node *node)
                return (node->header.max_items - node->header.nr_items) <= 2;
 }
 
-static inline int paritition_keys(struct btree_key *keys, int l, int h)
+static inline void extent_node_update_offset(struct btree_node *node)
 {
-        int p = h;
-        struct btree_key pivot = keys[h--];
+        if (node->header.nr_items)
+                node->header.offset = node->keys[0].offset;
+}
 
-        while (l <= h) {
-                if (keys[l].offset > pivot.offset) {
-                        swap_keys(&keys[l], &keys[h]);
-                        h--;
-                } else {
-                        l++;
-                }
+// first slot with key offset above offset, keys are kept ordered
+static inline int extent_node_upper_bound(struct btree_node *node, u64 offset)
+{
+        int lo = 0, hi = node->header.nr_items;
+
+        while (lo < hi) {
+                int mid = lo + ((hi - lo) >> 1);
+
+                if (node->keys[mid].offset <= offset)
+                        lo = mid + 1;
+                else
+                        hi = mid;
         }
+        return lo;
+}
+
+static inline void extent_node_insert_at(struct btree_node *node,
+                                         int slot,
+                                         struct btree_key *key)
+{
+        int nr = node->header.nr_items;
+
+        BUG_ON(nr >= node->header.max_items || slot > nr);
 
-        swap_keys(&keys[l], &keys[p]);
-        return l;
+        memmove((char *)&node->keys[slot + 1], (char *)&node->keys[slot],
+                (nr - slot) * sizeof(struct btree_key));
+        memcpy((char *)&node->keys[slot], (char *)key, sizeof(struct btree_key));
+        node->header.nr_items++;
+        extent_node_update_offset(node);
 }
 
-static inline void extent_node_sort(struct btree_node *node)
+static inline void extent_node_remove_at(struct btree_node *node, int slot)
 {
-        int top = 0;
-        int stack[MAX_KEYS]; // stack size grows with btree fan-out
+        int nr = node->header.nr_items;
 
-        if (!node->header.nr_items)
-                return;
+        BUG_ON(slot >= nr);
 
-        stack[top++] = 0;
-        stack[top++] = node->header.nr_items - 1;
+        memmove((char *)&node->keys[slot], (char *)&node->keys[slot + 1],
+                (nr - slot - 1) * sizeof(struct btree_key));
+        SET_KEY_EMPTY(node->keys[nr - 1]);
+        node->header.nr_items--;
+        extent_node_update_offset(node);
+}
 
-        while (top) {
-                int p, q, k;
+/*
+ * Leaves are chained in key order through the header prev/next block
+ * pointers. first..last take the place of the leaves between prev and
+ * next; the outer neighbours are pointed back at them. Trees sharing
+ * nodes with a snapshot do not keep links, a neighbour may be shared.
+ */
+static void extent_leaf_link(struct btree_root_node *root,
+                             struct btree_node *first,
+                             struct btree_node *last,
+                             u64 prev,
+                             u64 next)
+{
+        struct buffer_head *ebh;
 
-                q = stack[--top];
-                p = stack[--top];
+        if (root->flags & BTREE_ROOT_SHARED)
+                return;
 
-                k = paritition_keys(node->keys, p, q);
+        first->header.prev = prev;
+        last->header.next = next;
 
-                if (k > p) {
-                       stack[top++] = p;
-                       stack[top++] = k - 1;
+        if (prev) {
+                ebh = bump_get_buffer_head(prev);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.next = first->header.blockptr;
+                        bump_put_buffer_head(ebh);
                 }
+        }
 
-                if (k < q) {
-                       stack[top++] = k + 1;
-                       stack[top++] = q;
+        if (next) {
+                ebh = bump_get_buffer_head(next);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.prev = last->header.blockptr;
+                        bump_put_buffer_head(ebh);
                 }
         }
+}
+
+static void extent_leaf_unlink(struct btree_root_node *root,
+                               struct btree_node *leaf)
+{
+        struct buffer_head *ebh;
 
-        node->header.offset = node->keys[0].offset;
+        if (root->flags & BTREE_ROOT_SHARED)
+                return;
+
+        if (leaf->header.prev) {
+                ebh = bump_get_buffer_head(leaf->header.prev);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.next = leaf->header.next;
+                        bump_put_buffer_head(ebh);
+                }
+        }
+
+        if (leaf->header.next) {
+                ebh = bump_get_buffer_head(leaf->header.next);
+                if (ebh) {
+                        BH2BTNODE(ebh)->header.prev = leaf->header.prev;
+                        bump_put_buffer_head(ebh);
+                }
+        }
 }
 
 static struct buffer_head *extent_tree_read_node(struct btree_node *node, int key_index)
@@ -202,37 +263,32 @@ static void extent_drop_path_refs(struct btree_path *paths)
 static int extent_index_node_search_keys(struct btree_node *node,
                                          struct btree_key *key)
 {
-        int i, slot = 0;
+        int slot;
 
         btree_node_print("search node entry", node);
 
-        for (i = 0; i < node->header.nr_items; i++) {
-                if (key->offset == node->keys[i].offset)
-                        return i;
-                else if (key->offset > node->keys[i].offset)
-                        slot = i;
-                else
-                        break;
-        }
-
-        btree_node_keys_print(node);
-        return slot;
+        // last key not above the search key, first child otherwise
+        slot = extent_node_upper_bound(node, key->offset) - 1;
+        return (slot < 0) ? 0 : slot;
 }
 
 static int extent_index_node_lookup(struct btree_node *node,
                                     struct btree_key *key)
 {
-        int i;
+        int slot;
 
         btree_node_print("lookup parent", node);
 
-        for (i = 0; i < node->header.nr_items; i++) {
-                if (key->offset == node->keys[i].offset)
-                        return i;
-        }
+        slot = extent_node_upper_bound(node, key->offset) - 1;
+        if (slot >= 0 && node->keys[slot].offset == key->offset)
+                return slot;
         return -ENOENT;
 }
 
+/*
+ * Keys are ordered by offset, not by blockptr, so this is a scan. Callers
+ * on the insert path use the slot recorded by the descent instead.
+ */
 static int extent_index_node_lookup_bptr(struct btree_node *node,
                                          struct btree_key *key)
 {
@@ -254,7 +310,7 @@ static void extent_node_update_backrefs(struct btree_node *curr_node,
 {
         struct btree_node *parent;
         int slot, level = curr_node->header.level;
-        struct btree_key key = {0, 0, curr_node->header.blockptr};
+        struct btree_key key = { .blockptr = curr_node->header.blockptr };
 
         if (extent_node_is_root(curr_node, path))
                 return;
@@ -263,9 +319,12 @@ static void extent_node_update_backrefs(struct btree_node *curr_node,
         do {
                 parent = path->nodes[++level];
 
-                slot = extent_index_node_lookup_bptr(parent, &key);
+                slot = path->slots[level];
+                if (slot < 0 || slot >= parent->header.nr_items ||
+                    parent->keys[slot].blockptr != key.blockptr)
+                        slot = extent_index_node_lookup_bptr(parent, &key);
                 if (slot < 0) {
-                        pr_debug("blockptr key :%llu\n", key.blockptr);
+                        pr_debug("blockptr key :%u\n", key.blockptr);
                         btree_node_print("child bptr not found in parent", parent);
                         btree_node_keys_print(parent);
                         break;
@@ -290,6 +349,7 @@ static int extent_index_node_insert_key(struct btree_node *parent,
 {
         struct btree_key key;
 
+        extent_reset_key(&key);
         SET_KEY_FROM_BTREE_HDR(key, node);
 
         if (extent_node_full(parent)) {
@@ -298,12 +358,9 @@ static int extent_index_node_insert_key(struct btree_node *parent,
                 return -ENOSPC;
         }
 
-        parent->header.nr_items++;
-
-        memcpy((char* )&parent->keys[parent->header.nr_items - 1],
-               (char*)&key, sizeof(struct btree_key));
-
-        extent_node_sort(parent);
+        extent_node_insert_at(parent,
+                              extent_node_upper_bound(parent, key.offset),
+                              &key);
 
         btree_node_print("added child node", node);
 
@@ -319,7 +376,7 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
                                         struct btree_path *path,
                                         bool collapse)
 {
-        int slot, last;
+        int slot;
         struct btree_key key;
 
         do {
@@ -333,7 +390,7 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
 
                 slot = extent_index_node_lookup_bptr(pnode, &key);
                 if (slot < 0) {
-                        pr_err("entry not found :%llu-%llu\n", key.offset, key.blockptr);
+                        pr_err("entry not found :%u-%u\n", key.offset, key.blockptr);
                         btree_node_keys_print(pnode);
                         WARN_ON(1);
                         return -ENOENT;
@@ -341,22 +398,10 @@ static int extent_index_node_remove_key(struct btree_node *pnode,
 
                 btree_node_keys_print(pnode);
 
-                last = pnode->header.nr_items - 1;
-
-                if (last) {
-                        memcpy((char* )&pnode->keys[slot],
-                               (char* )&pnode->keys[last], sizeof(struct btree_key));
-
-                        pnode->header.nr_items--;
-
-                        extent_node_sort(pnode);
+                extent_node_remove_at(pnode, slot);
 
+                if (pnode->header.nr_items)
                         extent_node_update_backrefs(pnode, path);
-                } else {
-                        pnode->header.nr_items--;
-
-                        BUG_ON(pnode->header.nr_items);
-                }
 
                 btree_node_print("parent node entry (after)", pnode);
 
@@ -399,6 +444,8 @@ static struct btree_node* extent_node_create(int level,
         node->header.offset = 0xFFFFFFFF;
         node->header.blockptr = block;
         node->header.max_items = max_items;
+        node->header.prev = 0;
+        node->header.next = 0;
         if (bh)
                 *bh = ebh;
         btree_node_print("new node created", node);
@@ -409,6 +456,12 @@ static void extent_node_destroy(struct btree_node *node)
 {
         int i, nr_keys = node->header.nr_items;
 
+        // subtree lives on in another version
+        if (extent_block_shared(node->header.blockptr)) {
+                bump_release_block(node->header.blockptr, PAGE_SIZE);
+                return;
+        }
+
         btree_node_print("destroying node", node);
         btree_node_keys_print(node);
 
@@ -424,7 +477,7 @@ static void extent_node_destroy(struct btree_node *node)
                         if (node->keys[i].blockptr) {
                                 ebh = bump_get_buffer_head(node->keys[i].blockptr);
                                 if (!ebh) {
-                                        pr_err("blockptr error :%llu\n", node->keys[i].blockptr);
+                                        pr_err("blockptr error :%u\n", node->keys[i].blockptr);
                                         BUG();
                                 }
                                 extent_node_destroy((struct btree_node *) (ebh->b_data));
@@ -439,6 +492,78 @@ static void extent_node_destroy(struct btree_node *node)
         bump_release_block(node->header.blockptr, PAGE_SIZE);
 }
 
+/*
+ * Private copy of a node shared with another tree version. The copy takes
+ * a reference on every block the node points to and the reference on the
+ * shared node is dropped.
+ */
+static struct btree_node *extent_node_cow(struct btree_node *node,
+                                          struct buffer_head **bh)
+{
+        int i;
+        u64 block;
+        struct btree_node *copy;
+
+        copy = extent_node_create(node->header.level,
+                                  node->header.max_items,
+                                  node->header.flags,
+                                  bh);
+        if (!copy)
+                return NULL;
+
+        block = copy->header.blockptr;
+        memcpy((char *)copy, (char *)node, sizeof(struct btree_node));
+        copy->header.blockptr = block;
+        copy->header.prev = 0;
+        copy->header.next = 0;
+
+        for (i = 0; i < copy->header.nr_items; i++)
+                bump_block_get(copy->keys[i].blockptr);
+
+        bump_release_block(node->header.blockptr, PAGE_SIZE);
+
+        btree_node_print("copied shared node", copy);
+        return copy;
+}
+
+// keys of node were copied elsewhere, they need references of their own
+static void extent_node_share_children(struct btree_node *node)
+{
+        int i;
+
+        if (!extent_block_shared(node->header.blockptr))
+                return;
+
+        for (i = 0; i < node->header.nr_items; i++)
+                bump_block_get(node->keys[i].blockptr);
+}
+
+// sibling about to be modified by rebalance, give it a private copy
+static struct btree_node *extent_tree_cow_sibling(struct btree_node *parent,
+                                                  struct buffer_head **bh)
+{
+        int slot;
+        struct btree_key key;
+        struct buffer_head *cbh;
+        struct btree_node *copy, *sib = BH2BTNODE(*bh);
+
+        if (!extent_block_shared(sib->header.blockptr))
+                return sib;
+
+        SET_KEY_FROM_BTREE_HDR(key, sib);
+        slot = extent_index_node_lookup_bptr(parent, &key);
+        BUG_ON(slot < 0);
+
+        copy = extent_node_cow(sib, &cbh);
+        if (!copy)
+                return NULL;
+
+        parent->keys[slot].blockptr = copy->header.blockptr;
+        brelse(*bh);
+        *bh = cbh;
+        return copy;
+}
+
 static inline bool extent_tree_can_shrink(struct btree_node *root)
 {
         bool shrink = false;
@@ -456,7 +581,7 @@ static inline bool extent_tree_can_shrink(struct btree_node *root)
         BUG_ON(qbh == NULL);
         qnode = BH2BTNODE(qbh);
 
-        if (pnode->header.nr_items + qnode->header.nr_items <= root->header.max_items)
+        if (pnode->header.nr_items + qnode->header.nr_items <= root->header.max_items - 3)
                 shrink = true;
 
         bump_put_buffer_head(pbh);
@@ -503,12 +628,20 @@ static struct btree_node* extent_tree_shrink(struct btree_root_node *root,
         for (j = 0; j < qnode->header.nr_items; j++)
                 merge->keys[merge->header.nr_items++] = qnode->keys[j];
 
-        extent_node_sort(merge);
+        extent_node_update_offset(merge);
+
+        if (IS_BTREE_LEAF(merge))
+                extent_leaf_link(root, merge, merge,
+                                 pnode->header.prev, qnode->header.next);
 
         btree_node_print("merged new root node", merge);
 
         btree_node_keys_print(merge);
 
+        extent_node_share_children(pnode);
+
+        extent_node_share_children(qnode);
+
         bump_put_buffer_head(pbh);
 
         bump_release_block(pnode->header.blockptr, PAGE_SIZE);
@@ -566,12 +699,20 @@ static struct btree_node* extent_node_merge_siblings(struct btree_node *pnode,
         for (j = 0; j < qnode->header.nr_items; j++)
                 merge->keys[merge->header.nr_items++] = qnode->keys[j];
 
-	extent_node_sort(merge);
+	extent_node_update_offset(merge);
+
+        if (IS_BTREE_LEAF(merge))
+                extent_leaf_link(paths->root, merge, merge,
+                                 pnode->header.prev, qnode->header.next);
 
 	btree_node_print("merged new node", merge);
 
         btree_node_keys_print(merge);
 
+        extent_node_share_children(pnode);
+
+        extent_node_share_children(qnode);
+
         (void) extent_index_node_remove_key(parent, pnode, paths, collapse);
 
         (void) extent_index_node_remove_key(parent, qnode, paths, collapse);
@@ -599,7 +740,7 @@ static int extent_node_steal_from_sibling(struct btree_node *cur_node,
         struct btree_node *parent;
         int r_index_curr, r_index_sib;
 
-        parent = path->nodes[cur_node->header.level];
+        parent = path->nodes[cur_node->header.level + 1];
 
         SET_KEY_FROM_BTREE_HDR(key, cur_node);
         r_index_curr = extent_index_node_lookup(parent, &key);
@@ -613,41 +754,21 @@ static int extent_node_steal_from_sibling(struct btree_node *cur_node,
 
         btree_node_print("stealing keys from adjacent node", cur_node);
 
-        // right sibling
+        // right sibling, its first key goes to the end of current node
         if (cur_node->header.offset < sib_node->header.offset) {
-                int p = cur_node->header.nr_items - 1;
-                int q = sib_node->header.nr_items - 1;
+                extent_node_insert_at(cur_node, cur_node->header.nr_items,
+                                      &sib_node->keys[0]);
+                extent_node_remove_at(sib_node, 0);
 
-                memcpy((char *) &cur_node->keys[p + 1], (char *) &sib_node->keys[0],
-                       sizeof(struct btree_key));
-                memcpy((char *) &sib_node->keys[0], (char *) &sib_node->keys[q],
-                       sizeof(struct btree_key));
-                cur_node->header.nr_items++;
-                sib_node->header.nr_items--;
-
-                extent_node_sort(sib_node);
-                //btree_node_keys_print(sib_node);
-
-                SET_KEY_EMPTY(sib_node->keys[p]);
-                sib_node->header.offset = sib_node->keys[0].offset;
                 parent->keys[r_index_sib].offset = sib_node->header.offset;
                 extent_node_update_backrefs(sib_node, path);
-        // left sibling
+        // left sibling, its last key goes to the front of current node
         } else {
-                int p = cur_node->header.nr_items - 1;
                 int q = sib_node->header.nr_items - 1;
 
-                memcpy((char *) &cur_node->keys[p + 1], (char *) &sib_node->keys[q],
-                       sizeof(struct btree_key));
-
-                cur_node->header.nr_items++;
-                sib_node->header.nr_items--;
+                extent_node_insert_at(cur_node, 0, &sib_node->keys[q]);
+                extent_node_remove_at(sib_node, q);
 
-                extent_node_sort(cur_node);
-                //btree_node_keys_print(cur_node);
-
-                SET_KEY_EMPTY(sib_node->keys[q]);
-                cur_node->header.offset = cur_node->keys[0].offset;
                 parent->keys[r_index_curr].offset = cur_node->header.offset;
                 extent_node_update_backrefs(cur_node, path);
         }
@@ -696,7 +817,9 @@ static void extent_tree_rebalance(struct btree_node *curr_node,
                 lsib_bh = extent_tree_get_adjacent_node(curr_node, parent, path, LEFT_SIBLING);
 		if (lsib_bh) {
                         lsib = BH2BTNODE(lsib_bh); 
-                        if (extent_node_can_borrow(curr_node, lsib)) {
+                        if (extent_node_can_borrow(curr_node, lsib) &&
+                            extent_tree_cow_sibling(parent, &lsib_bh)) {
+                                lsib = BH2BTNODE(lsib_bh);
                                 extent_node_steal_from_sibling(curr_node, lsib, path);
                                 continue_balance = true;
                                 goto next_round;
@@ -706,7 +829,9 @@ static void extent_tree_rebalance(struct btree_node *curr_node,
                 rsib_bh = extent_tree_get_adjacent_node(curr_node, parent, path, RIGHT_SIBLING);
 		if (rsib_bh) {
                         rsib = BH2BTNODE(rsib_bh); 
-                        if (extent_node_can_borrow(curr_node, rsib)) {
+                        if (extent_node_can_borrow(curr_node, rsib) &&
+                            extent_tree_cow_sibling(parent, &rsib_bh)) {
+                                rsib = BH2BTNODE(rsib_bh);
                                 extent_node_steal_from_sibling(curr_node, rsib, path);
                                 continue_balance = true;
                                 goto next_round;
@@ -804,6 +929,13 @@ static struct btree_node* extent_node_split(struct btree_root_node *root_node,
 
                 btree_node_keys_print(r_sib);
 
+                if (IS_BTREE_LEAF(node)) {
+                        l_sib->header.next = r_sib->header.blockptr;
+                        r_sib->header.prev = l_sib->header.blockptr;
+                        extent_leaf_link(root_node, l_sib, r_sib,
+                                         node->header.prev, node->header.next);
+                }
+
                 if (curr_level < paths->depth - 1) {
                         pnode = paths->nodes[curr_level + 1];
                         if (extent_index_node_remove_key(pnode, node, paths, collapse) < 0)
@@ -877,6 +1009,8 @@ static struct btree_node* extent_tree_find_leaf(struct btree_key* key,
 
         slot = extent_index_node_search_keys(node, key);
 
+        path->slots[node->header.level] = slot;
+
         ebh = bump_get_buffer_head(node->keys[slot].blockptr);
         if (!ebh)
                 return ERR_PTR(-EIO);
@@ -887,56 +1021,203 @@ static struct btree_node* extent_tree_find_leaf(struct btree_key* key,
                                      path);
 }
 
-long extent_tree_lookup_item(struct btree_root_node *root,
-                             loff_t off,
-                             unsigned int size)
+static struct btree_path *extent_tree_alloc_path(struct btree_root_node *root)
 {
-        int slot;
-        struct btree_node *leaf;
-        struct btree_key key = { off, size, 0xFFFFFFFF };
         struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
 
-        pr_debug("lookup request for key :%llu\n", off); 
+        if (!path)
+                return NULL;
 
+        path->root = root;
         path->level = root->max_level;
+        return path;
+}
 
-        get_bh(root->bh);
+/*
+ * Copy the shared nodes on a path top-down before the path is modified,
+ * so that no version sees the change of another. A private node may
+ * still point to shared children, so every level is checked.
+ */
+static int extent_tree_cow_path(struct btree_root_node *root,
+                                struct btree_path *path)
+{
+        int level;
+        struct buffer_head *bh;
+        struct btree_node *node, *copy, *parent;
 
-        leaf = extent_tree_find_leaf(&key, root->node, root->bh, path);
-        BUG_ON(!leaf);
-        if (IS_ERR(leaf)) {
-                pr_err("failed to locate key: %llu, status: %ld\n", off, PTR_ERR(leaf));
-                brelse(root->bh);
-                kfree(path);
-                return -EIO;
+        if (!(root->flags & BTREE_ROOT_SHARED))
+                return 0;
+
+        for (level = path->depth - 1; level >= 0; level--) {
+                node = path->nodes[level];
+                if (!extent_block_shared(node->header.blockptr))
+                        continue;
+
+                copy = extent_node_cow(node, &bh);
+                if (!copy)
+                        return -ENOMEM;
+
+                bump_put_buffer_head(path->bh[level]);
+                path->nodes[level] = copy;
+                path->bh[level] = bh;
+
+                if (level == path->depth - 1) {
+                        // root holds a reference of its own
+                        bump_put_buffer_head(root->bh);
+                        get_bh(bh);
+                        root->bh = bh;
+                        root->node = copy;
+                } else {
+                        parent = path->nodes[level + 1];
+                        parent->keys[path->slots[level + 1]].blockptr =
+                                copy->header.blockptr;
+                }
         }
+        return 0;
+}
+
+/*
+ * Writers are serialized per tree by root->lock and keep root->seq odd
+ * while they update it. Readers take neither: blocks are freed only after
+ * an RCU grace period, so a reader can always finish its walk, and the
+ * sequence count tells it whether a writer overlapped the walk.
+ */
+static inline void extent_tree_write_lock(struct btree_root_node *root)
+{
+        mutex_lock(&root->lock);
+        write_seqcount_begin(&root->seq);
+}
+
+static inline void extent_tree_write_unlock(struct btree_root_node *root)
+{
+        write_seqcount_end(&root->seq);
+        mutex_unlock(&root->lock);
+}
+
+// read section of extent_tree_read(), -EAGAIN reports a torn read
+typedef long (*btree_read_t)(struct btree_root_node *root, void *arg);
+
+/*
+ * Run read without taking root->lock, again if a writer overlapped it.
+ * Results must be copied out of the nodes before read returns. A reader
+ * that keeps losing to writers falls back to the lock.
+ */
+static long extent_tree_read(struct btree_root_node *root,
+                             btree_read_t read,
+                             void *arg)
+{
+        int retry;
+        long ret;
+        unsigned seq;
+
+        for (retry = 0; retry < BTREE_READ_RETRIES; retry++) {
+                seq = raw_read_seqcount(&root->seq);
+                if (seq & 1) {
+                        cpu_relax();
+                        continue;
+                }
+
+                rcu_read_lock();
+                ret = read(root, arg);
+                rcu_read_unlock();
+
+                if (!read_seqcount_retry(&root->seq, seq))
+                        goto out;
+        }
+
+        mutex_lock(&root->lock);
+        rcu_read_lock();
+        ret = read(root, arg);
+        rcu_read_unlock();
+        mutex_unlock(&root->lock);
+out:
+        // a torn read without a writer to blame is a broken tree
+        return (ret == -EAGAIN) ? -EIO : ret;
+}
+
+/*
+ * Lockless descent to the leaf for off, see extent_tree_descend() for
+ * *next. Nodes may be changing under us, so anything that would take the
+ * walk out of bounds is reported as a torn read.
+ */
+static struct btree_node *extent_tree_descend_rcu(struct btree_root_node *root,
+                                                  loff_t off,
+                                                  u64 *next)
+{
+        int level, slot;
+        struct btree_key key = { .offset = off };
+        struct btree_node *node = READ_ONCE(root->node);
+
+        *next = 0;
+
+        for (level = 0; level < MAX_BTREE_LEVEL; level++) {
+                if (!node || node->header.nr_items > MAX_BKEYS_PER_BLOCK)
+                        return NULL;
+                if (IS_BTREE_LEAF(node))
+                        return node;
+                if (!node->header.nr_items)
+                        return NULL;
+
+                slot = extent_index_node_search_keys(node, &key);
+                if (slot + 1 < node->header.nr_items)
+                        *next = node->keys[slot + 1].offset;
+                node = bump_block_data(node->keys[slot].blockptr);
+        }
+        return NULL;
+}
+
+static long extent_tree_lookup_rcu(struct btree_root_node *root, void *arg)
+{
+        int slot;
+        u64 next;
+        struct btree_key *key = arg;
+        struct btree_node *leaf;
+
+        leaf = extent_tree_descend_rcu(root, key->offset, &next);
+        if (!leaf)
+                return -EAGAIN;
 
         btree_node_print("selected leaf to lookup", leaf);
 
-        slot = extent_index_node_lookup(leaf, &key);
-        if (slot < 0) {
-                pr_err("offset key :%llu not found\n", key.offset);
-                extent_drop_path_refs(path);
+        slot = extent_index_node_lookup(leaf, key);
+        if (slot < 0)
                 return -ENOENT;
-        }
+        return leaf->keys[slot].blockptr;
+}
 
-        key.blockptr = leaf->keys[slot].blockptr;
-        extent_drop_path_refs(path);
-        return key.blockptr;
+long extent_tree_lookup_item(struct btree_root_node *root,
+                             loff_t off,
+                             unsigned int size)
+{
+        long ret;
+        struct btree_key key = { off, size, 0xFFFFFFFF };
+
+        pr_debug("lookup request for key :%llu\n", off); 
+
+        if (off < 0 || off > BTREE_MAX_OFFSET)
+                return -ENOENT;
+
+        ret = extent_tree_read(root, extent_tree_lookup_rcu, &key);
+        if (ret == -ENOENT)
+                pr_err("offset key :%u not found\n", key.offset);
+        else if (ret < 0)
+                pr_err("failed to locate key: %llu, status: %ld\n", off, ret);
+        return ret;
 }
 
-int extent_tree_insert_item(struct btree_root_node *root,
-                            loff_t off,
-                            unsigned long block,
-                            unsigned int size)
+static int __extent_tree_insert_item(struct btree_root_node *root,
+                                    loff_t off,
+                                    unsigned long block,
+                                    unsigned int size)
 {
         int i, ret = 0;
         bool added = false;
         struct btree_node *leaf;
         struct btree_key key = { off, size, block };
-        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
+        struct btree_path *path = extent_tree_alloc_path(root);
 
-        path->level = root->max_level;
+        if (!path)
+                return -ENOMEM;
 
         pr_debug("insert request for key :%llu\n", off); 
 
@@ -957,25 +1238,28 @@ int extent_tree_insert_item(struct btree_root_node *root,
 
         btree_node_print("selected leaf to insert", leaf);
 
+        ret = extent_tree_cow_path(root, path);
+        if (ret < 0) {
+                extent_drop_path_refs(path);
+                return ret;
+        }
+        leaf = path->nodes[0];
+
         if (!block)
                 block = bump_alloc_data_block();
 
-        for (i = 0; i < leaf->header.max_items; i++) {
-                if (IS_KEY_EMPTY(leaf->keys[i])) {
-                    leaf->keys[i].blockptr = block;
-                    leaf->keys[i].offset = off;
-                    leaf->keys[i].size = size;
-                    leaf->header.nr_items++;
-                    btree_info("inserted item[%d/%d] :%llu %u-%u\n",
-                            i, leaf->header.nr_items, off,
-                            path->level, path->depth);
-                    added = true;
-                    break;
-                }
+        key.blockptr = block;
+
+        if (!extent_node_full(leaf)) {
+                i = extent_node_upper_bound(leaf, off);
+                extent_node_insert_at(leaf, i, &key);
+                btree_info("inserted item[%d/%d] :%llu %u-%u\n",
+                        i, leaf->header.nr_items, off,
+                        path->level, path->depth);
+                added = true;
         }
 
         if (added) {
-                extent_node_sort(leaf);
                 //btree_node_keys_print(leaf);
                 extent_node_update_backrefs(leaf, path);
                 //extent_tree_rebalance(inode, leaf, path);
@@ -991,17 +1275,34 @@ int extent_tree_insert_item(struct btree_root_node *root,
         return ret;
 }
 
-int extent_tree_delete_item(struct btree_root_node *root,
-                            unsigned long offset)
+int extent_tree_insert_item(struct btree_root_node *root,
+                            loff_t off,
+                            unsigned long block,
+                            unsigned int size)
 {
-        int i;
+        int ret;
+
+        if (off < 0 || off > BTREE_MAX_OFFSET || block > BTREE_MAX_BLOCK)
+                return -ERANGE;
+
+        extent_tree_write_lock(root);
+        ret = __extent_tree_insert_item(root, off, block, size);
+        extent_tree_write_unlock(root);
+        return ret;
+}
+
+static int __extent_tree_delete_item(struct btree_root_node *root,
+                                     unsigned long offset)
+{
+        int i, ret = 0;
         bool deleted = false;
         bool collapse = true;
         struct btree_node *leaf, *parent;
         struct btree_key key = { offset, 0, 0 };
-        struct btree_path *path = kzalloc(sizeof(struct btree_path), GFP_KERNEL);
+        struct btree_path *path = extent_tree_alloc_path(root);
 
-        path->level = root->max_level;
+        if (!path)
+                return -ENOMEM;
 
         get_bh(root->bh);
 
@@ -1021,41 +1322,38 @@ int extent_tree_delete_item(struct btree_root_node *root,
         btree_node_print("selected leaf to delete", leaf);
         btree_node_keys_print(leaf);
 
-        for (i = 0; i < leaf->header.nr_items; i++) {
-                if (leaf->keys[i].offset != key.offset)
-                        continue;
+        i = extent_index_node_lookup(leaf, &key);
+        if (i >= 0 && extent_tree_cow_path(root, path) < 0) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        if (i >= 0) {
+                leaf = path->nodes[0];
                 bump_release_block(leaf->keys[i].blockptr, PAGE_SIZE);
-                memcpy((char *)&leaf->keys[i],
-	               (char *)&leaf->keys[leaf->header.nr_items - 1],
-                       sizeof(struct btree_key));
-                memset((char *)&leaf->keys[leaf->header.nr_items - 1],
-                        0,
-                        sizeof(struct btree_key));
-                leaf->header.nr_items--;
-		BUG_ON(leaf->header.nr_items < 0);
+                extent_node_remove_at(leaf, i);
                 btree_info("deleted item[%d/%d] :%lu %u-%u/%u\n",
                             i, leaf->header.nr_items, offset,
                             path->level, path->depth, leaf->header.max_items);
                 deleted = true;
-                break;
         }
 
         if (!deleted) {
                 pr_err("key :%lu not found\n", offset);
+                ret = -ENOENT;
                 goto out;
         }
 
-        if (extent_node_is_root(leaf, path)) {
-                extent_node_sort(leaf);
-        } else {
+        if (!extent_node_is_root(leaf, path)) {
                 parent = path->nodes[leaf->header.level + 1];
                 if (leaf->header.nr_items) {
-                        extent_node_sort(leaf);
                         extent_node_update_backrefs(leaf, path);
                         extent_tree_rebalance(leaf, path);
                 } else {
                         int plevel;
 
+                        extent_leaf_unlink(root, leaf);
+
                         plevel = extent_index_node_remove_key(parent, leaf, path, collapse);
                         if (plevel < 0)
 				BUG();
@@ -1068,7 +1366,14 @@ int extent_tree_delete_item(struct btree_root_node *root,
 
         //btree_node_keys_print(leaf);
 
-        if (extent_tree_can_shrink(root->node)) {
+        // last key gone, every index level emptied up to the root
+        if (!IS_BTREE_LEAF(root->node) && !root->node->header.nr_items) {
+                root->node->header.level = 0;
+                root->node->header.flags = LEAF_NODE;
+                root->node->header.prev = 0;
+                root->node->header.next = 0;
+                root->max_level = 0;
+        } else if (extent_tree_can_shrink(root->node)) {
                 struct buffer_head *new_bh;
 
                 root->node = extent_tree_shrink(root, &new_bh);
@@ -1077,9 +1382,679 @@ int extent_tree_delete_item(struct btree_root_node *root,
         }
 out:
         extent_drop_path_refs(path);
+        return ret;
+}
+
+int extent_tree_delete_item(struct btree_root_node *root,
+                            unsigned long offset)
+{
+        int ret;
+
+        if (offset > BTREE_MAX_OFFSET)
+                return -ENOENT;
+
+        extent_tree_write_lock(root);
+        ret = __extent_tree_delete_item(root, offset);
+        extent_tree_write_unlock(root);
+        return ret;
+}
+
+// keys packed into a bulk loaded node, leaving the headroom insert expects
+static inline int extent_bulk_node_cap(int max_items, int level, int fill)
+{
+        int cap = max_items * fill / 100;
+        int limit = level ? max_items - 3 : max_items - 1;
+
+        return clamp(cap, 2, limit);
+}
+
+/*
+ * Build the tree bottom-up from nr_keys keys sorted by offset. Each level
+ * is packed to fill percent of node capacity with keys spread evenly over
+ * its nodes, so no node starts out underflowed. The tree must be empty.
+ * Blocks referenced by the keys are left to the caller on failure.
+ */
+static int __extent_tree_bulk_load(struct btree_root_node *root,
+                                   struct btree_key *keys,
+                                   int nr_keys,
+                                   int fill)
+{
+        int i, n, level, ret = 0;
+        int nr_nodes = 0, max_nodes = 0;
+        int max_items = root->node->header.max_items;
+        unsigned long *blocks;
+        struct btree_key *in = keys, *out = NULL;
+        struct buffer_head *bh, *prev_bh = NULL;
+        struct btree_node *node, *prev = NULL;
+
+        if (root->max_level || root->node->header.nr_items)
+                return -EEXIST;
+
+        if (fill <= 0 || fill > 100)
+                return -EINVAL;
+
+        for (i = 0; i < nr_keys; i++) {
+                if (IS_KEY_EMPTY(keys[i]) ||
+                    (i && keys[i].offset <= keys[i - 1].offset))
+                        return -EINVAL;
+        }
+
+        if (!nr_keys)
+                return 0;
+
+        // size the tree up front, the root must fit MAX_BTREE_LEVEL
+        n = nr_keys;
+        level = 0;
+        do {
+                n = DIV_ROUND_UP(n, extent_bulk_node_cap(max_items, level, fill));
+                max_nodes += n;
+                level++;
+        } while (n > 1);
+
+        if (level > MAX_BTREE_LEVEL)
+                return -E2BIG;
+
+        blocks = kmalloc(max_nodes * sizeof(unsigned long), GFP_KERNEL);
+        if (!blocks)
+                return -ENOMEM;
+
+        n = nr_keys;
+        for (level = 0; ; level++) {
+                int j, k = 0;
+                int m = DIV_ROUND_UP(n, extent_bulk_node_cap(max_items, level, fill));
+
+                out = kmalloc(m * sizeof(struct btree_key), GFP_KERNEL);
+                if (!out) {
+                        ret = -ENOMEM;
+                        goto fail;
+                }
+
+                for (j = 0; j < m; j++) {
+                        // first n % m nodes take one key more
+                        int cnt = n / m + (j < n % m);
+
+                        node = extent_node_create(level,
+                                                  max_items,
+                                                  level ? INDEX_NODE : LEAF_NODE,
+                                                  &bh);
+                        if (!node) {
+                                ret = -ENOMEM;
+                                goto fail;
+                        }
+
+                        blocks[nr_nodes++] = node->header.blockptr;
+
+                        memcpy((char *)node->keys, (char *)&in[k],
+                               cnt * sizeof(struct btree_key));
+                        node->header.nr_items = cnt;
+                        extent_node_update_offset(node);
+                        k += cnt;
+
+                        extent_reset_key(&out[j]);
+                        SET_KEY_FROM_BTREE_HDR(out[j], node);
+
+                        if (prev_bh) {
+                                if (!level) {
+                                        prev->header.next = node->header.blockptr;
+                                        node->header.prev = prev->header.blockptr;
+                                }
+                                bump_put_buffer_head(prev_bh);
+                        }
+                        prev = node;
+                        prev_bh = bh;
+                }
+
+                bump_put_buffer_head(prev_bh);
+                prev_bh = NULL;
+
+                if (in != keys)
+                        kfree(in);
+                in = out;
+                out = NULL;
+                n = m;
+
+                if (n == 1)
+                        break;
+        }
+
+        bh = bump_get_buffer_head(in[0].blockptr);
+        if (!bh) {
+                ret = -EIO;
+                goto fail;
+        }
+
+        bump_release_block(root->node->header.blockptr, PAGE_SIZE);
+        bump_put_buffer_head(root->bh);
+
+        root->bh = bh;
+        root->node = BH2BTNODE(bh);
+        root->max_level = level;
+
+        btree_node_print("bulk loaded root", root->node);
+
+        kfree(in);
+        kfree(blocks);
+        return 0;
+
+fail:
+        if (prev_bh)
+                bump_put_buffer_head(prev_bh);
+
+        for (i = 0; i < nr_nodes; i++)
+                bump_release_block(blocks[i], PAGE_SIZE);
+
+        if (in != keys)
+                kfree(in);
+        kfree(out);
+        kfree(blocks);
+        return ret;
+}
+
+int extent_tree_bulk_load(struct btree_root_node *root,
+                          struct btree_key *keys,
+                          int nr_keys,
+                          int fill)
+{
+        int ret;
+
+        extent_tree_write_lock(root);
+        ret = __extent_tree_bulk_load(root, keys, nr_keys, fill);
+        extent_tree_write_unlock(root);
+        return ret;
+}
+
+/*
+ * Descend to the leaf for off holding one node reference at a time. *next
+ * is set to the lowest index key above the path taken, where the leaf
+ * following the returned one starts, or 0 for the last leaf.
+ */
+static struct buffer_head *extent_tree_descend(struct btree_root_node *root,
+                                               loff_t off,
+                                               u64 *next)
+{
+        int slot;
+        struct btree_key key = { .offset = off };
+        struct buffer_head *ebh, *bh = root->bh;
+        struct btree_node *node = root->node;
+
+        *next = 0;
+
+        get_bh(bh);
+
+        while (!IS_BTREE_LEAF(node)) {
+                slot = extent_index_node_search_keys(node, &key);
+                if (slot + 1 < node->header.nr_items)
+                        *next = node->keys[slot + 1].offset;
+                ebh = bump_get_buffer_head(node->keys[slot].blockptr);
+                bump_put_buffer_head(bh);
+                if (!ebh)
+                        return NULL;
+                bh = ebh;
+                node = BH2BTNODE(bh);
+        }
+        return bh;
+}
+
+/*
+ * Position iter at the last key not above off, or at the first key of the
+ * tree if there is none. The leaf reference is kept until
+ * extent_tree_iter_release(); the caller holds root->lock until then.
+ */
+int extent_tree_iter_init(struct btree_root_node *root,
+                          struct btree_iter *iter,
+                          loff_t off)
+{
+        int slot;
+        u64 next;
+        struct buffer_head *bh;
+
+        iter->root = root;
+        iter->bh = NULL;
+        iter->node = NULL;
+        iter->slot = 0;
+
+        bh = extent_tree_descend(root, off, &next);
+        if (!bh)
+                return -EIO;
+
+        slot = extent_node_upper_bound(BH2BTNODE(bh), off) - 1;
+
+        iter->bh = bh;
+        iter->node = BH2BTNODE(bh);
+        iter->slot = (slot < 0) ? 0 : slot;
         return 0;
 }
 
+/*
+ * Leaf links are not kept once a tree shares nodes with a snapshot, find
+ * the leaf after the current one from the root instead.
+ */
+static int extent_tree_iter_next_leaf(struct btree_iter *iter)
+{
+        u64 last, next;
+        struct buffer_head *bh;
+        struct btree_node *node = iter->node;
+
+        if (!node->header.nr_items) {
+                extent_tree_iter_release(iter);
+                return -ENOENT;
+        }
+
+        last = node->keys[node->header.nr_items - 1].offset;
+        extent_tree_iter_release(iter);
+
+        bh = extent_tree_descend(iter->root, last, &next);
+        if (!bh)
+                return -EIO;
+
+        if (extent_node_upper_bound(BH2BTNODE(bh), last) >=
+            BH2BTNODE(bh)->header.nr_items) {
+                bump_put_buffer_head(bh);
+                if (!next)
+                        return -ENOENT;
+                bh = extent_tree_descend(iter->root, next, &next);
+                if (!bh)
+                        return -EIO;
+        }
+
+        iter->bh = bh;
+        iter->node = BH2BTNODE(bh);
+        iter->slot = extent_node_upper_bound(iter->node, last);
+        return 0;
+}
+
+// return the key under the cursor and advance, following leaf links
+int extent_tree_iter_next(struct btree_iter *iter, struct btree_key *key)
+{
+        int ret;
+        u64 next;
+        struct buffer_head *ebh;
+
+        if (!iter->bh)
+                return -ENOENT;
+
+        while (iter->slot >= iter->node->header.nr_items) {
+                if (iter->root->flags & BTREE_ROOT_SHARED) {
+                        ret = extent_tree_iter_next_leaf(iter);
+                        if (ret < 0)
+                                return ret;
+                        continue;
+                }
+
+                next = iter->node->header.next;
+                extent_tree_iter_release(iter);
+                if (!next)
+                        return -ENOENT;
+                ebh = bump_get_buffer_head(next);
+                if (!ebh)
+                        return -EIO;
+                iter->bh = ebh;
+                iter->node = BH2BTNODE(ebh);
+                iter->slot = 0;
+        }
+
+        memcpy((char *)key, (char *)&iter->node->keys[iter->slot++],
+               sizeof(struct btree_key));
+        return 0;
+}
+
+void extent_tree_iter_release(struct btree_iter *iter)
+{
+        if (iter->bh)
+                bump_put_buffer_head(iter->bh);
+        iter->bh = NULL;
+        iter->node = NULL;
+}
+
+// one leaf of a range query, copied out under extent_tree_read()
+struct btree_leaf_read {
+        u64               pos;
+        u64               next;
+        int               nr_items;
+        struct btree_key *keys;
+};
+
+static long extent_tree_read_leaf_rcu(struct btree_root_node *root, void *arg)
+{
+        struct btree_leaf_read *rd = arg;
+        struct btree_node *leaf;
+
+        leaf = extent_tree_descend_rcu(root, rd->pos, &rd->next);
+        if (!leaf)
+                return -EAGAIN;
+
+        rd->nr_items = leaf->header.nr_items;
+        memcpy((char *)rd->keys, (char *)leaf->keys,
+               rd->nr_items * sizeof(struct btree_key));
+        return 0;
+}
+
+/*
+ * Collect keys with offsets in [off, off + range) on range_list as
+ * btree_key_entry items, in key order. Returns the number of keys added;
+ * the caller frees them with extent_tree_range_release().
+ *
+ * Leaves are read one at a time without the tree lock, each one as of a
+ * single point in time; writers may run between two leaves.
+ */
+int extent_tree_range_query(struct btree_root_node *root,
+                            loff_t off,
+                            size_t range,
+                            struct list_head *range_list)
+{
+        int i, count = 0;
+        long ret = 0;
+        u64 last = 0;
+        struct btree_key *key;
+        struct btree_key_entry *entry;
+        struct btree_leaf_read rd = { .pos = off };
+
+        if (off < 0 || off > BTREE_MAX_OFFSET)
+                return 0;
+
+        rd.keys = kmalloc(MAX_BKEYS_PER_BLOCK * sizeof(struct btree_key), GFP_KERNEL);
+        if (!rd.keys)
+                return -ENOMEM;
+
+        for (;;) {
+                ret = extent_tree_read(root, extent_tree_read_leaf_rcu, &rd);
+                if (ret < 0)
+                        goto fail;
+
+                for (i = 0; i < rd.nr_items; i++) {
+                        key = &rd.keys[i];
+                        // a leaf may have been split into the one we read
+                        if (key->offset < off || (count && key->offset <= last))
+                                continue;
+                        if (key->offset - off >= range)
+                                goto out;
+                        entry = kmalloc(sizeof(struct btree_key_entry), GFP_KERNEL);
+                        if (!entry) {
+                                ret = -ENOMEM;
+                                goto fail;
+                        }
+                        memcpy((char *)&entry->key, (char *)key, sizeof(struct btree_key));
+                        list_add_tail(&entry->list, range_list);
+                        last = key->offset;
+                        count++;
+                }
+
+                if (!rd.next)
+                        break;
+                rd.pos = rd.next;
+        }
+out:
+        kfree(rd.keys);
+        return count;
+
+fail:
+        kfree(rd.keys);
+        extent_tree_range_release(range_list);
+        return ret;
+}
+
+void extent_tree_range_release(struct list_head *range_list)
+{
+        struct btree_key_entry *entry, *tmp;
+
+        list_for_each_entry_safe(entry, tmp, range_list, list) {
+                list_del(&entry->list);
+                kfree(entry);
+        }
+}
+
+/*
+ * Snapshot a tree as version. The snapshot shares every node with the
+ * tree through block reference counts; either version copies the shared
+ * nodes on its path when it is modified.
+ */
+struct btree_root_node* extent_tree_snapshot(struct btree_root_node *root,
+                                             int version)
+{
+        struct btree_root_node *snap;
+
+        snap = kzalloc(sizeof(struct btree_root_node), GFP_KERNEL);
+        if (!snap)
+                return NULL;
+
+        mutex_init(&snap->lock);
+        seqcount_init(&snap->seq);
+
+        extent_tree_write_lock(root);
+
+        bump_block_get(root->node->header.blockptr);
+        get_bh(root->bh);
+
+        root->flags |= BTREE_ROOT_SHARED;
+
+        snap->inode = root->inode;
+        snap->node = root->node;
+        snap->bh = root->bh;
+        snap->max_level = root->max_level;
+        snap->flags = root->flags;
+        snap->version = version;
+
+        extent_tree_write_unlock(root);
+        return snap;
+}
+
+// position of a tree walk, one node per level from the root down
+struct btree_cursor {
+        struct buffer_head *bh[MAX_BTREE_LEVEL];
+        struct btree_node  *nodes[MAX_BTREE_LEVEL];
+        int                 slots[MAX_BTREE_LEVEL];
+        int                 level;
+        int                 top;
+};
+
+static void extent_cursor_init(struct btree_cursor *c,
+                               struct btree_root_node *root)
+{
+        c->top = c->level = root->max_level;
+        c->nodes[c->top] = root->node;
+        c->slots[c->top] = 0;
+        c->bh[c->top] = root->bh;
+        get_bh(root->bh);
+
+        if (!root->node->header.nr_items) {
+                bump_put_buffer_head(c->bh[c->top]);
+                c->level++;
+        }
+}
+
+static inline bool extent_cursor_done(struct btree_cursor *c)
+{
+        return c->level > c->top;
+}
+
+static inline struct btree_key *extent_cursor_key(struct btree_cursor *c)
+{
+        return &c->nodes[c->level]->keys[c->slots[c->level]];
+}
+
+// skip the key or subtree under the cursor
+static void extent_cursor_next(struct btree_cursor *c)
+{
+        c->slots[c->level]++;
+        while (c->slots[c->level] >= c->nodes[c->level]->header.nr_items) {
+                bump_put_buffer_head(c->bh[c->level]);
+                if (++c->level > c->top)
+                        return;
+                c->slots[c->level]++;
+        }
+}
+
+static int extent_cursor_down(struct btree_cursor *c)
+{
+        struct buffer_head *bh;
+
+        bh = bump_get_buffer_head(extent_cursor_key(c)->blockptr);
+        if (!bh)
+                return -EIO;
+
+        c->level--;
+        c->bh[c->level] = bh;
+        c->nodes[c->level] = BH2BTNODE(bh);
+        c->slots[c->level] = 0;
+        return 0;
+}
+
+static void extent_cursor_release(struct btree_cursor *c)
+{
+        for (; c->level <= c->top; c->level++)
+                bump_put_buffer_head(c->bh[c->level]);
+}
+
+// lock two trees in address order
+static void extent_tree_lock_pair(struct btree_root_node *a,
+                                  struct btree_root_node *b)
+{
+        if (a > b)
+                swap(a, b);
+
+        mutex_lock(&a->lock);
+        if (a != b)
+                mutex_lock_nested(&b->lock, SINGLE_DEPTH_NESTING);
+}
+
+static void extent_tree_unlock_pair(struct btree_root_node *a,
+                                    struct btree_root_node *b)
+{
+        mutex_unlock(&a->lock);
+        if (a != b)
+                mutex_unlock(&b->lock);
+}
+
+static int extent_delta_add(struct list_head *delta_list,
+                            struct btree_key *key,
+                            int op)
+{
+        struct btree_delta_entry *entry;
+
+        entry = kmalloc(sizeof(struct btree_delta_entry), GFP_KERNEL);
+        if (!entry)
+                return -ENOMEM;
+
+        memcpy((char *)&entry->key, (char *)key, sizeof(struct btree_key));
+        entry->op = op;
+        list_add_tail(&entry->list, delta_list);
+        return 0;
+}
+
+/*
+ * Collect on delta_list the keys added, removed or changed going from one
+ * tree version to another, in key order. Both trees are walked in step;
+ * a subtree reached through the same index key in both is shared and is
+ * skipped without being read, so the cost follows the size of the change.
+ * Returns the number of entries added, release them with
+ * extent_tree_delta_release().
+ */
+int extent_tree_delta(struct btree_root_node *from,
+                      struct btree_root_node *to,
+                      struct list_head *delta_list)
+{
+        int ret = 0, count = 0;
+        struct btree_key *ka, *kb;
+        struct btree_cursor a, b;
+
+        // the walk holds node references, keep writers of both trees out
+        extent_tree_lock_pair(from, to);
+
+        extent_cursor_init(&a, from);
+        extent_cursor_init(&b, to);
+
+        while (!ret && (!extent_cursor_done(&a) || !extent_cursor_done(&b))) {
+                // descend until both cursors point at keys of the same level
+                if (extent_cursor_done(&b) ||
+                    (!extent_cursor_done(&a) && a.level > b.level)) {
+                        if (a.level) {
+                                ret = extent_cursor_down(&a);
+                                continue;
+                        }
+                }
+
+                if (extent_cursor_done(&a) ||
+                    (!extent_cursor_done(&b) && b.level > a.level)) {
+                        if (b.level) {
+                                ret = extent_cursor_down(&b);
+                                continue;
+                        }
+                }
+
+                if (extent_cursor_done(&b)) {
+                        ret = extent_delta_add(delta_list, extent_cursor_key(&a),
+                                               BTREE_DELTA_DEL);
+                        extent_cursor_next(&a);
+                        count++;
+                        continue;
+                }
+
+                if (extent_cursor_done(&a)) {
+                        ret = extent_delta_add(delta_list, extent_cursor_key(&b),
+                                               BTREE_DELTA_ADD);
+                        extent_cursor_next(&b);
+                        count++;
+                        continue;
+                }
+
+                ka = extent_cursor_key(&a);
+                kb = extent_cursor_key(&b);
+
+                if (a.level) {
+                        if ((ka->offset == kb->offset) &&
+                            (ka->blockptr == kb->blockptr)) {
+                                extent_cursor_next(&a);
+                                extent_cursor_next(&b);
+                        } else {
+                                ret = extent_cursor_down(&a);
+                                if (!ret)
+                                        ret = extent_cursor_down(&b);
+                        }
+                        continue;
+                }
+
+                if (ka->offset < kb->offset) {
+                        ret = extent_delta_add(delta_list, ka, BTREE_DELTA_DEL);
+                        extent_cursor_next(&a);
+                        count++;
+                } else if (ka->offset > kb->offset) {
+                        ret = extent_delta_add(delta_list, kb, BTREE_DELTA_ADD);
+                        extent_cursor_next(&b);
+                        count++;
+                } else {
+                        if ((ka->blockptr != kb->blockptr) ||
+                            (ka->size != kb->size)) {
+                                ret = extent_delta_add(delta_list, kb,
+                                                       BTREE_DELTA_MOD);
+                                count++;
+                        }
+                        extent_cursor_next(&a);
+                        extent_cursor_next(&b);
+                }
+        }
+
+        extent_cursor_release(&a);
+        extent_cursor_release(&b);
+
+        extent_tree_unlock_pair(from, to);
+
+        if (ret < 0) {
+                extent_tree_delta_release(delta_list);
+                return ret;
+        }
+        return count;
+}
+
+void extent_tree_delta_release(struct list_head *delta_list)
+{
+        struct btree_delta_entry *entry, *tmp;
+
+        list_for_each_entry_safe(entry, tmp, delta_list, list) {
+                list_del(&entry->list);
+                kfree(entry);
+        }
+}
+
 // DFS
 unsigned long extent_tree_dump(struct seq_file *m, struct btree_node *node, long refcount, int count)
 {
@@ -1106,7 +2081,7 @@ unsigned long extent_tree_dump(struct seq_file *m, struct btree_node *node, long
                 for (j = 0; j <= count; j++)
                         seq_printf(m, "-");
 
-                seq_printf(m, "[%d] offset :%llu  bptr :%llu\n", i,
+                seq_printf(m, "[%d] offset :%u  bptr :%u\n", i,
                               node->keys[i].offset,
                               node->keys[i].blockptr);
 
@@ -1147,6 +2122,12 @@ struct btree_root_node* extent_tree_init(int version, int max_keys)
         struct btree_root_node *root = NULL;
         struct buffer_head *bh = NULL;
 
+        if (max_keys < 4 || max_keys > MAX_BKEYS_PER_BLOCK) {
+                pr_err("invalid fanout :%d, node holds up to %zu keys\n",
+                       max_keys, MAX_BKEYS_PER_BLOCK);
+                return NULL;
+        }
+
         root = kzalloc(sizeof(struct btree_root_node), GFP_KERNEL);
         if (!root)
                 goto exit;
@@ -1159,6 +2140,8 @@ struct btree_root_node* extent_tree_init(int version, int max_keys)
         root->inode = NULL;
         root->max_level = 0;
         root->version = version;
+        mutex_init(&root->lock);
+        seqcount_init(&root->seq);
         return root;
 
 exit:
@@ -1168,9 +2151,11 @@ exit:
 
 void extent_tree_destroy(struct btree_root_node *root)
 {
+        bool shared = extent_block_shared(root->node->header.blockptr);
+
         bump_leak_detector();
         extent_node_destroy(root->node);
-        BUG_ON(root->node->header.nr_items);
+        BUG_ON(!shared && root->node->header.nr_items);
         bump_put_buffer_head(root->bh);
         root->node = NULL;
         kfree(root);
@@ -1209,7 +2194,11 @@ static void cleanup_test_root(void)
 static int
 __init init_btree_tests(void)
 {
-        bump_allocator_init();
+        int ret;
+
+        ret = bump_allocator_init();
+        if (ret)
+                return ret;
         btreedev_init();
         init_test_root();
         btree_info("btree-store module loaded");
@@ -4,6 +4,8 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/buffer_head.h>
 #include <linux/seq_file.h>
 
@@ -21,14 +23,24 @@ struct btree_header {
         __le64 offset;
         __le64 blockptr;
         __le64 flags;
+        __le64 prev;    // leaf sibling links, 0 at either end
+        __le64 next;
 } __attribute__ ((__packed__));
 
+/*
+ * Keys are 32-bit wide to pack more of them in a node, the store's
+ * offsets and bump allocated blocks stay below 2^32. 0xFFFFFFFF is kept
+ * as the empty key marker.
+ */
 struct btree_key {
-        __le64 offset;
+        __le32 offset;
         __le32 size;
-        __le64 blockptr;
+        __le32 blockptr;
 } __attribute__ ((__packed__));
 
+#define BTREE_MAX_OFFSET            (U32_MAX - 1)
+#define BTREE_MAX_BLOCK             (U32_MAX - 1)
+
 struct btree_node {
         struct btree_header header;
         struct btree_key    keys[MAX_BKEYS_PER_BLOCK];
@@ -36,19 +48,53 @@ struct btree_node {
 
 // in-memory
 struct btree_path {
+        struct btree_root_node *root;
         struct btree_node  *nodes[MAX_BTREE_LEVEL];
         struct buffer_head *bh[MAX_BTREE_LEVEL];
+        int                 slots[MAX_BTREE_LEVEL]; // child slot taken at each level
         int                 depth;
         int                 level;
 };
 
+// leaf cursor for in-order scans, the caller holds the tree lock
+struct btree_iter {
+        struct btree_root_node *root;
+        struct buffer_head     *bh;
+        struct btree_node      *node;
+        int                     slot;
+};
+
+struct btree_key_entry {
+        struct list_head list;
+        struct btree_key key;
+};
+
+enum {
+        BTREE_DELTA_ADD,
+        BTREE_DELTA_DEL,
+        BTREE_DELTA_MOD,
+};
+
+// key changed between two tree versions, see extent_tree_delta()
+struct btree_delta_entry {
+        struct list_head list;
+        struct btree_key key;
+        int              op;
+};
+
+// tree shares nodes with a snapshot
+#define BTREE_ROOT_SHARED 0x1
+
 struct btree_root_node {
         struct inode* inode;
         struct btree_node* node;
         struct buffer_head *bh;
         int    version;
         int    max_level;
-        struct list_head list;
+        unsigned long flags;
+        struct mutex lock;      // serializes writers
+        seqcount_t   seq;       // odd while a writer updates the tree
+        struct hlist_node hash; // btree device version table
 };
 
 struct btree_operations {
@@ -72,17 +118,41 @@ int extent_tree_insert_item(struct btree_root_node *root,
 int extent_tree_delete_item(struct btree_root_node *root,
                             unsigned long key);
 
+int extent_tree_bulk_load(struct btree_root_node *root,
+                          struct btree_key *keys,
+                          int nr_keys,
+                          int fill);
+
+int extent_tree_iter_init(struct btree_root_node *root,
+                          struct btree_iter *iter,
+                          loff_t off);
+
+int extent_tree_iter_next(struct btree_iter *iter,
+                          struct btree_key *key);
+
+void extent_tree_iter_release(struct btree_iter *iter);
+
 int extent_tree_range_query(struct btree_root_node *root,
                             loff_t off,
                             size_t range,
-                            struct list_head *range_list,
-                            int level);
+                            struct list_head *range_list);
+
+void extent_tree_range_release(struct list_head *range_list);
 
 struct btree_root_node* extent_tree_init(int version,
                                          int max_keys);
 
 void extent_tree_destroy(struct btree_root_node *root);
 
+struct btree_root_node* extent_tree_snapshot(struct btree_root_node *root,
+                                             int version);
+
+int extent_tree_delta(struct btree_root_node *from,
+                      struct btree_root_node *to,
+                      struct list_head *delta_list);
+
+void extent_tree_delta_release(struct list_head *delta_list);
+
 unsigned long extent_tree_dump(struct seq_file *m,
                                struct btree_node *node,
                                long refcount,
@@ -92,7 +162,7 @@ struct dentry *btree_debugfs_init(struct btree_root_node *btree_root);
 
 int btree_debugfs_destroy(struct dentry *dentry);
 
-#define BH2BTNODE(bh) ((struct btree_node *)(bh->b_data))
+#define BH2BTNODE(bh) ((struct btree_node *)((bh)->b_data))
 
 #define IS_BTREE_LEAF(node) \
         ((node)->header.flags == LEAF_NODE)
@@ -135,7 +205,7 @@ int btree_debugfs_destroy(struct dentry *dentry);
                         (node)->header.nr_items, \
                         (node)->header.flags == INDEX_NODE ? "INDEX" : "LEAF"); \
                 for (i = 0; i < (node)->header.nr_items; i++) \
-                        pr_debug("bptr=%llu [%u] offset=%llu keybptr=%llu\n", \
+                        pr_debug("bptr=%llu [%u] offset=%u keybptr=%u\n", \
                                 (node)->header.blockptr, i, \
                                 (node)->keys[i].offset, \
                                 (node)->keys[i].blockptr);\
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#include "btree_ioctl.h"
+
+/*
+ * Inserts and looks up nr_keys keys one ioctl per key, then again with
+ * BTREE_IOCTL_WRITEV and BTREE_IOCTL_READV in batches, and reports the
+ * throughput of both.
+ *
+ * usage: btree_batch_bench [nr_keys] [batch size]
+ */
+
+#define NR_KEYS      100000
+#define BATCH_SIZE   64
+#define BLOCK_SIZE   4096
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int tree_create(int fd, int version)
+{
+        struct btree_ioctl_arg arg;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.version = version;
+        arg.fanout  = 32;
+        return ioctl(fd, BTREE_IOCTL_CREATE, &arg) < 0 ? -EIO : 0;
+}
+
+static void tree_destroy(int fd, int version)
+{
+        struct btree_ioctl_arg arg;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.version = version;
+        if (ioctl(fd, BTREE_IOCTL_DESTROY, &arg) < 0)
+                printf("destroy ioctl failed\n");
+}
+
+static unsigned long run_single(int fd, int version, unsigned long cmd,
+                                unsigned long nr_keys, char *buf)
+{
+        unsigned long i, errors = 0;
+        struct btree_ioctl_arg arg;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.version = version;
+        arg.data = buf;
+        arg.datalen = BLOCK_SIZE;
+
+        for (i = 0; i < nr_keys; i++) {
+                arg.offset = i;
+                if (ioctl(fd, cmd, &arg) < 0)
+                        errors++;
+        }
+        return errors;
+}
+
+static unsigned long run_batch(int fd, int version, unsigned long cmd,
+                               unsigned long nr_keys, int batch, char *buf,
+                               struct btree_ioctl_vec *vecs)
+{
+        long ret;
+        unsigned long i, j, n, errors = 0;
+        struct btree_ioctl_arg arg;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.version = version;
+        arg.data = vecs;
+
+        for (i = 0; i < nr_keys; i += n) {
+                n = nr_keys - i < (unsigned long)batch ? nr_keys - i : batch;
+                for (j = 0; j < n; j++) {
+                        vecs[j].offset = i + j;
+                        vecs[j].data = (__u64)(unsigned long)(buf + j * BLOCK_SIZE);
+                        vecs[j].datalen = BLOCK_SIZE;
+                        vecs[j].status = 0;
+                }
+                arg.datalen = n * sizeof(struct btree_ioctl_vec);
+                ret = ioctl(fd, cmd, &arg);
+                if (ret < 0)
+                        errors += n;
+                else
+                        errors += n - ret;
+        }
+        return errors;
+}
+
+static void report(const char *name, unsigned long nr_keys, double elapsed,
+                   unsigned long errors)
+{
+        printf("%-8s %12.0f ops/s", name, nr_keys / elapsed);
+        if (errors)
+                printf(" (%lu failed)", errors);
+        printf("\n");
+}
+
+int main(int argc, char **argv) {
+        int fd, ret = 0;
+        int batch = BATCH_SIZE;
+        unsigned long errors, nr_keys = NR_KEYS;
+        double start;
+        char *buf;
+        struct btree_ioctl_vec *vecs;
+
+        if (argc > 1)
+                nr_keys = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                batch = atoi(argv[2]);
+        if (batch < 1)
+                batch = 1;
+
+        fd = open("/dev/btree-store", O_RDWR);
+        if (fd < 0) {
+                printf("failed to open device\n");
+                return -ENODEV;
+        }
+
+        buf = calloc(batch, BLOCK_SIZE);
+        vecs = calloc(batch, sizeof(struct btree_ioctl_vec));
+        if (!buf || !vecs) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        if (tree_create(fd, 1) || tree_create(fd, 2)) {
+                printf("create ioctl failed\n");
+                ret = -EIO;
+                goto destroy;
+        }
+
+        printf("%lu keys, batch %d\n", nr_keys, batch);
+
+        start = now();
+        errors = run_single(fd, 1, BTREE_IOCTL_WRITE, nr_keys, buf);
+        report("write", nr_keys, now() - start, errors);
+
+        start = now();
+        errors = run_batch(fd, 2, BTREE_IOCTL_WRITEV, nr_keys, batch, buf, vecs);
+        report("writev", nr_keys, now() - start, errors);
+
+        start = now();
+        errors = run_single(fd, 1, BTREE_IOCTL_READ, nr_keys, buf);
+        report("read", nr_keys, now() - start, errors);
+
+        start = now();
+        errors = run_batch(fd, 2, BTREE_IOCTL_READV, nr_keys, batch, buf, vecs);
+        report("readv", nr_keys, now() - start, errors);
+
+destroy:
+        tree_destroy(fd, 1);
+        tree_destroy(fd, 2);
+out:
+        free(vecs);
+        free(buf);
+        close(fd);
+        return ret;
+}
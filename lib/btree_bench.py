@@ -0,0 +1,67 @@
+"""
+ btree lib microbenchmark
+ (C) 2019, Saptarshi Sen
+
+ Replays a key trace (btree.replay2 by default) through the debugfs
+ insert, lookup and delete files of linux-btree.ko and prints the
+ per-operation cost accounted by the module. Run once against each
+ module build to compare node search/update changes. Elapsed time
+ includes a debugfs write per key, the module stats give the tree cost.
+
+ usage: python btree_bench.py [replay file] [max keys]
+"""
+import sys
+import csv
+import time
+
+DEBUGFS = '/sys/kernel/debug/btree/'
+
+REPLAY_FILE = 'btree.replay2'
+
+def LoadKeys(path, max_keys):
+    keys = []
+    seen = set()
+    with open(path, 'r') as csvfile:
+        reader = csv.reader(csvfile, delimiter=' ')
+        for row in reader:
+            if len(row) < 2 or row[1] in seen:
+                continue
+            seen.add(row[1])
+            keys.append(row[1])
+            if max_keys and len(keys) >= max_keys:
+                break
+    return keys
+
+def Replay(op, keys):
+    ''' writes each key to the debugfs op file, one write per key '''
+    start = time.time()
+    with open(DEBUGFS + op, 'w', buffering=1) as f:
+        for key in keys:
+            f.write(key + '\n')
+            f.flush()
+    return time.time() - start
+
+def ResetStats():
+    with open(DEBUGFS + 'stats', 'w') as f:
+        f.write('0\n')
+
+def ShowStats():
+    with open(DEBUGFS + 'stats', 'r') as f:
+        print(f.read())
+
+def BenchDriver():
+    path = sys.argv[1] if len(sys.argv) > 1 else REPLAY_FILE
+    max_keys = int(sys.argv[2]) if len(sys.argv) > 2 else 0
+
+    keys = LoadKeys(path, max_keys)
+    print('replaying {} keys from {}'.format(len(keys), path))
+
+    ResetStats()
+    for op in ['insert', 'lookup', 'delete']:
+        elapsed = Replay(op, keys)
+        print('{:8s} {:8d} keys {:10.3f} s {:10.0f} ns/key'.format(op,
+              len(keys), elapsed, elapsed * 1e9 / max(len(keys), 1)))
+    ShowStats()
+
+if __name__ == "__main__":
+    BenchDriver()
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#include "btree_ioctl.h"
+
+/*
+ * Compares building a tree of nr_keys sequential keys with one
+ * BTREE_IOCTL_WRITE per key against a single BTREE_IOCTL_BULK.
+ *
+ * usage: btree_bulk_bench [nr_keys] [fill percent] [fanout]
+ */
+
+#define MAX_KEYS  1000000
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long nr_keys, double elapsed)
+{
+        printf("%-8s %10lu keys %10.3f s %12.0f keys/s\n",
+               name, nr_keys, elapsed, nr_keys / elapsed);
+}
+
+int main(int argc, char **argv) {
+        int fd, ret = 0;
+        double start;
+        unsigned long i, nr_keys = MAX_KEYS;
+        int fill = BTREE_BULK_FILL_DEFAULT, fanout = 32;
+        __u64 *offsets;
+        struct btree_ioctl_arg arg;
+
+        if (argc > 1)
+                nr_keys = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                fill = atoi(argv[2]);
+        if (argc > 3)
+                fanout = atoi(argv[3]);
+
+        fd = open("/dev/btree-store", O_RDWR);
+        if (fd < 0) {
+                printf("failed to open device\n");
+                return -ENODEV;
+        }
+
+        offsets = malloc(nr_keys * sizeof(__u64));
+        if (!offsets) {
+                ret = -ENOMEM;
+                goto exit;
+        }
+
+        for (i = 0; i < nr_keys; i++)
+                offsets[i] = i;
+
+        // repeated single key inserts
+        arg.version = 1;
+        arg.fanout  = fanout;
+        if (ioctl(fd, BTREE_IOCTL_CREATE, &arg) < 0) {
+                printf("create ioctl failed\n");
+                ret = -EIO;
+                goto out;
+        }
+
+        start = now();
+        for (i = 0; i < nr_keys; i++) {
+                arg.offset = offsets[i];
+                arg.data = NULL;
+                arg.datalen = 0;
+                if (ioctl(fd, BTREE_IOCTL_WRITE, &arg) < 0) {
+                        printf("write ioctl failed\n");
+                        ret = -EIO;
+                        break;
+                }
+        }
+        if (!ret)
+                report("insert", nr_keys, now() - start);
+
+        if (ioctl(fd, BTREE_IOCTL_DESTROY, &arg) < 0)
+                printf("destroy ioctl failed\n");
+        if (ret)
+                goto out;
+
+        // bottom-up bulk load
+        arg.version = 2;
+        arg.fanout  = fanout;
+        if (ioctl(fd, BTREE_IOCTL_CREATE, &arg) < 0) {
+                printf("create ioctl failed\n");
+                ret = -EIO;
+                goto out;
+        }
+
+        arg.data = offsets;
+        arg.datalen = nr_keys * sizeof(__u64);
+        arg.fanout = fill;
+
+        start = now();
+        if (ioctl(fd, BTREE_IOCTL_BULK, &arg) < 0) {
+                printf("bulk ioctl failed\n");
+                ret = -EIO;
+        } else
+                report("bulk", nr_keys, now() - start);
+
+        if (ioctl(fd, BTREE_IOCTL_DESTROY, &arg) < 0)
+                printf("destroy ioctl failed\n");
+out:
+        free(offsets);
+exit:
+        close(fd);
+        return ret;
+}
@@ -1,8 +1,12 @@
 #include <linux/fs.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rwsem.h>
 #include <linux/module.h>
 #include <linux/ioctl.h>
 #include <linux/miscdevice.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <asm/uaccess.h>
 
 #include "btree.h"
@@ -11,117 +15,131 @@
 
 #define BTREE_MISC 254
 
-struct list_head btree_ver_list;
+#define BTREE_VER_HASH_BITS 6
 
-static long btreedev_create_extent_tree(int version, int fanout)
+// vectors copied in per batch step
+#define BTREE_VEC_CHUNK 64
+
+/*
+ * Tree versions hashed by version number. create, destroy and snap take
+ * btree_ver_sem for write, every other op holds it for read for as long
+ * as it uses the root, so a root cannot be destroyed under it.
+ */
+DEFINE_HASHTABLE(btree_ver_table, BTREE_VER_HASH_BITS);
+DECLARE_RWSEM(btree_ver_sem);
+
+// caller holds btree_ver_sem
+struct btree_root_node *btreedev_find_root(int version)
 {
-        struct btree_root_node *root, *iter;
+        struct btree_root_node *iter;
 
-        list_for_each_entry(iter, &btree_ver_list, list) {
-                if (iter->version == version) {
-                        pr_err("version already exists! :%d\n", version);
-                        return -EEXIST;
-                }
+        hash_for_each_possible(btree_ver_table, iter, hash, version) {
+                if (iter->version == version)
+                        return iter;
+        }
+        return NULL;
+}
+
+static long btreedev_create_extent_tree(int version, int fanout)
+{
+        long retl;
+        struct btree_root_node *root;
+
+        down_write(&btree_ver_sem);
+        if (btreedev_find_root(version)) {
+                pr_err("version already exists! :%d\n", version);
+                retl = -EEXIST;
+                goto out;
         }
 
         root = extent_tree_init(version, fanout);
-        if (root)
-                list_add(&root->list, &btree_ver_list);
-        else {
+        if (!root) {
                 pr_err("extent tree create failed\n");
-                return -EIO;
+                retl = -EIO;
+                goto out;
         }
 
+        hash_add(btree_ver_table, &root->hash, root->version);
         pr_info("extent tree created with version :%d\n", version);
-        return root->version;
+        retl = root->version;
+out:
+        up_write(&btree_ver_sem);
+        return retl;
 }
 
 static long btreedev_destroy_extent_tree(int version)
 {
-        long retl = -ENOENT;
-        struct btree_root_node *iter, *tmp;
+        struct btree_root_node *root;
 
-        list_for_each_entry_safe(iter, tmp, &btree_ver_list, list) {
-                if (iter->version != version)
-                        continue;
-                list_del(&iter->list);
-                extent_tree_destroy(iter);
-                retl = 0;
-        }
+        down_write(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (root)
+                hash_del(&root->hash);
+        up_write(&btree_ver_sem);
 
-        if (!retl)
-                pr_info("extent tree destroyed with version :%d\n", version);
-        return retl;
+        if (!root)
+                return -ENOENT;
+
+        extent_tree_destroy(root);
+        pr_info("extent tree destroyed with version :%d\n", version);
+        return 0;
 }
 
-static long btreedev_insert_extent(int version, loff_t off, void __user *data, size_t datalen)
+static long __btreedev_insert_extent(struct btree_root_node *root, loff_t off,
+                                     void __user *data, size_t datalen)
 {
+        int ret;
         unsigned long block;
         struct buffer_head *bh;
-        struct btree_root_node *root = NULL, *iter = NULL;
 
         if (datalen > PAGE_SIZE) {
                 pr_err("%s, invalid datalen\n", __func__);
                 return -EINVAL;
         }
 
-        list_for_each_entry(iter, &btree_ver_list, list) {
-                if (iter->version != version)
-                        continue;
-                root = iter;
-                break;
-        }
-
-        if (!root) {
-                pr_err("%s failed, root node not found!", __func__);
-                return -EINVAL;
-        }
+        if (off < 0 || off > BTREE_MAX_OFFSET)
+                return -ERANGE;
 
         block = bump_alloc_data_block();
+        if (!block)
+                return -ENOMEM;
 
         bh = bump_get_buffer_head(block);
         if (!bh) {
                 pr_err("%s failed, buffer head!", __func__);
+                bump_release_block(block, PAGE_SIZE);
                 return -EIO;
         }
 
         if (copy_from_user((void *)bh->b_data, data, datalen)) {
-                brelse(bh);
+                bump_put_buffer_head(bh);
+                bump_release_block(block, PAGE_SIZE);
                 return -EFAULT;
         }
 
         bump_put_buffer_head(bh);
 
         pr_debug("inserting off=%llu, block=%lu\n", off, block);
-        return extent_tree_insert_item(root, off, block, datalen);
+        ret = extent_tree_insert_item(root, off, block, datalen);
+        if (ret)
+                bump_release_block(block, PAGE_SIZE);
+        return ret;
 }
 
-static long btreedev_lookup_extent(int version, loff_t off, void __user *data, size_t datalen)
+static long __btreedev_lookup_extent(struct btree_root_node *root, loff_t off,
+                                     void __user *data, size_t datalen)
 {
-        unsigned long retl, block;
+        long retl, block;
         struct buffer_head *bh;
-        struct btree_root_node *root = NULL, *iter = NULL;
 
         if (datalen > PAGE_SIZE) {
                 pr_err("%s, invalid datalen\n", __func__);
                 return -EINVAL;
         }
 
-        list_for_each_entry(iter, &btree_ver_list, list) {
-                if (iter->version != version)
-                        continue;
-                root = iter;
-                break;
-        }
-
-        if (!root) {
-                pr_err("%s failed, root node not found!", __func__);
-                return -EINVAL;
-        }
-
         block = extent_tree_lookup_item(root, off, datalen);
         if (block < 0) {
-                pr_err("%s failed, cannot find key :%llu\n", __func__, off);
+                pr_debug("%s failed, cannot find key :%llu\n", __func__, off);
                 return -ENOENT;
         }
 
@@ -131,9 +149,9 @@ static long btreedev_lookup_extent(int version, loff_t off, void __user *data, s
                 return -EIO;
         }
 
-        if (copy_to_user(data, (void*) bh->b_data, PAGE_SIZE)) {
-                retl = -ENOENT;
-        } else
+        if (copy_to_user(data, (void*) bh->b_data, datalen))
+                retl = -EFAULT;
+        else
                 retl = datalen;
 
         bump_put_buffer_head(bh);
@@ -141,38 +159,272 @@ static long btreedev_lookup_extent(int version, loff_t off, void __user *data, s
         return retl;
 }
 
-static long btreedev_range_query_extents(int version, loff_t off, size_t range, int level)
+static long btreedev_insert_extent(int version, loff_t off, void __user *data, size_t datalen)
 {
-        unsigned long count = 0;
-#if 0
-        struct list_head range_list;
-        struct btree_root_node *root = NULL, *iter = NULL;
+        long retl;
+        struct btree_root_node *root;
 
-        INIT_LIST_HEAD(&range_list);
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (root)
+                retl = __btreedev_insert_extent(root, off, data, datalen);
+        else {
+                pr_err("%s failed, root node not found!", __func__);
+                retl = -EINVAL;
+        }
+        up_read(&btree_ver_sem);
+        return retl;
+}
 
-        list_for_each_entry(iter, &btree_ver_list, list) {
-                if (iter->version != version)
-                        continue;
-                root = iter;
-                break;
+static long btreedev_lookup_extent(int version, loff_t off, void __user *data, size_t datalen)
+{
+        long retl;
+        struct btree_root_node *root;
+
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (root)
+                retl = __btreedev_lookup_extent(root, off, data, datalen);
+        else {
+                pr_err("%s failed, root node not found!", __func__);
+                retl = -EINVAL;
+        }
+        up_read(&btree_ver_sem);
+        return retl;
+}
+
+/*
+ * Runs an array of datalen bytes of btree_ioctl_vec through insert or
+ * lookup with a single root lookup, writing each op's result back into
+ * its status field. Returns the number of ops that succeeded.
+ */
+static long btreedev_vec_extents(int version, void __user *data, size_t datalen,
+                                 bool write)
+{
+        long i, n, done, nr_vecs, retl = 0;
+        struct btree_ioctl_vec *vecs;
+        struct btree_ioctl_vec __user *uvecs = data;
+        struct btree_root_node *root;
+
+        nr_vecs = datalen / sizeof(struct btree_ioctl_vec);
+        if (!nr_vecs || datalen % sizeof(struct btree_ioctl_vec)) {
+                pr_err("%s, invalid datalen\n", __func__);
+                return -EINVAL;
+        }
+
+        vecs = kmalloc(BTREE_VEC_CHUNK * sizeof(struct btree_ioctl_vec),
+                       GFP_KERNEL);
+        if (!vecs)
+                return -ENOMEM;
+
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (!root) {
+                pr_err("%s failed, root node not found!", __func__);
+                retl = -EINVAL;
+                goto out;
         }
 
+        for (done = 0; done < nr_vecs; done += n) {
+                n = min_t(long, nr_vecs - done, BTREE_VEC_CHUNK);
+                if (copy_from_user(vecs, &uvecs[done], n * sizeof(*vecs))) {
+                        retl = -EFAULT;
+                        goto out;
+                }
+
+                for (i = 0; i < n; i++) {
+                        void __user *buf = (void __user *)(unsigned long)vecs[i].data;
+
+                        if (write)
+                                vecs[i].status = __btreedev_insert_extent(root,
+                                                                          vecs[i].offset,
+                                                                          buf,
+                                                                          vecs[i].datalen);
+                        else
+                                vecs[i].status = __btreedev_lookup_extent(root,
+                                                                          vecs[i].offset,
+                                                                          buf,
+                                                                          vecs[i].datalen);
+                        if (vecs[i].status >= 0)
+                                retl++;
+                }
+
+                if (copy_to_user(&uvecs[done], vecs, n * sizeof(*vecs))) {
+                        retl = -EFAULT;
+                        goto out;
+                }
+        }
+out:
+        up_read(&btree_ver_sem);
+        kfree(vecs);
+        return retl;
+}
+
+static long btreedev_range_query_extents(int version, loff_t off, size_t range)
+{
+        long count;
+        struct list_head range_list;
+        struct btree_root_node *root;
+
+        INIT_LIST_HEAD(&range_list);
+
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
         if (!root) {
+                up_read(&btree_ver_sem);
                 pr_err("%s failed, root node not found!", __func__);
                 return -EINVAL;
         }
-        
-        extent_tree_range_query(root, off, range, &range_list, level);
 
-        list_for_each_entry(iter_key, &range_list, list)
-                count++;
-#endif
+        count = extent_tree_range_query(root, off, range, &range_list);
+        up_read(&btree_ver_sem);
+
+        extent_tree_range_release(&range_list);
         return count;
 }
 
-static long btreedev_fetch_extent_delta(int fd, int snapfd, loff_t off, size_t datalen)
+static long btreedev_bulk_load_extents(int version, void __user *data, size_t datalen, int fill)
+{
+        long i, nr_keys, retl;
+        __u64 *offsets;
+        struct btree_key *keys;
+        struct btree_root_node *root;
+
+        nr_keys = datalen / sizeof(__u64);
+        if (!nr_keys || datalen % sizeof(__u64) || nr_keys > INT_MAX) {
+                pr_err("%s, invalid datalen\n", __func__);
+                return -EINVAL;
+        }
+
+        offsets = vmalloc(datalen);
+        keys = vzalloc(nr_keys * sizeof(struct btree_key));
+        if (!offsets || !keys) {
+                vfree(keys);
+                vfree(offsets);
+                return -ENOMEM;
+        }
+
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (!root) {
+                pr_err("%s failed, root node not found!", __func__);
+                retl = -EINVAL;
+                goto out;
+        }
+
+        if (copy_from_user(offsets, data, datalen)) {
+                retl = -EFAULT;
+                goto out;
+        }
+
+        for (i = 0; i < nr_keys; i++) {
+                if (offsets[i] > BTREE_MAX_OFFSET) {
+                        retl = -ERANGE;
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < nr_keys; i++) {
+                keys[i].offset = offsets[i];
+                keys[i].size = PAGE_SIZE;
+                keys[i].blockptr = bump_alloc_data_block();
+        }
+
+        retl = extent_tree_bulk_load(root, keys, nr_keys,
+                                     fill ? fill : BTREE_BULK_FILL_DEFAULT);
+        if (retl < 0) {
+                pr_err("%s failed, bulk load status :%ld\n", __func__, retl);
+                for (i = 0; i < nr_keys; i++)
+                        bump_release_block(keys[i].blockptr, PAGE_SIZE);
+        } else
+                retl = nr_keys;
+out:
+        up_read(&btree_ver_sem);
+        vfree(keys);
+        vfree(offsets);
+        return retl;
+}
+
+static long btreedev_snapshot_extent_tree(int version, int snapid)
+{
+        long retl;
+        struct btree_root_node *root, *snap;
+
+        down_write(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        if (!root) {
+                pr_err("%s failed, root node not found!", __func__);
+                retl = -EINVAL;
+                goto out;
+        }
+
+        if (btreedev_find_root(snapid)) {
+                pr_err("version already exists! :%d\n", snapid);
+                retl = -EEXIST;
+                goto out;
+        }
+
+        snap = extent_tree_snapshot(root, snapid);
+        if (!snap) {
+                retl = -ENOMEM;
+                goto out;
+        }
+
+        hash_add(btree_ver_table, &snap->hash, snap->version);
+        pr_info("extent tree version :%d snapshot :%d\n", version, snapid);
+        retl = snapid;
+out:
+        up_write(&btree_ver_sem);
+        return retl;
+}
+
+static long btreedev_fetch_extent_delta(int version, int snapid, loff_t off,
+                                        void __user *data, size_t datalen)
 {
-        return -ENOTSUPP;
+        long count = 0, nr_max;
+        struct list_head delta_list;
+        struct btree_delta_entry *entry;
+        struct btree_ioctl_delta rec;
+        struct btree_root_node *root, *snap;
+        struct btree_ioctl_delta __user *urec = data;
+
+        down_read(&btree_ver_sem);
+        root = btreedev_find_root(version);
+        snap = btreedev_find_root(snapid);
+        if (!root || !snap) {
+                up_read(&btree_ver_sem);
+                pr_err("%s failed, root node not found!", __func__);
+                return -EINVAL;
+        }
+
+        INIT_LIST_HEAD(&delta_list);
+
+        nr_max = data ? datalen / sizeof(struct btree_ioctl_delta) : 0;
+
+        count = extent_tree_delta(snap, root, &delta_list);
+        up_read(&btree_ver_sem);
+        if (count < 0)
+                return count;
+
+        count = 0;
+        list_for_each_entry(entry, &delta_list, list) {
+                if (entry->key.offset < off)
+                        continue;
+                if (count < nr_max) {
+                        rec.offset = entry->key.offset;
+                        rec.blockptr = entry->key.blockptr;
+                        rec.size = entry->key.size;
+                        rec.op = entry->op;
+                        if (copy_to_user(&urec[count], &rec, sizeof(rec))) {
+                                count = -EFAULT;
+                                break;
+                        }
+                }
+                count++;
+        }
+
+        extent_tree_delta_release(&delta_list);
+        return count;
 }
 
 long btreedev_ioctl(struct file *file, unsigned cmd, unsigned long arg)
@@ -194,13 +446,22 @@ long btreedev_ioctl(struct file *file, unsigned cmd, unsigned long arg)
                 return btreedev_insert_extent(argp->version, argp->offset, argp->data, argp->datalen);
 
         case BTREE_IOCTL_RQUERY:
-                return btreedev_range_query_extents(argp->version, argp->offset, argp->datalen, 0);
+                return btreedev_range_query_extents(argp->version, argp->offset, argp->datalen);
+
+        case BTREE_IOCTL_BULK:
+                return btreedev_bulk_load_extents(argp->version, argp->data, argp->datalen, argp->fanout);
 
         case BTREE_IOCTL_DELTA:
-                return btreedev_fetch_extent_delta(argp->version, argp->snapid, argp->offset, argp->datalen);
+                return btreedev_fetch_extent_delta(argp->version, argp->snapid, argp->offset, argp->data, argp->datalen);
 
         case BTREE_IOCTL_SNAP:
-                break;
+                return btreedev_snapshot_extent_tree(argp->version, argp->snapid);
+
+        case BTREE_IOCTL_WRITEV:
+                return btreedev_vec_extents(argp->version, argp->data, argp->datalen, true);
+
+        case BTREE_IOCTL_READV:
+                return btreedev_vec_extents(argp->version, argp->data, argp->datalen, false);
         }
 
         return -ENOTTY;
@@ -220,18 +481,19 @@ struct miscdevice btreedev_misc = {
 
 int __init btreedev_init(void)
 {
-        INIT_LIST_HEAD(&btree_ver_list);
         return misc_register(&btreedev_misc);
 }
 
 void __exit btreedev_exit(void)
 {
-        struct btree_root_node *iter, *tmp;
+        int bkt;
+        struct hlist_node *tmp;
+        struct btree_root_node *iter;
 
-        list_for_each_entry_safe(iter, tmp, &btree_ver_list, list) {
+        hash_for_each_safe(btree_ver_table, bkt, tmp, iter, hash) {
                 pr_info("releasing btree version :%d\n", iter->version);
+                hash_del(&iter->hash);
                 extent_tree_destroy(iter);
-                list_del(&iter->list);
         }
 
         if (misc_deregister(&btreedev_misc) < 0)
@@ -23,6 +23,43 @@ struct btree_ioctl_arg {
 #define BTREE_IOCTL_READ           _IOR(BTREE_DEV_MAGIC, 4, struct btree_ioctl_arg)
 #define BTREE_IOCTL_DELTA          _IO(BTREE_DEV_MAGIC,  5)
 #define BTREE_IOCTL_RQUERY         _IO(BTREE_DEV_MAGIC,  6)
+#define BTREE_IOCTL_BULK           _IOW(BTREE_DEV_MAGIC, 7, struct btree_ioctl_arg)
+#define BTREE_IOCTL_WRITEV         _IOWR(BTREE_DEV_MAGIC, 8, struct btree_ioctl_arg)
+#define BTREE_IOCTL_READV          _IOWR(BTREE_DEV_MAGIC, 9, struct btree_ioctl_arg)
+
+/*
+ * BTREE_IOCTL_SNAP snapshots tree version as snapid. BTREE_IOCTL_DELTA
+ * reports the keys from offset on that changed going from snapid to
+ * version as btree_ioctl_delta records in data, up to datalen bytes, and
+ * returns the number of changes.
+ */
+struct btree_ioctl_delta {
+        __u64 offset;
+        __u64 blockptr;
+        __u32 size;
+        __u32 op;
+}__attribute__((packed));
+
+/*
+ * BTREE_IOCTL_BULK loads an empty tree from data, an array of datalen
+ * bytes of __u64 offsets in ascending order. fanout is the node fill
+ * percent, 0 selects BTREE_BULK_FILL_DEFAULT.
+ */
+#define BTREE_BULK_FILL_DEFAULT    90
+
+/*
+ * BTREE_IOCTL_WRITEV and BTREE_IOCTL_READV run an insert or a lookup for
+ * each btree_ioctl_vec in data, an array of datalen bytes. data points to
+ * the op's user buffer of datalen bytes. Each op's result, as returned by
+ * BTREE_IOCTL_WRITE or BTREE_IOCTL_READ, is written back to its status
+ * and the ioctl returns the number of ops that succeeded.
+ */
+struct btree_ioctl_vec {
+        __u64 offset;
+        __u64 data;
+        __u32 datalen;
+        __s32 status;
+}__attribute__((packed));
 
 //int  btreedev_init(void);
 //void btreedev_exit(void);
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#include "btree_ioctl.h"
+
+/*
+ * Bulk loads nr_keys keys, then runs random BTREE_IOCTL_READ lookups from
+ * 1, 2, 4 .. max_threads threads and reports throughput and scaling over
+ * the single thread run.
+ *
+ * usage: btree_lookup_bench [nr_keys] [lookups per thread] [max threads]
+ */
+
+#define NR_KEYS      100000
+#define NR_LOOKUPS   100000
+#define MAX_THREADS  8
+#define BLOCK_SIZE   4096
+
+struct bench_thread {
+        pthread_t     tid;
+        int           fd;
+        unsigned int  seed;
+        unsigned long nr_keys;
+        unsigned long nr_lookups;
+        unsigned long errors;
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *lookup_thread(void *data)
+{
+        unsigned long i;
+        struct btree_ioctl_arg arg;
+        struct bench_thread *t = data;
+        char *buf = malloc(BLOCK_SIZE);
+
+        if (!buf) {
+                t->errors = t->nr_lookups;
+                return NULL;
+        }
+
+        arg.version = 1;
+        arg.data = buf;
+        arg.datalen = BLOCK_SIZE;
+
+        for (i = 0; i < t->nr_lookups; i++) {
+                arg.offset = rand_r(&t->seed) % t->nr_keys;
+                if (ioctl(t->fd, BTREE_IOCTL_READ, &arg) < 0)
+                        t->errors++;
+        }
+
+        free(buf);
+        return NULL;
+}
+
+static int run(int fd, int nr_threads, unsigned long nr_keys,
+               unsigned long nr_lookups, double *rate)
+{
+        int i;
+        double start, elapsed;
+        unsigned long errors = 0;
+        struct bench_thread *threads;
+
+        threads = calloc(nr_threads, sizeof(struct bench_thread));
+        if (!threads)
+                return -ENOMEM;
+
+        start = now();
+        for (i = 0; i < nr_threads; i++) {
+                threads[i].fd = fd;
+                threads[i].seed = i + 1;
+                threads[i].nr_keys = nr_keys;
+                threads[i].nr_lookups = nr_lookups;
+                pthread_create(&threads[i].tid, NULL, lookup_thread, &threads[i]);
+        }
+
+        for (i = 0; i < nr_threads; i++) {
+                pthread_join(threads[i].tid, NULL);
+                errors += threads[i].errors;
+        }
+        elapsed = now() - start;
+
+        free(threads);
+
+        if (errors) {
+                printf("%lu lookups failed\n", errors);
+                return -EIO;
+        }
+
+        *rate = nr_threads * nr_lookups / elapsed;
+        return 0;
+}
+
+int main(int argc, char **argv) {
+        int fd, nr, ret = 0;
+        int max_threads = MAX_THREADS;
+        unsigned long i, nr_keys = NR_KEYS, nr_lookups = NR_LOOKUPS;
+        double rate, base = 0;
+        __u64 *offsets;
+        struct btree_ioctl_arg arg;
+
+        if (argc > 1)
+                nr_keys = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                nr_lookups = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                max_threads = atoi(argv[3]);
+
+        fd = open("/dev/btree-store", O_RDWR);
+        if (fd < 0) {
+                printf("failed to open device\n");
+                return -ENODEV;
+        }
+
+        offsets = malloc(nr_keys * sizeof(__u64));
+        if (!offsets) {
+                ret = -ENOMEM;
+                goto exit;
+        }
+
+        for (i = 0; i < nr_keys; i++)
+                offsets[i] = i;
+
+        arg.version = 1;
+        arg.fanout  = 32;
+        if (ioctl(fd, BTREE_IOCTL_CREATE, &arg) < 0) {
+                printf("create ioctl failed\n");
+                ret = -EIO;
+                goto out;
+        }
+
+        arg.data = offsets;
+        arg.datalen = nr_keys * sizeof(__u64);
+        arg.fanout = 0;
+        if (ioctl(fd, BTREE_IOCTL_BULK, &arg) < 0) {
+                printf("bulk ioctl failed\n");
+                ret = -EIO;
+                goto destroy;
+        }
+
+        for (nr = 1; nr <= max_threads; nr *= 2) {
+                ret = run(fd, nr, nr_keys, nr_lookups, &rate);
+                if (ret)
+                        break;
+                if (nr == 1)
+                        base = rate;
+                printf("%3d threads %12.0f lookups/s %6.2fx\n",
+                       nr, rate, rate / base);
+        }
+
+destroy:
+        if (ioctl(fd, BTREE_IOCTL_DESTROY, &arg) < 0)
+                printf("destroy ioctl failed\n");
+out:
+        free(offsets);
+exit:
+        close(fd);
+        return ret;
+}
@@ -1,12 +1,50 @@
 #include <linux/fs.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/rwsem.h>
 
 #include "btree.h"
 
 int bt_version;
 
-extern struct list_head btree_ver_list;
+extern struct rw_semaphore btree_ver_sem;
+struct btree_root_node *btreedev_find_root(int version);
+
+enum {
+        BTREE_STAT_INSERT,
+        BTREE_STAT_LOOKUP,
+        BTREE_STAT_DELETE,
+        BTREE_STAT_MAX,
+};
+
+static const char *btree_stat_names[BTREE_STAT_MAX] = {
+        "insert", "lookup", "delete",
+};
+
+// per-operation cost, as seen from the debugfs write path
+struct btree_op_stat {
+        atomic64_t count;
+        atomic64_t total_ns;
+        atomic64_t max_ns;
+};
+
+static struct btree_op_stat btree_stats[BTREE_STAT_MAX];
+
+static void btree_stat_account(int op, ktime_t start)
+{
+        s64 delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+        s64 max = atomic64_read(&btree_stats[op].max_ns);
+
+        atomic64_inc(&btree_stats[op].count);
+        atomic64_add(delta, &btree_stats[op].total_ns);
+        while (delta > max) {
+                s64 old = atomic64_cmpxchg(&btree_stats[op].max_ns, max, delta);
+                if (old == max)
+                        break;
+                max = old;
+        }
+}
 
 static int btree_debugfs_show(struct seq_file *m, void *data)
 {
@@ -15,10 +53,12 @@ static int btree_debugfs_show(struct seq_file *m, void *data)
 
         root_node = (struct btree_root_node *)m->private;
         if (root_node) {
+                mutex_lock(&root_node->lock);
                 nr_keys = extent_tree_dump(m,
                                            root_node->node,
                                            atomic_read(&root_node->bh->b_count),
                                            0);
+                mutex_unlock(&root_node->lock);
                 seq_printf(m, "Total Keys Stored :%lu\n", nr_keys);
         }
         return 0;
@@ -32,16 +72,18 @@ static int btree_debugfs_show_version(struct seq_file *m, void *data)
 
         vers = *(int *)m->private;
 
-        list_for_each_entry(root_node, &btree_ver_list, list) {
-                if (root_node->version != vers)
-                        continue;
+        down_read(&btree_ver_sem);
+        root_node = btreedev_find_root(vers);
+        if (root_node) {
+                mutex_lock(&root_node->lock);
                 nr_keys = extent_tree_dump(m,
                                            root_node->node,
                                            atomic_read(&root_node->bh->b_count),
                                            0);
+                mutex_unlock(&root_node->lock);
                 seq_printf(m, "Total Keys Stored :%lu\n", nr_keys);
-                break;
         }
+        up_read(&btree_ver_sem);
         return 0;
 }
 
@@ -51,6 +93,7 @@ static ssize_t btree_debugfs_insert(struct file *file,
                                    loff_t *off)
 {
         int rc;
+        ktime_t start;
         unsigned long value;
         struct btree_root_node *root_node;
 
@@ -59,17 +102,45 @@ static ssize_t btree_debugfs_insert(struct file *file,
                 return rc;
 
         root_node = (struct btree_root_node *) (file_inode(file)->i_private);
-        if (extent_tree_insert_item(root_node, value, 0, PAGE_SIZE) < 0)
+        start = ktime_get();
+        rc = extent_tree_insert_item(root_node, value, 0, PAGE_SIZE);
+        btree_stat_account(BTREE_STAT_INSERT, start);
+        if (rc < 0)
                 return -EIO;
         return count;
 }
 
+static ssize_t btree_debugfs_lookup(struct file *file,
+                                   const char __user *ubuf,
+                                   size_t count,
+                                   loff_t *off)
+{
+        int rc;
+        long block;
+        ktime_t start;
+        unsigned long value;
+        struct btree_root_node *root_node;
+
+        rc = kstrtoul_from_user(ubuf, count, 10, &value);
+        if (rc)
+                return rc;
+
+        root_node = (struct btree_root_node *) (file_inode(file)->i_private);
+        start = ktime_get();
+        block = extent_tree_lookup_item(root_node, value, PAGE_SIZE);
+        btree_stat_account(BTREE_STAT_LOOKUP, start);
+        if (block < 0)
+                return block;
+        return count;
+}
+
 static ssize_t btree_debugfs_delete(struct file *file,
                                    const char __user *ubuf,
                                    size_t count,
                                    loff_t *off)
 {
         int rc;
+        ktime_t start;
         unsigned long value;
         struct btree_root_node *root_node;
 
@@ -78,11 +149,48 @@ static ssize_t btree_debugfs_delete(struct file *file,
                 return rc;
 
         root_node = (struct btree_root_node *) (file_inode(file)->i_private);
-        if (extent_tree_delete_item(root_node, value) < 0)
+        start = ktime_get();
+        rc = extent_tree_delete_item(root_node, value);
+        btree_stat_account(BTREE_STAT_DELETE, start);
+        if (rc < 0)
                 return -EIO;
         return count;
 }
 
+static int btree_debugfs_show_stats(struct seq_file *m, void *data)
+{
+        int i;
+
+        seq_printf(m, "%-8s %10s %14s %10s %10s\n",
+                   "op", "count", "total(ns)", "avg(ns)", "max(ns)");
+        for (i = 0; i < BTREE_STAT_MAX; i++) {
+                s64 nr = atomic64_read(&btree_stats[i].count);
+                s64 total = atomic64_read(&btree_stats[i].total_ns);
+
+                seq_printf(m, "%-8s %10lld %14lld %10lld %10lld\n",
+                           btree_stat_names[i], nr, total,
+                           nr ? div64_s64(total, nr) : 0,
+                           (s64)atomic64_read(&btree_stats[i].max_ns));
+        }
+        return 0;
+}
+
+// any write resets the counters
+static ssize_t btree_debugfs_reset_stats(struct file *file,
+                                         const char __user *ubuf,
+                                         size_t count,
+                                         loff_t *off)
+{
+        int i;
+
+        for (i = 0; i < BTREE_STAT_MAX; i++) {
+                atomic64_set(&btree_stats[i].count, 0);
+                atomic64_set(&btree_stats[i].total_ns, 0);
+                atomic64_set(&btree_stats[i].max_ns, 0);
+        }
+        return count;
+}
+
 static ssize_t btree_debugfs_update_version(struct file *file,
                                             const char __user *ubuf,
                                             size_t count,
@@ -103,6 +211,11 @@ static int btree_debugfs_open(struct inode *inode, struct file *file)
         return single_open(file, btree_debugfs_show, inode->i_private);
 }
 
+static int btree_debugfs_open_stats(struct inode *inode, struct file *file)
+{
+        return single_open(file, btree_debugfs_show_stats, inode->i_private);
+}
+
 static int btree_debugfs_open_version(struct inode *inode, struct file *file)
 {
         return single_open(file, btree_debugfs_show_version, inode->i_private);
@@ -124,6 +237,22 @@ static const struct file_operations btree_delops = {
         .release 	= single_release,
 };
 
+static const struct file_operations btree_lookupops = {
+        .open		= btree_debugfs_open,
+        .read 		= seq_read,
+        .write 		= btree_debugfs_lookup,
+        .llseek 	= no_llseek,
+        .release 	= single_release,
+};
+
+static const struct file_operations btree_statops = {
+        .open		= btree_debugfs_open_stats,
+        .read 		= seq_read,
+        .write 		= btree_debugfs_reset_stats,
+        .llseek 	= no_llseek,
+        .release 	= single_release,
+};
+
 static const struct file_operations btree_ioctlops = {
         .open		= btree_debugfs_open_version,
         .read 		= seq_read,
@@ -135,7 +264,7 @@ static const struct file_operations btree_ioctlops = {
 struct dentry *btree_debugfs_init(struct btree_root_node *btree_root)
 {
         struct dentry *dir;
-        struct dentry *insert, *delete, *ioctl;
+        struct dentry *insert, *delete, *lookup, *stats, *ioctl;
 
         dir = debugfs_create_dir("btree", NULL);
         if (!dir)
@@ -154,7 +283,23 @@ struct dentry *btree_debugfs_init(struct btree_root_node *btree_root)
                                      dir,
                                      (void *) btree_root,
                                      &btree_delops);
-        if (!insert)
+        if (!delete)
+                goto free_out;
+
+        lookup = debugfs_create_file("lookup",
+                                     0644,
+                                     dir,
+                                     (void *) btree_root,
+                                     &btree_lookupops);
+        if (!lookup)
+                goto free_out;
+
+        stats = debugfs_create_file("stats",
+                                     0644,
+                                     dir,
+                                     NULL,
+                                     &btree_statops);
+        if (!stats)
                 goto free_out;
 
         ioctl = debugfs_create_file("version",
@@ -1,7 +1,13 @@
 #include <linux/gfp.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
+#include <linux/pagemap.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
 #include <linux/radix-tree.h>
 #include <linux/buffer_head.h>
 
@@ -9,10 +15,71 @@
 
 #define META_BLOCK_START (1UL << 30)
 
-static atomic_t data_block, meta_block;
+#define BUMP_CHUNK_ORDER 4      // pages are carved from 64K chunks
+#define BUMP_CHUNK_PAGES (1 << BUMP_CHUNK_ORDER)
 
 static struct radix_tree_root pgtree; // track btree index pages
 
+static DEFINE_SPINLOCK(pgtree_lock); // serializes pgtree updates, lookups are RCU
+
+static struct kmem_cache *bump_block_cachep;
+
+/*
+ * backing page of a block, blocks are shared by tree snapshots. A block
+ * whose last reference is dropped goes back to its arena's free list an
+ * RCU grace period later, so lockless tree readers never see it reused
+ * under them. Free blocks keep their entry and page, refcount 0.
+ */
+struct bump_block {
+        struct page       *page;
+        unsigned long      block;
+        atomic_t           refcount;
+        struct bump_block *next_free;
+        struct rcu_head    rcu;
+};
+
+struct bump_chunk {
+        struct list_head list;
+        struct page     *page;
+};
+
+/*
+ * Data and meta blocks are numbered from separate arenas. Block numbers
+ * and pages of freed blocks are handed out again before the arena grows,
+ * so memory follows the peak number of live blocks.
+ */
+struct bump_arena {
+        const char        *name;
+        unsigned long      start;
+        unsigned long      limit;       // block numbers the arena may hand out
+        unsigned long      next;        // block numbers handed out so far
+        struct mutex       lock;        // serializes allocation
+        spinlock_t         free_lock;   // free list, fed from RCU callbacks
+        struct bump_block *free;
+        struct list_head   chunks;
+        int                chunk_used;  // pages taken from the newest chunk
+        atomic_long_t      live;
+        long               peak;
+};
+
+static struct bump_arena data_arena = {
+        .name      = "data",
+        .start     = 0,
+        .limit     = META_BLOCK_START - 1,
+        .lock      = __MUTEX_INITIALIZER(data_arena.lock),
+        .free_lock = __SPIN_LOCK_UNLOCKED(data_arena.free_lock),
+        .chunks    = LIST_HEAD_INIT(data_arena.chunks),
+};
+
+static struct bump_arena meta_arena = {
+        .name      = "meta",
+        .start     = META_BLOCK_START,
+        .limit     = U32_MAX - 1 - META_BLOCK_START, // block keys are 32-bit
+        .lock      = __MUTEX_INITIALIZER(meta_arena.lock),
+        .free_lock = __SPIN_LOCK_UNLOCKED(meta_arena.free_lock),
+        .chunks    = LIST_HEAD_INIT(meta_arena.chunks),
+};
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0))
 static inline int page_ref_count(struct page *page)
 {
@@ -20,47 +87,157 @@ static inline int page_ref_count(struct page *page)
 }
 #endif
 
-static int bump_alloc_backing_pages(unsigned long block, size_t size)
+static inline struct bump_arena *bump_block_arena(unsigned long block)
 {
-        int i, nblocks = size >> PAGE_SHIFT;
+        return (block > META_BLOCK_START) ? &meta_arena : &data_arena;
+}
 
-        for (i = 0; i < nblocks; i++) {
-                struct page *page;
+// entry of an allocated block, under rcu_read_lock()
+static struct bump_block *bump_lookup_block(unsigned long block)
+{
+        struct bump_block *bb = radix_tree_lookup(&pgtree, block);
+
+        return (bb && atomic_read(&bb->refcount)) ? bb : NULL;
+}
+
+// next unused page of the newest chunk, a new chunk when it is used up
+static struct page *bump_arena_grow(struct bump_arena *arena)
+{
+        struct page *page;
+        struct bump_chunk *chunk;
+
+        if (!list_empty(&arena->chunks) && arena->chunk_used < BUMP_CHUNK_PAGES) {
+                chunk = list_first_entry(&arena->chunks, struct bump_chunk, list);
+                return chunk->page + arena->chunk_used++;
+        }
+
+        chunk = kmalloc(sizeof(struct bump_chunk), GFP_KERNEL);
+        if (!chunk)
+                return NULL;
+
+        page = alloc_pages(GFP_KERNEL | __GFP_ZERO, BUMP_CHUNK_ORDER);
+        if (!page) {
+                kfree(chunk);
+                return NULL;
+        }
+        // pages of a chunk are handed out and locked one by one
+        split_page(page, BUMP_CHUNK_ORDER);
 
-                page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-                if (!page)
-                        return -ENOMEM;
-                if (radix_tree_insert(&pgtree, block + i, page))
-                        return -EIO;
-                pr_debug("allocating backing page for block:%lu\n", block + i);
-                #ifdef DBG_BTREE_PAGE_REFCOUNT
-                pr_debug("%s : page 0x%p:%u\n", __func__, page, page_ref_count(page));
-                #endif
+        chunk->page = page;
+        list_add(&chunk->list, &arena->chunks);
+        arena->chunk_used = 1;
+        return page;
+}
+
+static unsigned long bump_arena_alloc(struct bump_arena *arena)
+{
+        long live;
+        struct page *page;
+        struct bump_block *bb;
+
+        mutex_lock(&arena->lock);
+
+        spin_lock_bh(&arena->free_lock);
+        bb = arena->free;
+        if (bb)
+                arena->free = bb->next_free;
+        spin_unlock_bh(&arena->free_lock);
+
+        if (bb) {
+                // entry is still in pgtree, readers only see it once live
+                clear_page(page_address(bb->page));
+                pr_debug("reusing block:%lu\n", bb->block);
+                goto out;
+        }
+
+        if (arena->next >= arena->limit) {
+                pr_err("%s arena is out of block numbers\n", arena->name);
+                goto fail;
+        }
+
+        bb = kmem_cache_alloc(bump_block_cachep, GFP_KERNEL);
+        if (!bb)
+                goto fail;
+
+        page = bump_arena_grow(arena);
+        if (!page)
+                goto fail_free;
+
+        bb->page = page;
+        bb->block = ++arena->next + arena->start;
+        bb->next_free = NULL;
+        atomic_set(&bb->refcount, 0);
+
+        if (radix_tree_preload(GFP_KERNEL))
+                goto fail_page;
+        spin_lock(&pgtree_lock);
+        if (radix_tree_insert(&pgtree, bb->block, bb)) {
+                spin_unlock(&pgtree_lock);
+                radix_tree_preload_end();
+                goto fail_page;
         }
+        spin_unlock(&pgtree_lock);
+        radix_tree_preload_end();
+        pr_debug("allocating backing page for block:%lu\n", bb->block);
+        #ifdef DBG_BTREE_PAGE_REFCOUNT
+        pr_debug("%s : page 0x%p:%u\n", __func__, page, page_ref_count(page));
+        #endif
+out:
+        atomic_set(&bb->refcount, 1);
+        live = atomic_long_inc_return(&arena->live);
+        if (live > arena->peak)
+                arena->peak = live;
+        mutex_unlock(&arena->lock);
+        return bb->block;
+
+fail_page:
+        // the page stays with its chunk until the allocator is released
+fail_free:
+        kmem_cache_free(bump_block_cachep, bb);
+fail:
+        mutex_unlock(&arena->lock);
         return 0;
 }
 
+static void bump_free_block_rcu(struct rcu_head *head)
+{
+        struct bump_block *bb = container_of(head, struct bump_block, rcu);
+        struct bump_arena *arena = bump_block_arena(bb->block);
+
+        ClearPagePrivate(bb->page);
+        #ifdef DBG_BTREE_PAGE_REFCOUNT
+        pr_debug("%s : page 0x%p:%u\n", __func__, bb->page, page_ref_count(bb->page));
+        #endif
+
+        spin_lock_bh(&arena->free_lock);
+        bb->next_free = arena->free;
+        arena->free = bb;
+        spin_unlock_bh(&arena->free_lock);
+        atomic_long_dec(&arena->live);
+}
+
 static int bump_release_backing_pages(unsigned long block, size_t size)
 {
-        int i, nblocks = size >> PAGE_SHIFT;
+        int i, nblocks = max_t(int, DIV_ROUND_UP(size, PAGE_SIZE), 1);
 
         for (i = 0; i < nblocks; i++) {
-                struct page *page;
+                struct bump_block *bb;
 
-                pr_debug("releasing backing page for block:%lu\n", block + i);
-                page = radix_tree_lookup(&pgtree, block + i); 
-                if (!page) {
+                rcu_read_lock();
+                bb = bump_lookup_block(block + i);
+                rcu_read_unlock();
+                if (!bb) {
                         pr_err("radix tree lookup failed for block :%lu\n", block + i);
                         dump_stack();
                         continue;
                 }
-                radix_tree_delete(&pgtree, block + i);
-                ClearPagePrivate(page);
-                #ifdef DBG_BTREE_PAGE_REFCOUNT
-                pr_debug("%s: radix tree entry deleted :%lu\n", __func__, block + i);
-                pr_debug("%s : page 0x%p:%u\n", __func__, page, page_ref_count(page));
-                #endif
-                put_page(page);
+
+                // still referenced by another tree version
+                if (!atomic_dec_and_test(&bb->refcount))
+                        continue;
+
+                pr_debug("releasing backing page for block:%lu\n", block + i);
+                call_rcu(&bb->rcu, bump_free_block_rcu);
         }
         return 0;
 }
@@ -75,8 +252,13 @@ static void bump_scan_backing_pages(struct radix_tree_root *radix_root)
                 pr_warn("radix_tree height!! :%d", radix_root->height);
 
         radix_tree_for_each_slot(slot, radix_root, &iter, 0) {
-                struct page *page = (struct page *)radix_tree_deref_slot(slot);
-                BUG_ON(radix_tree_exception(page));
+                struct bump_block *bb = radix_tree_deref_slot(slot);
+                struct page *page;
+
+                BUG_ON(radix_tree_exception(bb));
+                if (!atomic_read(&bb->refcount))
+                        continue;
+                page = bb->page;
                 pr_warn("%s :[%lu] leaked block :%lu page :%p(ref :%u)\n",
                                 __func__,
                                 i++,
@@ -90,14 +272,20 @@ struct buffer_head* bump_get_buffer_head(unsigned long block)
 {
         struct buffer_head *bh;
         struct page *page;
-       
-        page = radix_tree_lookup(&pgtree, block); 
-        if (!page) {
+        struct bump_block *bb;
+
+        rcu_read_lock();
+        bb = bump_lookup_block(block);
+        rcu_read_unlock();
+        if (!bb) {
                 pr_err("radix tree lookup failed for block :%lu\n", block);
                 dump_stack();
                 return NULL;
         }
+        page = bb->page;
 
+        // blocks shared by snapshots are reached from more than one tree
+        lock_page(page);
         if (!page_has_buffers(page)) {
                 bh = alloc_page_buffers(page, PAGE_SIZE, 1);
                 BUG_ON(atomic_read(&bh->b_count));
@@ -107,16 +295,20 @@ struct buffer_head* bump_get_buffer_head(unsigned long block)
                 bh = page_buffers(page);
                 pr_debug("found buffer head :%lu\n", block);
         }
-
         get_bh(bh);
+        unlock_page(page);
         return bh;
 }
 
 void bump_put_buffer_head(struct buffer_head *bh)
 {
         unsigned int count;
+        struct page *page;
 
         BUG_ON(bh == NULL);
+        page = bh->b_page;
+
+        lock_page(page);
         count = atomic_read(&bh->b_count);
 
         #ifdef DBG_BTREE_PAGE_REFCOUNT
@@ -129,54 +321,138 @@ void bump_put_buffer_head(struct buffer_head *bh)
         } else {
                 if (count == 1) {
                         brelse(bh);
-                        set_page_private(bh->b_page, 0UL);
-                        ClearPagePrivate(bh->b_page);
+                        set_page_private(page, 0UL);
+                        ClearPagePrivate(page);
                         free_buffer_head(bh);
                 } else
                         brelse(bh);
         }
+        unlock_page(page);
 }
 
 unsigned long bump_alloc_data_block(void)
 {
-        unsigned long block;
-
-        atomic_inc(&data_block);
-        block = atomic_read(&data_block);
-        (void) bump_alloc_backing_pages(block, PAGE_SIZE);
-        return block;
+        return bump_arena_alloc(&data_arena);
 }
 
 unsigned long bump_alloc_meta_block(void)
 {
-        unsigned long mblock;
-
-        atomic_inc(&meta_block);
-        mblock = atomic_read(&meta_block);
-        (void) bump_alloc_backing_pages(mblock, PAGE_SIZE);
-        return mblock;
+        return bump_arena_alloc(&meta_arena);
 }
 
+// drop a reference, the block is freed with its last reference
 void bump_release_block(unsigned long block, size_t size)
 {
         bump_release_backing_pages(block, size);
 }
 
-void bump_allocator_init(void)
+void bump_block_get(unsigned long block)
+{
+        struct bump_block *bb;
+
+        rcu_read_lock();
+        bb = bump_lookup_block(block);
+        if (bb)
+                atomic_inc(&bb->refcount);
+        else
+                pr_err("radix tree lookup failed for block :%lu\n", block);
+        rcu_read_unlock();
+}
+
+int bump_block_refcount(unsigned long block)
 {
-        atomic_set(&data_block, 0);
-        atomic_set(&meta_block, META_BLOCK_START);
-        INIT_RADIX_TREE(&pgtree, GFP_KERNEL);
+        int refcount;
+        struct bump_block *bb;
+
+        rcu_read_lock();
+        bb = bump_lookup_block(block);
+        refcount = bb ? atomic_read(&bb->refcount) : 0;
+        rcu_read_unlock();
+        return refcount;
+}
+
+/*
+ * Contents of block without taking a buffer reference, for lockless
+ * readers. Only valid inside the caller's rcu_read_lock() section.
+ */
+void *bump_block_data(unsigned long block)
+{
+        struct bump_block *bb = radix_tree_lookup(&pgtree, block);
+
+        return bb ? page_address(bb->page) : NULL;
+}
+
+int bump_allocator_init(void)
+{
+        INIT_RADIX_TREE(&pgtree, GFP_ATOMIC);
+
+        bump_block_cachep = kmem_cache_create("bump_block",
+                                              sizeof(struct bump_block),
+                                              0, 0, NULL);
+        if (!bump_block_cachep)
+                return -ENOMEM;
+        return 0;
+}
+
+static void bump_arena_stats(struct bump_arena *arena, const char *msg)
+{
+        pr_info("%s %s blocks: live :%ld peak :%ld used :%lu\n",
+                msg,
+                arena->name,
+                atomic_long_read(&arena->live),
+                arena->peak,
+                arena->next);
 }
 
 void bump_leak_detector(void)
 {
-        //bump_scan_backing_pages(&pgtree);
+        bump_arena_stats(&data_arena, "bump allocator");
+        bump_arena_stats(&meta_arena, "bump allocator");
+}
+
+static void bump_arena_release(struct bump_arena *arena)
+{
+        int i;
+        struct bump_chunk *chunk, *tmp;
+
+        if (atomic_long_read(&arena->live))
+                bump_arena_stats(arena, "leaked");
+
+        list_for_each_entry_safe(chunk, tmp, &arena->chunks, list) {
+                for (i = 0; i < BUMP_CHUNK_PAGES; i++) {
+                        set_page_private(chunk->page + i, 0UL);
+                        ClearPagePrivate(chunk->page + i);
+                        __free_page(chunk->page + i);
+                }
+                list_del(&chunk->list);
+                kfree(chunk);
+        }
+
+        arena->free = NULL;
+        arena->next = 0;
+        arena->chunk_used = 0;
+        arena->peak = 0;
+        atomic_long_set(&arena->live, 0);
 }
 
 void bump_allocator_release(void)
 {
+        int i, nr;
+        struct bump_block *batch[16];
+
+        // wait for blocks still waiting out a grace period
+        rcu_barrier();
         bump_scan_backing_pages(&pgtree);
-        atomic_set(&data_block, 0);
-        atomic_set(&meta_block, META_BLOCK_START);
+
+        while ((nr = radix_tree_gang_lookup(&pgtree, (void **)batch, 0,
+                                            ARRAY_SIZE(batch)))) {
+                for (i = 0; i < nr; i++) {
+                        radix_tree_delete(&pgtree, batch[i]->block);
+                        kmem_cache_free(bump_block_cachep, batch[i]);
+                }
+        }
+
+        bump_arena_release(&data_arena);
+        bump_arena_release(&meta_arena);
+        kmem_cache_destroy(bump_block_cachep);
 }
@@ -9,11 +9,17 @@ unsigned long bump_alloc_meta_block(void);
 
 void bump_release_block(unsigned long, size_t);
 
+void bump_block_get(unsigned long block);
+
+int bump_block_refcount(unsigned long block);
+
+void *bump_block_data(unsigned long block);
+
 struct buffer_head* bump_get_buffer_head(unsigned long block);
 
 void bump_put_buffer_head(struct buffer_head *bh);
 
-void bump_allocator_init(void);
+int bump_allocator_init(void);
 
 void bump_allocator_release(void);
 
@@ -0,0 +1,366 @@
+/*
+ * Replays key traces through a userspace build of btree.c and reports
+ * per-phase throughput, tree shape and allocations per operation.
+ *
+ * usage: btree_replay [-n keys] [-f fanout] [-s seed] trace...
+ *
+ * A trace is seq, random, delete (delete-heavy churn) or the path of a
+ * replay file such as btree.replay2, whose second column holds the keys.
+ * A fanout is refused if the tree could outgrow MAX_BTREE_LEVEL before
+ * it holds all keys of a trace.
+ *
+ * A std::map of key to data block is kept as the reference. Every lookup
+ * and delete result is checked against it after each phase, followed by
+ * range queries over the whole key space and random windows. Any
+ * mismatch fails the run.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "btree_user.h"
+
+#define PAGE_SIZE 4096
+
+typedef std::vector<unsigned long> KeyList;
+
+// reference model, key to the data block stored with it
+typedef std::map<unsigned long, unsigned long> Model;
+
+struct Options {
+        unsigned long nr_keys = 100000;
+        int fanout = 32;
+        unsigned seed = 1;
+};
+
+enum Op { INSERT, LOOKUP, DELETE };
+
+static const char *op_names[] = { "insert", "lookup", "delete" };
+
+static double Now()
+{
+        using namespace std::chrono;
+        return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// inserts pass their own data block so the model knows what lookups return
+static long RunOp(struct btree_root_node *root, Op op, unsigned long key,
+                  unsigned long *block)
+{
+        switch (op) {
+        case INSERT:
+                *block = bump_alloc_data_block();
+                return extent_tree_insert_item(root, key, *block, PAGE_SIZE);
+        case LOOKUP:
+                return extent_tree_lookup_item(root, key, PAGE_SIZE);
+        case DELETE:
+                return extent_tree_delete_item(root, key);
+        }
+        return -EINVAL;
+}
+
+// result op on key should give, the model is updated as the tree should be
+static long ModelOp(Model &model, Op op, unsigned long key, unsigned long block)
+{
+        Model::iterator it = model.find(key);
+
+        switch (op) {
+        case INSERT:
+                model[key] = block;
+                return 0;
+        case LOOKUP:
+                return it != model.end() ? (long)it->second : -ENOENT;
+        case DELETE:
+                if (it == model.end())
+                        return -ENOENT;
+                model.erase(it);
+                return 0;
+        }
+        return -EINVAL;
+}
+
+static bool Phase(struct btree_root_node *root, Op op, const KeyList &keys,
+                  Model &model)
+{
+        unsigned long errors = 0;
+        struct btree_user_stats before, after;
+        std::vector<long> results(keys.size());
+        std::vector<unsigned long> blocks(keys.size());
+        double start, elapsed;
+
+        btree_user_stats(&before);
+        start = Now();
+        for (size_t i = 0; i < keys.size(); i++)
+                results[i] = RunOp(root, op, keys[i], &blocks[i]);
+        elapsed = Now() - start;
+        btree_user_stats(&after);
+
+        // keys of a phase are unique, each result only depends on the state
+        // before the phase and the model can be replayed afterwards
+        for (size_t i = 0; i < keys.size(); i++) {
+                long expect = ModelOp(model, op, keys[i], blocks[i]);
+
+                if (results[i] == expect)
+                        continue;
+                if (errors++ < 8)
+                        printf("  %-8s key %lu returned %ld, expected %ld\n",
+                               op_names[op], keys[i], results[i], expect);
+        }
+
+        double nr = keys.size() ? keys.size() : 1;
+        printf("  %-8s %9zu ops %9.3f s %12.0f ops/s %6.2f kmallocs/op %6.2f blocks/op\n",
+               op_names[op], keys.size(), elapsed,
+               elapsed > 0 ? keys.size() / elapsed : 0,
+               (after.kmallocs - before.kmallocs) / nr,
+               (after.blocks - before.blocks) / nr);
+
+        if (errors)
+                printf("  %-8s %lu ops failed\n", op_names[op], errors);
+        return errors == 0;
+}
+
+// compare one range query against the keys of the model in the range
+static bool CheckRange(struct btree_root_node *root, const Model &model,
+                       unsigned long off, unsigned long range,
+                       std::vector<struct btree_user_key> &buf)
+{
+        long n = btree_user_range(root, off, range, buf.data(), buf.size());
+        Model::const_iterator it = model.lower_bound(off);
+        long i;
+
+        for (i = 0; i < n && i < (long)buf.size(); i++, ++it) {
+                if (it == model.end() || it->first - off >= range ||
+                    buf[i].offset != it->first || buf[i].block != it->second)
+                        break;
+        }
+
+        if (i == n && (it == model.end() || it->first - off >= range))
+                return true;
+
+        printf("  range    [%lu, +%lu) returned %ld keys, mismatch at %ld\n",
+               off, range, n, i);
+        return false;
+}
+
+// range queries over the whole key space and windows of up to 256 keys
+static bool Verify(struct btree_root_node *root, const Model &model,
+                   std::mt19937 &rng)
+{
+        std::vector<struct btree_user_key> buf(model.size() + 1);
+        std::vector<unsigned long> keys;
+        unsigned long errors = 0;
+
+        errors += !CheckRange(root, model, 0, ~0UL, buf);
+
+        for (Model::const_iterator it = model.begin(); it != model.end(); ++it)
+                keys.push_back(it->first);
+
+        for (int i = 0; i < 64 && !keys.empty(); i++) {
+                std::uniform_int_distribution<size_t> first(0, keys.size() - 1);
+                size_t a = first(rng);
+                size_t b = std::min(keys.size() - 1, a + rng() % 256);
+                // start in the gap before a key now and then
+                unsigned long off = keys[a] - (keys[a] && (rng() & 1));
+
+                errors += !CheckRange(root, model, off, keys[b] - off + 1, buf);
+        }
+
+        return errors == 0;
+}
+
+static void Shape(struct btree_root_node *root)
+{
+        struct btree_user_shape shape;
+        struct btree_user_stats stats;
+
+        btree_user_shape(root, &shape);
+        btree_user_stats(&stats);
+        printf("  shape    height %d, %lu nodes, %lu keys, fill %.1f%%, "
+               "%lu blocks live (peak %lu)\n",
+               shape.height, shape.nodes, shape.keys,
+               shape.slots ? 100.0 * shape.items / shape.slots : 0.0,
+               stats.blocks_live, stats.blocks_peak);
+}
+
+// unique keys in trace order, from the second column of a replay file
+static bool LoadReplay(const std::string &path, KeyList &keys)
+{
+        std::ifstream in(path);
+        std::set<unsigned long> seen;
+        std::string line, op, key;
+
+        if (!in)
+                return false;
+
+        while (std::getline(in, line)) {
+                std::istringstream row(line);
+                if (!(row >> op >> key))
+                        continue;
+                unsigned long k = std::strtoul(key.c_str(), NULL, 10);
+                if (seen.insert(k).second)
+                        keys.push_back(k);
+        }
+        return true;
+}
+
+static KeyList RandomKeys(unsigned long n, std::mt19937 &rng)
+{
+        std::set<unsigned long> seen;
+        std::uniform_int_distribution<unsigned long> dist(0, (1UL << 31) - 1);
+        KeyList keys;
+
+        while (keys.size() < n) {
+                unsigned long k = dist(rng);
+                if (seen.insert(k).second)
+                        keys.push_back(k);
+        }
+        return keys;
+}
+
+static bool IsGenerated(const std::string &trace)
+{
+        return trace == "seq" || trace == "random" || trace == "delete";
+}
+
+// the tree aborts once it outgrows MAX_BTREE_LEVEL, refuse such runs
+static bool CheckFanout(const Options &opt, unsigned long nr_keys)
+{
+        unsigned long capacity = btree_user_capacity(opt.fanout);
+
+        if (!capacity) {
+                fprintf(stderr, "invalid fanout %d\n", opt.fanout);
+                return false;
+        }
+        if (nr_keys > capacity) {
+                fprintf(stderr, "fanout %d holds %lu keys, %lu requested\n",
+                        opt.fanout, capacity, nr_keys);
+                return false;
+        }
+        return true;
+}
+
+static bool RunTrace(const std::string &trace, const Options &opt)
+{
+        std::mt19937 rng(opt.seed);
+        struct btree_root_node *root;
+        KeyList keys;
+        Model model;
+        bool ok = true;
+
+        if (trace == "seq") {
+                for (unsigned long i = 0; i < opt.nr_keys; i++)
+                        keys.push_back(i);
+        } else if (trace == "random" || trace == "delete") {
+                keys = RandomKeys(opt.nr_keys, rng);
+        } else if (!LoadReplay(trace, keys)) {
+                fprintf(stderr, "cannot read trace %s\n", trace.c_str());
+                return false;
+        } else if (!CheckFanout(opt, keys.size())) {
+                return false;
+        }
+
+        if (btree_user_init()) {
+                fprintf(stderr, "allocator init failed\n");
+                return false;
+        }
+
+        root = extent_tree_init(1, opt.fanout);
+        if (!root) {
+                btree_user_release();
+                return false;
+        }
+
+        printf("%s: %zu keys, fanout %d\n", trace.c_str(), keys.size(), opt.fanout);
+
+        ok &= Phase(root, INSERT, keys, model);
+        ok &= Verify(root, model, rng);
+        Shape(root);
+
+        KeyList order(keys);
+        if (trace != "seq")
+                std::shuffle(order.begin(), order.end(), rng);
+        ok &= Phase(root, LOOKUP, order, model);
+
+        if (trace == "delete") {
+                // churn: drop most keys, bring some back, then drain the tree
+                KeyList drop(order.begin(), order.begin() + order.size() * 9 / 10);
+                KeyList back(drop.begin(), drop.begin() + drop.size() * 4 / 10);
+                KeyList rest(order.begin() + drop.size(), order.end());
+
+                ok &= Phase(root, DELETE, drop, model);
+                ok &= Verify(root, model, rng);
+                Shape(root);
+                ok &= Phase(root, LOOKUP, rest, model);
+                ok &= Phase(root, INSERT, back, model);
+                ok &= Verify(root, model, rng);
+                Shape(root);
+                rest.insert(rest.end(), back.begin(), back.end());
+                std::shuffle(rest.begin(), rest.end(), rng);
+                ok &= Phase(root, DELETE, rest, model);
+        } else {
+                ok &= Phase(root, DELETE, order, model);
+        }
+        ok &= Verify(root, model, rng);
+        Shape(root);
+
+        extent_tree_destroy(root);
+        btree_user_release();
+        return ok;
+}
+
+int main(int argc, char **argv)
+{
+        int c;
+        bool ok = true;
+        Options opt;
+
+        while ((c = getopt(argc, argv, "n:f:s:")) != -1) {
+                switch (c) {
+                case 'n':
+                        opt.nr_keys = std::strtoul(optarg, NULL, 10);
+                        break;
+                case 'f':
+                        opt.fanout = std::atoi(optarg);
+                        break;
+                case 's':
+                        opt.seed = std::strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n keys] [-f fanout] [-s seed] trace...\n",
+                                argv[0]);
+                        return 1;
+                }
+        }
+
+        // generated traces hold nr_keys, replay files are checked on load
+        bool generated = (optind == argc);
+        for (int i = optind; i < argc; i++)
+                generated |= IsGenerated(argv[i]);
+
+        if (!CheckFanout(opt, generated ? opt.nr_keys : 0)) {
+                fprintf(stderr, "usage: %s [-n keys] [-f fanout] [-s seed] trace...\n",
+                        argv[0]);
+                return 1;
+        }
+
+        if (optind == argc) {
+                const char *traces[] = { "seq", "random", "delete" };
+                for (const char *trace : traces)
+                        ok &= RunTrace(trace, opt);
+        }
+
+        for (int i = optind; i < argc; i++)
+                ok &= RunTrace(argv[i], opt);
+
+        return ok ? 0 : 1;
+}
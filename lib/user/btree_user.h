@@ -0,0 +1,83 @@
+#ifndef LINUX_BTREE_USER_H
+#define LINUX_BTREE_USER_H
+
+/*
+ * Userspace entry points of btree.c for the replay driver, declared
+ * without the kernel shim. shim.c includes btree.h as well, so these
+ * are checked against the real prototypes.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct btree_root_node;
+
+struct btree_root_node* extent_tree_init(int version,
+                                         int max_keys);
+
+void extent_tree_destroy(struct btree_root_node *root);
+
+long extent_tree_lookup_item(struct btree_root_node *root,
+                             long long off,
+                             unsigned int size);
+
+int extent_tree_insert_item(struct btree_root_node *root,
+                            long long off,
+                            unsigned long block,
+                            unsigned int size);
+
+int extent_tree_delete_item(struct btree_root_node *root,
+                            unsigned long key);
+
+// allocations made through the shim since start
+struct btree_user_stats {
+        unsigned long kmallocs;
+        unsigned long blocks;           // block allocations, reuse included
+        unsigned long blocks_live;
+        unsigned long blocks_peak;
+};
+
+// node population of a tree
+struct btree_user_shape {
+        int           height;
+        unsigned long nodes;
+        unsigned long keys;             // leaf keys
+        unsigned long items;            // keys of all nodes
+        unsigned long slots;            // key capacity of all nodes
+};
+
+// key as returned by a range query
+struct btree_user_key {
+        unsigned long offset;
+        unsigned long block;
+};
+
+unsigned long bump_alloc_data_block(void);
+
+int btree_user_init(void);
+
+void btree_user_release(void);
+
+void btree_user_stats(struct btree_user_stats *stats);
+
+// keys a tree of this fanout always holds before it outgrows
+// MAX_BTREE_LEVEL, 0 if nodes cannot have this fanout
+unsigned long btree_user_capacity(int max_keys);
+
+void btree_user_shape(struct btree_root_node *root,
+                      struct btree_user_shape *shape);
+
+// keys in [off, off + range) in order, the first max are copied to keys.
+// Returns the number of keys in the range or an error.
+long btree_user_range(struct btree_root_node *root,
+                      long long off,
+                      unsigned long range,
+                      struct btree_user_key *keys,
+                      unsigned long max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef LINUX_BTREE_KERNEL_SHIM_H
+#define LINUX_BTREE_KERNEL_SHIM_H
+
+/*
+ * Just enough of the kernel API to build btree.c as a userspace object.
+ * Every <linux/...> header btree.c and btree.h include resolves to this
+ * file, see the Makefile. page_io.h is implemented by shim.c.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+// the kernel's loff_t is long long, keep libc's out of the way
+#define loff_t shim_libc_loff_t
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#undef loff_t
+typedef long long loff_t;
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+typedef uint8_t  __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef int32_t  __s32;
+typedef unsigned long long __u64;
+
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef unsigned long long __le64;
+
+#define U32_MAX ((u32)~0U)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1UL << PAGE_SHIFT)
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+#define __init
+#define __exit
+#define __rcu
+
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define module_init(fn) void *__shim_module_init = (void *)fn;
+#define module_exit(fn) void *__shim_module_exit = (void *)fn;
+
+// printing
+
+static inline __attribute__((format(printf, 1, 2)))
+int no_printk(const char *fmt, ...)
+{
+        return 0;
+}
+
+#define pr_debug(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...)  no_printk(fmt, ##__VA_ARGS__)
+#define pr_cont(fmt, ...)  no_printk(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...)  fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...)   fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define dump_stack() do { } while (0)
+
+#define BUG() \
+        do { \
+                fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); \
+                abort(); \
+        } while (0)
+
+#define BUG_ON(cond) do { if (cond) BUG(); } while (0)
+
+#define WARN_ON(cond) \
+        ({ \
+                int __ret = !!(cond); \
+                if (__ret) \
+                        fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); \
+                __ret; \
+        })
+
+// helpers
+
+#define ARRAY_SIZE(a)        (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)   (((n) + (d) - 1) / (d))
+#define min(a, b)            ((a) < (b) ? (a) : (b))
+#define max(a, b)            ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)       min((t)(a), (t)(b))
+#define max_t(t, a, b)       max((t)(a), (t)(b))
+#define clamp(v, lo, hi)     min(max(v, lo), hi)
+#define swap(a, b) \
+        do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define cpu_relax()  do { } while (0)
+
+#define MAX_ERRNO 4095
+
+static inline void *ERR_PTR(long error)
+{
+        return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+        return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+        return (unsigned long)ptr >= (unsigned long)-MAX_ERRNO;
+}
+
+// atomics
+
+typedef struct {
+        int counter;
+} atomic_t;
+
+#define atomic_read(v)   __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v)    __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(v)    __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) (atomic_dec(v) == 0)
+
+// memory, counted by shim.c
+
+void *shim_kmalloc(size_t size, bool zero);
+void shim_kfree(const void *ptr);
+
+#define kmalloc(size, flags) shim_kmalloc(size, false)
+#define kzalloc(size, flags) shim_kmalloc(size, true)
+#define kfree(ptr)           shim_kfree(ptr)
+#define vmalloc(size)        shim_kmalloc(size, false)
+#define vzalloc(size)        shim_kmalloc(size, true)
+#define vfree(ptr)           shim_kfree(ptr)
+
+// lists
+
+struct list_head {
+        struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+        list->next = list;
+        list->prev = list;
+}
+
+static inline void __list_add(struct list_head *entry,
+                              struct list_head *prev,
+                              struct list_head *next)
+{
+        next->prev = entry;
+        entry->next = next;
+        entry->prev = prev;
+        prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+        __list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+        __list_add(entry, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+        entry->next->prev = entry->prev;
+        entry->prev->next = entry->next;
+        entry->next = entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+        return head->next == head;
+}
+
+struct hlist_node {
+        struct hlist_node *next, **pprev;
+};
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_first_entry(ptr, type, member) \
+        list_entry((ptr)->next, type, member)
+
+#define list_for_each_entry(pos, head, member) \
+        for (pos = list_entry((head)->next, typeof(*pos), member); \
+             &pos->member != (head); \
+             pos = list_entry(pos->member.next, typeof(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+        for (pos = list_entry((head)->next, typeof(*pos), member), \
+             n = list_entry(pos->member.next, typeof(*pos), member); \
+             &pos->member != (head); \
+             pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+// locking, the tree is driven from one thread
+
+struct mutex {
+        pthread_mutex_t lock;
+};
+
+#define SINGLE_DEPTH_NESTING 1
+
+#define mutex_init(m)               pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_lock(m)               pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m)             pthread_mutex_unlock(&(m)->lock)
+#define mutex_lock_nested(m, sub)   mutex_lock(m)
+
+typedef struct {
+        unsigned sequence;
+} seqcount_t;
+
+#define seqcount_init(s) ((s)->sequence = 0)
+
+#define raw_read_seqcount(s) \
+        __atomic_load_n(&(s)->sequence, __ATOMIC_ACQUIRE)
+
+#define read_seqcount_retry(s, start) \
+        (__atomic_load_n(&(s)->sequence, __ATOMIC_ACQUIRE) != (start))
+
+#define write_seqcount_begin(s) \
+        __atomic_add_fetch(&(s)->sequence, 1, __ATOMIC_RELEASE)
+
+#define write_seqcount_end(s) \
+        __atomic_add_fetch(&(s)->sequence, 1, __ATOMIC_RELEASE)
+
+#define rcu_read_lock()   do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+
+// buffers and seq files
+
+struct page;
+struct inode;
+struct dentry;
+
+struct buffer_head {
+        char        *b_data;
+        atomic_t     b_count;
+        struct page *b_page;
+};
+
+static inline void get_bh(struct buffer_head *bh)
+{
+        atomic_inc(&bh->b_count);
+}
+
+static inline void brelse(struct buffer_head *bh)
+{
+        if (bh)
+                atomic_dec(&bh->b_count);
+}
+
+struct seq_file {
+        FILE *out;
+        void *private;
+};
+
+#define seq_printf(m, fmt, ...) \
+        ((m)->out ? fprintf((m)->out, fmt, ##__VA_ARGS__) : 0)
+
+#endif
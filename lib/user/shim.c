@@ -0,0 +1,328 @@
+/*
+ * Userspace backing for btree.c: the page_io.h block allocator on heap
+ * memory, counted allocations and stubs for the module's debugfs and
+ * device hooks.
+ */
+#include "kernel_shim.h"
+
+#include "btree.h"
+#include "page_io.h"
+#include "btree_user.h"
+
+#define META_BLOCK_START (1UL << 30)
+
+// a block of one arena, free blocks are chained for reuse
+struct user_block {
+        unsigned long       block;
+        int                 refcount;
+        char               *data;
+        struct buffer_head  bh;
+        struct user_block  *next_free;
+};
+
+struct user_arena {
+        unsigned long       start;
+        unsigned long       nr_blocks;  // block numbers handed out so far
+        unsigned long       capacity;
+        struct user_block **blocks;
+        struct user_block  *free;
+};
+
+static struct user_arena data_arena = { .start = 0 };
+static struct user_arena meta_arena = { .start = META_BLOCK_START };
+
+static struct btree_user_stats stats;
+
+void *shim_kmalloc(size_t size, bool zero)
+{
+        stats.kmallocs++;
+        return zero ? calloc(1, size) : malloc(size);
+}
+
+void shim_kfree(const void *ptr)
+{
+        free((void *)ptr);
+}
+
+static struct user_arena *user_block_arena(unsigned long block)
+{
+        return (block > META_BLOCK_START) ? &meta_arena : &data_arena;
+}
+
+static struct user_block *user_lookup_block(unsigned long block)
+{
+        struct user_arena *arena = user_block_arena(block);
+        unsigned long i = block - arena->start - 1;
+
+        if (block <= arena->start || i >= arena->nr_blocks)
+                return NULL;
+        return arena->blocks[i]->refcount ? arena->blocks[i] : NULL;
+}
+
+static unsigned long user_arena_alloc(struct user_arena *arena)
+{
+        struct user_block *ub = arena->free;
+
+        if (ub) {
+                arena->free = ub->next_free;
+                memset(ub->data, 0, PAGE_SIZE);
+                goto out;
+        }
+
+        if (arena->nr_blocks == arena->capacity) {
+                unsigned long capacity = arena->capacity ? arena->capacity * 2 : 1024;
+                struct user_block **blocks;
+
+                blocks = realloc(arena->blocks, capacity * sizeof(*blocks));
+                if (!blocks)
+                        return 0;
+                arena->blocks = blocks;
+                arena->capacity = capacity;
+        }
+
+        ub = calloc(1, sizeof(struct user_block));
+        if (!ub)
+                return 0;
+        if (posix_memalign((void **)&ub->data, PAGE_SIZE, PAGE_SIZE)) {
+                free(ub);
+                return 0;
+        }
+        memset(ub->data, 0, PAGE_SIZE);
+        ub->bh.b_data = ub->data;
+        arena->blocks[arena->nr_blocks++] = ub;
+        ub->block = arena->start + arena->nr_blocks;
+out:
+        ub->refcount = 1;
+        stats.blocks++;
+        if (++stats.blocks_live > stats.blocks_peak)
+                stats.blocks_peak = stats.blocks_live;
+        return ub->block;
+}
+
+unsigned long bump_alloc_data_block(void)
+{
+        return user_arena_alloc(&data_arena);
+}
+
+unsigned long bump_alloc_meta_block(void)
+{
+        return user_arena_alloc(&meta_arena);
+}
+
+// drop a reference, the block is freed with its last reference
+void bump_release_block(unsigned long block, size_t size)
+{
+        int i, nblocks = max_t(int, DIV_ROUND_UP(size, PAGE_SIZE), 1);
+
+        for (i = 0; i < nblocks; i++) {
+                struct user_block *ub = user_lookup_block(block + i);
+                struct user_arena *arena = user_block_arena(block + i);
+
+                if (!ub) {
+                        pr_err("lookup failed for block :%lu\n", block + i);
+                        continue;
+                }
+
+                if (--ub->refcount)
+                        continue;
+
+                ub->next_free = arena->free;
+                arena->free = ub;
+                stats.blocks_live--;
+        }
+}
+
+void bump_block_get(unsigned long block)
+{
+        struct user_block *ub = user_lookup_block(block);
+
+        if (ub)
+                ub->refcount++;
+        else
+                pr_err("lookup failed for block :%lu\n", block);
+}
+
+int bump_block_refcount(unsigned long block)
+{
+        struct user_block *ub = user_lookup_block(block);
+
+        return ub ? ub->refcount : 0;
+}
+
+void *bump_block_data(unsigned long block)
+{
+        struct user_block *ub = user_lookup_block(block);
+
+        return ub ? ub->data : NULL;
+}
+
+struct buffer_head* bump_get_buffer_head(unsigned long block)
+{
+        struct user_block *ub = user_lookup_block(block);
+
+        if (!ub) {
+                pr_err("lookup failed for block :%lu\n", block);
+                return NULL;
+        }
+
+        get_bh(&ub->bh);
+        return &ub->bh;
+}
+
+void bump_put_buffer_head(struct buffer_head *bh)
+{
+        BUG_ON(bh == NULL);
+
+        if (!atomic_read(&bh->b_count))
+                pr_err("invalid bh release\n");
+        else
+                brelse(bh);
+}
+
+int bump_allocator_init(void)
+{
+        return 0;
+}
+
+void bump_leak_detector(void)
+{
+}
+
+static void user_arena_release(struct user_arena *arena)
+{
+        unsigned long i;
+
+        for (i = 0; i < arena->nr_blocks; i++) {
+                free(arena->blocks[i]->data);
+                free(arena->blocks[i]);
+        }
+        free(arena->blocks);
+        arena->nr_blocks = 0;
+        arena->capacity = 0;
+        arena->blocks = NULL;
+        arena->free = NULL;
+}
+
+void bump_allocator_release(void)
+{
+        user_arena_release(&data_arena);
+        user_arena_release(&meta_arena);
+}
+
+// module hooks btree.c refers to
+
+int btreedev_init(void)
+{
+        return 0;
+}
+
+void btreedev_exit(void)
+{
+}
+
+struct dentry *btree_debugfs_init(struct btree_root_node *btree_root)
+{
+        return NULL;
+}
+
+int btree_debugfs_destroy(struct dentry *dentry)
+{
+        return 0;
+}
+
+// driver side
+
+int btree_user_init(void)
+{
+        memset(&stats, 0, sizeof(stats));
+        return bump_allocator_init();
+}
+
+void btree_user_release(void)
+{
+        bump_allocator_release();
+        memset(&stats, 0, sizeof(stats));
+}
+
+void btree_user_stats(struct btree_user_stats *out)
+{
+        *out = stats;
+}
+
+static void btree_user_walk(struct btree_node *node,
+                            struct btree_user_shape *shape)
+{
+        int i;
+
+        shape->nodes++;
+        shape->items += node->header.nr_items;
+        shape->slots += node->header.max_items;
+
+        if (IS_BTREE_LEAF(node)) {
+                shape->keys += node->header.nr_items;
+                return;
+        }
+
+        for (i = 0; i < node->header.nr_items; i++)
+                btree_user_walk(bump_block_data(node->keys[i].blockptr), shape);
+}
+
+/*
+ * Root splits are what grow the tree. The root at the last level splits
+ * once it holds max_keys - 2 children, and below it every index node and
+ * leaf holds at least the lower half of a split, so one key less than
+ * that always fits. An index node of a fanout of 4 splits as soon as it
+ * is created, such a tree holds a single leaf.
+ */
+unsigned long btree_user_capacity(int max_keys)
+{
+        int level;
+        unsigned long keys;
+
+        if (max_keys < 4 || max_keys > MAX_BKEYS_PER_BLOCK)
+                return 0;
+
+        if (max_keys <= 4)
+                return max_keys - 1;
+
+        keys = (max_keys - 2) * (max_keys >> 1);
+        for (level = 1; level < MAX_BTREE_LEVEL - 1; level++) {
+                if (keys > ULONG_MAX / ((max_keys - 2) >> 1))
+                        return ULONG_MAX;
+                keys *= (max_keys - 2) >> 1;
+        }
+        return keys - 1;
+}
+
+void btree_user_shape(struct btree_root_node *root,
+                      struct btree_user_shape *shape)
+{
+        memset(shape, 0, sizeof(*shape));
+        shape->height = root->max_level + 1;
+        btree_user_walk(root->node, shape);
+}
+
+long btree_user_range(struct btree_root_node *root,
+                      long long off,
+                      unsigned long range,
+                      struct btree_user_key *keys,
+                      unsigned long max)
+{
+        long ret, count = 0;
+        struct btree_key_entry *entry;
+        LIST_HEAD(range_list);
+
+        ret = extent_tree_range_query(root, off, range, &range_list);
+        if (ret < 0)
+                return ret;
+
+        list_for_each_entry(entry, &range_list, list) {
+                if (count < max) {
+                        keys[count].offset = entry->key.offset;
+                        keys[count].block = entry->key.blockptr;
+                }
+                count++;
+        }
+        extent_tree_range_release(&range_list);
+        return count;
+}